@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <math.h>
+#include <mutex>
+#include <shared_mutex>
+#include <stdint.h>
+
+#include "background_model.h"
+#include "frame_tiling.h"
+
+using namespace bigpicture;
+
+void background_model::reset() {
+  std::unique_lock<std::shared_mutex> lock(m_mutex);
+  m_stale = true;
+  m_n_frames = 0;
+}
+
+bool background_model::begin_series(int64_t series_id) {
+  {
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    if (series_id == m_series || series_id == m_previous_series) {
+      return series_id == m_series;
+    }
+  }
+  std::unique_lock<std::shared_mutex> lock(m_mutex);
+  if (series_id == m_series || series_id == m_previous_series) {
+    return series_id == m_series;
+  }
+  m_previous_series = m_series;
+  m_series = series_id;
+  m_stale = true;
+  m_n_frames = 0;
+  return true;
+}
+
+void background_model::use_memory_budget(memory_budget& budget) {
+  std::unique_lock<std::shared_mutex> lock(m_mutex);
+  m_memory = memory_reservation(&budget);
+  m_memory.resize(m_memory_usage);
+}
+
+std::shared_lock<std::shared_mutex> background_model::lock_for(const frame_tiling& tiling) {
+  std::shared_lock<std::shared_mutex> lock(m_mutex);
+  while (m_stale || m_width != tiling.width() || m_height != tiling.height()) {
+    lock.unlock();
+    {
+      std::unique_lock<std::shared_mutex> exclusive(m_mutex);
+      resize(tiling);
+    }
+    lock.lock();
+  }
+  return lock;
+}
+
+// Called with the mutex held exclusively.
+void background_model::resize(const frame_tiling& tiling) {
+  if (!m_stale && m_width == tiling.width() && m_height == tiling.height()) {
+    return; // another thread got here first
+  }
+  m_width = tiling.width();
+  m_height = tiling.height();
+  m_n_frames = 0;
+  m_stale = false;
+  m_mean.assign(tiling.n_pixels(), NAN);
+  m_streak.assign(tiling.n_pixels(), 0);
+  m_variance.assign(tiling.n_pixels(), NAN);
+  m_tile_mutexes.reset(new std::mutex[tiling.n_tiles()]);
+  m_memory_usage = tiling.n_pixels() * (2*sizeof(float) + sizeof(uint8_t));
+  m_memory.resize(m_memory_usage);
+}
+
+template<typename T>
+void background_model::update(const frame_tiling& tiling, const T* frame,
+			      const uint8_t* pixel_mask, const uint8_t* exclude) {
+  std::shared_lock<std::shared_mutex> lock = lock_for(tiling);
+  const size_t width = m_width;
+  const float alpha = m_alpha;
+  const uint8_t readmit = m_readmit;
+  float* mean = m_mean.data();
+  uint8_t* streak = m_streak.data();
+  float* variance = m_variance.data();
+  tiling.for_each_tile([&](const frame_tile_t& t, size_t j) {
+    std::lock_guard<std::mutex> tile_lock(m_tile_mutexes[j]);
+    for (size_t y=t.y; y < t.y + t.height; ++y) {
+      const size_t begin = y*width + t.x, end = begin + t.width;
+#pragma omp simd
+      for (size_t i=begin; i < end; ++i) {
+	const T raw = frame[i];
+	const bool unmasked = !pixel_traits<T>::is_masked(raw) && !(pixel_mask && pixel_mask[i]);
+	const bool hit = exclude && exclude[i];
+	const uint8_t run = hit ? streak[i] + (streak[i] < 255) : 0;
+	streak[i] = unmasked ? run : streak[i];
+	const bool valid = unmasked && (!hit || run >= readmit);
+	const float v = raw;
+	const float m = mean[i], var = variance[i];
+	const bool known = (m == m);
+	// West's incremental update of an exponentially weighted mean and variance.
+	const float diff = v - m;
+	const float incr = alpha * diff;
+	mean[i] = !valid ? m : known ? m + incr : v;
+	variance[i] = !valid ? var : known ? (1.0f - alpha) * (var + diff*incr) : v;
+      }
+    }
+  });
+  ++m_n_frames;
+}
+
+template<typename T>
+bool background_model::threshold(const frame_tiling& tiling, const T* frame,
+				 const uint8_t* pixel_mask, double sigma, double gain,
+				 uint64_t global_threshold, uint8_t* strong, size_t& n_strong) {
+  // The shared lock keeps the estimates from being resized until the frame is added.
+  std::shared_lock<std::shared_mutex> lock(m_mutex);
+  if (!is_warm(tiling)) {
+    return false;
+  }
+  const size_t width = m_width;
+  const float alpha = m_alpha;
+  const uint8_t readmit = m_readmit;
+  const float s = sigma, g = gain;
+  float* mean = m_mean.data();
+  uint8_t* streak = m_streak.data();
+  float* variance = m_variance.data();
+  n_strong = 0;
+  tiling.for_each_tile([&](const frame_tile_t& t, size_t j) {
+    std::lock_guard<std::mutex> tile_lock(m_tile_mutexes[j]);
+    size_t n = 0;
+    for (size_t y=t.y; y < t.y + t.height; ++y) {
+      const size_t begin = y*width + t.x, end = begin + t.width;
+#pragma omp simd reduction(+:n)
+      for (size_t i=begin; i < end; ++i) {
+	const T raw = frame[i];
+	const bool valid = !pixel_traits<T>::is_masked(raw) && !(pixel_mask && pixel_mask[i]);
+	const float v = raw;
+	const float m = mean[i], var = variance[i];
+	const bool known = (m == m);
+	const float floor = g * std::max(m, 1.0f);
+	const float sd = sqrtf(std::max(var, floor));
+	const bool is_strong = valid && known && v > m + s*sd && uint64_t(raw) > global_threshold;
+	strong[i] = is_strong;
+	n += is_strong;
+
+	const uint8_t run = is_strong ? streak[i] + (streak[i] < 255) : 0;
+	streak[i] = valid ? run : streak[i];
+	const bool add = valid && (!is_strong || run >= readmit);
+	const float diff = v - m;
+	const float incr = alpha * diff;
+	mean[i] = !add ? m : known ? m + incr : v;
+	variance[i] = !add ? var : known ? (1.0f - alpha) * (var + diff*incr) : v;
+      }
+    }
+#pragma omp atomic
+    n_strong += n;
+  });
+  ++m_n_frames;
+  return true;
+}
+
+template void background_model::update<uint8_t>(const frame_tiling&, const uint8_t*,
+						 const uint8_t*, const uint8_t*);
+template void background_model::update<uint16_t>(const frame_tiling&, const uint16_t*,
+						  const uint8_t*, const uint8_t*);
+template void background_model::update<uint32_t>(const frame_tiling&, const uint32_t*,
+						  const uint8_t*, const uint8_t*);
+template bool background_model::threshold<uint8_t>(const frame_tiling&, const uint8_t*,
+						   const uint8_t*, double, double, uint64_t,
+						   uint8_t*, size_t&);
+template bool background_model::threshold<uint16_t>(const frame_tiling&, const uint16_t*,
+						    const uint8_t*, double, double, uint64_t,
+						    uint8_t*, size_t&);
+template bool background_model::threshold<uint32_t>(const frame_tiling&, const uint32_t*,
+						    const uint8_t*, double, double, uint64_t,
+						    uint8_t*, size_t&);
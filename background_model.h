@@ -0,0 +1,157 @@
+#ifndef BP_BACKGROUND_MODEL_H
+#define BP_BACKGROUND_MODEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdint.h>
+#include <vector>
+
+#include "frame_tiling.h"
+#include "memory_budget.h"
+
+namespace bigpicture {
+  /**
+   * An exponentially weighted estimate of the mean and variance of every pixel's
+   * background, updated incrementally with each frame of a sweep.
+   *
+   * The diffuse background (solvent, air scatter, ice) changes slowly from frame to
+   * frame, so a pixel can be tested against its running estimate in one fused
+   * subtract-and-compare pass, instead of estimating the background afresh from a box
+   * around every pixel. Strong and masked pixels are left out of the update, so that
+   * Bragg peaks do not leak into the background. A pixel which stays strong for
+   * readmit frames in a row is no Bragg peak but a change of the background itself,
+   * e.g. a forming ice ring, and is added to the estimate again until it catches up.
+   *
+   * Estimates are stored as floats, plus a count of consecutive strong frames, i.e.
+   * 9 bytes per pixel. A pixel has no estimate (NAN) until it has been observed as
+   * background, and is never strong until then.
+   *
+   * One model may be shared by the threads searching the frames of a series, e.g. the
+   * workers of bpindexd, so that it costs its 9 bytes per pixel only once. update() and
+   * threshold() lock one tile at a time, so concurrent frames pass through the model
+   * tile by tile, and each frame is added as it is searched, in whatever order.
+   */
+  class background_model {
+  public:
+    /**
+     * @param alpha The weight of each new frame, between 0 and 1. The estimate
+     *              forgets a frame after roughly 1/alpha frames.
+     * @param warmup Frames to observe before the model is used to find strong pixels.
+     * @param readmit Consecutive strong frames after which a pixel is added to the
+     *                estimate regardless, between 1 and 255.
+     */
+    explicit background_model(double alpha=0.05, size_t warmup=5, size_t readmit=10) noexcept :
+      m_alpha(alpha), m_readmit(std::clamp<size_t>(readmit, 1, 255)), m_warmup(warmup),
+      m_width(0), m_height(0), m_memory_usage(0), m_n_frames(0), m_previous_series(-1),
+      m_series(-1), m_stale(true) {}
+
+    /// Forgets every frame.
+    void reset();
+
+    /**
+     * Starts modelling a series, forgetting every frame of the previous one, unless it
+     * is the series being modelled already.
+     *
+     * @return false if series_id is the series before, e.g. when one thread still
+     *         searches a frame of it after another started on the next series. Such a
+     *         frame must be searched without the model.
+     */
+    bool begin_series(int64_t series_id);
+
+    /**
+     * Draws the estimates from a memory budget, as they are allocated for the frame
+     * dimensions of a series.
+     * @note Call this before any frame is added.
+     */
+    void use_memory_budget(memory_budget& budget);
+
+    /**
+     * Adds a frame to the estimate. The first frame after a reset, or after the frame
+     * dimensions change, initializes the estimate.
+     *
+     * @param pixel_mask Optional, nonzero for pixels to leave out, one per pixel.
+     * @param exclude Optional, nonzero for pixels to leave out of this frame only,
+     *                e.g. the strong pixels found by another method. Excluded pixels
+     *                count as strong towards readmit.
+     */
+    template<typename T>
+    void update(const frame_tiling& tiling, const T* frame, const uint8_t* pixel_mask,
+		const uint8_t* exclude);
+
+    /**
+     * Marks each unmasked pixel which is more than sigma standard deviations above its
+     * background, and adds the remaining unmasked pixels, and those strong for readmit
+     * frames in a row, to the estimate.
+     *
+     * The variance is not allowed below the Poisson variance, gain*max(mean, 1), so
+     * that a flat background cannot make every photon strong.
+     *
+     * @param strong 1 if strong, 0 otherwise, for every pixel within a tile.
+     * @param n_strong The number of strong pixels.
+     * @return false if the model is not warm() for the dimensions of the frame, e.g.
+     *         since another thread started the next series, in which case neither
+     *         strong nor the model is changed, and the frame must be searched without
+     *         the model.
+     */
+    template<typename T>
+    bool threshold(const frame_tiling& tiling, const T* frame, const uint8_t* pixel_mask,
+		   double sigma, double gain, uint64_t global_threshold, uint8_t* strong,
+		   size_t& n_strong);
+
+    /// @return true if enough frames of the current dimensions have been observed.
+    bool warm(const frame_tiling& tiling) const {
+      std::shared_lock<std::shared_mutex> lock(m_mutex);
+      return is_warm(tiling);
+    }
+
+    double   alpha()    const { return m_alpha; }
+    size_t   readmit()  const { return m_readmit; }
+    uint64_t n_frames() const { return m_n_frames.load(std::memory_order_relaxed); }
+
+    /// @note Not synchronized with frames being added.
+    float    mean(size_t x, size_t y)     const { return m_mean[y*m_width + x]; }
+    float    variance(size_t x, size_t y) const { return m_variance[y*m_width + x]; }
+
+    size_t   memory_usage() const {
+      std::shared_lock<std::shared_mutex> lock(m_mutex);
+      return m_memory_usage;
+    }
+
+  private:
+    background_model(const background_model&) = delete;
+
+    /// Called with the mutex held.
+    bool is_warm(const frame_tiling& tiling) const {
+      const uint64_t n_frames = m_n_frames.load(std::memory_order_relaxed);
+      return !m_stale && n_frames >= m_warmup && n_frames > 0 &&
+	m_width == tiling.width() && m_height == tiling.height();
+    }
+
+    /// @return A shared lock on the model, once it has the dimensions of tiling.
+    std::shared_lock<std::shared_mutex> lock_for(const frame_tiling& tiling);
+    void resize(const frame_tiling& tiling);
+
+    double                   m_alpha;
+    uint8_t                  m_readmit;
+    size_t                   m_warmup;
+    size_t                   m_width;
+    size_t                   m_height;
+    std::vector<float>       m_mean;
+    memory_reservation       m_memory;
+    size_t                   m_memory_usage;
+    mutable std::shared_mutex m_mutex; //!< exclusive to resize or reset, shared otherwise
+    std::atomic<uint64_t>    m_n_frames;
+    int64_t                  m_previous_series;
+    int64_t                  m_series;
+    bool                     m_stale;  //!< true if the estimates must be initialized
+    std::vector<uint8_t>     m_streak; //!< consecutive frames in which the pixel was strong
+    std::unique_ptr<std::mutex[]> m_tile_mutexes; //!< one per tile, held while it is updated
+    std::vector<float>       m_variance;
+  };
+}
+
+#endif // header guard
@@ -1,37 +1,46 @@
-#include <atomic>
-#include <string.h>
-#include <execinfo.h>
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fstream>
 #include <iostream>
-#include <list>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sstream>
+#include <stdexcept>
 #include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <system_error>
 #include <unistd.h>
+#include <vector>
 
-#include <jxl/encode.h> // libjxl
-#include <zmq.hpp>      // cppzmq (a header-only library)
+#include <simdjson.h>
 
 #include "bigpicture_utils.h"
+#include "json_writer.h"
+#include "metrics.h"
+
+using namespace bigpicture;
+using std::chrono::steady_clock;
+
+extern char** environ;
 
-static const int shutdown_timeout = 5;
+// glibc does not wrap ioprio_set(2), see linux/ioprio.h.
+static constexpr int ioprio_class_shift = 13;
+static constexpr int ioprio_who_process = 1;
 
 /**
- * This executable is responsible for spawning, killing, and monitoring all 
- * child processes. 
+ * This executable is responsible for spawning, killing, and monitoring all
+ * child processes.
  */
-std::atomic<bool> shutdown = false;
-static void signal_handler(int signum) {
-  // iostream and printf are not signal-safe (reentrant), but plain-old write() is.
-  shutdown = true;
-  char strbuf[1024];
-  memset(strbuf, '\0', sizeof(strbuf));
-  strlcat(strbuf, "Received \"", sizeof(strbuf));
-  strlcat(strbuf, strsignal(signum), sizeof(strbuf));
-  strlcat(strbuf, "\" signal, shutting down now.\n", sizeof(strbuf));
-  write(STDOUT_FILENO, strbuf, strlen(strbuf));
-  fsync(STDOUT_FILENO); // flush terminal output immediately
-}
 
 static void usage() {
   std::cerr << "  bigpicture [-h] config_file\n"
@@ -39,18 +48,580 @@ static void usage() {
 	    << "    -c : a JSON-based config file. Default is /etc/bigpicture/config.json" << std::endl;
 }
 
+/**
+ * A daemon started and restarted by the supervisor, configured by an entry of
+ * "/supervisor/children":
+ *
+ *   { "name" : "bparchived", "path" : "/usr/local/bin/bparchived", "args" : [],
+ *     "cpus" : "0-3", "io_class" : "realtime", "io_level" : 0, "cpu_weight" : 1000 }
+ *
+ * "path" defaults to the name, searched for in PATH. Every child is passed the
+ * supervisor's config file with "-c", followed by "args".
+ *
+ * "cpus" is a list of CPUs such as "0-3,8", or "rest" for every CPU not listed by
+ * another child. "io_class" is "realtime", "best-effort" or "idle", with a level from
+ * 0 (highest) to 7. "cpu_weight" is the child's cgroup v2 cpu.weight, from 1 to 10000.
+ * Each is optional, and by default the child inherits the supervisor's.
+ */
+struct child_t {
+  child_t() : pinned(false), io_priority(-1), cpu_weight(0), pid(-1), timer_fd(-1),
+	      backoff_ms(0), n_restarts(0), restart_pending(false) {
+    CPU_ZERO(&cpus);
+  }
+
+  std::string              name;
+  std::string              path;
+  std::vector<std::string> args;
+  cpu_set_t                cpus;
+  bool                     pinned;      //!< cpus is set
+  int                      io_priority; //!< for ioprio_set(2), -1 if inherited
+  int64_t                  cpu_weight;  //!< 0 if unset
+  std::string              cgroup;      //!< directory, empty if none
+  std::string              metrics;     //!< shared-memory segment, empty if none
+  pid_t                    pid;        //!< -1 if not running
+  int                      timer_fd;   //!< fires when a pending restart is due
+  int64_t                  backoff_ms; //!< delay before the next restart
+  uint64_t                 n_restarts;
+  bool                     restart_pending;
+  steady_clock::time_point started;
+};
+
+/*
+  Parses a list of CPUs in the format of cpuset.cpus, e.g. "0-3,8".
+*/
+static bool parse_cpus(std::string_view list, cpu_set_t& cpus) {
+  CPU_ZERO(&cpus);
+  std::stringstream ss{std::string(list)};
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    int first = -1, last = -1;
+    char dash = 0;
+    std::stringstream rs(range);
+    rs >> first;
+    if (!(rs >> dash)) {
+      last = first;
+    } else if (dash != '-' || !(rs >> last)) {
+      return false;
+    }
+    if (rs.fail() || first < 0 || last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (int cpu=first; cpu <= last; ++cpu) {
+      CPU_SET(cpu, &cpus);
+    }
+  }
+  return CPU_COUNT(&cpus) > 0;
+}
+
+static std::string format_cpus(const cpu_set_t& cpus) {
+  std::stringstream ss;
+  for (int cpu=0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &cpus)) {
+      continue;
+    }
+    int last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpus)) {
+      ++last;
+    }
+    ss << (ss.tellp() > 0 ? "," : "") << cpu;
+    if (last > cpu) {
+      ss << "-" << last;
+    }
+    cpu = last;
+  }
+  return ss.str();
+}
+
+/*
+  Reads the CPU and I/O placement of a child. CPUs which the supervisor may not run on
+  are dropped, so the same config serves hosts with different numbers of cores.
+*/
+static void parse_placement(child_t& child, const simdjson::dom::object& obj,
+			    const cpu_set_t& available, std::vector<child_t*>& rest) {
+  std::string_view tmp_sv;
+  if (!obj["cpus"].get(tmp_sv)) {
+    if (tmp_sv == "rest") {
+      rest.push_back(&child);
+    } else if (!parse_cpus(tmp_sv, child.cpus)) {
+      std::stringstream ss;
+      ss << "The \"cpus\" of child \"" << child.name << "\" must be a list of CPUs such as "
+	 << "\"0-3,8\", or \"rest\".";
+      throw std::runtime_error(ss.str());
+    } else {
+      CPU_AND(&child.cpus, &child.cpus, &available);
+      if (CPU_COUNT(&child.cpus) == 0) {
+	std::stringstream ss;
+	ss << "None of the \"cpus\" of child \"" << child.name << "\" are available.";
+	throw std::runtime_error(ss.str());
+      }
+    }
+    child.pinned = true;
+  }
+
+  if (!obj["io_class"].get(tmp_sv)) {
+    int io_class = 0;
+    if (tmp_sv == "realtime") {
+      io_class = 1;
+    } else if (tmp_sv == "best-effort") {
+      io_class = 2;
+    } else if (tmp_sv == "idle") {
+      io_class = 3;
+    } else {
+      std::stringstream ss;
+      ss << "The \"io_class\" of child \"" << child.name << "\" must be \"realtime\", "
+	 << "\"best-effort\" or \"idle\".";
+      throw std::runtime_error(ss.str());
+    }
+    int64_t io_level = 4;
+    if (!obj["io_level"].get(io_level) && (io_level < 0 || io_level > 7)) {
+      std::stringstream ss;
+      ss << "The \"io_level\" of child \"" << child.name << "\" must be from 0 to 7.";
+      throw std::runtime_error(ss.str());
+    }
+    child.io_priority = (io_class << ioprio_class_shift) | static_cast<int>(io_level);
+  }
+
+  if (!obj["cpu_weight"].get(child.cpu_weight) &&
+      (child.cpu_weight < 1 || child.cpu_weight > 10000)) {
+    std::stringstream ss;
+    ss << "The \"cpu_weight\" of child \"" << child.name << "\" must be from 1 to 10000.";
+    throw std::runtime_error(ss.str());
+  }
+}
+
+/**
+ * Deserialized "/supervisor" config parameters.
+ */
+struct supervisor_config_t {
+  supervisor_config_t(const simdjson::dom::object& config) :
+    min_backoff_ms(10),
+    max_backoff_ms(10000),
+    stable_s(60),
+    shutdown_timeout_s(45), // beyond bparchived's default drain timeout of 30s
+    cgroup(""),
+    metrics_interval_s(10),
+    metrics_path("") {
+
+    maybe_extract_json_pointer(min_backoff_ms, config, "/supervisor/min_backoff_ms");
+    maybe_extract_json_pointer(max_backoff_ms, config, "/supervisor/max_backoff_ms");
+    maybe_extract_json_pointer(stable_s, config, "/supervisor/stable_s");
+    maybe_extract_json_pointer(shutdown_timeout_s, config, "/supervisor/shutdown_timeout_s");
+    maybe_extract_json_pointer(cgroup, config, "/supervisor/cgroup");
+    maybe_extract_json_pointer(metrics_interval_s, config, "/supervisor/metrics_interval_s");
+    maybe_extract_json_pointer(metrics_path, config, "/supervisor/metrics_path");
+    if (metrics_interval_s <= 0) {
+      throw std::runtime_error("The config parameter \"/supervisor/metrics_interval_s\" must be "
+			       "greater than 0.");
+    }
+    if (min_backoff_ms < 0 || max_backoff_ms < min_backoff_ms) {
+      throw std::runtime_error("The config parameters \"/supervisor/min_backoff_ms\" and "
+			       "\"/supervisor/max_backoff_ms\" must satisfy 0 <= min <= max.");
+    }
+
+    simdjson::dom::array arr;
+    if (config.at_pointer("/supervisor/children").get(arr)) {
+      for (const char* name : { "bparchived", "bpcompressd", "bpindexd" }) {
+	children.emplace_back();
+	children.back().name = name;
+	children.back().path = name;
+      }
+      return;
+    }
+    cpu_set_t available;
+    if (sched_getaffinity(0, sizeof(available), &available) != 0) {
+      throw std::system_error(errno, std::system_category(), "sched_getaffinity() failed");
+    }
+    std::vector<child_t*> rest;
+    for (auto element : arr) {
+      simdjson::dom::object obj;
+      std::string_view tmp_sv;
+      if (element.get(obj) || obj["name"].get(tmp_sv)) {
+	throw std::runtime_error("Each entry of the config parameter \"/supervisor/children\" "
+				 "must be an object with a \"name\".");
+      }
+      children.emplace_back();
+      child_t& child = children.back();
+      child.name = std::string(tmp_sv);
+      child.path = obj["path"].get(tmp_sv) ? child.name : std::string(tmp_sv);
+      simdjson::dom::array args;
+      if (!obj["args"].get(args)) {
+	for (auto arg : args) {
+	  if (arg.get(tmp_sv)) {
+	    std::stringstream ss;
+	    ss << "The \"args\" of child \"" << child.name << "\" in \"/supervisor/children\" "
+	       << "must be an array of strings." << std::endl;
+	    throw std::runtime_error(ss.str());
+	  }
+	  child.args.emplace_back(tmp_sv);
+	}
+      }
+      parse_placement(child, obj, available, rest);
+    }
+
+    // Children given explicit CPUs must not share them, e.g. the archiver's cores are
+    // reserved for receiving and decoding frames. The rest are shared by the others.
+    cpu_set_t reserved;
+    CPU_ZERO(&reserved);
+    for (const child_t& child : children) {
+      if (!child.pinned || std::find(rest.begin(), rest.end(), &child) != rest.end()) {
+	continue;
+      }
+      cpu_set_t overlap;
+      CPU_AND(&overlap, &reserved, &child.cpus);
+      if (CPU_COUNT(&overlap) > 0) {
+	std::stringstream ss;
+	ss << "The \"cpus\" of child \"" << child.name << "\" overlap those of another child "
+	   << "in \"/supervisor/children\".";
+	throw std::runtime_error(ss.str());
+      }
+      CPU_OR(&reserved, &reserved, &child.cpus);
+    }
+    for (child_t* child : rest) {
+      CPU_XOR(&child->cpus, &available, &reserved);
+      if (CPU_COUNT(&child->cpus) == 0) {
+	std::stringstream ss;
+	ss << "No CPUs are left over for child \"" << child->name << "\".";
+	throw std::runtime_error(ss.str());
+      }
+    }
+  }
+
+  int64_t              min_backoff_ms; //!< delay before restarting a child which crashed once
+  int64_t              max_backoff_ms;
+  int64_t              stable_s;       //!< uptime after which a crash resets the backoff
+  int64_t              shutdown_timeout_s;
+  std::string          cgroup;         //!< cgroup v2 directory of the children, if any
+  double               metrics_interval_s;
+  std::string          metrics_path;   //!< file to which aggregated metrics are written
+  std::vector<child_t> children;
+};
+
+static bool write_file(const std::string& path, const std::string& value) {
+  std::ofstream out(path);
+  out << value;
+  out.flush();
+  return out.good();
+}
+
+/*
+  Creates a cgroup v2 directory for each child under "/supervisor/cgroup", limited to
+  its CPUs and weighted by its cpu_weight. The supervisor must be allowed to write to
+  the directory, and the cpu and cpuset controllers must be enabled in its parent. If
+  cgroups are unavailable, children are still pinned by their affinity.
+*/
+static void setup_cgroups(supervisor_config_t& cfg) {
+  if (cfg.cgroup.empty()) {
+    return;
+  }
+  if (mkdir(cfg.cgroup.c_str(), 0755) != 0 && errno != EEXIST) {
+    std::clog << "WARNING: failed to create the cgroup \"" << cfg.cgroup << "\": "
+	      << strerror(errno) << std::endl;
+    return;
+  }
+  if (!write_file(cfg.cgroup + "/cgroup.subtree_control", "+cpu +cpuset")) {
+    std::clog << "WARNING: failed to enable the cpu and cpuset controllers in \""
+	      << cfg.cgroup << "\"" << std::endl;
+  }
+  for (child_t& child : cfg.children) {
+    const std::string dir = cfg.cgroup + "/" + child.name;
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      std::clog << "WARNING: failed to create the cgroup \"" << dir << "\": "
+		<< strerror(errno) << std::endl;
+      continue;
+    }
+    child.cgroup = dir;
+    if (child.pinned && !write_file(dir + "/cpuset.cpus", format_cpus(child.cpus))) {
+      std::clog << "WARNING: failed to set \"" << dir << "/cpuset.cpus\"" << std::endl;
+    }
+    if (child.cpu_weight > 0 && !write_file(dir + "/cpu.weight",
+					    std::to_string(child.cpu_weight))) {
+      std::clog << "WARNING: failed to set \"" << dir << "/cpu.weight\"" << std::endl;
+    }
+  }
+}
+
+/*
+  Spawns a child with the default signal dispositions and an empty signal mask, since
+  the supervisor blocks the signals it receives through its signalfd.
+
+  Each child leads a process group of its own, so that a Ctrl-C at the terminal
+  signals only the supervisor, which then signals every child exactly once. A child
+  signalled twice, e.g. bparchived, would otherwise give up draining its series.
+
+  CPU affinity and I/O priority are inherited, so the single-threaded supervisor takes
+  on the child's for the duration of the spawn. Every thread the child starts is then
+  placed from its first instruction, which setting them on the child's pid afterwards
+  could not guarantee.
+*/
+static void spawn(child_t& child, const std::string& config_file) {
+  std::vector<std::string> argv = { child.path, "-c", config_file };
+  argv.insert(argv.end(), child.args.begin(), child.args.end());
+  std::vector<char*> args;
+  for (std::string& arg : argv) {
+    args.push_back(arg.data());
+  }
+  args.push_back(nullptr);
+
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t no_signals, all_signals;
+  sigemptyset(&no_signals);
+  sigfillset(&all_signals);
+  posix_spawnattr_setsigmask(&attr, &no_signals);
+  posix_spawnattr_setsigdefault(&attr, &all_signals);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF |
+			   POSIX_SPAWN_SETPGROUP);
+
+  cpu_set_t own_cpus;
+  const bool pin = child.pinned && sched_getaffinity(0, sizeof(own_cpus), &own_cpus) == 0;
+  if (pin && sched_setaffinity(0, sizeof(child.cpus), &child.cpus) != 0) {
+    std::clog << "WARNING: failed to set the CPU affinity of " << child.name << ": "
+	      << strerror(errno) << std::endl;
+  }
+  const int own_io_priority = (child.io_priority < 0) ? -1 :
+    syscall(SYS_ioprio_get, ioprio_who_process, 0);
+  if (own_io_priority >= 0 &&
+      syscall(SYS_ioprio_set, ioprio_who_process, 0, child.io_priority) != 0) {
+    std::clog << "WARNING: failed to set the I/O priority of " << child.name << ": "
+	      << strerror(errno) << std::endl;
+  }
+  pid_t pid = -1;
+  int err = posix_spawnp(&pid, args[0], nullptr, &attr, args.data(), environ);
+  posix_spawnattr_destroy(&attr);
+  if (pin) {
+    sched_setaffinity(0, sizeof(own_cpus), &own_cpus);
+  }
+  if (own_io_priority >= 0) {
+    syscall(SYS_ioprio_set, ioprio_who_process, 0, own_io_priority);
+  }
+  if (err != 0) {
+    std::stringstream ss;
+    ss << "Failed to execute \"" << child.path << "\" for " << child.name;
+    throw std::system_error(err, std::system_category(), ss.str());
+  }
+  child.pid = pid;
+  child.started = steady_clock::now();
+  if (!child.cgroup.empty() &&
+      !write_file(child.cgroup + "/cgroup.procs", std::to_string(pid))) {
+    std::clog << "WARNING: failed to move " << child.name << " into the cgroup \""
+	      << child.cgroup << "\"" << std::endl;
+  }
+  std::clog << "INFO: started " << child.name << " (pid " << pid;
+  if (child.pinned) {
+    std::clog << ", cpus " << format_cpus(child.cpus);
+  }
+  std::clog << ")" << std::endl;
+}
+
+static void arm_timer(int fd, int64_t ms) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  // A zero it_value disarms the timer, so a restart without delay waits 1ns.
+  spec.it_value.tv_sec = ms / 1000;
+  spec.it_value.tv_nsec = (ms % 1000) * 1000000 + 1;
+  if (timerfd_settime(fd, 0, &spec, nullptr) != 0) {
+    throw std::system_error(errno, std::system_category(), "timerfd_settime() failed");
+  }
+}
+
+/*
+  Tries to start a child, and on failure schedules another attempt after its backoff.
+*/
+static void start_or_schedule(child_t& child, const supervisor_config_t& cfg,
+			      const std::string& config_file) {
+  child.restart_pending = false;
+  try {
+    spawn(child, config_file);
+    return;
+  } catch (const std::system_error& e) {
+    std::clog << "ERROR: " << e.what() << ", retrying in " << child.backoff_ms << "ms"
+	      << std::endl;
+  }
+  child.restart_pending = true;
+  arm_timer(child.timer_fd, child.backoff_ms);
+  child.backoff_ms = std::min(std::max<int64_t>(2*child.backoff_ms, 1), cfg.max_backoff_ms);
+}
+
+/*
+  Records the exit of a child, and unless shutting down, schedules its restart. A
+  child which crashes repeatedly is restarted with exponential backoff, but one which
+  ran for a while is restarted immediately, since the detector may still be sending.
+*/
+static void on_exit(child_t& child, int status, bool shutting_down,
+		    const supervisor_config_t& cfg) {
+  const auto uptime = steady_clock::now() - child.started;
+  const double uptime_s = std::chrono::duration<double>(uptime).count();
+  child.pid = -1;
+  std::stringstream ss;
+  ss << child.name << " exited ";
+  if (WIFSIGNALED(status)) {
+    ss << "on signal \"" << strsignal(WTERMSIG(status)) << "\"";
+  } else {
+    ss << "with status " << WEXITSTATUS(status);
+  }
+  ss << " after " << uptime_s << "s";
+  if (shutting_down) {
+    std::clog << "INFO: " << ss.str() << std::endl;
+    return;
+  }
+
+  if (uptime_s >= cfg.stable_s) {
+    child.backoff_ms = cfg.min_backoff_ms;
+  }
+  std::clog << "WARNING: " << ss.str() << ", restarting in " << child.backoff_ms << "ms"
+	    << std::endl;
+  ++child.n_restarts;
+  child.restart_pending = true;
+  arm_timer(child.timer_fd, child.backoff_ms);
+  child.backoff_ms = std::min(std::max<int64_t>(2*child.backoff_ms, 1), cfg.max_backoff_ms);
+}
+
+static int open_timer() {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (fd < 0) {
+    throw std::system_error(errno, std::system_category(), "timerfd_create() failed");
+  }
+  return fd;
+}
+
+static void watch(int epoll_fd, int fd, uint64_t tag) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u64 = tag;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    throw std::system_error(errno, std::system_category(), "epoll_ctl() failed");
+  }
+}
+
+static void drain(int fd) {
+  uint64_t expirations;
+  while (read(fd, &expirations, sizeof(expirations)) > 0) {}
+}
+
+/*
+  Writes a file in full or not at all, so that a reader never sees a partial view.
+*/
+static void replace_file(const std::string& path, std::string_view contents) {
+  const std::string tmp = path + ".tmp";
+  FILE* file = fopen(tmp.c_str(), "w");
+  bool ok = file && fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+  ok = file && (fclose(file) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    std::clog << "WARNING: failed to write \"" << path << "\": " << strerror(errno) << std::endl;
+  }
+}
+
+/**
+ * Aggregates the metrics which each child publishes in shared memory into one view of
+ * the pipeline, e.g. frames received vs. archived vs. previewed vs. indexed. Each
+ * child's lag is the number of frames it trails the furthest stage of the newest series.
+ */
+class metrics_view {
+public:
+  metrics_view() : m_buf(1 << 16) {}
+
+  void update(const std::vector<child_t>& children, const supervisor_config_t& cfg) {
+    std::vector<metrics_snapshot_t> snapshots(children.size());
+    std::vector<bool> valid(children.size(), false);
+    int64_t series_id = -1, head = -1;
+    for (size_t i=0; i < children.size(); ++i) {
+      const child_t& child = children[i];
+      try {
+	// A segment left behind by a previous instance of the child is stale.
+	valid[i] = child.pid > 0 && !child.metrics.empty() &&
+	  read_metrics(child.metrics, snapshots[i]) && snapshots[i].pid == child.pid;
+      } catch (const std::runtime_error& e) {
+	std::clog << "WARNING: " << e.what() << std::endl;
+      }
+      if (valid[i]) {
+	series_id = std::max(series_id, snapshots[i].value("series_id", -1));
+      }
+    }
+    for (size_t i=0; i < children.size(); ++i) {
+      if (valid[i] && snapshots[i].value("series_id", -1) == series_id) {
+	head = std::max(head, snapshots[i].value("frame_id", -1));
+      }
+    }
+
+    std::stringstream summary;
+    json_writer w(m_buf.data(), m_buf.size());
+    w.begin_object()
+      .field("time_ms", int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+	std::chrono::system_clock::now().time_since_epoch()).count()))
+      .field("series", series_id)
+      .field("frame", head)
+      .key("daemons").begin_array();
+    for (size_t i=0; i < children.size(); ++i) {
+      const child_t& child = children[i];
+      const metrics_snapshot_t& snapshot = snapshots[i];
+      w.begin_object()
+	.field("name", std::string_view(child.name))
+	.field("pid", int64_t(child.pid))
+	.field("restarts", child.n_restarts);
+      summary << (i ? "; " : "") << child.name;
+      if (!valid[i]) {
+	w.end_object();
+	summary << " unavailable";
+	continue;
+      }
+      const int64_t child_series = snapshot.value("series_id", -1);
+      const int64_t child_frame = snapshot.value("frame_id", -1);
+      w.field("series", child_series).field("frame", child_frame);
+      summary << " series " << child_series << " frame " << child_frame;
+      if (child_series == series_id && child_frame >= 0) {
+	w.field("lag", head - child_frame);
+	summary << " lag " << head - child_frame;
+      } else {
+	w.key("lag").null();
+      }
+
+      w.key("counters").begin_object();
+      for (const auto& counter : snapshot.counters) {
+	w.field(counter.first, counter.second);
+	if (counter.first != "series_id" && counter.first != "frame_id") {
+	  summary << " " << counter.first << "=" << counter.second;
+	}
+      }
+      w.end_object().key("histograms").begin_object();
+      for (const metrics_histogram_t& h : snapshot.histograms) {
+	w.key(h.name).begin_object()
+	  .field("count", h.count)
+	  .field("mean", h.count ? double(h.sum) / h.count : 0.0)
+	  .field("p50", h.quantile(0.5))
+	  .field("p99", h.quantile(0.99))
+	  .end_object();
+	summary << " " << h.name << "_p50=" << h.quantile(0.5);
+      }
+      w.end_object().end_object();
+    }
+    w.end_array().end_object();
+
+    // Only log when the pipeline has moved, so an idle beamline does not fill the log.
+    if (summary.str() != m_summary) {
+      m_summary = summary.str();
+      std::clog << "INFO: pipeline: " << m_summary << std::endl;
+    }
+    if (!cfg.metrics_path.empty() && !w.overflow()) {
+      replace_file(cfg.metrics_path, w.view());
+    }
+  }
+
+private:
+  std::vector<char> m_buf;
+  std::string       m_summary;
+};
+
 int main(int argc, char** argv) {
   int c = 0;
-  int optind = 1;
   std::string config_file("/etc/bigpicture/config.json");
 
   // parse keyword args
   while ((c = getopt(argc, argv, "hc:")) != -1) {
-    ++optind;
     switch (c) {
     case 'c':
       config_file = std::string(optarg);
-      ++optind;
       break;
 
     case 'h':
@@ -61,45 +632,137 @@ int main(int argc, char** argv) {
     }
   }
 
-  // Load the config file.
-  simdjson::dom::parser parser;
-  simdjson::dom::element config;
-  auto simdjson_err = parser.load(config_file).get(config);
-  if (simdjson_err) {
-    std::cerr << simdjson_err << std::endl;
+  auto& config = load_config_file(config_file);
+  supervisor_config_t cfg(config);
+  setup_cgroups(cfg);
+
+  // Each daemon publishes its metrics under its own name if "/metrics" is configured.
+  simdjson::dom::object metrics_config;
+  const bool metrics = !config.at_pointer("/metrics").get(metrics_config);
+  if (metrics) {
+    for (child_t& child : cfg.children) {
+      child.metrics = metrics_name(config, child.name);
+    }
+  }
+
+  // Signals are received synchronously through a signalfd, so the event loop sleeps
+  // until a child exits, a restart is due, or a shutdown is requested.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGCHLD);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &signals, nullptr);
+  int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (signal_fd < 0 || epoll_fd < 0) {
+    std::clog << "ERROR: " << strerror(errno) << std::endl;
     return 1;
   }
-  //std::cout << config << std::endl;
+  const uint64_t signal_tag = UINT64_MAX, shutdown_tag = UINT64_MAX - 1;
+  const uint64_t metrics_tag = UINT64_MAX - 2;
+  watch(epoll_fd, signal_fd, signal_tag);
+  int shutdown_fd = open_timer();
+  watch(epoll_fd, shutdown_fd, shutdown_tag);
+  const int64_t metrics_interval_ms = static_cast<int64_t>(cfg.metrics_interval_s * 1000);
+  int metrics_fd = open_timer();
+  watch(epoll_fd, metrics_fd, metrics_tag);
+  metrics_view view;
+  if (metrics) {
+    arm_timer(metrics_fd, metrics_interval_ms);
+  }
 
-  // Setup IPC and initialize libraries here.
   std::cout << "bigpicture is starting up" << std::endl;
-  signal(SIGINT, signal_handler);
-  signal(SIGTERM, signal_handler);
-
-  // Start child processes
-  std::list<pid_t> child_pids;
-  
-  // Main event loop; monitors all child processes, reports errors,
-  // and restarts downed processes.
-  //std::cout << "bigpicture is ready" << std::endl;
-  std::cout << "bigpicture is ready" << std::endl;
-  while (!shutdown) {
-    sleep(1);
+  std::vector<child_t>& children = cfg.children;
+  for (size_t i=0; i < children.size(); ++i) {
+    children[i].timer_fd = open_timer();
+    children[i].backoff_ms = cfg.min_backoff_ms;
+    watch(epoll_fd, children[i].timer_fd, i);
+    start_or_schedule(children[i], cfg, config_file);
   }
+  std::cout << "bigpicture is ready" << std::endl;
 
-  // Send SIGTERM to children and give them until the timeout to wrap up.
-  // If they don't shutdown, use SIGKILL.
-  for (auto pid : child_pids) {
-    int proc_status = 0;
-    waitpid(pid, &proc_status, WNOHANG);
-    kill(pid, SIGTERM);
-  }
-  sleep(shutdown_timeout);
-  for (auto pid : child_pids) {
-    int proc_status = 0;
-    waitpid(pid, &proc_status, WNOHANG);
-    kill(pid, SIGKILL);
+  bool shutting_down = false;
+  auto n_running = [&]() {
+    return std::count_if(children.begin(), children.end(),
+			 [](const child_t& child) { return child.pid > 0; });
+  };
+  struct epoll_event events[16];
+  while (!shutting_down || n_running() > 0) {
+    int n = epoll_wait(epoll_fd, events, 16, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      std::clog << "ERROR: epoll_wait() failed: " << strerror(errno) << std::endl;
+      break;
+    }
+    for (int i=0; i < n; ++i) {
+      const uint64_t tag = events[i].data.u64;
+      if (tag == signal_tag) {
+	struct signalfd_siginfo info;
+	bool reap = false;
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+	  if (info.ssi_signo == SIGCHLD) {
+	    reap = true;
+	  } else if (info.ssi_signo == SIGHUP) {
+	    // Each daemon reloads the config file itself, once its current series ends.
+	    // The supervisor's own settings only take effect on restart.
+	    std::clog << "INFO: received the \"" << strsignal(info.ssi_signo)
+		      << "\" signal, asking every daemon to reload the config file" << std::endl;
+	    for (child_t& child : children) {
+	      if (child.pid > 0) {
+		kill(child.pid, SIGHUP);
+	      }
+	    }
+	  } else if (!shutting_down) {
+	    // Ask every child to wrap up, and give them until the timeout.
+	    std::clog << "INFO: received the \"" << strsignal(info.ssi_signo)
+		      << "\" signal, shutting down" << std::endl;
+	    shutting_down = true;
+	    for (child_t& child : children) {
+	      child.restart_pending = false;
+	      if (child.pid > 0) {
+		kill(child.pid, SIGTERM);
+	      }
+	    }
+	    arm_timer(shutdown_fd, cfg.shutdown_timeout_s * 1000);
+	  }
+	}
+	// Signals coalesce, so reap every child which has exited.
+	int status = 0;
+	pid_t pid;
+	while (reap && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	  for (child_t& child : children) {
+	    if (child.pid == pid) {
+	      on_exit(child, status, shutting_down, cfg);
+	    }
+	  }
+	}
+      } else if (tag == shutdown_tag) {
+	drain(shutdown_fd);
+	for (child_t& child : children) {
+	  if (child.pid > 0) {
+	    std::clog << "WARNING: " << child.name << " did not shut down within "
+		      << cfg.shutdown_timeout_s << "s, killing it" << std::endl;
+	    kill(child.pid, SIGKILL);
+	  }
+	}
+      } else if (tag == metrics_tag) {
+	drain(metrics_fd);
+	view.update(children, cfg);
+	arm_timer(metrics_fd, metrics_interval_ms);
+      } else if (tag < children.size()) {
+	child_t& child = children[tag];
+	drain(child.timer_fd);
+	if (child.restart_pending && !shutting_down) {
+	  start_or_schedule(child, cfg, config_file);
+	}
+      }
+    }
   }
-  
+
+  std::cout << "bigpicture is done" << std::endl;
   return 0;
 }
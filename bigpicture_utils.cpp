@@ -1,9 +1,11 @@
 #include <filesystem>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include <simdjson.h>
 
@@ -19,6 +21,9 @@ static std::string             s_config_file_name;
 static simdjson::dom::parser   s_config_parser;
 static simdjson::dom::element& s_config_root = s_empty_element;
 static simdjson::dom::object&  s_config_object = s_empty_object;
+
+// Every config loaded since startup, since values may still be viewed from any of them.
+static std::vector<std::unique_ptr<simdjson::dom::parser>> s_reloaded_parsers;
 const simdjson::dom::object&
 bigpicture::load_config_file(const std::string& filename) {
   using namespace simdjson::dom;
@@ -70,3 +75,26 @@ bigpicture::load_config_file(const std::string& filename) {
   
   return s_config_object;
 }
+
+const simdjson::dom::object& bigpicture::reload_config_file() {
+  using namespace simdjson::dom;
+  if (!s_config_loaded) {
+    throw std::runtime_error("No config file has been loaded to reload.");
+  }
+
+  auto parser = std::make_unique<simdjson::dom::parser>();
+  element root;
+  auto ec = parser->load(s_config_file_name).get(root);
+  if (ec) {
+    std::stringstream ss;
+    ss << "Failed to reload the config file " << s_config_file_name << ": "
+       << simdjson::error_message(ec);
+    throw std::runtime_error(ss.str());
+  }
+  if (!root.is<object>()) {
+    throw std::runtime_error("The root of the JSON config file hierarchy should be an object, not an array");
+  }
+  s_config_object = root.get_object();
+  s_reloaded_parsers.push_back(std::move(parser));
+  return s_config_object;
+}
@@ -1,6 +1,7 @@
 #ifndef BP_UTILS_H
 #define BP_UTILS_H
 
+#include <iostream>
 #include <stdexcept>
 #include <string>
 
@@ -171,6 +172,32 @@ namespace bigpicture {
    */
   const simdjson::dom::object& load_config_file(const std::string& filename);
 
+  /**
+   * Re-reads the config file last loaded by load_config_file(), e.g. on SIGHUP.
+   *
+   * Values already extracted from the previous config remain valid, including views
+   * of its strings, so a daemon may finish a series under the previous config.
+   *
+   * @return A reference to the top-level object of the new config file, which is
+   *         also returned by subsequent calls to load_config_file().
+   * \throws std::runtime_error if the file cannot be read or is ill-formed, in which
+   *         case the previous config remains loaded.
+   */
+  const simdjson::dom::object& reload_config_file();
+
+  /**
+   * Keeps the running value of a config parameter which only takes effect on restart,
+   * warning if a reloaded config file changed it.
+   */
+  template<typename T>
+  void keep_running_value(T& reloaded, const T& running, const char* json_pointer) {
+    if (!(reloaded == running)) {
+      std::clog << "WARNING: the config parameter \"" << json_pointer << "\" only takes "
+		<< "effect on restart, ignoring its new value." << std::endl;
+      reloaded = running;
+    }
+  }
+
   /**
    * A convenience utility wrapper around std::unique_ptr<char[]>.
    *
@@ -11,6 +11,7 @@
 #include "bigpicture_utils.h"
 #include "dectris_stream.h"
 #include "dectris_utils.h"
+#include "memory_budget.h"
 #include "stream_to_cbf.h"
 
 static void noop() {}
@@ -35,13 +36,22 @@ static void signal_handler(int signum) {
     
   } else {
     strlcat(strbuf, "\" signal. Shutdown will complete after any "
-	    "currently-running image series is completed.\n", sizeof(strbuf));
+	    "currently-running image series is completed, or after "
+	    "\"/archiver/source/drain_timeout_s\" seconds.\n", sizeof(strbuf));
     write(STDOUT_FILENO, strbuf, strlen(strbuf));
     fsync(STDOUT_FILENO); // flush terminal output immediately
     signal_safe_shutdown_adapter_func();
   }
 }
 
+std::function<void()> signal_safe_reload_adapter_func = noop; // I must always be reentrant!
+static void reload_handler(int signum) {
+  static const char msg[] = "bparchived received the \"Hangup\" signal. The config file "
+    "will be reloaded after any currently-running image series is completed.\n";
+  write(STDOUT_FILENO, msg, sizeof(msg)-1);
+  signal_safe_reload_adapter_func();
+}
+
 static void usage() {
   std::cerr << "bparchived [-c config_file]\n"
 	    << "  -c config_file : A JSON config file, see README for details.\n"
@@ -79,11 +89,26 @@ int main(int argc, char** argv) {
   sigemptyset(&action.sa_mask);
   sigaction(SIGINT, &action, NULL);
   sigaction(SIGTERM, &action, NULL);
+  action.sa_handler = reload_handler;
+  sigaction(SIGHUP, &action, NULL);
   
   auto& config = load_config_file(config_file);
+  memory_budget memory(config, "archiver");
   stream_to_cbf parser(config);
   dectris_streamer<stream_to_cbf> streamer(std::ref(parser), config);
+  parser.use_memory_budget(memory);
+  streamer.use_memory_budget(memory);
   signal_safe_shutdown_adapter_func = [&]() { streamer.shutdown(); };
+  signal_safe_reload_adapter_func = [&]() { streamer.reload(); };
+  streamer.on_reload([&]() {
+    // The DCU endpoint, receive buffer, workers and memory budget only take effect
+    // on restart.
+    try {
+      parser.reconfigure(reload_config_file());
+    } catch (const std::exception& e) {
+      std::clog << "ERROR: keeping the running config: " << e.what() << std::endl;
+    }
+  });
   streamer.run();
   std::clog << "INFO: done" << std::endl;
   
@@ -1,14 +1,812 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <inttypes.h>
+#include <filesystem>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <omp.h>
+#include <signal.h>
+#include <sstream>
+#include <stdio.h>
 #include <string>
+#include <string.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <simdjson.h>
+
+#include "bigpicture_utils.h"
+#include "cbf_reader.h"
+#include "frame_events.h"
+#include "frame_ring.h"
+#include "http_server.h"
+#include "lru_cache.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "preview.h"
+#include "tile_pyramid.h"
+#include "work_queue.h"
+
+using namespace bigpicture;
+
+std::atomic<bool> shutdown_requested = false;
+static void signal_handler(int signum) {
+  // iostream and printf() are not signal-safe (reentrant), but plain-old
+  // write() is, and so are all the functions called below.
+  shutdown_requested = true;
+  char strbuf[1024];
+  memset(strbuf, '\0', sizeof(strbuf));
+  strlcat(strbuf, "bpcompressd received the \"", sizeof(strbuf));
+  strlcat(strbuf, strsignal(signum), sizeof(strbuf));
+  strlcat(strbuf, "\" signal, shutting down now.\n", sizeof(strbuf));
+  write(STDOUT_FILENO, strbuf, strlen(strbuf));
+  fsync(STDOUT_FILENO); // flush terminal output immediately
+}
+
+std::atomic<bool> reload_requested = false;
+static void reload_handler(int signum) {
+  reload_requested = true;
+  static const char msg[] = "bpcompressd received the \"Hangup\" signal. The config file "
+    "will be reloaded after any currently-running image series is completed.\n";
+  write(STDOUT_FILENO, msg, sizeof(msg)-1);
+}
+
+static void usage() {
+  std::cerr << "bpcompressd [-c config_file]\n"
+	    << "  -c config_file : A JSON config file, see README for details.\n"
+	    << "\n"
+	    << "Generates browser-viewable previews of images archived by bparchived.\n"
+	    << std::endl;
+}
+
+/**
+ * Deserialized "/compressor" config parameters.
+ *
+ * On SIGHUP, all of them except the HTTP server, the tile cache, the memory budget and
+ * the shared-memory names are reloaded between series.
+ */
+struct compressor_config_t {
+  compressor_config_t(const simdjson::dom::object& config) :
+    format(preview_format_t::jpeg),
+    workers(4),
+    quality(90),
+    queue_depth(64),
+    memory_budget_mb(0),
+    percentile_low(5.0),
+    percentile_high(99.9),
+    invert(false),
+    bin_factor(0),
+    max_size(1024),
+    bin_mode(bin_mode_t::max),
+    tiles(false),
+    tile_size(256),
+    tile_eager_size(1024),
+    tile_cache_mb(512),
+    eager_stride(1),
+    http(false),
+    http_socket("/tmp/bigpicture-previews.sock"),
+    http_threads(4),
+    http_cache_mb(256),
+    ring_name("/bigpicture-frames"),
+    live_name("/bigpicture-live") {
+
+    std::string_view tmp_sv;
+    if (maybe_extract_json_pointer(tmp_sv, config, "/compressor/format")) {
+      auto it = preview_format_values.find(tmp_sv);
+      if (it == preview_format_values.end() || it->second == preview_format_t::unknown) {
+	std::stringstream ss;
+	ss << "The config parameter \"/compressor/format\" has an unsupported value, \""
+	   << tmp_sv << "\". The supported formats are \"jpeg\" and \"jxl\"." << std::endl;
+	throw std::runtime_error(ss.str());
+      }
+      format = it->second;
+    }
+    maybe_extract_json_pointer(workers, config, "/compressor/workers");
+    maybe_extract_json_pointer(quality, config, "/compressor/quality");
+    maybe_extract_json_pointer(queue_depth, config, "/compressor/queue_depth");
+    maybe_extract_json_pointer(memory_budget_mb, config, "/compressor/memory_budget_mb");
+    maybe_extract_json_pointer(percentile_low, config, "/compressor/percentile/0");
+    maybe_extract_json_pointer(percentile_high, config, "/compressor/percentile/1");
+    maybe_extract_json_pointer(invert, config, "/compressor/invert");
+    maybe_extract_json_pointer(destination, config, "/compressor/destination");
+    maybe_extract_json_pointer(jxl.bit_depth, config, "/compressor/jxl/bit_depth");
+    maybe_extract_json_pointer(jxl.distance, config, "/compressor/jxl/distance");
+    maybe_extract_json_pointer(jxl.effort, config, "/compressor/jxl/effort");
+    maybe_extract_json_pointer(jxl.lossless, config, "/compressor/jxl/lossless");
+    maybe_extract_json_pointer(jxl.progressive, config, "/compressor/jxl/progressive");
+    jxl.threads = 0;
+    maybe_extract_json_pointer(jxl.threads, config, "/compressor/jxl/threads");
+    simdjson::dom::object tiles_obj;
+    if (maybe_extract_json_pointer(tiles_obj, config, "/compressor/tiles")) {
+      tiles = true;
+      maybe_extract_json_pointer(tile_size, config, "/compressor/tiles/size");
+      maybe_extract_json_pointer(tile_eager_size, config, "/compressor/tiles/eager_size");
+      maybe_extract_json_pointer(tile_cache_mb, config, "/compressor/tiles/cache_mb");
+    }
+    maybe_extract_json_pointer(eager_stride, config, "/compressor/eager_stride");
+    maybe_extract_json_pointer(archive_dir, config, "/compressor/archive_dir");
+    simdjson::dom::object http_obj;
+    if (maybe_extract_json_pointer(http_obj, config, "/compressor/http")) {
+      http = true;
+      maybe_extract_json_pointer(http_socket, config, "/compressor/http/socket");
+      maybe_extract_json_pointer(http_threads, config, "/compressor/http/threads");
+      maybe_extract_json_pointer(http_cache_mb, config, "/compressor/http/cache_mb");
+    }
+    maybe_extract_json_pointer(bin_factor, config, "/compressor/bin_factor");
+    maybe_extract_json_pointer(max_size, config, "/compressor/max_size");
+    if (maybe_extract_json_pointer(tmp_sv, config, "/compressor/bin_mode")) {
+      auto it = bin_mode_values.find(tmp_sv);
+      if (it == bin_mode_values.end() || it->second == bin_mode_t::unknown) {
+	std::stringstream ss;
+	ss << "The config parameter \"/compressor/bin_mode\" has an unsupported value, \""
+	   << tmp_sv << "\". The supported modes are \"sum\" and \"max\"." << std::endl;
+	throw std::runtime_error(ss.str());
+      }
+      bin_mode = it->second;
+    }
+    maybe_extract_json_pointer(ring_name, config, "/archiver/frame_ring/name");
+    maybe_extract_json_pointer(live_name, config, "/archiver/live_view/name");
+    if (workers < 1) {
+      throw std::runtime_error("The config parameter \"/compressor/workers\" must be at least 1.");
+    }
+    if (eager_stride < 0) {
+      throw std::runtime_error("The config parameter \"/compressor/eager_stride\" must not be negative.");
+    }
+    if (jxl.bit_depth != 8 && jxl.bit_depth != 16) {
+      throw std::runtime_error("The config parameter \"/compressor/jxl/bit_depth\" must be 8 or 16.");
+    }
+    if (jxl.threads < 1) {
+      // Share the cores among workers, since every worker may be encoding at once.
+      int64_t n_cores = std::thread::hardware_concurrency();
+      jxl.threads = std::max<int64_t>(1, n_cores / workers);
+    }
+    if (bin_factor < 0 || bin_factor > int64_t(max_bin_factor)) {
+      std::stringstream ss;
+      ss << "The config parameter \"/compressor/bin_factor\" must be between 0 (automatic) and "
+	 << max_bin_factor << "." << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+  }
+
+  /// @return The bin factor for a frame, either as configured or to fit within max_size.
+  size_t bin_factor_for_frame(size_t width, size_t height) const {
+    if (bin_factor > 0) {
+      return bin_factor;
+    }
+    size_t factor = bin_factor_for(std::max(width, height), std::max<int64_t>(max_size, 0));
+    return std::min(factor, max_bin_factor);
+  }
+
+  preview_format_t format;
+  int64_t          workers;
+  int64_t          quality;         //!< 1-100
+  int64_t          queue_depth;     //!< frames waiting for a worker
+  int64_t          memory_budget_mb; //!< for frames in flight and caches, 0 for no limit
+  double           percentile_low;  //!< mapped to black
+  double           percentile_high; //!< mapped to white
+  bool             invert;
+  std::string      destination;     //!< empty to write previews next to the raw images
+  int64_t          bin_factor;      //!< 0 to derive from max_size
+  int64_t          max_size;        //!< longest preview edge in pixels when binning automatically
+  bin_mode_t       bin_mode;
+  jxl_options_t    jxl;
+  bool             tiles;           //!< also write a Deep Zoom tile pyramid per frame
+  int64_t          tile_size;       //!< pixels
+  int64_t          tile_eager_size; //!< levels up to this size are written eagerly
+  int64_t          tile_cache_mb;   //!< pyramids kept to render tiles on demand
+  int64_t          eager_stride;    //!< render every nth frame as it arrives, 0 for none
+  std::string      archive_dir;     //!< where to find frames not announced since startup
+  bool             http;            //!< serve previews on demand
+  std::string      http_socket;
+  int64_t          http_threads;
+  int64_t          http_cache_mb;   //!< encoded previews kept in memory
+  std::string      ring_name;
+  std::string      live_name;       //!< bparchived's live view, see live_view
+};
+
+/**
+ * Counters shared by all workers, reported at the end of every series.
+ */
+struct preview_counters_t {
+  std::atomic<uint64_t> written = 0;
+  std::atomic<uint64_t> missing = 0; //!< no longer in the frame ring
+  std::atomic<uint64_t> failed = 0;
+  std::atomic<uint64_t> busy_us = 0;
+};
+
+/**
+ * Metrics published to the supervisor, which unlike the counters are never reset.
+ */
+struct preview_metrics_t {
+  explicit preview_metrics_t(metrics_writer& writer) :
+    frames_notified(writer.counter("frames_notified")),
+    frames_dropped(writer.counter("frames_dropped")),
+    previews_written(writer.counter("previews_written")),
+    previews_missing(writer.counter("previews_missing")),
+    previews_failed(writer.counter("previews_failed")),
+    series_id(writer.counter("series_id")),
+    frame_id(writer.counter("frame_id")),
+    preview_us(writer.histogram("preview_us")) {}
+
+  metrics_counter   frames_notified;
+  metrics_counter   frames_dropped;   //!< because the queue was full
+  metrics_counter   previews_written;
+  metrics_counter   previews_missing;
+  metrics_counter   previews_failed;
+  metrics_counter   series_id;
+  metrics_counter   frame_id;         //!< the newest frame previewed
+  metrics_histogram preview_us;
+};
+
+static std::filesystem::path preview_path(const compressor_config_t& cfg,
+					  const frame_event_t& event, const char* extension) {
+  std::filesystem::path raw(event.path);
+  if (raw.empty()) {
+    raw = std::to_string(event.series_id) + "-" + std::to_string(event.frame_id);
+  }
+  if (cfg.destination.empty()) {
+    return raw.replace_extension(extension);
+  }
+  return std::filesystem::path(cfg.destination) / raw.filename().replace_extension(extension);
+}
+
+/*
+  Writes to a temporary file and renames it, so that a web server never serves a
+  partially-written preview.
+*/
+static void write_file(const std::filesystem::path& path, const void* data, size_t len) {
+  std::string tmp = path.string() + ".tmp";
+  FILE* file_handle = fopen(tmp.c_str(), "wb");
+  if (file_handle == nullptr) {
+    std::stringstream ss;
+    ss << "libc error: " << tmp << " - " << strerror(errno) << "\n";
+    throw std::system_error(errno, std::system_category(), ss.str());
+  }
+  size_t n_written = fwrite(data, 1, len, file_handle);
+  if (fclose(file_handle) != 0 || n_written != len ||
+      rename(tmp.c_str(), path.c_str()) != 0) {
+    int err = errno;
+    std::stringstream ss;
+    ss << "libc error: " << path.string() << " - " << strerror(err) << "\n";
+    unlink(tmp.c_str());
+    throw std::system_error(err, std::system_category(), ss.str());
+  }
+}
+
+struct frame_key_hash {
+  size_t operator()(const std::pair<int64_t, int64_t>& key) const {
+    return std::hash<int64_t>()(key.first * 1000003 + key.second);
+  }
+};
+/**
+ * Tile pyramids of recent frames, kept to render their remaining tiles on demand.
+ */
+using pyramid_cache_t = lru_cache<std::pair<int64_t, int64_t>, tile_pyramid, frame_key_hash>;
+
+/*
+  Writes the DZI descriptor of a pyramid and every tile of the levels no larger than
+  eager_size, in the directory layout expected by Deep Zoom viewers:
+  <name>.dzi and <name>_files/<level>/<column>_<row>.jpg
+*/
+static void write_pyramid(const compressor_config_t& cfg, const frame_event_t& job,
+			  tile_pyramid& pyramid, jpeg_encoder& encoder) {
+  std::filesystem::path base = preview_path(cfg, job, "");
+  std::string dzi = pyramid.dzi();
+  std::filesystem::path files = base.string() + "_files";
+  for (size_t level=0; level <= pyramid.max_level(); ++level) {
+    if (std::max(pyramid.width(level), pyramid.height(level)) > size_t(cfg.tile_eager_size)) {
+      break;
+    }
+    std::filesystem::path dir = files / std::to_string(level);
+    std::filesystem::create_directories(dir);
+    for (size_t row=0; row < pyramid.n_rows(level); ++row) {
+      for (size_t column=0; column < pyramid.n_columns(level); ++column) {
+	auto tile = pyramid.tile(level, column, row, encoder);
+	std::string name = std::to_string(column) + "_" + std::to_string(row) + ".jpg";
+	write_file(dir / name, tile->data(), tile->size());
+      }
+    }
+  }
+  write_file(base.string() + ".dzi", dzi.data(), dzi.size());
+}
+
+static void preview_worker(const compressor_config_t& cfg, frame_source& source,
+			   work_queue<frame_event_t>& jobs, pyramid_cache_t& pyramids,
+			   memory_budget& memory, preview_counters_t& counters,
+			   preview_metrics_t& metrics) {
+  // Frames are already processed in parallel, one per worker.
+  omp_set_num_threads(1);
+
+  // Previews are either tone mapped to 8 bits, or keep photon counts in 16 bits.
+  std::unique_ptr<jpeg_encoder> jpeg;
+  std::unique_ptr<jxl_encoder> jxl;
+  const char* extension = ".jpg";
+  bool counts = false;
+  if (cfg.format == preview_format_t::jxl) {
+    jxl = std::make_unique<jxl_encoder>(cfg.jxl);
+    extension = ".jxl";
+    counts = (cfg.jxl.bit_depth == 16);
+  } else {
+    jpeg = std::make_unique<jpeg_encoder>(cfg.quality);
+  }
+  std::unique_ptr<jpeg_encoder> tile_encoder;
+  if (cfg.tiles) {
+    tile_encoder = std::make_unique<jpeg_encoder>(cfg.quality);
+  }
+
+  unique_buffer scratch;
+  std::vector<uint8_t> gray;
+  std::vector<uint16_t> gray16;
+  std::vector<uint32_t> binned;
+  frame_event_t job;
+  while (jobs.pop(job)) {
+    try {
+      auto start = std::chrono::steady_clock::now();
+      size_t width = 0, height = 0;
+      std::shared_ptr<tile_pyramid> pyramid;
+      memory_reservation in_flight(&memory); // until the preview is written
+      bool ok = source.with_frame(job.series_id, job.frame_id, scratch,
+				  [&](const frame_meta_t& meta, const void* pixels) {
+	const size_t factor = cfg.bin_factor_for_frame(meta.width, meta.height);
+	width = binned_size(meta.width, factor);
+	height = binned_size(meta.height, factor);
+	in_flight.resize(size_t(meta.width)*meta.height*(meta.bit_depth/8 + (cfg.tiles ? 4 : 0)) +
+			 width*height*(counts ? 6 : 1));
+	tone_map_t tone;
+	if (cfg.tiles || !counts) {
+	  tone = compute_tone_map(pixels, size_t(meta.width)*meta.height, meta.bit_depth,
+				  cfg.percentile_low, cfg.percentile_high);
+	  tone.invert = cfg.invert;
+	}
+	if (cfg.tiles) {
+	  pyramid = std::make_shared<tile_pyramid>(pixels, meta.width, meta.height,
+						   meta.bit_depth, cfg.bin_mode, tone,
+						   cfg.tile_size);
+	}
+	if (counts) {
+	  gray16.resize(width*height);
+	  if (factor == 1) {
+	    counts_to_gray16(pixels, width*height, meta.bit_depth, gray16.data());
+	  } else {
+	    binned.resize(width*height);
+	    bin_frame(pixels, meta.width, meta.height, meta.bit_depth, factor,
+		      cfg.bin_mode, binned.data());
+	    counts_to_gray16(binned.data(), binned.size(), gray16.data());
+	  }
+	  return;
+	}
+
+	gray.resize(width*height);
+	if (factor == 1) {
+	  tone_map_frame(pixels, width*height, meta.bit_depth, tone, gray.data());
+	} else {
+	  bin_and_tone_map(pixels, meta.width, meta.height, meta.bit_depth, factor,
+			   cfg.bin_mode, tone, gray.data());
+	}
+      });
+      if (!ok) {
+	++counters.missing;
+	metrics.previews_missing.add();
+	continue;
+      }
+
+      std::filesystem::path path = preview_path(cfg, job, extension);
+      if (jxl) {
+	const void* image = counts ? static_cast<const void*>(gray16.data()) : gray.data();
+	size_t len = jxl->encode(image, width, height);
+	write_file(path, jxl->data(), len);
+      } else {
+	size_t len = jpeg->encode(gray.data(), width, height);
+	write_file(path, jpeg->data(), len);
+      }
+      if (pyramid) {
+	write_pyramid(cfg, job, *pyramid, *tile_encoder);
+	uint64_t cost = pyramid->memory_usage();
+	pyramids.put(std::make_pair(job.series_id, job.frame_id), std::move(pyramid), cost);
+      }
+
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+	std::chrono::steady_clock::now() - start);
+      counters.busy_us += elapsed.count();
+      ++counters.written;
+      metrics.previews_written.add();
+      metrics.preview_us.record(elapsed.count());
+      metrics.frame_id.set(job.frame_id);
+    } catch (const std::exception& e) {
+      ++counters.failed;
+      metrics.previews_failed.add();
+      std::clog << "ERROR: failed to generate a preview of series " << job.series_id
+		<< ", frame " << job.frame_id << ": " << e.what() << std::endl;
+    }
+  }
+}
+
+/**
+ * Renders previews and tiles of archived frames when they are requested over HTTP,
+ * rather than rendering every frame of every series as it arrives.
+ *
+ * Frames are read by mapping the archived miniCBF files. Encoded previews are kept
+ * in a size-bounded LRU cache, and concurrent requests for the same preview or for
+ * tiles of the same frame are coalesced, so that each is rendered once.
+ *
+ * Routes:
+ *   /preview/<series>/<frame>.jpg?level=<n>&contrast=<low>,<high>
+ *     The frame binned by 2^level (0-4), with a percentile stretch from low to high.
+ *   /tiles/<series>/<frame>.dzi
+ *   /tiles/<series>/<frame>_files/<level>/<column>_<row>.jpg
+ *     A Deep Zoom pyramid of the frame, see tile_pyramid.
+ *   /live.jpg?contrast=<low>,<high>
+ *     The sum of the latest frames of the running series, see live_view. Never cached.
+ */
+class preview_service {
+public:
+  /**
+   * Keeps a copy of cfg, so that previews rendered on demand use the startup config.
+   * Frames being rendered and the caches draw from the memory budget.
+   */
+  preview_service(const compressor_config_t& cfg, pyramid_cache_t& pyramids,
+		  memory_budget& memory) :
+    m_cfg(cfg),
+    m_live(cfg.live_name),
+    m_memory(memory),
+    m_pyramids(pyramids),
+    m_previews(uint64_t(std::max<int64_t>(cfg.http_cache_mb, 0)) << 20, &memory),
+    m_paths(16 << 20, &memory) {}
+
+  /// Records where the archiver committed a frame.
+  void add_frame(const frame_event_t& event) {
+    if (!event.path.empty()) {
+      m_paths.put(std::make_pair(event.series_id, event.frame_id),
+		  std::make_shared<const std::string>(event.path), event.path.size());
+    }
+  }
+
+  void handle(const http_request_t& request, http_response_t& response) {
+    int64_t series_id = 0, frame_id = 0;
+    size_t level = 0, column = 0, row = 0;
+    int n = 0;
+    const char* path = request.path.c_str();
+    try {
+      if (request.path == "/live.jpg") {
+	live(request, response);
+	return;
+      }
+      if (sscanf(path, "/preview/%" SCNd64 "/%" SCNd64 ".jpg%n",
+		 &series_id, &frame_id, &n) == 2 && path[n] == '\0') {
+	preview(series_id, frame_id, request, response);
+      } else if (sscanf(path, "/tiles/%" SCNd64 "/%" SCNd64 ".dzi%n",
+			&series_id, &frame_id, &n) == 2 && path[n] == '\0') {
+	response.text = pyramid(series_id, frame_id)->dzi();
+	response.content_type = "application/xml";
+      } else if (sscanf(path, "/tiles/%" SCNd64 "/%" SCNd64 "_files/%zu/%zu_%zu.jpg%n",
+			&series_id, &frame_id, &level, &column, &row, &n) == 5 &&
+		 path[n] == '\0') {
+	thread_local jpeg_encoder encoder(m_cfg.quality);
+	auto p = pyramid(series_id, frame_id);
+	response.body = p->tile(level, column, row, encoder);
+	response.content_type = "image/jpeg";
+	// The pyramid keeps the tile, so it counts against the cache from now on.
+	m_pyramids.update_cost(std::make_pair(series_id, frame_id), p->memory_usage());
+      } else {
+	response.status = 404;
+	response.text = "Unknown resource, see the bpcompressd section of the README.\n";
+	return;
+      }
+      // Archived frames never change.
+      response.cache_control = "public, max-age=86400, immutable";
+    } catch (const std::system_error& e) {
+      if (e.code().value() != ENOENT) {
+	throw;
+      }
+      response = http_response_t();
+      response.status = 404;
+      response.text = "Frame " + std::to_string(frame_id) + " of series " +
+	std::to_string(series_id) + " is not archived.\n";
+    } catch (const std::out_of_range& e) {
+      response = http_response_t();
+      response.status = 404;
+      response.text = e.what();
+    } catch (const std::invalid_argument& e) {
+      response = http_response_t();
+      response.status = 400;
+      response.text = e.what();
+    }
+  }
+
+  std::string stats() const {
+    std::stringstream ss;
+    ss << m_previews.size() << " previews cached (" << (m_previews.cost() >> 20) << " MiB), "
+       << m_previews.n_hits() << " hits, " << m_previews.n_misses() << " misses, "
+       << m_previews.n_coalesced() << " coalesced";
+    return ss.str();
+  }
+
+private:
+  std::string frame_path(int64_t series_id, int64_t frame_id) {
+    auto path = m_paths.get(std::make_pair(series_id, frame_id));
+    if (path) {
+      return *path;
+    }
+    std::string name = std::to_string(series_id) + "-" + std::to_string(frame_id) + ".cbf";
+    return (std::filesystem::path(m_cfg.archive_dir) / name).string();
+  }
+
+  /*
+    Maps and decodes a frame into a per-thread buffer, which remains valid until the
+    next call on the same thread.
+  */
+  const unique_buffer& load(int64_t series_id, int64_t frame_id, size_t& width,
+			    size_t& height, int64_t& bit_depth) {
+    thread_local unique_buffer pixels;
+    cbf_reader cbf(frame_path(series_id, frame_id));
+    cbf.decode(pixels);
+    width = cbf.width();
+    height = cbf.height();
+    bit_depth = cbf.bit_depth();
+    return pixels;
+  }
+
+  void contrast(const http_request_t& request, double& low, double& high) const {
+    low = m_cfg.percentile_low;
+    high = m_cfg.percentile_high;
+    std::string param(request.param("contrast"));
+    if (!param.empty() && sscanf(param.c_str(), "%lf,%lf", &low, &high) != 2) {
+      throw std::invalid_argument("contrast must be a pair of percentiles, e.g. 5,99.9\n");
+    }
+  }
+
+  void preview(int64_t series_id, int64_t frame_id, const http_request_t& request,
+	       http_response_t& response) {
+    const size_t level = strtoul(std::string(request.param("level", "0")).c_str(), nullptr, 10);
+    double low = 0, high = 0;
+    contrast(request, low, high);
+    if ((size_t(1) << std::min<size_t>(level, 63)) > max_bin_factor) {
+      throw std::invalid_argument("level must be between 0 and 4\n");
+    }
+
+    std::stringstream key;
+    key << series_id << "/" << frame_id << "/" << level << "/" << low << "/" << high;
+    response.body = m_previews.get_or_compute(key.str(), [&](uint64_t& cost) {
+      size_t width = 0, height = 0;
+      int64_t bit_depth = 0;
+      const void* pixels = load(series_id, frame_id, width, height, bit_depth).get();
+      memory_reservation in_flight(&m_memory);
+      in_flight.resize(width*height*(bit_depth/8 + 1));
+      tone_map_t tone = compute_tone_map(pixels, width*height, bit_depth, low, high);
+      tone.invert = m_cfg.invert;
+
+      const size_t factor = size_t(1) << level;
+      const size_t out_width = binned_size(width, factor);
+      const size_t out_height = binned_size(height, factor);
+      thread_local std::vector<uint8_t> gray;
+      gray.resize(out_width * out_height);
+      if (factor == 1) {
+	tone_map_frame(pixels, width*height, bit_depth, tone, gray.data());
+      } else {
+	bin_and_tone_map(pixels, width, height, bit_depth, factor, m_cfg.bin_mode,
+			 tone, gray.data());
+      }
+      thread_local jpeg_encoder encoder(m_cfg.quality);
+      size_t len = encoder.encode(gray.data(), out_width, out_height);
+      cost = len;
+      return std::make_shared<const std::string>(
+	reinterpret_cast<const char*>(encoder.data()), len);
+    });
+    response.content_type = "image/jpeg";
+  }
+
+  void live(const http_request_t& request, http_response_t& response) {
+    double low = 0, high = 0;
+    contrast(request, low, high);
+
+    // The live view is tiny and rarely overwritten, so a retry almost always succeeds.
+    thread_local std::vector<uint8_t> gray;
+    thread_local jpeg_encoder encoder(m_cfg.quality);
+    size_t width = 0, height = 0;
+    bool ok = false;
+    for (int attempt=0; attempt < 3 && !ok; ++attempt) {
+      ok = m_live.with_latest([&](const frame_meta_t& meta, const void* pixels) {
+	width = meta.width;
+	height = meta.height;
+	tone_map_t tone = compute_tone_map(pixels, width*height, meta.bit_depth, low, high);
+	tone.invert = m_cfg.invert;
+	gray.resize(width*height);
+	tone_map_frame(pixels, width*height, meta.bit_depth, tone, gray.data());
+      });
+    }
+    if (!ok) {
+      response.status = 503;
+      response.text = "No live view is available, see \"/archiver/live_view\" in the README.\n";
+      return;
+    }
+    size_t len = encoder.encode(gray.data(), width, height);
+    response.body = std::make_shared<const std::string>(
+      reinterpret_cast<const char*>(encoder.data()), len);
+    response.content_type = "image/jpeg";
+    response.cache_control = "no-store";
+  }
+
+  std::shared_ptr<const tile_pyramid> pyramid(int64_t series_id, int64_t frame_id) {
+    return m_pyramids.get_or_compute(std::make_pair(series_id, frame_id), [&](uint64_t& cost) {
+      size_t width = 0, height = 0;
+      int64_t bit_depth = 0;
+      const void* pixels = load(series_id, frame_id, width, height, bit_depth).get();
+      memory_reservation in_flight(&m_memory);
+      in_flight.resize(width*height*(bit_depth/8 + 4));
+      tone_map_t tone = compute_tone_map(pixels, width*height, bit_depth,
+					 m_cfg.percentile_low, m_cfg.percentile_high);
+      tone.invert = m_cfg.invert;
+      auto result = std::make_shared<const tile_pyramid>(pixels, width, height,
+							 bit_depth, m_cfg.bin_mode, tone,
+							 m_cfg.tile_size);
+      cost = result->memory_usage();
+      return result;
+    });
+  }
+
+  const compressor_config_t                              m_cfg;
+  frame_source                                           m_live;
+  memory_budget&                                         m_memory;
+  pyramid_cache_t&                                       m_pyramids;
+  lru_cache<std::string, std::string>                    m_previews;
+  lru_cache<std::pair<int64_t, int64_t>, std::string, frame_key_hash> m_paths;
+};
 
 int main(int argc, char** argv) {
-  std::cout << "TODO: implement bcompressd" << std::endl;
+  std::string config_file("/etc/bigpicture/config.json");
+
+  int c = 0;
+  while ((c = getopt(argc, argv, "c:")) != -1) {
+    switch (c) {
+    case 'c':
+      config_file = std::string(optarg);
+      break;
+
+    case 'h':
+    case '?':
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  struct sigaction action;
+  action.sa_handler = signal_handler;
+  action.sa_flags = 0;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  action.sa_handler = reload_handler;
+  sigaction(SIGHUP, &action, NULL);
 
-  // Temporary kludge to silence -Wunused-parameter
-  std::cerr << "args:\n";
-  for (int i=0; i<argc; ++i) {
-    std::cerr << argv[i] << " ";
+  auto& config = load_config_file(config_file);
+  compressor_config_t cfg(config);
+  if (!cfg.destination.empty()) {
+    std::filesystem::create_directories(cfg.destination);
   }
-  std::cerr << std::endl;
+
+  frame_source source(cfg.ring_name);
+  preview_counters_t counters;
+  metrics_writer metrics_segment(config, "bpcompressd");
+  preview_metrics_t metrics(metrics_segment);
+  memory_budget memory(uint64_t(std::max<int64_t>(cfg.memory_budget_mb, 0)) << 20);
+  memory.publish(metrics_segment);
+  auto jobs = std::make_unique<work_queue<frame_event_t>>(cfg.queue_depth);
+  uint64_t n_dropped_before = 0; // by the queues replaced on reload
+  pyramid_cache_t pyramids(uint64_t(std::max<int64_t>(cfg.tile_cache_mb, 0)) << 20, &memory);
+  std::vector<std::thread> workers;
+  auto start_workers = [&]() {
+    for (int64_t i=0; i < cfg.workers; ++i) {
+      workers.emplace_back(preview_worker, std::cref(cfg), std::ref(source), std::ref(*jobs),
+			   std::ref(pyramids), std::ref(memory), std::ref(counters),
+			   std::ref(metrics));
+    }
+    std::clog << "INFO: bpcompressd started " << cfg.workers << " " << cfg.format
+	      << " workers" << std::endl;
+  };
+  auto stop_workers = [&]() {
+    jobs->close();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    workers.clear();
+  };
+  start_workers();
+
+  preview_service service(cfg, pyramids, memory);
+  std::unique_ptr<http_server> server;
+  if (cfg.http) {
+    server = std::make_unique<http_server>(cfg.http_socket, cfg.http_threads,
+      [&service](const http_request_t& request, http_response_t& response) {
+	service.handle(request, response);
+      });
+    std::clog << "INFO: serving previews on demand at " << cfg.http_socket << std::endl;
+  }
+
+  frame_event_subscriber events(config);
+  const std::chrono::milliseconds poll_interval(250);
+  frame_event_t event;
+  bool in_series = false;
+  while (!shutdown_requested) {
+    if (reload_requested && !in_series) {
+      // Validate the whole file before stopping anything, then let the workers finish
+      // the previews already queued under the running config.
+      reload_requested = false;
+      try {
+	compressor_config_t new_cfg(reload_config_file());
+	keep_running_value(new_cfg.http, cfg.http, "/compressor/http");
+	keep_running_value(new_cfg.http_socket, cfg.http_socket, "/compressor/http/socket");
+	keep_running_value(new_cfg.http_threads, cfg.http_threads, "/compressor/http/threads");
+	keep_running_value(new_cfg.http_cache_mb, cfg.http_cache_mb, "/compressor/http/cache_mb");
+	keep_running_value(new_cfg.tile_cache_mb, cfg.tile_cache_mb, "/compressor/tiles/cache_mb");
+	keep_running_value(new_cfg.memory_budget_mb, cfg.memory_budget_mb,
+			   "/compressor/memory_budget_mb");
+	keep_running_value(new_cfg.ring_name, cfg.ring_name, "/archiver/frame_ring/name");
+	keep_running_value(new_cfg.live_name, cfg.live_name, "/archiver/live_view/name");
+	if (!new_cfg.destination.empty()) {
+	  std::filesystem::create_directories(new_cfg.destination);
+	}
+	stop_workers();
+	n_dropped_before += jobs->n_dropped();
+	cfg = std::move(new_cfg);
+	jobs = std::make_unique<work_queue<frame_event_t>>(cfg.queue_depth);
+	start_workers();
+	std::clog << "INFO: applied the reloaded config file" << std::endl;
+      } catch (const std::exception& e) {
+	std::clog << "ERROR: keeping the running config: " << e.what() << std::endl;
+      }
+    }
+    // While the frames being rendered overdraw the memory budget, stop receiving, and
+    // let the archiver drop the events of frames which could not be previewed anyway.
+    if (!memory.wait_until_available(poll_interval)) {
+      continue;
+    }
+    if (!events.recv(event, poll_interval)) {
+      continue;
+    }
+    if (event.type == frame_event_type_t::frame) {
+      in_series = true;
+      metrics.frames_notified.add();
+      metrics.series_id.set(event.series_id);
+      service.add_frame(event);
+      if (cfg.eager_stride > 0 && event.frame_id % cfg.eager_stride == 0) {
+	jobs->push(std::move(event));
+	metrics.frames_dropped.set(n_dropped_before + jobs->n_dropped());
+      } else if (cfg.eager_stride <= 0) {
+	metrics.frame_id.set(event.frame_id); // previews are only rendered on demand
+      }
+      continue;
+    }
+
+    // Counters cover everything since the previous series ended, which may include
+    // frames of this series still waiting in the queue.
+    in_series = false;
+    uint64_t written = counters.written.exchange(0);
+    uint64_t busy_us = counters.busy_us.exchange(0);
+    std::clog << "INFO: series " << event.series_id << " complete, "
+	      << event.n_committed << " frames archived, "
+	      << written << " previews written, "
+	      << counters.missing.exchange(0) << " no longer available, "
+	      << counters.failed.exchange(0) << " failed, "
+	      << n_dropped_before + jobs->n_dropped() << " dropped in total, "
+	      << (written ? busy_us/written : 0) << "us per preview" << std::endl;
+    if (server) {
+      std::clog << "INFO: " << service.stats() << std::endl;
+    }
+    std::clog << "INFO: " << (memory.in_use() >> 20) << " MiB of memory in use, "
+	      << (memory.high_water() >> 20) << " MiB at most" << std::endl;
+  }
+
+  if (server) {
+    server->stop();
+  }
+  stop_workers();
+  std::clog << "INFO: done" << std::endl;
+
   return 0;
 }
@@ -1,14 +1,548 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <filesystem>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <omp.h>
+#include <signal.h>
+#include <sstream>
+#include <stdio.h>
 #include <string>
+#include <string.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <simdjson.h>
+
+#include "background_model.h"
+#include "bigpicture_utils.h"
+#include "external_indexer.h"
+#include "frame_events.h"
+#include "frame_quality.h"
+#include "frame_ring.h"
+#include "frame_scheduler.h"
+#include "frame_tiling.h"
+#include "json_writer.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "radial_profile.h"
+#include "resolution_map.h"
+#include "spot_finder.h"
+#include "work_queue.h"
+
+using namespace bigpicture;
+
+std::atomic<bool> shutdown_requested = false;
+static void signal_handler(int signum) {
+  // iostream and printf() are not signal-safe (reentrant), but plain-old
+  // write() is, and so are all the functions called below.
+  shutdown_requested = true;
+  char strbuf[1024];
+  memset(strbuf, '\0', sizeof(strbuf));
+  strlcat(strbuf, "bpindexd received the \"", sizeof(strbuf));
+  strlcat(strbuf, strsignal(signum), sizeof(strbuf));
+  strlcat(strbuf, "\" signal, shutting down now.\n", sizeof(strbuf));
+  write(STDOUT_FILENO, strbuf, strlen(strbuf));
+  fsync(STDOUT_FILENO); // flush terminal output immediately
+}
+
+std::atomic<bool> reload_requested = false;
+static void reload_handler(int signum) {
+  reload_requested = true;
+  static const char msg[] = "bpindexd received the \"Hangup\" signal. The config file "
+    "will be reloaded after any currently-running image series is completed.\n";
+  write(STDOUT_FILENO, msg, sizeof(msg)-1);
+}
+
+static void usage() {
+  std::cerr << "bpindexd [-c config_file]\n"
+	    << "  -c config_file : A JSON config file, see README for details.\n"
+	    << "\n"
+	    << "Indexes images archived by bparchived.\n"
+	    << std::endl;
+}
+
+/**
+ * Deserialized "/indexer" config parameters.
+ *
+ * On SIGHUP, all of them except the geometry cache, the memory budget and the frame
+ * ring's name are reloaded between series.
+ */
+struct indexer_config_t {
+  indexer_config_t(const simdjson::dom::object& config) :
+    workers(4),
+    queue_depth(64),
+    radial_bins(2048),
+    geometry_cache_mb(256),
+    memory_budget_mb(0),
+    layout(config),
+    spots(config),
+    scheduler(config),
+    external(config),
+    ring_name("/bigpicture-frames") {
+
+    maybe_extract_json_pointer(workers, config, "/indexer/workers");
+    maybe_extract_json_pointer(queue_depth, config, "/indexer/queue_depth");
+    maybe_extract_json_pointer(radial_bins, config, "/indexer/radial_bins");
+    maybe_extract_json_pointer(geometry_cache_mb, config, "/indexer/geometry_cache_mb");
+    maybe_extract_json_pointer(memory_budget_mb, config, "/indexer/memory_budget_mb");
+    maybe_extract_json_pointer(destination, config, "/indexer/destination");
+    maybe_extract_json_pointer(ring_name, config, "/archiver/frame_ring/name");
+    std::string_view tmp_sv;
+    if (maybe_extract_json_pointer(tmp_sv, config, "/indexer/output") && tmp_sv.compare("json") != 0) {
+      std::stringstream ss;
+      ss << "The config parameter \"/indexer/output\" has an unsupported value, \""
+	 << tmp_sv << "\". The only supported output is \"json\"." << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+    if (workers < 1) {
+      throw std::runtime_error("The config parameter \"/indexer/workers\" must be at least 1.");
+    }
+    if (radial_bins < 1 || radial_bins > int64_t(resolution_map::max_bins)) {
+      std::stringstream ss;
+      ss << "The config parameter \"/indexer/radial_bins\" must be between 1 and "
+	 << resolution_map::max_bins << "." << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+  }
+
+  int64_t                    workers;
+  int64_t                    queue_depth; //!< frames waiting for a worker
+  int64_t                    radial_bins; //!< of the radial profile of each frame
+  int64_t                    geometry_cache_mb; //!< resolution maps of recent geometries
+  int64_t                    memory_budget_mb; //!< for frames in flight and maps, 0 for no limit
+  std::string                destination; //!< empty to write spots next to the raw images
+  module_layout_t            layout;
+  spot_finder_options_t      spots;
+  frame_scheduler_options_t  scheduler;
+  external_indexer_options_t external;
+  std::string                ring_name;
+};
+
+/**
+ * A frame for a worker to analyze, and why the scheduler chose it.
+ */
+struct index_job_t {
+  frame_event_t    event;
+  frame_decision_t decision;
+};
+
+/**
+ * Counters shared by all workers, reported at the end of every series.
+ */
+struct index_counters_t {
+  std::atomic<uint64_t> frames = 0;
+  std::atomic<uint64_t> spots = 0;
+  std::atomic<uint64_t> missing = 0; //!< no longer in the frame ring
+  std::atomic<uint64_t> failed = 0;
+  std::atomic<uint64_t> busy_us = 0;
+};
+
+/**
+ * Metrics published to the supervisor, which unlike the counters are never reset.
+ */
+struct index_metrics_t {
+  explicit index_metrics_t(metrics_writer& writer) :
+    frames_notified(writer.counter("frames_notified")),
+    frames_skipped(writer.counter("frames_skipped")),
+    frames_dropped(writer.counter("frames_dropped")),
+    frames_analyzed(writer.counter("frames_analyzed")),
+    frames_missing(writer.counter("frames_missing")),
+    frames_failed(writer.counter("frames_failed")),
+    frames_indexed(writer.counter("frames_indexed")),
+    series_id(writer.counter("series_id")),
+    frame_id(writer.counter("frame_id")),
+    analysis_us(writer.histogram("analysis_us")) {}
+
+  metrics_counter   frames_notified;
+  metrics_counter   frames_skipped;   //!< by the scheduler
+  metrics_counter   frames_dropped;   //!< because the queue was full
+  metrics_counter   frames_analyzed;
+  metrics_counter   frames_missing;
+  metrics_counter   frames_failed;
+  metrics_counter   frames_indexed;   //!< by the external indexer
+  metrics_counter   series_id;
+  metrics_counter   frame_id;         //!< the newest frame analyzed
+  metrics_histogram analysis_us;
+};
+
+/**
+ * Appends one line of JSON per frame to a file per series, shared by all workers.
+ * Every line is flushed as it is written, so that a GUI can follow the file.
+ */
+class jsonl_log {
+public:
+  jsonl_log() : m_file(nullptr) {}
+  ~jsonl_log() noexcept { close(); }
+
+  /// \throws std::system_error if the file cannot be opened or written.
+  void append(const std::filesystem::path& path, std::string_view line) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_file == nullptr || path != m_path) {
+      close_locked();
+      m_file = fopen(path.c_str(), "a");
+      if (m_file == nullptr) {
+	std::stringstream ss;
+	ss << "libc error: " << path.string() << " - " << strerror(errno) << "\n";
+	throw std::system_error(errno, std::system_category(), ss.str());
+      }
+      m_path = path;
+    }
+    if (fwrite(line.data(), 1, line.size(), m_file) != line.size() ||
+	fputc('\n', m_file) == EOF || fflush(m_file) != 0) {
+      std::stringstream ss;
+      ss << "libc error: " << m_path.string() << " - " << strerror(errno) << "\n";
+      throw std::system_error(errno, std::system_category(), ss.str());
+    }
+  }
+
+  /// Flushes and closes the current file, e.g. at the end of a series.
+  void close() noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    close_locked();
+  }
+
+private:
+  void close_locked() noexcept {
+    if (m_file) {
+      fclose(m_file);
+      m_file = nullptr;
+    }
+  }
+
+  std::mutex            m_mutex;
+  std::filesystem::path m_path;
+  FILE*                 m_file;
+};
+
+static std::filesystem::path output_path(const indexer_config_t& cfg,
+					 const frame_event_t& event, const char* suffix) {
+  std::string name = std::to_string(event.series_id) + suffix;
+  if (!cfg.destination.empty()) {
+    return std::filesystem::path(cfg.destination) / name;
+  }
+  return std::filesystem::path(event.path).parent_path() / name;
+}
+
+/*
+  {"series":1,"frame":2,"sampling":"stride","stride":4,"wedge":false,"n_strong":31,
+   "spots":[[x,y,intensity,peak,n_pixels],...]}
+*/
+static std::string_view serialize_spots(const frame_event_t& event,
+					const frame_decision_t& decision, size_t n_strong,
+					const std::vector<spot_t>& spots,
+					std::vector<char>& buf) {
+  buf.resize(128 + 96*spots.size());
+  json_writer w(buf.data(), buf.size());
+  w.begin_object()
+    .field("series", event.series_id)
+    .field("frame", event.frame_id)
+    .field("sampling", sampling_mode_name(decision.mode))
+    .field("stride", decision.stride)
+    .field("wedge", decision.wedge)
+    .field("n_strong", uint64_t(n_strong))
+    .key("spots").begin_array();
+  for (const spot_t& spot : spots) {
+    w.begin_array()
+      .value(spot.x).value(spot.y).value(spot.intensity)
+      .value(uint64_t(spot.peak)).value(uint64_t(spot.n_pixels))
+      .end_array();
+  }
+  w.end_array().end_object();
+  if (w.overflow()) {
+    throw std::runtime_error("Spot list too long to serialize.");
+  }
+  return w.view();
+}
+
+/*
+  @return The resolution map of a frame's geometry, or nullptr if the geometry is
+  incomplete, e.g. when the beam center was never set.
+*/
+static std::shared_ptr<const resolution_map> map_for(const indexer_config_t& cfg,
+						     resolution_map_cache& maps,
+						     const frame_event_t& event,
+						     const frame_meta_t& meta) {
+  if (event.geometry.width != meta.width || event.geometry.height != meta.height) {
+    return nullptr;
+  }
+  try {
+    return maps.get(event.geometry, cfg.radial_bins);
+  } catch (const std::runtime_error&) {
+    return nullptr;
+  }
+}
+
+static void index_worker(const indexer_config_t& cfg, frame_source& source,
+			 work_queue<index_job_t>& jobs, resolution_map_cache& maps,
+			 memory_budget& memory, jsonl_log& spot_log, jsonl_log& quality_log,
+			 frame_scheduler& scheduler, std::shared_ptr<background_model> background,
+			 index_counters_t& counters, index_metrics_t& metrics) {
+  // Frames are already processed in parallel, one per worker.
+  omp_set_num_threads(1);
+
+  spot_finder finder(cfg.spots, background);
+  radial_profile profile;
+  std::shared_ptr<const resolution_map> map;
+  frame_tiling tiling;
+  unique_buffer scratch;
+  std::vector<spot_t> spots;
+  std::vector<char> buf;
+  char quality_buf[256];
+  index_job_t job;
+  while (jobs.pop(job)) {
+    const frame_event_t& event = job.event;
+    finder.begin_series(event.series_id);
+    try {
+      auto start = std::chrono::steady_clock::now();
+      // The spot finder updates its background model from the frame, so the frame is
+      // copied out of the ring and validated first, rather than analyzed in place.
+      frame_meta_t meta;
+      if (!source.copy_frame(event.series_id, event.frame_id, scratch, meta)) {
+	++counters.missing;
+	metrics.frames_missing.add();
+	continue;
+      }
+      memory_reservation in_flight(&memory); // until the frame is analyzed
+      in_flight.resize(scratch.size());
+      if (tiling.width() != meta.width || tiling.height() != meta.height) {
+	tiling.reset(meta.width, meta.height, cfg.layout);
+      }
+      finder.find(tiling, scratch.get(), meta.bit_depth, spots);
+      map = map_for(cfg, maps, event, meta);
+      if (map) {
+	profile.compute(tiling, *map, scratch.get(), meta.bit_depth);
+      }
+      spot_log.append(output_path(cfg, event, ".spots.jsonl"),
+		      serialize_spots(event, job.decision, finder.n_strong(), spots, buf));
+      frame_quality_t quality = map ?
+	assess_frame_quality(event, spots, &profile, map.get()) : assess_frame_quality(event, spots);
+      size_t len = quality.serialize(quality_buf, sizeof(quality_buf));
+      if (len < sizeof(quality_buf)) {
+	quality_log.append(output_path(cfg, event, ".quality.jsonl"),
+			   std::string_view(quality_buf, len));
+      } else {
+	// A truncated line would corrupt the log for every reader, so leave it out.
+	std::clog << "WARNING: the quality metrics of series " << event.series_id
+		  << ", frame " << event.frame_id << " do not fit in " << sizeof(quality_buf)
+		  << " bytes, skipping them" << std::endl;
+      }
+
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+	std::chrono::steady_clock::now() - start);
+      scheduler.completed(elapsed);
+      counters.busy_us += elapsed.count();
+      counters.spots += spots.size();
+      ++counters.frames;
+      metrics.frames_analyzed.add();
+      metrics.analysis_us.record(elapsed.count());
+      metrics.frame_id.set(event.frame_id);
+    } catch (const std::exception& e) {
+      ++counters.failed;
+      metrics.frames_failed.add();
+      std::clog << "ERROR: failed to find spots in series " << event.series_id
+		<< ", frame " << event.frame_id << ": " << e.what() << std::endl;
+    }
+  }
+}
 
 int main(int argc, char** argv) {
-  std::cout << "TODO: implement bpindexd" << std::endl;
+  std::string config_file("/etc/bigpicture/config.json");
 
-  // Temporary kludge to silence -Wunused-parameter
-  std::cerr << "args:\n";
-  for (int i=0; i<argc; ++i) {
-    std::cerr << argv[i] << " ";
+  int c = 0;
+  while ((c = getopt(argc, argv, "c:")) != -1) {
+    switch (c) {
+    case 'c':
+      config_file = std::string(optarg);
+      break;
+
+    case 'h':
+    case '?':
+    default:
+      usage();
+      return 1;
+    }
   }
-  std::cerr << std::endl;
+
+  struct sigaction action;
+  action.sa_handler = signal_handler;
+  action.sa_flags = 0;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  action.sa_handler = reload_handler;
+  sigaction(SIGHUP, &action, NULL);
+
+  auto& config = load_config_file(config_file);
+  indexer_config_t cfg(config);
+  if (!cfg.destination.empty()) {
+    std::filesystem::create_directories(cfg.destination);
+  }
+
+  frame_source source(cfg.ring_name);
+  index_counters_t counters;
+  metrics_writer metrics_segment(config, "bpindexd");
+  index_metrics_t metrics(metrics_segment);
+  memory_budget memory(uint64_t(std::max<int64_t>(cfg.memory_budget_mb, 0)) << 20);
+  memory.publish(metrics_segment);
+  resolution_map_cache maps(std::max<int64_t>(cfg.geometry_cache_mb, 0), &memory);
+  jsonl_log spot_log, quality_log, index_log;
+  std::unique_ptr<frame_scheduler> scheduler;
+  auto jobs = std::make_unique<work_queue<index_job_t>>(cfg.queue_depth);
+  uint64_t n_dropped_before = 0; // by the queues replaced on reload
+  std::vector<std::thread> workers;
+  std::unique_ptr<external_indexer_pool> external;
+  auto start_workers = [&]() {
+    scheduler = std::make_unique<frame_scheduler>(cfg.scheduler, cfg.workers);
+    // The workers share one background model, rather than each keeping its own.
+    std::shared_ptr<background_model> background;
+    if (cfg.spots.background == spot_background_t::incremental) {
+      background = std::make_shared<background_model>(cfg.spots.background_alpha,
+						      cfg.spots.background_warmup,
+						      cfg.spots.background_readmit);
+      background->use_memory_budget(memory);
+    }
+    for (int64_t i=0; i < cfg.workers; ++i) {
+      workers.emplace_back(index_worker, std::cref(cfg), std::ref(source), std::ref(*jobs),
+			   std::ref(maps), std::ref(memory), std::ref(spot_log), std::ref(quality_log),
+			   std::ref(*scheduler), background, std::ref(counters), std::ref(metrics));
+    }
+    std::clog << "INFO: bpindexd started " << cfg.workers << " spot finding workers" << std::endl;
+
+    if (cfg.external.processes > 0) {
+      external.reset(new external_indexer_pool(cfg.external, cfg.queue_depth,
+	[&](const std::vector<frame_event_t>& batch, std::string_view response) {
+	  index_log.append(output_path(cfg, batch.front(), ".index.jsonl"), response);
+	  metrics.frames_indexed.add(batch.size());
+	}));
+      std::clog << "INFO: bpindexd started " << cfg.external.processes << " \""
+		<< cfg.external.argv[0] << "\" processes" << std::endl;
+    }
+  };
+  auto stop_workers = [&]() {
+    jobs->close();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    workers.clear();
+    if (external) {
+      external->close();
+    }
+  };
+  start_workers();
+
+  frame_event_subscriber events(config);
+  const std::chrono::milliseconds poll_interval(250);
+  frame_event_t event;
+  int64_t series_id = -1;
+  bool in_series = false;
+  uint64_t prev_analyzed = 0, prev_skipped = 0;
+  while (!shutdown_requested) {
+    if (reload_requested && !in_series) {
+      // Validate the whole file before stopping anything, then let the workers and the
+      // external indexer finish the frames already queued under the running config.
+      reload_requested = false;
+      try {
+	indexer_config_t new_cfg(reload_config_file());
+	keep_running_value(new_cfg.geometry_cache_mb, cfg.geometry_cache_mb,
+			   "/indexer/geometry_cache_mb");
+	keep_running_value(new_cfg.memory_budget_mb, cfg.memory_budget_mb,
+			   "/indexer/memory_budget_mb");
+	keep_running_value(new_cfg.ring_name, cfg.ring_name, "/archiver/frame_ring/name");
+	if (!new_cfg.destination.empty()) {
+	  std::filesystem::create_directories(new_cfg.destination);
+	}
+	stop_workers();
+	n_dropped_before += jobs->n_dropped();
+	external.reset();
+	cfg = std::move(new_cfg);
+	jobs = std::make_unique<work_queue<index_job_t>>(cfg.queue_depth);
+	start_workers();
+	series_id = -1;
+	prev_analyzed = prev_skipped = 0;
+	std::clog << "INFO: applied the reloaded config file" << std::endl;
+      } catch (const std::exception& e) {
+	std::clog << "ERROR: keeping the running config: " << e.what() << std::endl;
+      }
+    }
+    // While the frames being analyzed overdraw the memory budget, stop receiving, and
+    // let the archiver drop the events of frames which could not be analyzed anyway.
+    if (!memory.wait_until_available(poll_interval)) {
+      continue;
+    }
+    if (!events.recv(event, poll_interval)) {
+      continue;
+    }
+    if (event.type == frame_event_type_t::frame) {
+      in_series = true;
+      metrics.frames_notified.add();
+      if (event.series_id != series_id) {
+	scheduler->begin_series(event.geometry);
+	series_id = event.series_id;
+	metrics.series_id.set(series_id);
+      }
+      frame_decision_t decision = scheduler->decide(event.frame_id,
+						   std::chrono::steady_clock::now());
+      if (!decision.analyze) {
+	metrics.frames_skipped.add();
+	continue;
+      }
+      if (external) {
+	external->submit(event);
+      }
+      // Wedges are always searched in full, however far the workers fall behind.
+      jobs->push(index_job_t{std::move(event), decision}, decision.wedge);
+      metrics.frames_dropped.set(n_dropped_before + jobs->n_dropped());
+      continue;
+    }
+
+    // Counters cover everything since the previous series ended, which may include
+    // frames of this series still waiting in the queue.
+    in_series = false;
+    uint64_t frames = counters.frames.exchange(0);
+    uint64_t busy_us = counters.busy_us.exchange(0);
+    std::clog << "INFO: series " << event.series_id << " complete, "
+	      << event.n_committed << " frames archived, "
+	      << frames << " frames searched, "
+	      << counters.spots.exchange(0) << " spots found, "
+	      << counters.missing.exchange(0) << " no longer available, "
+	      << counters.failed.exchange(0) << " failed, "
+	      << n_dropped_before + jobs->n_dropped() << " dropped in total, "
+	      << (frames ? busy_us/frames : 0) << "us per frame" << std::endl;
+    std::clog << "INFO: series " << event.series_id << ", scheduler: "
+	      << scheduler->n_analyzed() - prev_analyzed << " frames analyzed, "
+	      << scheduler->n_skipped() - prev_skipped << " skipped, sampling "
+	      << sampling_mode_name(scheduler->mode()) << " with stride " << scheduler->stride()
+	      << ", " << scheduler->incoming_rate() << " Hz incoming, "
+	      << scheduler->capacity() << " Hz capacity" << std::endl;
+    prev_analyzed = scheduler->n_analyzed();
+    prev_skipped = scheduler->n_skipped();
+    if (external) {
+      external_indexer_counters_t& ext = external->counters();
+      uint64_t ext_frames = ext.frames.exchange(0);
+      uint64_t ext_busy_us = ext.busy_us.exchange(0);
+      std::clog << "INFO: series " << event.series_id << ", external indexer: "
+		<< ext_frames << " frames in " << ext.batches.exchange(0) << " batches, "
+		<< ext.failed.exchange(0) << " failed, "
+		<< ext.timeouts.exchange(0) << " timed out, "
+		<< ext.restarts.exchange(0) << " restarts, "
+		<< external->n_dropped() << " dropped in total, "
+		<< (ext_frames ? ext_busy_us/ext_frames : 0) << "us per frame" << std::endl;
+    }
+    std::clog << "INFO: " << (memory.in_use() >> 20) << " MiB of memory in use, "
+	      << (memory.high_water() >> 20) << " MiB at most" << std::endl;
+    spot_log.close();
+    quality_log.close();
+    index_log.close();
+  }
+
+  stop_workers();
+  std::clog << "INFO: done" << std::endl;
+
   return 0;
 }
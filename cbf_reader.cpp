@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <array>
+#include <errno.h>
+#include <fcntl.h>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+#include "cbf_reader.h"
+#include "frame_tiling.h"
+
+using namespace bigpicture;
+
+static constexpr std::string_view binary_section = "--CIF-BINARY-FORMAT-SECTION--";
+static constexpr std::string_view binary_marker  = "\x0c\x1a\x04\xd5";
+
+size_t bigpicture::base64_decode(const char* src, size_t len, uint8_t* dst, size_t capacity) {
+  static const auto table = []() {
+    std::array<int8_t, 256> t;
+    t.fill(-1);
+    const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (int i=0; i < 64; ++i) {
+      t[static_cast<uint8_t>(alphabet[i])] = i;
+    }
+    return t;
+  }();
+
+  size_t n = 0;
+  uint32_t bits = 0;
+  int n_bits = 0;
+  for (size_t i=0; i < len; ++i) {
+    const char c = src[i];
+    if (c == '=') {
+      break;
+    }
+    if (c == '\r' || c == '\n' || c == ' ' || c == '\t') {
+      continue;
+    }
+    const int8_t v = table[static_cast<uint8_t>(c)];
+    if (v < 0) {
+      std::stringstream ss;
+      ss << "Invalid base64 character 0x" << std::hex << int(static_cast<uint8_t>(c))
+	 << " at offset " << std::dec << i << "." << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+    bits = (bits << 6) | v;
+    n_bits += 6;
+    if (n_bits >= 8) {
+      n_bits -= 8;
+      if (n == capacity) {
+	throw std::runtime_error("Base64 data is larger than its declared size.");
+      }
+      dst[n++] = static_cast<uint8_t>(bits >> n_bits);
+    }
+  }
+  return n;
+}
+
+template<typename T>
+static void byte_offset_decode_impl(const uint8_t* src, size_t len, T* dst, size_t n_pixels) {
+  const uint8_t* p = src;
+  const uint8_t* end = src + len;
+  int64_t value = 0;
+  for (size_t i=0; i < n_pixels; ++i) {
+    // Each width is read only if the narrower one holds its escape value.
+    if (p + 1 > end) break;
+    int64_t delta = static_cast<int8_t>(*p);
+    p += 1;
+    if (delta == INT8_MIN) {
+      if (p + 2 > end) break;
+      int16_t d16;
+      memcpy(&d16, p, 2);
+      p += 2;
+      delta = d16;
+      if (delta == INT16_MIN) {
+	if (p + 4 > end) break;
+	int32_t d32;
+	memcpy(&d32, p, 4);
+	p += 4;
+	delta = d32;
+	if (delta == INT32_MIN) {
+	  if (p + 8 > end) break;
+	  memcpy(&delta, p, 8);
+	  p += 8;
+	}
+      }
+    }
+    value += delta;
+    dst[i] = static_cast<T>(value);
+    if (i + 1 == n_pixels) {
+      return;
+    }
+  }
+  std::stringstream ss;
+  ss << "Byte-offset data ended before all " << n_pixels << " pixels were decoded."
+     << std::endl;
+  throw std::runtime_error(ss.str());
+}
+
+void bigpicture::byte_offset_decode(const uint8_t* src, size_t len, void* dst,
+				    size_t n_pixels, int64_t bit_depth) {
+  if (n_pixels == 0) {
+    return;
+  }
+  dispatch_pixel_type(bit_depth, [&](auto pixel) {
+    using T = decltype(pixel);
+    byte_offset_decode_impl(src, len, static_cast<T*>(dst), n_pixels);
+  });
+}
+
+/*
+  Returns the value of a MIME header field, or an empty string_view if it is absent.
+*/
+static std::string_view header_value(std::string_view header, std::string_view name) {
+  size_t pos = header.find(name);
+  if (pos == std::string_view::npos) {
+    return std::string_view();
+  }
+  size_t begin = header.find_first_not_of(" \t:", pos + name.size());
+  size_t end = header.find_first_of("\r\n", begin);
+  if (begin == std::string_view::npos) {
+    return std::string_view();
+  }
+  std::string_view value = header.substr(begin, end - begin);
+  while (!value.empty() && (value.back() == ' ' || value.back() == ';')) {
+    value.remove_suffix(1);
+  }
+  return value;
+}
+
+static size_t header_size(std::string_view header, std::string_view name) {
+  std::string_view value = header_value(header, name);
+  if (value.empty()) {
+    std::stringstream ss;
+    ss << "The miniCBF header is missing \"" << name << "\"." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+  return strtoull(std::string(value).c_str(), nullptr, 10);
+}
+
+cbf_reader::cbf_reader(const std::string& path) :
+  m_path(path), m_map(nullptr), m_map_size(0), m_base64(false), m_binary_size(0),
+  m_width(0), m_height(0), m_bit_depth(0) {
+  int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    int err = errno;
+    if (fd >= 0) close(fd);
+    std::stringstream ss;
+    ss << "libc error: " << path << " - " << strerror(err) << "\n";
+    throw std::system_error(err, std::system_category(), ss.str());
+  }
+  m_map_size = st.st_size;
+  void* map = (m_map_size > 0) ?
+    mmap(nullptr, m_map_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  int err = errno;
+  close(fd); // The mapping keeps the file open.
+  if (map == MAP_FAILED) {
+    std::stringstream ss;
+    ss << "libc error: mmap() " << path << " - "
+       << (m_map_size ? strerror(err) : "empty file") << "\n";
+    throw std::system_error(m_map_size ? err : EINVAL, std::system_category(), ss.str());
+  }
+  m_map = static_cast<const char*>(map);
+  madvise(map, m_map_size, MADV_SEQUENTIAL);
+
+  try {
+    // The MIME header of the binary section ends with an empty line.
+    std::string_view file(m_map, m_map_size);
+    size_t section = file.find(binary_section);
+    size_t body = std::string_view::npos;
+    if (section != std::string_view::npos) {
+      size_t crlf = file.find("\r\n\r\n", section);
+      size_t lf = file.find("\n\n", section);
+      body = std::min(crlf == std::string_view::npos ? crlf : crlf + 4,
+		      lf == std::string_view::npos ? lf : lf + 2);
+    }
+    if (body == std::string_view::npos) {
+      std::stringstream ss;
+      ss << path << " is not a miniCBF file with a MIME binary section." << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+    parse_header(file.substr(section, body - section));
+
+    if (m_base64) {
+      size_t end = file.find(binary_section, body);
+      m_payload = file.substr(body, (end == std::string_view::npos) ? end : end - body);
+    } else {
+      size_t start = file.find(binary_marker, section);
+      if (start == std::string_view::npos) {
+	throw std::runtime_error(m_path + " has no binary data marker.");
+      }
+      m_payload = file.substr(start + binary_marker.size(), m_binary_size);
+      if (m_payload.size() < m_binary_size) {
+	throw std::runtime_error(m_path + " is truncated.");
+      }
+    }
+  } catch (...) {
+    munmap(const_cast<char*>(m_map), m_map_size);
+    throw;
+  }
+}
+
+cbf_reader::~cbf_reader() noexcept {
+  munmap(const_cast<char*>(m_map), m_map_size);
+}
+
+void cbf_reader::parse_header(std::string_view header) {
+  if (header.find("x-CBF_BYTE_OFFSET") == std::string_view::npos) {
+    std::stringstream ss;
+    ss << m_path << " is not byte-offset compressed, which is the only supported "
+       << "miniCBF compression." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+  std::string_view encoding = header_value(header, "Content-Transfer-Encoding");
+  if (encoding == "BASE64") {
+    m_base64 = true;
+  } else if (encoding == "BINARY") {
+    m_base64 = false;
+  } else {
+    std::stringstream ss;
+    ss << m_path << " has an unsupported Content-Transfer-Encoding, \"" << encoding
+       << "\". The supported encodings are \"BASE64\" and \"BINARY\"." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+  // e.g. "signed 32-bit integer"
+  std::string_view type = header_value(header, "X-Binary-Element-Type");
+  size_t bits = type.find("-bit");
+  if (bits != std::string_view::npos && bits > 0) {
+    size_t digits = type.find_last_not_of("0123456789", bits - 1);
+    digits = (digits == std::string_view::npos) ? 0 : digits + 1;
+    m_bit_depth = strtoll(std::string(type.substr(digits, bits - digits)).c_str(),
+			  nullptr, 10);
+  }
+  if (m_bit_depth != 8 && m_bit_depth != 16 && m_bit_depth != 32) {
+    std::stringstream ss;
+    ss << m_path << " has an unsupported X-Binary-Element-Type, " << type << "." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+  m_binary_size = header_size(header, "X-Binary-Size:");
+  m_width = header_size(header, "X-Binary-Size-Fastest-Dimension");
+  m_height = header_size(header, "X-Binary-Size-Second-Dimension");
+}
+
+void cbf_reader::decode(unique_buffer& dst) const {
+  const size_t n_pixels = m_width * m_height;
+  dst.reset(n_pixels * (m_bit_depth/8));
+  if (!m_base64) {
+    byte_offset_decode(reinterpret_cast<const uint8_t*>(m_payload.data()), m_binary_size,
+		       dst.get(), n_pixels, m_bit_depth);
+    return;
+  }
+
+  // The compressed image is a fraction of the decoded size, so decode base64 into a
+  // per-thread buffer rather than allocating on every call.
+  thread_local std::vector<uint8_t> compressed;
+  if (compressed.size() < m_binary_size) {
+    compressed.resize(m_binary_size);
+  }
+  size_t len = base64_decode(m_payload.data(), m_payload.size(), compressed.data(),
+			     m_binary_size);
+  if (len != m_binary_size) {
+    std::stringstream ss;
+    ss << m_path << " declares " << m_binary_size << " bytes of binary data, but contains "
+       << len << "." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+  byte_offset_decode(compressed.data(), len, dst.get(), n_pixels, m_bit_depth);
+}
@@ -0,0 +1,74 @@
+#ifndef BP_CBF_READER_H
+#define BP_CBF_READER_H
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+#include "bigpicture_utils.h"
+
+namespace bigpicture {
+  /**
+   * Decodes base64 text, skipping line breaks and other whitespace.
+   *
+   * @return The number of bytes written to dst.
+   * \throws std::runtime_error on a character outside the base64 alphabet, or if the
+   *         decoded data would exceed capacity.
+   */
+  size_t base64_decode(const char* src, size_t len, uint8_t* dst, size_t capacity);
+
+  /**
+   * Decompresses CBF byte-offset data into n_pixels pixels of bit_depth bits.
+   *
+   * Byte-offset data stores signed differences between consecutive pixels in 1, 2, 4,
+   * or 8 bytes. Values are truncated to bit_depth bits, so the signed -1 and -2 written
+   * for masked pixels decode to pixel_traits<T>::gap and pixel_traits<T>::bad.
+   *
+   * \throws std::runtime_error if src ends before n_pixels have been decoded.
+   */
+  void byte_offset_decode(const uint8_t* src, size_t len, void* dst, size_t n_pixels,
+			  int64_t bit_depth);
+
+  /**
+   * Reads the image of a miniCBF file, such as those written by bparchived, without
+   * libcbf. The file is mapped into memory and only its binary section is decoded.
+   *
+   * Supports byte-offset compressed 8, 16, and 32-bit integer images, either base64 or
+   * binary (raw) transfer encoded. The MIME header of the binary section must be
+   * present, as it is for every file written with the MIME_HEADERS flag.
+   */
+  class cbf_reader {
+  public:
+    /// \throws std::system_error if the file cannot be mapped.
+    /// \throws std::runtime_error if the file is not a supported miniCBF file.
+    explicit cbf_reader(const std::string& path);
+    ~cbf_reader() noexcept;
+
+    size_t  width()     const { return m_width; }
+    size_t  height()    const { return m_height; }
+    int64_t bit_depth() const { return m_bit_depth; }
+
+    /**
+     * Decodes the image into dst, resizing it to width()*height()*bit_depth()/8 bytes.
+     * \throws std::runtime_error if the binary section is truncated or corrupt.
+     */
+    void decode(unique_buffer& dst) const;
+
+  private:
+    cbf_reader(const cbf_reader&) = delete;
+
+    void parse_header(std::string_view header);
+
+    std::string      m_path;
+    const char*      m_map;
+    size_t           m_map_size;
+    std::string_view m_payload; //!< encoded binary data
+    bool             m_base64;
+    size_t           m_binary_size;
+    size_t           m_width;
+    size_t           m_height;
+    int64_t          m_bit_depth;
+  };
+}
+
+#endif // header guard
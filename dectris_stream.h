@@ -3,14 +3,19 @@
 
 #include <atomic>
 #include <chrono>
+#include <errno.h>
+#include <functional>
 #include <iostream>
+#include <limits.h>
 #include <sstream>
+#include <stdexcept>
 #include <stdint.h>
 #include <string>
 
 #include <zmq.hpp>
 
 #include "bigpicture_utils.h"
+#include "memory_budget.h"
 
 namespace bigpicture {
   template<typename T> class dectris_streamer;
@@ -20,8 +25,7 @@ namespace bigpicture {
    * API provides an implementation which converts stream data to miniCBF files, but extending 
    * this interface with another implementation allows for conversion to other output types.
    *
-   * Implementations need only implement 2 function with the following signatures, 
-   * which returns true upon completion of parsing an image series and false otherwise:
+   * Implementations need only implement 3 functions with the following signatures:
    *
    *   1. bool parse(void*, size*) // returns
    *        Parses the user-specified data and returns true if and only if a complete 
@@ -30,6 +34,10 @@ namespace bigpicture {
    *   2. void flush()
    *        Flushes all parsed data to the destination, similar to std::ostream::flush().
    *
+   *   3. void drain()
+   *        Abandons any partially-received image series and commits everything written
+   *        so far to stable storage. Called once, when the streamer shuts down.
+   *
    * @tparam Impl A class implementing parse() and flush() functions.
    * @note Implementations may call flush() on themselves to eagerly write out data. 
    *       This interface shall accommodate eager writing.
@@ -63,6 +71,13 @@ namespace bigpicture {
       static_cast<Impl*>(this)->flush();
       return *(static_cast<Impl*>(this));
     }
+
+    /**
+     * Abandon any partial image series and sync all output to stable storage.
+     */
+    void drain() {
+      static_cast<Impl*>(this)->drain();
+    }
     
   protected:
     stream_parser() = default; // Only children can be declared.
@@ -79,10 +94,13 @@ namespace bigpicture {
     /// @param url - The protocol and address of a ZMQ push socket, e.g. "tcp://grape.ls-cat.org:9999"
     constexpr dectris_streamer(stream_parser<T>& parser,
 			       const std::string& url) noexcept :
+      m_drain_timeout(drain_timeout_default),
       m_parser(parser),
       m_poll_interval(poll_interval_default),
+      m_rcvhwm(rcvhwm_default),
       m_recv_buf(new char[recv_buf_default]),
       m_recv_buf_size(recv_buf_default),
+      m_reload_requested(false),
       m_shutdown_requested(false),
       m_url(url),
       m_zmq_ctx(zmq_nthread_default) {
@@ -98,12 +116,16 @@ namespace bigpicture {
      * @param parser - A parser capable of processing data sent over the Dectris 
      *                 "stream" interface.
      * @param config - A deserialized bigpicture config file.
+     * \throws std::runtime_error if "/archiver/source/rcvhwm" is less than 1.
      */
     dectris_streamer(stream_parser<T>& parser, const simdjson::dom::object& config) :
+      m_drain_timeout(drain_timeout_default),
       m_parser(parser),
       m_poll_interval(poll_interval_default),
+      m_rcvhwm(rcvhwm_default),
       m_recv_buf(new char[recv_buf_default]),
       m_recv_buf_size(recv_buf_default),
+      m_reload_requested(false),
       m_shutdown_requested(false),
       m_url(url_default),
       m_zmq_ctx(zmq_nthread_default) {
@@ -115,12 +137,25 @@ namespace bigpicture {
 	m_poll_interval = std::chrono::milliseconds(tmp_int * 1000);
       }
 
+      if (maybe_extract_json_pointer(tmp_int, config,
+				     "/archiver/source/drain_timeout_s")) {
+	m_drain_timeout = std::chrono::milliseconds(tmp_int * 1000);
+      }
+
       if (maybe_extract_json_pointer(tmp_int, config,
 				     "/archiver/source/read_buffer_mb")) {
 	m_recv_buf_size = tmp_int*1024*1024;
 	m_recv_buf.reset(new char[m_recv_buf_size]);
       }
 
+      if (maybe_extract_json_pointer(tmp_int, config,
+				     "/archiver/source/rcvhwm")) {
+	if (tmp_int < 1 || tmp_int > INT_MAX) {
+	  throw std::runtime_error("\"/archiver/source/rcvhwm\" must be at least 1 message");
+	}
+	m_rcvhwm = tmp_int;
+      }
+
       if (maybe_extract_json_pointer(tmp_int, config,
 				     "/archiver/source/workers")) {
 	m_zmq_ctx.set(zmq::ctxopt::io_threads, tmp_int);
@@ -132,7 +167,9 @@ namespace bigpicture {
       std::clog << "INFO: Initialized dectris_streamer with the following parameters\n"
 		<< "  url=\"" << m_url << "\""
 		<< "  rcv_buf_size=" << m_recv_buf_size
-		<< "  poll_interval=" << m_poll_interval.count() << "ms" << std::endl;
+		<< "  rcvhwm=" << m_rcvhwm
+		<< "  poll_interval=" << m_poll_interval.count() << "ms"
+		<< "  drain_timeout=" << m_drain_timeout.count() << "ms" << std::endl;
     }
     
     /**
@@ -140,10 +177,15 @@ namespace bigpicture {
      * @note Required for use by std::thread to avoid passing const refs around.
      */ 
     constexpr dectris_streamer(dectris_streamer&& src) noexcept :
+      m_drain_timeout(src.m_drain_timeout),
+      m_memory(std::move(src.m_memory)),
+      m_on_reload(std::move(src.m_on_reload)),
       m_parser(std::move(src.m_parser)),
       m_poll_interval(src.m_poll_interval),
+      m_rcvhwm(src.m_rcvhwm),
       m_recv_buf(std::move(src.m_recv_buf)),
       m_recv_buf_size(src.m_recv_buf_size),
+      m_reload_requested(src.m_reload_requested),
       m_shutdown_requested(src.m_shutdown_requested), 
       m_url(std::move(src.m_url)),
       m_zmq_ctx(std::move(src.m_zmq_ctx)) {
@@ -157,7 +199,7 @@ namespace bigpicture {
     void operator()() { run(); }
 		
     /**
-     * Starts the server and runs until shutdown() is called.
+     * Starts the server and runs until shutdown() is called, then drains the parser.
      */
     void run() {
       // Setup polling for data. The polling timeout doesn't matter because
@@ -169,12 +211,34 @@ namespace bigpicture {
       zmq::socket_t       sock(m_zmq_ctx, zmq::socket_type::pull);
       zmq::mutable_buffer buf(m_recv_buf.get(), m_recv_buf_size);      
             
+      // A receive which waits in vain, e.g. for the rest of a frame the DCU never sends,
+      // times out so that a shutdown without a signal still starts draining.
+      sock.set(zmq::sockopt::rcvtimeo, static_cast<int>(recv_timeout_default));
+      // ZMQ queues at most m_rcvhwm messages, each no larger than the receive buffer, so
+      // the queue is bounded, and beyond it the DCU holds on to the frames. A larger
+      // message could not be received whole anyway, and drops the connection instead.
+      sock.set(zmq::sockopt::rcvhwm, m_rcvhwm);
+      sock.set(zmq::sockopt::maxmsgsize, static_cast<int64_t>(m_recv_buf_size));
       in_poller.add(sock, zmq::event_flags::pollin);
       sock.connect(m_url);
       std::clog << "INFO: connected to Dectris DCU at " << m_url << std::endl;
       while (!m_shutdown_requested) {
-	// Wait for the start of a new series by polling.
-	const auto n_in = in_poller.wait_all(in_events, m_poll_interval);
+	// Between series is the only time a reloaded config may be applied.
+	if (m_reload_requested.exchange(false) && m_on_reload) {
+	  m_on_reload();
+	}
+
+	// Wait for the start of a new series by polling. A signal, e.g. SIGHUP to
+	// reload the config, interrupts the wait.
+	size_t n_in = 0;
+	try {
+	  n_in = in_poller.wait_all(in_events, m_poll_interval);
+	} catch (const zmq::error_t& e) {
+	  if (e.num() != EINTR) {
+	    throw;
+	  }
+	  continue;
+	}
 	if (!n_in) {
 	  auto minutes = std::chrono::duration_cast<std::chrono::minutes>(m_poll_interval);
 	  std::clog << "INFO: no activity in the past " << minutes.count() << " minutes" << std::endl;
@@ -194,40 +258,129 @@ namespace bigpicture {
 		receive a 4-part image message.
 	*/
 	bool series_finished = false;
+	bool draining = false;
+	std::chrono::steady_clock::time_point deadline;
 	while (!series_finished) {
-	  auto result = in_events[0].socket.recv(buf,zmq::recv_flags::none);
+	  // Once shutdown is requested, give the DCU until the deadline to finish the
+	  // series rather than waiting indefinitely for its end.
+	  if (m_shutdown_requested) {
+	    auto now = std::chrono::steady_clock::now();
+	    if (!draining) {
+	      draining = true;
+	      deadline = now + m_drain_timeout;
+	      std::clog << "INFO: draining the current image series for up to "
+			<< m_drain_timeout.count() << "ms" << std::endl;
+	    }
+	    if (now >= deadline) {
+	      std::clog << "WARNING: the current image series was not completed within "
+			<< m_drain_timeout.count() << "ms of shutdown" << std::endl;
+	      break;
+	    }
+	    size_t n_ready = 0;
+	    try {
+	      n_ready = in_poller.wait_all(in_events,
+		std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now));
+	    } catch (const zmq::error_t& e) {
+	      if (e.num() != EINTR) {
+		throw;
+	      }
+	    }
+	    if (!n_ready) {
+	      continue;
+	    }
+	  }
+
+	  zmq::recv_buffer_result_t result;
+	  try {
+	    result = in_events[0].socket.recv(buf,zmq::recv_flags::none);
+	  } catch (const zmq::error_t& e) {
+	    if (e.num() != EINTR) {
+	      throw;
+	    }
+	    continue;
+	  }
 	  if (!result.has_value()) {
 	    continue;
 	  }
 	  series_finished = m_parser(buf.data(), result.value().size);
 	}
-	std::clog << "INFO: image series successfully committed to storage\n" << std::endl;
+	if (series_finished) {
+	  std::clog << "INFO: image series successfully committed to storage\n" << std::endl;
+	}
 	
       } // while not shutting down
+      m_parser.drain();
     }
 
     /**
      * Notify the stream client to shutdown in a signal-safe manner.
-     * @note The client shall finish processing the current series before termination.
+     * @note The client shall finish processing the current series before termination,
+     *       unless the series is not completed within "/archiver/source/drain_timeout_s".
      * @note { This method does not satisfy the legalist's definition of "reentrant".
      *         However, it is most definitely signal-safe in terms of its consequences.
      *         Its action is atomic, it is idempotent, its effect is irreversible.
      */
     void shutdown() noexcept { m_shutdown_requested = true; }
+
+    /**
+     * Notify the stream client to call the reload handler in a signal-safe manner.
+     * @note The handler is called once the current series, if any, is completed.
+     */
+    void reload() noexcept { m_reload_requested = true; }
+
+    /**
+     * Sets a function to call between series after reload(), e.g. to apply a reloaded
+     * config file to the parser. The socket stays connected throughout, so the DCU
+     * never sees the archiver go away.
+     */
+    void on_reload(std::function<void()> f) { m_on_reload = std::move(f); }
+
+    /**
+     * Draws the receive buffer and ZMQ's queue of received messages from a memory
+     * budget. The queue is bounded by "/archiver/source/rcvhwm" messages of at most
+     * "/archiver/source/read_buffer_mb" each, so (1 + rcvhwm) * read_buffer_mb MiB are
+     * reserved. Once the queue is full, e.g. during a storage stall, the DCU buffers
+     * the frames instead of the archiver.
+     *
+     * \throws std::runtime_error if the budget cannot hold the buffer and the queue.
+     * @note Call this before run().
+     */
+    void use_memory_budget(memory_budget& budget) {
+      memory_reservation memory(&budget);
+      if (!memory.try_resize((1 + m_rcvhwm)*m_recv_buf_size)) {
+	std::stringstream ss;
+	ss << "The " << (budget.available() >> 20) << " MiB left of the memory budget cannot "
+	   << "hold the " << (m_recv_buf_size >> 20) << " MiB receive buffer and a queue of "
+	   << m_rcvhwm << " messages as large, \"/archiver/source/read_buffer_mb\" and "
+	   << "\"/archiver/source/rcvhwm\".";
+	throw std::runtime_error(ss.str());
+      }
+      m_memory = std::move(memory);
+      std::clog << "INFO: dectris_streamer drew " << (m_memory.size() >> 20)
+		<< " MiB from the memory budget" << std::endl;
+    }
     
   private:
     dectris_streamer() = delete;
     dectris_streamer(const dectris_streamer&) = delete;
 
+    static constexpr int64_t drain_timeout_default = 30*1000; // ms
     static constexpr int64_t poll_interval_default = 60*60*1000; // ms
+    static constexpr int     rcvhwm_default        = 8; // messages, i.e. 2 frames
     static constexpr int64_t recv_buf_default      = 128*1024*1024; // bytes
+    static constexpr int64_t recv_timeout_default  = 100; // ms
     static constexpr char    url_default[]         = "tcp://localhost:9999";
     static constexpr int     zmq_nthread_default   = 1;
     
+    std::chrono::milliseconds m_drain_timeout;
+    memory_reservation        m_memory; //!< The receive buffer and ZMQ's queue
+    std::function<void()>     m_on_reload;
     stream_parser<T>&         m_parser;
     std::chrono::milliseconds m_poll_interval;
+    int                       m_rcvhwm; //!< messages
     std::unique_ptr<char[]>   m_recv_buf;
     size_t                    m_recv_buf_size;
+    std::atomic<bool>         m_reload_requested;
     std::atomic<bool>         m_shutdown_requested;
     std::string               m_url;
     zmq::context_t            m_zmq_ctx;
@@ -1,7 +1,9 @@
 #ifndef BP_DECTRIS_UTILS_H
 #define BP_DECTRIS_UTILS_H
 
+#include <algorithm>
 #include <math.h>
+#include <string_view>
 #include <simdjson.h>
 #include "bigpicture_utils.h"
 
@@ -26,6 +28,29 @@ namespace bigpicture {
       throw std::runtime_error(ss.str());
     }
   }
+
+  /**
+   * Finds the htype of a message part without parsing it, e.g. to tell the first part
+   * of a global header or of a frame from any other part, including pixel data.
+   *
+   * @return The value of "htype" if the part is a JSON object which gives it within its
+   *         first 256 bytes, otherwise an empty view.
+   */
+  inline std::string_view sniff_htype(const void* data, size_t len) {
+    constexpr std::string_view whitespace(" \t\r\n");
+    std::string_view s(static_cast<const char*>(data), std::min<size_t>(len, 256));
+    size_t pos = s.find_first_not_of(whitespace);
+    if (pos == s.npos || s[pos] != '{' || (pos = s.find("\"htype\"", pos)) == s.npos) {
+      return std::string_view();
+    }
+    pos = s.find_first_not_of(whitespace, pos + 7);
+    if (pos == s.npos || s[pos] != ':' ||
+	(pos = s.find_first_not_of(whitespace, pos + 1)) == s.npos || s[pos] != '"') {
+      return std::string_view();
+    }
+    size_t end = s.find('"', pos + 1);
+    return (end == s.npos) ? std::string_view() : s.substr(pos + 1, end - pos - 1);
+  }
   
   /**
    * The header_detail field of a stream interface global header, as found in the part 1 message.
@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <iterator>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sstream>
+#include <stdexcept>
+#include <string.h>
+#include <system_error>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bigpicture_utils.h"
+#include "external_indexer.h"
+#include "json_writer.h"
+
+extern char** environ;
+
+using namespace bigpicture;
+using namespace std::chrono;
+
+static constexpr milliseconds min_backoff(1000);
+static constexpr milliseconds max_backoff(30000);
+static constexpr milliseconds stop_grace(2000);
+
+external_indexer_options_t::external_indexer_options_t(const simdjson::dom::object& config) :
+  external_indexer_options_t() {
+  maybe_extract_json_pointer(processes, config, "/indexer/processes");
+  maybe_extract_json_pointer(batch_size, config, "/indexer/batch_size");
+  maybe_extract_json_pointer(timeout_s, config, "/indexer/timeout_s");
+  maybe_extract_json_pointer(ring_name, config, "/archiver/frame_ring/name");
+  if (processes <= 0) {
+    processes = 0;
+    return;
+  }
+
+  std::string_view tmp_sv("executable");
+  maybe_extract_json_pointer(tmp_sv, config, "/indexer/type");
+  if (tmp_sv.compare("executable") != 0) {
+    std::stringstream ss;
+    ss << "The config parameter \"/indexer/type\" has an unsupported value, \""
+       << tmp_sv << "\". The only supported type is \"executable\"." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+  std::string method;
+  if (!maybe_extract_json_pointer(method, config, "/indexer/method") || method.empty()) {
+    throw std::runtime_error("The config parameter \"/indexer/method\" is required when "
+			     "\"/indexer/processes\" is nonzero.");
+  }
+  argv.push_back(method);
+
+  simdjson::dom::array arr;
+  if (!config.at_pointer("/indexer/arguments").get(arr)) {
+    for (auto element : arr) {
+      if (element.get(tmp_sv)) {
+	throw std::runtime_error("The config parameter \"/indexer/arguments\" must be an "
+				 "array of strings.");
+      }
+      argv.emplace_back(tmp_sv);
+    }
+  }
+  if (batch_size < 1) {
+    throw std::runtime_error("The config parameter \"/indexer/batch_size\" must be at least 1.");
+  }
+  if (!(timeout_s > 0)) {
+    throw std::runtime_error("The config parameter \"/indexer/timeout_s\" must be positive.");
+  }
+}
+
+/*
+  Waits until fd is ready or the deadline passes.
+  Returns 1 if ready, 0 on timeout, or -1 on error.
+*/
+static int wait_fd(int fd, short events, steady_clock::time_point deadline) {
+  for (;;) {
+    auto left = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+    if (left <= 0) {
+      return 0;
+    }
+    struct pollfd pfd = { fd, events, 0 };
+    int rc = poll(&pfd, 1, static_cast<int>(std::min<int64_t>(left, INT32_MAX)));
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    return (rc < 0) ? -1 : (rc > 0);
+  }
+}
+
+static indexer_process::result_t write_all(int fd, const char* p, size_t n,
+					   steady_clock::time_point deadline) {
+  while (n > 0) {
+    ssize_t k = write(fd, p, n);
+    if (k > 0) {
+      p += k;
+      n -= k;
+    } else if (k < 0 && errno == EINTR) {
+      continue;
+    } else if (k < 0 && errno == EAGAIN) {
+      int rc = wait_fd(fd, POLLOUT, deadline);
+      if (rc == 0) {
+	return indexer_process::result_t::timeout;
+      } else if (rc < 0) {
+	return indexer_process::result_t::exited;
+      }
+    } else {
+      return indexer_process::result_t::exited; // EPIPE: the process is gone
+    }
+  }
+  return indexer_process::result_t::ok;
+}
+
+void indexer_process::start() {
+  kill();
+  if (m_argv.empty()) {
+    throw std::runtime_error("An external indexer requires a method to execute.");
+  }
+
+  int in[2], out[2];
+  if (pipe2(in, O_CLOEXEC) != 0) {
+    throw std::system_error(errno, std::system_category(), "pipe2() failed");
+  }
+  if (pipe2(out, O_CLOEXEC) != 0) {
+    int err = errno;
+    ::close(in[0]);
+    ::close(in[1]);
+    throw std::system_error(err, std::system_category(), "pipe2() failed");
+  }
+
+  // posix_spawn() rather than fork(), which is unsafe in a threaded process. dup2()
+  // clears O_CLOEXEC, so only stdin and stdout are inherited. Signals ignored or
+  // blocked by bpindexd, e.g. SIGPIPE, are restored to their defaults.
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t no_signals, all_signals;
+  sigemptyset(&no_signals);
+  sigfillset(&all_signals);
+  posix_spawnattr_setsigmask(&attr, &no_signals);
+  posix_spawnattr_setsigdefault(&attr, &all_signals);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  std::vector<char*> args;
+  for (const std::string& arg : m_argv) {
+    args.push_back(const_cast<char*>(arg.c_str()));
+  }
+  args.push_back(nullptr);
+  pid_t pid = -1;
+  int err = posix_spawnp(&pid, args[0], &actions, &attr, args.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  ::close(in[0]);
+  ::close(out[1]);
+  if (err != 0) {
+    ::close(in[1]);
+    ::close(out[0]);
+    std::stringstream ss;
+    ss << "Failed to execute \"" << m_argv[0] << "\"";
+    throw std::system_error(err, std::system_category(), ss.str());
+  }
+
+  m_pid = pid;
+  m_stdin = in[1];
+  m_stdout = out[0];
+  m_pending.clear();
+  fcntl(m_stdin, F_SETFL, fcntl(m_stdin, F_GETFL) | O_NONBLOCK);
+  fcntl(m_stdout, F_SETFL, fcntl(m_stdout, F_GETFL) | O_NONBLOCK);
+}
+
+indexer_process::result_t indexer_process::call(std::string_view request,
+						std::string& response,
+						milliseconds timeout) {
+  response.clear();
+  if (!running()) {
+    return result_t::exited;
+  }
+  const auto deadline = steady_clock::now() + timeout;
+  m_pending.clear(); // a partial line left by an earlier request can only be noise
+  result_t result = write_all(m_stdin, request.data(), request.size(), deadline);
+  if (result == result_t::ok) {
+    result = write_all(m_stdin, "\n", 1, deadline);
+  }
+
+  char buf[65536];
+  while (result == result_t::ok) {
+    size_t newline = m_pending.find('\n');
+    if (newline != std::string::npos) {
+      response.assign(m_pending, 0, newline);
+      m_pending.erase(0, newline + 1);
+      return result_t::ok;
+    }
+    ssize_t k = read(m_stdout, buf, sizeof(buf));
+    if (k > 0) {
+      m_pending.append(buf, k);
+    } else if (k < 0 && errno == EINTR) {
+      continue;
+    } else if (k < 0 && errno == EAGAIN) {
+      int rc = wait_fd(m_stdout, POLLIN, deadline);
+      if (rc == 0) {
+	result = result_t::timeout;
+      } else if (rc < 0) {
+	result = result_t::exited;
+      }
+    } else {
+      result = result_t::exited; // EOF
+    }
+  }
+  kill();
+  return result;
+}
+
+int indexer_process::stop(milliseconds grace) noexcept {
+  if (!running()) {
+    return -1;
+  }
+  close_pipes(); // EOF on stdin asks the process to exit
+  const auto deadline = steady_clock::now() + grace;
+  int status = 0;
+  while (steady_clock::now() < deadline) {
+    pid_t rc = waitpid(m_pid, &status, WNOHANG);
+    if (rc == m_pid || (rc < 0 && errno != EINTR)) {
+      m_pid = -1;
+      return status;
+    }
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  return kill();
+}
+
+int indexer_process::kill() noexcept {
+  if (!running()) {
+    close_pipes();
+    return -1;
+  }
+  ::kill(m_pid, SIGKILL);
+  int status = 0;
+  while (waitpid(m_pid, &status, 0) < 0 && errno == EINTR) {}
+  m_pid = -1;
+  close_pipes();
+  return status;
+}
+
+void indexer_process::close_pipes() noexcept {
+  if (m_stdin >= 0) {
+    ::close(m_stdin);
+    m_stdin = -1;
+  }
+  if (m_stdout >= 0) {
+    ::close(m_stdout);
+    m_stdout = -1;
+  }
+}
+
+/*
+  {"series":1,"ring":"/bigpicture-frames","geometry":{...},"frames":[{"frame":2,"path":"..."},...]}
+*/
+static std::string_view serialize_batch(const std::vector<frame_event_t>& batch,
+					const std::string& ring_name, std::vector<char>& buf) {
+  size_t estimate = 1024;
+  for (const frame_event_t& event : batch) {
+    estimate += 64 + event.path.size();
+  }
+  if (buf.size() < estimate) {
+    buf.resize(estimate);
+  }
+  for (;;) {
+    json_writer w(buf.data(), buf.size());
+    w.begin_object()
+      .field("series", batch.front().series_id)
+      .field("ring", ring_name)
+      .key("geometry");
+    batch.front().geometry.serialize(w);
+    w.key("frames").begin_array();
+    for (const frame_event_t& event : batch) {
+      w.begin_object()
+	.field("frame", event.frame_id)
+	.field("path", event.path)
+	.end_object();
+    }
+    w.end_array().end_object();
+    if (!w.overflow()) {
+      return w.view();
+    }
+    buf.resize(2*buf.size()); // paths with escaped characters
+  }
+}
+
+external_indexer_pool::external_indexer_pool(const external_indexer_options_t& options,
+					     size_t queue_depth, result_handler on_result) :
+  m_options(options),
+  m_on_result(std::move(on_result)),
+  m_closing(false),
+  m_queue(queue_depth) {
+  signal(SIGPIPE, SIG_IGN);
+  for (int64_t i=0; i < m_options.processes; ++i) {
+    m_threads.emplace_back(&external_indexer_pool::run, this);
+  }
+}
+
+external_indexer_pool::~external_indexer_pool() noexcept {
+  close();
+}
+
+void external_indexer_pool::close() noexcept {
+  m_closing = true;
+  m_queue.close();
+  for (std::thread& thread : m_threads) {
+    thread.join();
+  }
+  m_threads.clear();
+}
+
+bool external_indexer_pool::process(indexer_process& child,
+				    const std::vector<frame_event_t>& batch,
+				    std::vector<char>& buf, std::string& response) {
+  const pid_t pid = child.pid();
+  const milliseconds timeout(static_cast<int64_t>(m_options.timeout_s * 1000));
+  auto start = steady_clock::now();
+  auto result = child.call(serialize_batch(batch, m_options.ring_name, buf), response, timeout);
+  m_counters.busy_us += duration_cast<microseconds>(steady_clock::now() - start).count();
+  ++m_counters.batches;
+
+  if (result == indexer_process::result_t::ok) {
+    m_counters.frames += batch.size();
+    try {
+      m_on_result(batch, response);
+    } catch (const std::exception& e) {
+      std::clog << "ERROR: failed to record the external indexer's results for series "
+		<< batch.front().series_id << ": " << e.what() << std::endl;
+    }
+    return true;
+  }
+
+  m_counters.failed += batch.size();
+  if (result == indexer_process::result_t::timeout) {
+    ++m_counters.timeouts;
+    std::clog << "WARNING: external indexer " << pid << " timed out after "
+	      << m_options.timeout_s << "s on series " << batch.front().series_id
+	      << ", frames " << batch.front().frame_id << "-" << batch.back().frame_id
+	      << ", killed it" << std::endl;
+  } else {
+    std::clog << "ERROR: external indexer " << pid << " exited on series "
+	      << batch.front().series_id << ", frames " << batch.front().frame_id
+	      << "-" << batch.back().frame_id << std::endl;
+  }
+  return false;
+}
+
+void external_indexer_pool::run() {
+  indexer_process child(m_options.argv);
+  std::vector<frame_event_t> jobs, batch;
+  std::vector<char> buf;
+  std::string response;
+  milliseconds backoff = min_backoff;
+  steady_clock::time_point not_before = steady_clock::now();
+  bool started = false;
+
+  while (m_queue.pop_batch(jobs, m_options.batch_size)) {
+    // A request covers a single series, since frames of a series share a geometry.
+    for (size_t begin=0, end=0; begin < jobs.size(); begin = end) {
+      end = begin + 1;
+      while (end < jobs.size() && jobs[end].series_id == jobs[begin].series_id) {
+	++end;
+      }
+      batch.assign(std::make_move_iterator(jobs.begin() + begin),
+		   std::make_move_iterator(jobs.begin() + end));
+
+      if (!child.running()) {
+	while (!m_closing && steady_clock::now() < not_before) {
+	  std::this_thread::sleep_for(std::min<milliseconds>(
+	    milliseconds(100), duration_cast<milliseconds>(not_before - steady_clock::now())));
+	}
+	if (steady_clock::now() < not_before) {
+	  m_counters.failed += batch.size(); // shutting down, don't wait out the backoff
+	  continue;
+	}
+	try {
+	  child.start();
+	  if (started) {
+	    ++m_counters.restarts;
+	  }
+	  started = true;
+	} catch (const std::exception& e) {
+	  std::clog << "ERROR: " << e.what() << ", retrying in "
+		    << backoff.count() << "ms" << std::endl;
+	  m_counters.failed += batch.size();
+	  not_before = steady_clock::now() + backoff;
+	  backoff = std::min(2*backoff, max_backoff);
+	  continue;
+	}
+      }
+
+      if (process(child, batch, buf, response)) {
+	backoff = min_backoff;
+      } else {
+	not_before = steady_clock::now() + backoff;
+	backoff = std::min(2*backoff, max_backoff);
+      }
+    }
+  }
+  child.stop(stop_grace);
+}
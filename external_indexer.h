@@ -0,0 +1,170 @@
+#ifndef BP_EXTERNAL_INDEXER_H
+#define BP_EXTERNAL_INDEXER_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+#include <simdjson.h>
+
+#include "frame_events.h"
+#include "work_queue.h"
+
+namespace bigpicture {
+  /**
+   * Deserialized "/indexer" parameters of an external indexer, e.g. a wrapper around
+   * DIALS or XDS:
+   *
+   *   "indexer" : {
+   *     "type"       : "executable",
+   *     "method"     : "bigpicture.index", // searched for in PATH
+   *     "arguments"  : [],
+   *     "processes"  : 2,                  // 0 to disable
+   *     "batch_size" : 16,                 // frames per request
+   *     "timeout_s"  : 60.0                // per request
+   *   }
+   */
+  struct external_indexer_options_t {
+    external_indexer_options_t() noexcept :
+      processes(0), batch_size(16), timeout_s(60.0), ring_name("/bigpicture-frames") {}
+
+    /// \throws std::runtime_error if a parameter is invalid.
+    explicit external_indexer_options_t(const simdjson::dom::object& config);
+
+    std::vector<std::string> argv; //!< the method and its arguments
+    int64_t                  processes;
+    int64_t                  batch_size;
+    double                   timeout_s;
+    std::string              ring_name; //!< "/archiver/frame_ring/name", passed to the method
+  };
+
+  /**
+   * A long-lived child process which answers each line of JSON written to its stdin
+   * with exactly one line of JSON on its stdout. Its stderr is inherited.
+   */
+  class indexer_process {
+  public:
+    enum class result_t : int {
+      ok=0,
+      timeout, //!< The process was killed for taking too long.
+      exited,  //!< The process exited, or closed its stdout.
+    };
+
+    explicit indexer_process(const std::vector<std::string>& argv) :
+      m_argv(argv), m_pid(-1), m_stdin(-1), m_stdout(-1) {}
+
+    /// Kills the process if it is still running.
+    ~indexer_process() noexcept { kill(); }
+
+    /**
+     * Spawns the process, killing the previous one if it is still running.
+     * \throws std::system_error if the process cannot be spawned.
+     */
+    void start();
+
+    /**
+     * Writes a request, which must not contain a newline, and reads one line of
+     * response. The process is killed unless the result is ok.
+     */
+    result_t call(std::string_view request, std::string& response,
+		  std::chrono::milliseconds timeout);
+
+    /**
+     * Closes the process' stdin and waits up to grace for it to exit, then kills it.
+     * @return The exit status, as returned by waitpid(), or -1 if it was not running.
+     */
+    int stop(std::chrono::milliseconds grace) noexcept;
+
+    /// Sends SIGKILL and reaps the process. @return As stop().
+    int kill() noexcept;
+
+    bool  running() const { return m_pid > 0; }
+    pid_t pid()     const { return m_pid; }
+
+  private:
+    indexer_process(const indexer_process&) = delete;
+    void close_pipes() noexcept;
+
+    std::vector<std::string> m_argv;
+    pid_t                    m_pid;
+    int                      m_stdin;   //!< write end of the child's stdin
+    int                      m_stdout;  //!< read end of the child's stdout
+    std::string              m_pending; //!< bytes read past the last newline
+  };
+
+  /**
+   * Counters of an external_indexer_pool, which may be reset by the reader.
+   */
+  struct external_indexer_counters_t {
+    std::atomic<uint64_t> frames = 0;
+    std::atomic<uint64_t> batches = 0;
+    std::atomic<uint64_t> failed = 0;   //!< frames in batches without a response
+    std::atomic<uint64_t> timeouts = 0;
+    std::atomic<uint64_t> restarts = 0;
+    std::atomic<uint64_t> busy_us = 0;  //!< time spent waiting on responses
+  };
+
+  /**
+   * Drives a pool of long-lived external indexer processes, so that the cost of
+   * starting a process, e.g. importing DIALS, is paid once rather than per frame.
+   *
+   * Frames are handed over by reference in batches: each request is one line of JSON
+   * naming the frame ring, the geometry of the series and the frames, e.g.
+   *
+   *   {"series":1,"ring":"/bigpicture-frames","geometry":{...},
+   *    "frames":[{"frame":2,"path":"/pf/.../1_000002.cbf"},...]}
+   *
+   * so that a process may map the frames out of shared memory or read the archived
+   * files. Each response line is passed verbatim to the result handler. A process
+   * which crashes or exceeds the timeout is killed, and restarted with exponential
+   * backoff once there is more work.
+   */
+  class external_indexer_pool {
+  public:
+    /// Called concurrently by the pool's threads with a batch and its response.
+    using result_handler = std::function<void(const std::vector<frame_event_t>& batch,
+					      std::string_view response)>;
+
+    /**
+     * Starts one thread per process; processes are spawned on demand.
+     * @param queue_depth Frames waiting for a process, the oldest are dropped.
+     * @note SIGPIPE is ignored from here on, so that a crashed process cannot kill
+     *       the caller.
+     */
+    external_indexer_pool(const external_indexer_options_t& options, size_t queue_depth,
+			  result_handler on_result);
+
+    /// Equivalent to close().
+    ~external_indexer_pool() noexcept;
+
+    /// Never blocks. @return false if the pool has been closed.
+    bool submit(frame_event_t event) { return m_queue.push(std::move(event)); }
+
+    /// Finishes the queued frames, then stops every process.
+    void close() noexcept;
+
+    external_indexer_counters_t& counters() { return m_counters; }
+    uint64_t n_dropped() const { return m_queue.n_dropped(); }
+
+  private:
+    external_indexer_pool(const external_indexer_pool&) = delete;
+    void run();
+    bool process(indexer_process& child, const std::vector<frame_event_t>& batch,
+		 std::vector<char>& buf, std::string& response);
+
+    external_indexer_options_t  m_options;
+    result_handler              m_on_result;
+    external_indexer_counters_t m_counters;
+    std::atomic<bool>           m_closing;
+    work_queue<frame_event_t>   m_queue;
+    std::vector<std::thread>    m_threads;
+  };
+}
+
+#endif // header guard
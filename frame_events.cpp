@@ -0,0 +1,197 @@
+#include <chrono>
+#include <errno.h>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+
+#include <simdjson.h>
+#include <zmq.hpp>
+
+#include "bigpicture_utils.h"
+#include "frame_events.h"
+#include "json_writer.h"
+
+using namespace bigpicture;
+
+static constexpr char endpoint_default[] = "ipc:///tmp/bigpicture-events";
+static constexpr int  sndhwm_default     = 100000; // events
+
+static const char* event_type_name(frame_event_type_t type) {
+  switch (type) {
+  case frame_event_type_t::frame:
+    return "frame";
+  case frame_event_type_t::series_end:
+    return "series_end";
+  default:
+    return "unknown";
+  }
+}
+
+std::string bigpicture::event_endpoint(const simdjson::dom::object& config) {
+  std::string endpoint(endpoint_default);
+  maybe_extract_json_pointer(endpoint, config, "/events/endpoint");
+  return endpoint;
+}
+
+size_t frame_event_t::serialize(char* buf, size_t len) const {
+  // Leaves room for the null terminator.
+  json_writer w(buf, len ? len - 1 : 0);
+  w.begin_object()
+    .field("event", event_type_name(type))
+    .field("series", series_id)
+    .field("frame", frame_id)
+    .field("committed", n_committed)
+    .field("path", path);
+
+  w.key("geometry");
+  geometry.serialize(w);
+
+  if (type == frame_event_type_t::frame) {
+    w.key("stats").begin_object()
+      .field("sum", stats.sum)
+      .field("max", stats.max)
+      .field("valid", stats.n_valid)
+      .field("masked", stats.n_masked)
+      .field("saturated", stats.n_saturated)
+      .end_object();
+  }
+  w.end_object();
+
+  if (w.overflow()) {
+    return len;
+  }
+  buf[w.size()] = '\0';
+  return w.size();
+}
+
+static inline double json_double(const simdjson::dom::object& record, const char* jsp) {
+  // Non-finite values are serialized as null.
+  double value = NAN;
+  maybe_extract_json_pointer(value, record, jsp);
+  return value;
+}
+
+void frame_event_t::parse(const simdjson::dom::object& record) {
+  std::string_view tmp_sv;
+  extract_json_value(tmp_sv, record, "event");
+  if (tmp_sv.compare("frame") == 0) {
+    type = frame_event_type_t::frame;
+  } else if (tmp_sv.compare("series_end") == 0) {
+    type = frame_event_type_t::series_end;
+  } else {
+    std::stringstream ss;
+    ss << "Unknown frame event type \"" << tmp_sv << "\"" << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+  extract_json_value(series_id, record, "series");
+  extract_json_value(frame_id, record, "frame");
+  extract_json_value(n_committed, record, "committed");
+  extract_json_value(path, record, "path");
+
+  extract_json_pointer(geometry.width, record, "/geometry/width");
+  extract_json_pointer(geometry.height, record, "/geometry/height");
+  extract_json_pointer(geometry.bit_depth, record, "/geometry/bit_depth");
+  extract_json_pointer(geometry.count_cutoff, record, "/geometry/count_cutoff");
+  extract_json_pointer(geometry.n_frames, record, "/geometry/n_frames");
+  geometry.beam_center_x     = json_double(record, "/geometry/beam_center_x");
+  geometry.beam_center_y     = json_double(record, "/geometry/beam_center_y");
+  geometry.detector_distance = json_double(record, "/geometry/detector_distance");
+  geometry.wavelength        = json_double(record, "/geometry/wavelength");
+  geometry.x_pixel_size      = json_double(record, "/geometry/x_pixel_size");
+  geometry.y_pixel_size      = json_double(record, "/geometry/y_pixel_size");
+  geometry.omega_start       = json_double(record, "/geometry/omega_start");
+  geometry.omega_increment   = json_double(record, "/geometry/omega_increment");
+
+  stats = frame_stats_t();
+  if (type == frame_event_type_t::frame) {
+    extract_json_pointer(stats.sum, record, "/stats/sum");
+    extract_json_pointer(stats.max, record, "/stats/max");
+    extract_json_pointer(stats.n_valid, record, "/stats/valid");
+    extract_json_pointer(stats.n_masked, record, "/stats/masked");
+    extract_json_pointer(stats.n_saturated, record, "/stats/saturated");
+  }
+}
+
+frame_event_publisher::frame_event_publisher(const std::string& endpoint) :
+  m_endpoint(endpoint),
+  m_zmq_ctx(1),
+  m_sock(m_zmq_ctx, zmq::socket_type::pub) {
+  m_sock.set(zmq::sockopt::sndhwm, sndhwm_default);
+  m_sock.set(zmq::sockopt::linger, 0);
+  m_sock.bind(m_endpoint);
+  std::clog << "INFO: publishing frame events at " << m_endpoint << std::endl;
+}
+
+frame_event_publisher::frame_event_publisher(const simdjson::dom::object& config) :
+  frame_event_publisher(event_endpoint(config)) {
+}
+
+void frame_event_publisher::publish(const frame_event_t& event) {
+  size_t len = event.serialize(m_buf, sizeof(m_buf));
+  if (len >= sizeof(m_buf)) {
+    std::clog << "WARNING: frame event for series " << event.series_id << ", frame "
+	      << event.frame_id << " is too large to publish" << std::endl;
+    return;
+  }
+  // PUB sockets drop messages for subscribers at their high water mark, so this
+  // never blocks the archiver.
+  m_sock.send(zmq::buffer(m_buf, len), zmq::send_flags::dontwait);
+}
+
+frame_event_subscriber::frame_event_subscriber(const std::string& endpoint,
+					       frame_event_type_t filter) :
+  m_endpoint(endpoint),
+  m_zmq_ctx(1),
+  m_sock(m_zmq_ctx, zmq::socket_type::sub) {
+  connect(filter);
+}
+
+frame_event_subscriber::frame_event_subscriber(const simdjson::dom::object& config,
+					       frame_event_type_t filter) :
+  m_endpoint(event_endpoint(config)),
+  m_zmq_ctx(1),
+  m_sock(m_zmq_ctx, zmq::socket_type::sub) {
+  connect(filter);
+}
+
+void frame_event_subscriber::connect(frame_event_type_t filter) {
+  // Every event begins with its type, so filtering is a prefix match done by ZMQ.
+  std::string prefix;
+  if (filter != frame_event_type_t::unknown) {
+    prefix = std::string("{\"event\":\"") + event_type_name(filter) + "\"";
+  }
+  m_sock.set(zmq::sockopt::subscribe, prefix);
+  m_sock.set(zmq::sockopt::linger, 0);
+  m_sock.connect(m_endpoint);
+  std::clog << "INFO: subscribed to frame events at " << m_endpoint << std::endl;
+}
+
+bool frame_event_subscriber::recv(frame_event_t& event, std::chrono::milliseconds timeout) {
+  m_sock.set(zmq::sockopt::rcvtimeo, static_cast<int>(timeout.count()));
+  zmq::recv_result_t result;
+  try {
+    result = m_sock.recv(m_msg, zmq::recv_flags::none);
+  } catch (const zmq::error_t& e) {
+    if (e.num() != EINTR) {
+      throw;
+    }
+    return false; // interrupted by a signal, e.g. SIGHUP to reload the config
+  }
+  if (!result.has_value()) {
+    return false;
+  }
+  simdjson::padded_string padded(static_cast<const char*>(m_msg.data()), m_msg.size());
+  simdjson::dom::object record;
+  auto ec = m_parser.parse(padded).get(record);
+  if (ec) {
+    std::stringstream ss;
+    ss << "simdjson failed with error code " << ec << " while parsing a frame event: "
+       << m_msg.to_string() << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+  event.parse(record);
+  return true;
+}
@@ -0,0 +1,176 @@
+#ifndef BP_FRAME_EVENTS_H
+#define BP_FRAME_EVENTS_H
+
+#include <chrono>
+#include <math.h>
+#include <stdint.h>
+#include <string>
+
+#include <simdjson.h>
+#include <zmq.hpp>
+
+#include "bigpicture_utils.h"
+#include "dectris_utils.h"
+#include "frame_tiling.h"
+#include "json_writer.h"
+
+namespace bigpicture {
+  /**
+   * The subset of detector_config_t which downstream consumers need to interpret a
+   * frame, in a trivially-copyable form which can be passed between threads and
+   * processes.
+   */
+  struct frame_geometry_t {
+    frame_geometry_t() noexcept :
+      width(0), height(0), bit_depth(0),
+      beam_center_x(NAN), beam_center_y(NAN), detector_distance(NAN), wavelength(NAN),
+      x_pixel_size(NAN), y_pixel_size(NAN), omega_start(NAN), omega_increment(NAN),
+      count_cutoff(-1), n_frames(-1) {}
+
+    explicit frame_geometry_t(const detector_config_t& config) noexcept :
+      width(config.x_pixels_in_detector),
+      height(config.y_pixels_in_detector),
+      bit_depth(config.bit_depth_image),
+      beam_center_x(config.beam_center_x),
+      beam_center_y(config.beam_center_y),
+      detector_distance(config.detector_distance),
+      wavelength(config.wavelength),
+      x_pixel_size(config.x_pixel_size),
+      y_pixel_size(config.y_pixel_size),
+      omega_start(config.omega_start),
+      omega_increment(config.omega_increment),
+      count_cutoff(config.countrate_correction_count_cutoff),
+      n_frames(config.nimages * config.ntrigger) {}
+
+    /// Writes the geometry as a JSON object, e.g. as the value of a key.
+    void serialize(json_writer& w) const {
+      w.begin_object()
+	.field("width", width)
+	.field("height", height)
+	.field("bit_depth", bit_depth)
+	.field("beam_center_x", beam_center_x)
+	.field("beam_center_y", beam_center_y)
+	.field("detector_distance", detector_distance)
+	.field("wavelength", wavelength)
+	.field("x_pixel_size", x_pixel_size)
+	.field("y_pixel_size", y_pixel_size)
+	.field("omega_start", omega_start)
+	.field("omega_increment", omega_increment)
+	.field("count_cutoff", count_cutoff)
+	.field("n_frames", n_frames)
+	.end_object();
+    }
+
+    int64_t width;             //!< pixels
+    int64_t height;            //!< pixels
+    int64_t bit_depth;         //!< bits per pixel
+    double  beam_center_x;     //!< pixels
+    double  beam_center_y;     //!< pixels
+    double  detector_distance; //!< m
+    double  wavelength;        //!< Angstroms
+    double  x_pixel_size;      //!< m
+    double  y_pixel_size;      //!< m
+    double  omega_start;       //!< degrees
+    double  omega_increment;   //!< degrees
+    int64_t count_cutoff;      //!< counts
+    int64_t n_frames;          //!< frames in the series
+  };
+
+  enum class frame_event_type_t : int {
+    unknown=-1,
+    frame=0,      //!< A frame has been committed to storage.
+    series_end=1, //!< Every frame of a series has been committed to storage.
+  };
+
+  /**
+   * A notification published by the archiver, serialized as a single-line JSON object
+   * which begins with its type, e.g. {"event":"frame",...}, so that subscribers can
+   * filter on a prefix.
+   */
+  struct frame_event_t {
+    frame_event_t() noexcept :
+      type(frame_event_type_t::unknown), series_id(-1), frame_id(-1), n_committed(0) {}
+
+    /**
+     * @return The number of bytes written to buf, excluding the null terminator, or
+     *         a value >= len if buf was too small.
+     */
+    size_t serialize(char* buf, size_t len) const;
+
+    /// \throws std::runtime_error if the record is not a valid event.
+    void parse(const simdjson::dom::object& record);
+
+    frame_event_type_t type;
+    int64_t            series_id;
+    int64_t            frame_id;    //!< frame events only
+    int64_t            n_committed; //!< frames committed so far in the series
+    std::string        path;        //!< frame events only, the output file
+    frame_geometry_t   geometry;
+    frame_stats_t      stats;       //!< frame events only
+  };
+
+  /**
+   * Publishes frame events on a ZMQ PUB socket. Slow subscribers drop events rather
+   * than slowing down the publisher.
+   *
+   * Configured by the top-level "events" section of a bigpicture config file:
+   *
+   *   "events" : {
+   *     "endpoint" : "ipc:///tmp/bigpicture-events"
+   *   }
+   */
+  class frame_event_publisher {
+  public:
+    explicit frame_event_publisher(const std::string& endpoint);
+    explicit frame_event_publisher(const simdjson::dom::object& config);
+
+    /// Never blocks; the event is dropped if it cannot be queued.
+    void publish(const frame_event_t& event);
+
+    const std::string& endpoint() const { return m_endpoint; }
+
+  private:
+    frame_event_publisher(const frame_event_publisher&) = delete;
+
+    std::string    m_endpoint;
+    zmq::context_t m_zmq_ctx;
+    zmq::socket_t  m_sock;
+    char           m_buf[2048];
+  };
+
+  /**
+   * Receives frame events published by the archiver.
+   */
+  class frame_event_subscriber {
+  public:
+    /**
+     * @param filter Only receive events of this type, or all events if unknown.
+     */
+    frame_event_subscriber(const std::string& endpoint,
+			   frame_event_type_t filter=frame_event_type_t::unknown);
+    explicit frame_event_subscriber(const simdjson::dom::object& config,
+				    frame_event_type_t filter=frame_event_type_t::unknown);
+
+    /**
+     * Waits up to timeout for the next event.
+     * @return false if no event arrived in time.
+     * \throws std::runtime_error if an ill-formed event is received.
+     */
+    bool recv(frame_event_t& event, std::chrono::milliseconds timeout);
+
+  private:
+    frame_event_subscriber(const frame_event_subscriber&) = delete;
+    void connect(frame_event_type_t filter);
+
+    std::string           m_endpoint;
+    zmq::context_t        m_zmq_ctx;
+    zmq::socket_t         m_sock;
+    zmq::message_t        m_msg;
+    simdjson::dom::parser m_parser;
+  };
+
+  /// @return The endpoint of the event bus configured in "/events/endpoint".
+  std::string event_endpoint(const simdjson::dom::object& config);
+}
+
+#endif // header guard
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#include "frame_events.h"
+#include "frame_quality.h"
+#include "json_writer.h"
+#include "radial_profile.h"
+#include "resolution_map.h"
+#include "spot_finder.h"
+
+using namespace bigpicture;
+
+static constexpr size_t min_spots_for_d_min = 10;
+static constexpr double d_min_percentile    = 0.95;
+static constexpr size_t min_ice_spots       = 10;
+static constexpr double ice_spot_fraction   = 0.25;
+
+double bigpicture::resolution_at(const frame_geometry_t& geometry, double x, double y) {
+  const double dx = (x - geometry.beam_center_x) * geometry.x_pixel_size;
+  const double dy = (y - geometry.beam_center_y) * geometry.y_pixel_size;
+  const double two_theta = atan2(sqrt(dx*dx + dy*dy), geometry.detector_distance);
+  return geometry.wavelength / (2.0 * sin(two_theta / 2.0));
+}
+
+frame_quality_t bigpicture::assess_frame_quality(const frame_event_t& event,
+						 const std::vector<spot_t>& spots,
+						 const radial_profile* profile,
+						 const resolution_map* map) {
+  frame_quality_t quality;
+  quality.series_id = event.series_id;
+  quality.frame_id = event.frame_id;
+  quality.n_spots = spots.size();
+  quality.n_saturated = event.stats.n_saturated;
+
+  uint64_t n_spot_pixels = 0;
+  thread_local std::vector<double> inverse_d;
+  inverse_d.clear();
+  for (const spot_t& spot : spots) {
+    quality.spot_intensity += spot.intensity;
+    n_spot_pixels += spot.n_pixels;
+    const double s = 1.0 / resolution_at(event.geometry, spot.x, spot.y);
+    if (!isfinite(s)) {
+      continue; // the geometry is unknown
+    }
+    inverse_d.push_back(s);
+    for (double ring : ice_ring_resolutions) {
+      if (fabs(s - 1.0/ring) <= ice_ring_width) {
+	++quality.n_ice_spots;
+	break;
+      }
+    }
+  }
+
+  if (inverse_d.size() >= min_spots_for_d_min) {
+    const size_t i = size_t(d_min_percentile * (inverse_d.size() - 1));
+    std::nth_element(inverse_d.begin(), inverse_d.begin() + i, inverse_d.end());
+    quality.d_min = 1.0 / inverse_d[i];
+  }
+  quality.ice_rings = quality.n_ice_spots >= min_ice_spots &&
+    quality.n_ice_spots >= ice_spot_fraction * quality.n_spots;
+  if (profile && map) {
+    quality.n_ice_rings = count_ice_rings(*profile, *map);
+    quality.ice_rings |= (quality.n_ice_rings > 0);
+  }
+
+  const uint64_t n_background = event.stats.n_valid - std::min(event.stats.n_valid, n_spot_pixels);
+  if (n_background > 0) {
+    const uint64_t counts = event.stats.sum - std::min(event.stats.sum, quality.spot_intensity);
+    quality.background = double(counts) / n_background;
+  }
+  return quality;
+}
+
+size_t frame_quality_t::serialize(char* buf, size_t len) const {
+  json_writer w(buf, len);
+  w.begin_object()
+    .field("series", series_id)
+    .field("frame", frame_id)
+    .field("spots", n_spots)
+    .field("spot_intensity", spot_intensity)
+    .field("d_min", d_min)
+    .field("ice_spots", n_ice_spots)
+    .field("ice_ring_count", n_ice_rings)
+    .field("ice_rings", ice_rings)
+    .field("saturated", n_saturated)
+    .field("background", background)
+    .end_object();
+  return w.overflow() ? len : w.size();
+}
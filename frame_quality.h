@@ -0,0 +1,76 @@
+#ifndef BP_FRAME_QUALITY_H
+#define BP_FRAME_QUALITY_H
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#include "frame_events.h"
+#include "radial_profile.h"
+#include "resolution_map.h"
+#include "spot_finder.h"
+
+namespace bigpicture {
+  /**
+   * Resolutions of the strongest powder rings of hexagonal ice, in Angstroms.
+   */
+  constexpr double ice_ring_resolutions[] = {
+    3.897, 3.669, 3.441, 2.671, 2.249, 2.072, 1.948, 1.918, 1.883, 1.721
+  };
+
+  /// Half-width of an ice ring in 1/Angstrom.
+  constexpr double ice_ring_width = 0.005;
+
+  /**
+   * @return The resolution (d-spacing) in Angstroms of a position on the detector in
+   *         pixels, or infinity at the beam center.
+   */
+  double resolution_at(const frame_geometry_t& geometry, double x, double y);
+
+  /**
+   * Per-frame quality metrics, for plotting the progress of a collection in real time.
+   */
+  struct frame_quality_t {
+    frame_quality_t() noexcept :
+      series_id(-1), frame_id(-1), n_spots(0), spot_intensity(0), d_min(NAN),
+      n_ice_spots(0), n_ice_rings(-1), ice_rings(false), n_saturated(0), background(NAN) {}
+
+    /**
+     * Writes the metrics as a single line of JSON without a line break, e.g.
+     * {"series":1,"frame":2,"spots":53,"spot_intensity":10234,"d_min":1.83,
+     *  "ice_spots":4,"ice_ring_count":0,"ice_rings":false,"saturated":0,"background":0.21}
+     *
+     * @return The number of bytes written to buf, or a value >= len if buf was too
+     *         small. 256 bytes always suffice.
+     */
+    size_t serialize(char* buf, size_t len) const;
+
+    int64_t  series_id;
+    int64_t  frame_id;
+    uint64_t n_spots;
+    uint64_t spot_intensity; //!< counts in all spots
+    double   d_min;          //!< estimated resolution limit in Angstroms, NAN if unknown
+    uint64_t n_ice_spots;    //!< spots on an ice ring
+    int64_t  n_ice_rings;    //!< rings standing out of the radial profile, -1 if unknown
+    bool     ice_rings;      //!< spots are concentrated on ice rings, or any ring stands out
+    uint64_t n_saturated;    //!< pixels at or above the count cutoff
+    double   background;     //!< mean counts per unmasked pixel outside spots
+  };
+
+  /**
+   * Derives quality metrics from the spots found in a frame and its pixel statistics.
+   *
+   * The resolution limit is the resolution of the spot at the 95th percentile of 1/d,
+   * such that a few spurious spots at the edge of the detector do not dominate, and is
+   * only estimated from at least 10 spots. Ice rings are flagged when at least 10
+   * spots, and a quarter of all spots, lie within ice_ring_width of an ice ring, or
+   * if the radial profile of the frame is given and any ice ring stands out of it
+   * (see count_ice_rings()).
+   */
+  frame_quality_t assess_frame_quality(const frame_event_t& event,
+				       const std::vector<spot_t>& spots,
+				       const radial_profile* profile=nullptr,
+				       const resolution_map* map=nullptr);
+}
+
+#endif // header guard
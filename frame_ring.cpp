@@ -0,0 +1,346 @@
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+#include <simdjson.h>
+
+#include "bigpicture_utils.h"
+#include "frame_ring.h"
+
+using namespace bigpicture;
+
+/*
+  Shared-memory layout:
+
+    [ring header][slot header 0][payload 0][slot header 1][payload 1]...
+
+  Every header and payload begins on a cache line boundary. The layout is versioned
+  so that a consumer built against a different release refuses to map the ring
+  rather than misreading it.
+*/
+static constexpr uint32_t ring_magic     = 0x42504652; // "BPFR"
+static constexpr uint32_t ring_version   = 1;
+static constexpr size_t   cache_line     = 64;
+
+static constexpr const char* name_default    = "/bigpicture-frames";
+static constexpr int64_t     n_slots_default = 16;
+static constexpr int64_t     slot_mb_default = 80;
+
+struct alignas(cache_line) ring_header_t {
+  uint32_t              magic;
+  uint32_t              version;
+  uint64_t              n_slots;
+  uint64_t              slot_size;
+  std::atomic<uint64_t> head; //!< sequence number of the next frame to be published
+};
+
+/*
+  Slot sequence lock: while frame n is being written the lock holds 2n+1, and once
+  it is published the lock holds 2n+2. A reader expecting frame n accepts the slot
+  if and only if the lock reads 2n+2 both before and after reading the slot.
+*/
+struct alignas(cache_line) slot_header_t {
+  std::atomic<uint64_t> lock;
+  frame_meta_t          meta;
+  uint64_t              size;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+	      "the frame ring requires lock-free 64-bit atomics");
+
+static inline size_t round_up(size_t n, size_t align) {
+  return (n + align - 1) / align * align;
+}
+
+static inline size_t slot_stride(size_t slot_size) {
+  return sizeof(slot_header_t) + round_up(slot_size, cache_line);
+}
+
+static inline size_t map_size(size_t n_slots, size_t slot_size) {
+  return sizeof(ring_header_t) + n_slots*slot_stride(slot_size);
+}
+
+static inline const slot_header_t* slot_at(const char* map, size_t slot_size, uint64_t seq,
+					   size_t n_slots) {
+  return reinterpret_cast<const slot_header_t*>(map + sizeof(ring_header_t) +
+						(seq % n_slots)*slot_stride(slot_size));
+}
+
+static void throw_errno(const std::string& what, const std::string& name) {
+  int err = errno;
+  std::stringstream ss;
+  ss << "libc error: " << what << " " << name << " - " << strerror(err) << "\n";
+  throw std::system_error(err, std::system_category(), ss.str());
+}
+
+frame_ring_writer::frame_ring_writer(const std::string& name, size_t n_slots,
+				     size_t slot_size) :
+  m_name(name),
+  m_n_slots(n_slots),
+  m_slot_size(slot_size),
+  m_payload(frame_ring_payload_t::compressed),
+  m_map(nullptr),
+  m_map_size(0),
+  m_next_seq(0),
+  m_n_oversize(0) {
+  open();
+}
+
+frame_ring_writer::frame_ring_writer(const simdjson::dom::object& config) :
+  m_name(name_default),
+  m_n_slots(n_slots_default),
+  m_slot_size(slot_mb_default*1024*1024),
+  m_payload(frame_ring_payload_t::compressed),
+  m_map(nullptr),
+  m_map_size(0),
+  m_next_seq(0),
+  m_n_oversize(0) {
+  int64_t tmp_int;
+  std::string_view tmp_sv;
+
+  maybe_extract_json_pointer(m_name, config, "/archiver/frame_ring/name");
+  if (maybe_extract_json_pointer(tmp_int, config, "/archiver/frame_ring/slots")) {
+    m_n_slots = tmp_int;
+  }
+  if (maybe_extract_json_pointer(tmp_int, config, "/archiver/frame_ring/slot_mb")) {
+    m_slot_size = tmp_int*1024*1024;
+  }
+  if (maybe_extract_json_pointer(tmp_sv, config, "/archiver/frame_ring/payload")) {
+    if (tmp_sv.compare("decoded") == 0) {
+      m_payload = frame_ring_payload_t::decoded;
+    } else if (tmp_sv.compare("compressed") != 0) {
+      throw std::runtime_error("The config parameter \"/archiver/frame_ring/payload\" "
+			       "must be either \"compressed\" or \"decoded\".");
+    }
+  }
+  open();
+}
+
+void frame_ring_writer::open() {
+  if (m_n_slots < 2 || m_slot_size == 0) {
+    throw std::runtime_error("A frame ring requires at least 2 slots and a nonzero slot size.");
+  }
+
+  // Replace any segment left behind by a previous archiver. Readers holding the old
+  // mapping keep it alive until they remap. Raw frames are only readable by consumers
+  // in the archiver's group.
+  shm_unlink(m_name.c_str());
+  int fd = shm_open(m_name.c_str(), O_CREAT|O_EXCL|O_RDWR, S_IRUSR|S_IWUSR|S_IRGRP);
+  if (fd < 0) {
+    throw_errno("shm_open()", m_name);
+  }
+  m_map_size = map_size(m_n_slots, m_slot_size);
+  if (ftruncate(fd, m_map_size) != 0) {
+    close(fd);
+    shm_unlink(m_name.c_str());
+    throw_errno("ftruncate()", m_name);
+  }
+  void* map = mmap(nullptr, m_map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    shm_unlink(m_name.c_str());
+    throw_errno("mmap()", m_name);
+  }
+  m_map = static_cast<char*>(map);
+
+  // The segment is zero-filled, so every slot lock reads as "never written".
+  ring_header_t* header = new (m_map) ring_header_t;
+  header->magic = ring_magic;
+  header->version = ring_version;
+  header->n_slots = m_n_slots;
+  header->slot_size = m_slot_size;
+  header->head.store(0, std::memory_order_release);
+
+  std::clog << "INFO: publishing frames to shared memory " << m_name
+	    << "  slots=" << m_n_slots << "  slot_size=" << m_slot_size << std::endl;
+}
+
+frame_ring_writer::~frame_ring_writer() noexcept {
+  if (m_map) {
+    munmap(m_map, m_map_size);
+    shm_unlink(m_name.c_str());
+  }
+}
+
+bool frame_ring_writer::publish(const frame_meta_t& meta, const void* data,
+				size_t len) noexcept {
+  if (len > m_slot_size) {
+    ++m_n_oversize;
+    return false;
+  }
+
+  const uint64_t seq = m_next_seq++;
+  slot_header_t* slot = const_cast<slot_header_t*>(slot_at(m_map, m_slot_size, seq, m_n_slots));
+  slot->lock.store(2*seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->meta = meta;
+  slot->size = len;
+  memcpy(reinterpret_cast<char*>(slot) + sizeof(slot_header_t), data, len);
+  slot->lock.store(2*seq + 2, std::memory_order_release);
+
+  reinterpret_cast<ring_header_t*>(m_map)->head.store(seq + 1, std::memory_order_release);
+  return true;
+}
+
+frame_ring_reader::frame_ring_reader(const std::string& name) :
+  m_name(name),
+  m_inode(0),
+  m_n_slots(0),
+  m_slot_size(0),
+  m_map(nullptr),
+  m_map_size(0),
+  m_next_seq(0),
+  m_n_skipped(0) {
+  int fd = shm_open(m_name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    throw_errno("shm_open()", m_name);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw_errno("fstat()", m_name);
+  }
+  if (static_cast<size_t>(st.st_size) < sizeof(ring_header_t)) {
+    close(fd);
+    throw std::runtime_error("Shared-memory segment " + m_name + " is not a frame ring.");
+  }
+  void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    throw_errno("mmap()", m_name);
+  }
+  m_map = static_cast<const char*>(map);
+  m_map_size = st.st_size;
+  m_inode = st.st_ino;
+
+  const ring_header_t* header = reinterpret_cast<const ring_header_t*>(m_map);
+  if (header->magic != ring_magic || header->version != ring_version ||
+      map_size(header->n_slots, header->slot_size) != m_map_size) {
+    munmap(const_cast<char*>(m_map), m_map_size);
+    m_map = nullptr;
+    std::stringstream ss;
+    ss << "Shared-memory segment " << m_name << " is not a version " << ring_version
+       << " frame ring. Please make sure all bigpicture daemons are the same version."
+       << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+  m_n_slots = header->n_slots;
+  m_slot_size = header->slot_size;
+
+  // Start with the newest frame rather than replaying the whole ring.
+  uint64_t head = header->head.load(std::memory_order_acquire);
+  m_next_seq = (head > 0) ? head - 1 : 0;
+}
+
+frame_ring_reader::~frame_ring_reader() noexcept {
+  if (m_map) {
+    munmap(const_cast<char*>(m_map), m_map_size);
+  }
+}
+
+bool frame_ring_reader::stale() const noexcept {
+  int fd = shm_open(m_name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return true;
+  }
+  struct stat st;
+  bool replaced = (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_ino) != m_inode);
+  close(fd);
+  return replaced;
+}
+
+bool frame_ring_reader::read_slot(uint64_t seq, frame_view_t& view) const {
+  const slot_header_t* slot = slot_at(m_map, m_slot_size, seq, m_n_slots);
+  if (slot->lock.load(std::memory_order_acquire) != 2*seq + 2) {
+    return false;
+  }
+  view.seq  = seq;
+  view.meta = slot->meta;
+  view.size = slot->size;
+  view.data = reinterpret_cast<const char*>(slot) + sizeof(slot_header_t);
+  return validate(view) && view.size <= m_slot_size;
+}
+
+bool frame_ring_reader::validate(const frame_view_t& view) const noexcept {
+  const slot_header_t* slot = slot_at(m_map, m_slot_size, view.seq, m_n_slots);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot->lock.load(std::memory_order_relaxed) == 2*view.seq + 2;
+}
+
+bool frame_ring_reader::next(frame_view_t& view) {
+  const ring_header_t* header = reinterpret_cast<const ring_header_t*>(m_map);
+  while (true) {
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    if (m_next_seq >= head) {
+      return false;
+    }
+    if (head - m_next_seq >= m_n_slots) {
+      m_n_skipped += head - 1 - m_next_seq;
+      m_next_seq = head - 1;
+    }
+    if (read_slot(m_next_seq++, view)) {
+      return true;
+    }
+    // Overwritten between loading head and reading the slot; try again.
+    ++m_n_skipped;
+  }
+}
+
+bool frame_ring_reader::find(int64_t series_id, int64_t frame_id, frame_view_t& view) const {
+  const ring_header_t* header = reinterpret_cast<const ring_header_t*>(m_map);
+  uint64_t head = header->head.load(std::memory_order_acquire);
+  uint64_t oldest = (head > m_n_slots) ? head - m_n_slots : 0;
+
+  // Search newest to oldest, since consumers usually ask for recent frames.
+  for (uint64_t seq=head; seq > oldest; --seq) {
+    if (read_slot(seq-1, view) &&
+	view.meta.series_id == series_id && view.meta.frame_id == frame_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool frame_ring_reader::latest(frame_view_t& view) const {
+  const ring_header_t* header = reinterpret_cast<const ring_header_t*>(m_map);
+  uint64_t head = header->head.load(std::memory_order_acquire);
+  return head > 0 && read_slot(head-1, view);
+}
+
+thread_local unique_buffer frame_source::m_copy;
+
+std::shared_ptr<frame_ring_reader> frame_source::reader() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!m_reader) {
+    try {
+      m_reader = std::make_shared<frame_ring_reader>(m_name);
+    } catch (const std::exception&) {
+      return nullptr; // The archiver has not created the ring yet.
+    }
+  }
+  return m_reader;
+}
+
+bool frame_source::copy_frame(int64_t series_id, int64_t frame_id, unique_buffer& scratch,
+			      frame_meta_t& meta) {
+  return with_frame(series_id, frame_id, scratch, [&](const frame_meta_t& m, const void* pixels) {
+    meta = m;
+    if (pixels != scratch.get()) {
+      const size_t n_bytes = size_t(m.width) * m.height * (m.bit_depth/8);
+      scratch.reset(n_bytes);
+      memcpy(scratch.get(), pixels, n_bytes);
+    }
+  });
+}
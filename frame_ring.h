@@ -0,0 +1,281 @@
+#ifndef BP_FRAME_RING_H
+#define BP_FRAME_RING_H
+
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#include <simdjson.h>
+
+#include "bigpicture_utils.h"
+
+namespace bigpicture {
+  /**
+   * Metadata describing a frame in a frame_ring slot.
+   */
+  struct frame_meta_t {
+    frame_meta_t() noexcept :
+      series_id(-1), frame_id(-1), width(0), height(0), bit_depth(0),
+      compression(compressor_t::none) {}
+
+    int64_t      series_id;
+    int64_t      frame_id;
+    uint32_t     width;       //!< pixels
+    uint32_t     height;      //!< pixels
+    int32_t      bit_depth;   //!< bits per pixel
+    compressor_t compression; //!< encoding of the payload, none if decoded
+  };
+
+  /**
+   * A frame mapped directly out of shared memory by a frame_ring_reader.
+   *
+   * @warning The payload may be overwritten by the archiver at any time. A consumer
+   *          must call frame_ring_reader::validate() after it has finished reading
+   *          the payload, and discard its results if validation fails.
+   */
+  struct frame_view_t {
+    frame_view_t() noexcept : seq(0), data(nullptr), size(0) {}
+
+    uint64_t     seq;  //!< sequence number of the frame within the ring
+    frame_meta_t meta;
+    const char*  data; //!< payload, points into shared memory
+    size_t       size; //!< payload size in bytes
+  };
+
+  /**
+   * The payload published for each frame by the archiver.
+   */
+  enum class frame_ring_payload_t : int {
+    compressed=0, //!< The frame as received from the DCU, see frame_meta_t::compression
+    decoded=1,    //!< The uncompressed frame
+  };
+
+  /**
+   * A single-producer, multiple-consumer ring of frames in a POSIX shared-memory
+   * segment, allowing local consumers to map frames zero-copy as soon as they arrive.
+   *
+   * Each slot is protected by a sequence lock, so the producer never waits on
+   * consumers. A consumer which falls a full ring behind skips ahead to the newest
+   * frame rather than blocking the producer.
+   */
+  class frame_ring_writer {
+  public:
+    /**
+     * Creates (or replaces) the shared-memory segment.
+     *
+     * @param name A POSIX shared-memory object name, e.g. "/bigpicture-frames".
+     * @param n_slots The number of frames retained in the ring.
+     * @param slot_size The largest payload in bytes that a slot can hold.
+     * \throws std::system_error if the segment cannot be created or mapped.
+     */
+    frame_ring_writer(const std::string& name, size_t n_slots, size_t slot_size);
+
+    /**
+     * Reads the "/archiver/frame_ring" section of a bigpicture config file:
+     *
+     *   "frame_ring" : {
+     *     "name"    : "/bigpicture-frames",
+     *     "slots"   : 16,
+     *     "slot_mb" : 80,
+     *     "payload" : "compressed" // or "decoded"
+     *   }
+     */
+    explicit frame_ring_writer(const simdjson::dom::object& config);
+
+    /// Unmaps and unlinks the shared-memory segment.
+    ~frame_ring_writer() noexcept;
+
+    /**
+     * Copies a frame into the next slot of the ring, overwriting the oldest frame.
+     * @return false if the payload is larger than the slot size, in which case the
+     *         frame is not published.
+     */
+    bool publish(const frame_meta_t& meta, const void* data, size_t len) noexcept;
+
+    const std::string&   name()      const { return m_name; }
+    size_t               n_slots()   const { return m_n_slots; }
+    size_t               slot_size() const { return m_slot_size; }
+    frame_ring_payload_t payload()   const { return m_payload; }
+    uint64_t             n_published() const { return m_next_seq; }
+    uint64_t             n_oversize()  const { return m_n_oversize; }
+
+  private:
+    frame_ring_writer(const frame_ring_writer&) = delete;
+    void open();
+
+    std::string          m_name;
+    size_t               m_n_slots;
+    size_t               m_slot_size;
+    frame_ring_payload_t m_payload;
+    char*                m_map;
+    size_t               m_map_size;
+    uint64_t             m_next_seq;
+    uint64_t             m_n_oversize;
+  };
+
+  /**
+   * Maps the frames published by a frame_ring_writer in another process.
+   */
+  class frame_ring_reader {
+  public:
+    /**
+     * Maps an existing ring read-only.
+     * \throws std::system_error if the segment does not exist or cannot be mapped.
+     * \throws std::runtime_error if the segment is not a frame ring.
+     */
+    explicit frame_ring_reader(const std::string& name);
+    ~frame_ring_reader() noexcept;
+
+    /**
+     * Maps the next unread frame. If the reader has fallen a full ring behind the
+     * writer, it skips ahead to the newest frame.
+     * @return false if there is no unread frame.
+     */
+    bool next(frame_view_t& view);
+
+    /**
+     * Maps a specific frame if it is still in the ring.
+     * @return false if the frame was never published or has been overwritten.
+     */
+    bool find(int64_t series_id, int64_t frame_id, frame_view_t& view) const;
+
+    /**
+     * Maps the newest frame, regardless of which frames have been read by next().
+     * @return false if no frame has been published, or if the newest frame was
+     *         overwritten while it was being mapped.
+     */
+    bool latest(frame_view_t& view) const;
+
+    /**
+     * @return true if the frame has not been overwritten since it was mapped.
+     */
+    bool validate(const frame_view_t& view) const noexcept;
+
+    /**
+     * @return true if the writer has since replaced the segment, e.g. because the
+     *         archiver restarted, in which case the ring should be reopened.
+     */
+    bool stale() const noexcept;
+
+    /// @return The number of frames skipped because the reader fell behind.
+    uint64_t n_skipped() const { return m_n_skipped; }
+    size_t   n_slots()   const { return m_n_slots; }
+
+  private:
+    frame_ring_reader(const frame_ring_reader&) = delete;
+    bool read_slot(uint64_t seq, frame_view_t& view) const;
+
+    std::string m_name;
+    uint64_t    m_inode;
+    size_t      m_n_slots;
+    size_t      m_slot_size;
+    const char* m_map;
+    size_t      m_map_size;
+    uint64_t    m_next_seq;
+    uint64_t    m_n_skipped;
+  };
+
+  /**
+   * Maps frames out of the archiver's shared-memory frame ring, and reopens the ring
+   * whenever the archiver replaces it.
+   */
+  class frame_source {
+  public:
+    explicit frame_source(const std::string& name) : m_name(name) {}
+
+    /**
+     * Calls f(meta, pixels) with the uncompressed pixels of a frame. Decoded payloads
+     * are read in place. Compressed payloads are small, so they are copied out of the
+     * ring before decoding, such that a torn payload is never handed to the decoder.
+     *
+     * @return false if the frame is not in the ring or was overwritten while in use,
+     *         in which case any output of f must be discarded.
+     */
+    template<typename F>
+    bool with_frame(int64_t series_id, int64_t frame_id, unique_buffer& scratch, F&& f) {
+      std::shared_ptr<frame_ring_reader> ring = reader();
+      frame_view_t view;
+      if (!ring || !ring->find(series_id, frame_id, view)) {
+	if (ring && ring->stale()) {
+	  std::lock_guard<std::mutex> lock(m_mutex);
+	  m_reader.reset();
+	}
+	return false;
+      }
+
+      const frame_meta_t& meta = view.meta;
+      const size_t n_bytes = size_t(meta.width) * meta.height * (meta.bit_depth/8);
+      if (meta.compression == compressor_t::none) {
+	if (view.size != n_bytes) {
+	  return false;
+	}
+	f(meta, view.data);
+	return ring->validate(view);
+      }
+
+      if (m_copy.size() < view.size) {
+	m_copy.reset(view.size + view.size/4); // headroom, compressed sizes vary by frame
+      }
+      memcpy(m_copy.get(), view.data, view.size);
+      if (!ring->validate(view)) {
+	return false;
+      }
+      scratch.reset(n_bytes);
+      scratch.decode(meta.compression, m_copy.get(), view.size, meta.bit_depth/8);
+      f(meta, scratch.get());
+      return true;
+    }
+
+    /**
+     * Copies the uncompressed pixels of a frame into scratch, for consumers which keep
+     * state derived from the pixels and so must not see a torn frame at all.
+     *
+     * @return false if the frame is not in the ring or was overwritten while copied.
+     */
+    bool copy_frame(int64_t series_id, int64_t frame_id, unique_buffer& scratch,
+		    frame_meta_t& meta);
+
+    /**
+     * Calls f(meta, pixels) with the newest frame in the ring, which must be decoded,
+     * e.g. the live view published by bparchived.
+     *
+     * @return false if the ring is empty or the frame was overwritten while in use, in
+     *         which case any output of f must be discarded.
+     */
+    template<typename F>
+    bool with_latest(F&& f) {
+      std::shared_ptr<frame_ring_reader> ring = reader();
+      if (ring && ring->stale()) {
+	// The archiver replaces the live view whenever its frames grow.
+	{
+	  std::lock_guard<std::mutex> lock(m_mutex);
+	  m_reader.reset();
+	}
+	ring = reader();
+      }
+      frame_view_t view;
+      if (!ring || !ring->latest(view)) {
+	return false;
+      }
+      const frame_meta_t& meta = view.meta;
+      const size_t n_bytes = size_t(meta.width) * meta.height * (meta.bit_depth/8);
+      if (meta.compression != compressor_t::none || view.size != n_bytes) {
+	return false;
+      }
+      f(meta, view.data);
+      return ring->validate(view);
+    }
+
+  private:
+    std::shared_ptr<frame_ring_reader> reader();
+
+    static thread_local unique_buffer  m_copy;
+    std::string                        m_name;
+    std::mutex                         m_mutex;
+    std::shared_ptr<frame_ring_reader> m_reader;
+  };
+}
+
+#endif // header guard
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <math.h>
+#include <stdexcept>
+
+#include "bigpicture_utils.h"
+#include "frame_scheduler.h"
+
+using namespace bigpicture;
+using namespace std::chrono;
+
+// Weight of the newest sample in the smoothed arrival and analysis times.
+static constexpr double smoothing = 0.1;
+
+const char* bigpicture::sampling_mode_name(sampling_mode_t mode) {
+  switch (mode) {
+  case sampling_mode_t::all:    return "all";
+  case sampling_mode_t::stride: return "stride";
+  case sampling_mode_t::wedges: return "wedges";
+  }
+  return "unknown";
+}
+
+frame_scheduler_options_t::frame_scheduler_options_t(const simdjson::dom::object& config) :
+  frame_scheduler_options_t() {
+  maybe_extract_json_pointer(wedge_degrees, config, "/indexer/scheduler/wedge_degrees");
+  maybe_extract_json_pointer(wedge_frames, config, "/indexer/scheduler/wedge_frames");
+  maybe_extract_json_pointer(utilization, config, "/indexer/scheduler/utilization");
+  maybe_extract_json_pointer(max_stride, config, "/indexer/scheduler/max_stride");
+  maybe_extract_json_pointer(interval_s, config, "/indexer/scheduler/interval_s");
+  if (!(wedge_degrees >= 0) || wedge_frames < 0) {
+    throw std::runtime_error("The config parameters \"/indexer/scheduler/wedge_degrees\" and "
+			     "\"/indexer/scheduler/wedge_frames\" must not be negative.");
+  }
+  if (!(utilization > 0 && utilization <= 1)) {
+    throw std::runtime_error("The config parameter \"/indexer/scheduler/utilization\" must be "
+			     "greater than 0 and at most 1.");
+  }
+  if (max_stride < 1) {
+    throw std::runtime_error("The config parameter \"/indexer/scheduler/max_stride\" must be "
+			     "at least 1.");
+  }
+}
+
+frame_scheduler::frame_scheduler(const frame_scheduler_options_t& options, size_t n_workers) :
+  m_options(options),
+  m_n_workers(std::max<size_t>(n_workers, 1)),
+  m_n_frames(-1),
+  m_wedge_size(options.wedge_frames),
+  m_stride(1),
+  m_interval_s(0),
+  m_have_arrival(false),
+  m_n_analyzed(0),
+  m_n_skipped(0),
+  m_busy_s(0) {}
+
+void frame_scheduler::begin_series(const frame_geometry_t& geometry) {
+  m_n_frames = geometry.n_frames;
+  const double increment = fabs(geometry.omega_increment);
+  if (isfinite(increment) && increment > 0) {
+    m_wedge_size = static_cast<int64_t>(ceil(m_options.wedge_degrees / increment));
+  } else {
+    m_wedge_size = m_options.wedge_frames;
+  }
+  // The pause between series is not an interval between frames.
+  m_have_arrival = false;
+}
+
+bool frame_scheduler::in_wedge(int64_t frame_id) const {
+  // Frame ids count from 1, so the wedges are [1, w], the w frames centred on the
+  // middle of the sweep, and [n - w + 1, n].
+  const int64_t w = m_wedge_size;
+  if (frame_id >= 1 && frame_id <= w) {
+    return true;
+  }
+  if (m_n_frames <= 0) {
+    return false;
+  }
+  const int64_t middle = (m_n_frames - w)/2 + 1;
+  return (frame_id >= middle && frame_id < middle + w) ||
+    (frame_id > m_n_frames - w && frame_id <= m_n_frames);
+}
+
+sampling_mode_t frame_scheduler::mode() const {
+  if (m_stride <= 1) {
+    return sampling_mode_t::all;
+  }
+  return (m_stride > m_options.max_stride) ? sampling_mode_t::wedges : sampling_mode_t::stride;
+}
+
+double frame_scheduler::incoming_rate() const {
+  return (m_interval_s > 0) ? 1.0 / m_interval_s : 0;
+}
+
+double frame_scheduler::capacity() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return (m_busy_s > 0) ? m_n_workers / m_busy_s : 0;
+}
+
+void frame_scheduler::completed(microseconds busy) {
+  const double s = busy.count() * 1e-6;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_busy_s = (m_busy_s > 0) ? smoothing*s + (1 - smoothing)*m_busy_s : s;
+}
+
+void frame_scheduler::update_stride(steady_clock::time_point now) {
+  if (now - m_last_update < duration<double>(m_options.interval_s)) {
+    return;
+  }
+  m_last_update = now;
+  const double incoming = incoming_rate(), available = capacity() * m_options.utilization;
+  if (incoming <= 0 || available <= 0) {
+    return; // keep the current stride until both rates have been measured
+  }
+  const double stride = ceil(incoming / available);
+  m_stride = static_cast<int64_t>(std::min<double>(stride, m_options.max_stride + 1));
+}
+
+frame_decision_t frame_scheduler::decide(int64_t frame_id, steady_clock::time_point now) {
+  if (m_have_arrival) {
+    const double dt = duration<double>(now - m_last_arrival).count();
+    m_interval_s = (m_interval_s > 0) ? smoothing*dt + (1 - smoothing)*m_interval_s : dt;
+  }
+  m_last_arrival = now;
+  m_have_arrival = true;
+  update_stride(now);
+
+  frame_decision_t decision;
+  decision.mode = mode();
+  decision.stride = m_stride;
+  decision.wedge = in_wedge(frame_id);
+  switch (decision.mode) {
+  case sampling_mode_t::all:
+    decision.analyze = true;
+    break;
+  case sampling_mode_t::stride:
+    decision.analyze = decision.wedge || (frame_id % m_stride == 0);
+    break;
+  case sampling_mode_t::wedges:
+    decision.analyze = decision.wedge;
+    break;
+  }
+  ++(decision.analyze ? m_n_analyzed : m_n_skipped);
+  return decision;
+}
@@ -0,0 +1,128 @@
+#ifndef BP_FRAME_SCHEDULER_H
+#define BP_FRAME_SCHEDULER_H
+
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+
+#include <simdjson.h>
+
+#include "frame_events.h"
+
+namespace bigpicture {
+  /**
+   * Which frames of a series are analyzed.
+   */
+  enum class sampling_mode_t : int {
+    all=0,    //!< every frame
+    stride=1, //!< every Nth frame, plus the wedges
+    wedges=2, //!< only the wedges
+  };
+
+  /// @return "all", "stride" or "wedges".
+  const char* sampling_mode_name(sampling_mode_t mode);
+
+  /**
+   * Reads the optional "/indexer/scheduler" section of a bigpicture config file:
+   *
+   *   "scheduler" : {
+   *     "wedge_degrees" : 5.0,  // of rotation at the start, middle and end of a sweep
+   *     "wedge_frames"  : 10,   // if the rotation increment is unknown
+   *     "utilization"   : 0.8,  // of the workers' capacity to plan for
+   *     "max_stride"    : 100,  // beyond which only the wedges are analyzed
+   *     "interval_s"    : 1.0   // between changes of stride
+   *   }
+   */
+  struct frame_scheduler_options_t {
+    frame_scheduler_options_t() noexcept :
+      wedge_degrees(5.0), wedge_frames(10), utilization(0.8), max_stride(100), interval_s(1.0) {}
+
+    /// \throws std::runtime_error if a parameter is out of range.
+    explicit frame_scheduler_options_t(const simdjson::dom::object& config);
+
+    double  wedge_degrees;
+    int64_t wedge_frames;
+    double  utilization;
+    int64_t max_stride;
+    double  interval_s;
+  };
+
+  /**
+   * The scheduler's choice for one frame, recorded alongside its results.
+   */
+  struct frame_decision_t {
+    frame_decision_t() noexcept :
+      analyze(true), wedge(false), mode(sampling_mode_t::all), stride(1) {}
+
+    bool            analyze;
+    bool            wedge;  //!< the frame lies in a wedge, which is always analyzed
+    sampling_mode_t mode;
+    int64_t         stride;
+  };
+
+  /**
+   * Chooses which frames to analyze so that analysis keeps up with the detector,
+   * rather than building a backlog of frames which will be stale by the time they
+   * are reached.
+   *
+   * The scheduler compares the rate at which frames arrive with the rate at which the
+   * workers can analyze them, measured from the time each frame took, and analyzes
+   * every Nth frame for the smallest N which fits. Regardless of the rate, wedges of
+   * frames at the start, middle and end of each sweep are always analyzed, since an
+   * indexing solution needs reflections from widely separated rotation angles. The
+   * stride changes at most once per interval, so it does not oscillate.
+   *
+   * decide() must be called from a single thread; completed() may be called from any.
+   */
+  class frame_scheduler {
+  public:
+    frame_scheduler(const frame_scheduler_options_t& options, size_t n_workers);
+
+    /**
+     * Starts a series, placing its wedges from the number of frames and the rotation
+     * increment. If the number of frames is unknown, only the first wedge is placed.
+     */
+    void begin_series(const frame_geometry_t& geometry);
+
+    /// Decides whether to analyze a frame, which arrived at time now.
+    frame_decision_t decide(int64_t frame_id, std::chrono::steady_clock::time_point now);
+
+    /// Records the time a worker took to analyze a frame.
+    void completed(std::chrono::microseconds busy);
+
+    /// @return Frames per second arriving from the detector, or 0 if unknown.
+    double incoming_rate() const;
+
+    /// @return Frames per second the workers can analyze, or 0 if unknown.
+    double capacity() const;
+
+    /// @return true if frame_id, counting from 1, lies in one of the current series' wedges.
+    bool in_wedge(int64_t frame_id) const;
+
+    int64_t         stride()      const { return m_stride; }
+    sampling_mode_t mode()        const;
+    int64_t         wedge_size()  const { return m_wedge_size; }
+    uint64_t        n_analyzed()  const { return m_n_analyzed; }
+    uint64_t        n_skipped()   const { return m_n_skipped; }
+
+  private:
+    frame_scheduler(const frame_scheduler&) = delete;
+    void update_stride(std::chrono::steady_clock::time_point now);
+
+    frame_scheduler_options_t m_options;
+    size_t                    m_n_workers;
+    int64_t                   m_n_frames;   //!< in the current series, -1 if unknown
+    int64_t                   m_wedge_size; //!< frames
+    int64_t                   m_stride;
+    double                    m_interval_s; //!< smoothed time between frames
+    std::chrono::steady_clock::time_point m_last_arrival;
+    std::chrono::steady_clock::time_point m_last_update;
+    bool                      m_have_arrival;
+    uint64_t                  m_n_analyzed;
+    uint64_t                  m_n_skipped;
+    mutable std::mutex        m_mutex;      //!< guards m_busy_s
+    double                    m_busy_s;     //!< smoothed time to analyze a frame
+  };
+}
+
+#endif // header guard
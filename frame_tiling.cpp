@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+
+#include <simdjson.h>
+
+#include "bigpicture_utils.h"
+#include "dectris_utils.h"
+#include "frame_tiling.h"
+
+using namespace bigpicture;
+
+// Rows per band when the frame does not fit the module layout.
+static constexpr size_t fallback_band_height = 64;
+
+static void extract_pair(size_t& first, size_t& second,
+			 const simdjson::dom::object& config, const char* jsp) {
+  simdjson::dom::array arr;
+  if (config.at_pointer(jsp).get(arr)) {
+    return; // optional parameter
+  }
+  int64_t a, b;
+  if (arr.size() != 2 || arr.at(0).get(a) || arr.at(1).get(b) || a < 0 || b < 0) {
+    std::stringstream ss;
+    ss << "The config parameter \"" << jsp << "\" must be an array of two "
+       << "non-negative integers, e.g. [1030, 514]." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+  first = static_cast<size_t>(a);
+  second = static_cast<size_t>(b);
+}
+
+module_layout_t::module_layout_t(const simdjson::dom::object& config) :
+  module_layout_t() {
+  extract_pair(module_width, module_height, config, "/detector/module_size");
+  extract_pair(gap_x, gap_y, config, "/detector/gap_size");
+
+  simdjson::dom::array arr;
+  if (config.at_pointer("/detector/modules").get(arr)) {
+    return;
+  }
+  for (auto element : arr) {
+    simdjson::dom::array rect;
+    int64_t v[4];
+    bool ok = !element.get(rect) && rect.size() == 4;
+    for (size_t i=0; ok && i < 4; ++i) {
+      ok = !rect.at(i).get(v[i]) && v[i] >= 0;
+    }
+    if (!ok || v[2] == 0 || v[3] == 0) {
+      throw std::runtime_error("Each entry of the config parameter \"/detector/modules\" "
+			       "must be an array of four non-negative integers, "
+			       "[x, y, width, height], with a nonzero width and height.");
+    }
+    modules.push_back(frame_tile_t{static_cast<size_t>(v[0]), static_cast<size_t>(v[1]),
+				   static_cast<size_t>(v[2]), static_cast<size_t>(v[3])});
+  }
+}
+
+/*
+  Returns the number of modules along one axis if the extent is an exact fit for
+  n modules separated by n-1 gaps, or 0 otherwise.
+*/
+static size_t modules_along_axis(size_t extent, size_t module_size, size_t gap) {
+  if (module_size == 0 || extent < module_size) {
+    return 0;
+  }
+  size_t n = (extent + gap) / (module_size + gap);
+  return (n*module_size + (n-1)*gap == extent) ? n : 0;
+}
+
+void frame_tiling::reset(size_t width, size_t height, const module_layout_t& layout) {
+  m_width = width;
+  m_height = height;
+  m_tiles.clear();
+
+  if (!layout.modules.empty()) {
+    for (const auto& m : layout.modules) {
+      if (m.x + m.width > width || m.y + m.height > height) {
+	std::stringstream ss;
+	ss << "Detector module [" << m.x << ", " << m.y << ", " << m.width << ", "
+	   << m.height << "] lies outside of the " << width << "x" << height
+	   << " frame. Please correct \"/detector/modules\" in the config file." << std::endl;
+	throw std::runtime_error(ss.str());
+      }
+    }
+    m_tiles = layout.modules;
+    m_modular = true;
+    return;
+  }
+
+  const size_t nx = modules_along_axis(width, layout.module_width, layout.gap_x);
+  const size_t ny = modules_along_axis(height, layout.module_height, layout.gap_y);
+  m_modular = (nx > 0 && ny > 0);
+  if (m_modular) {
+    m_tiles.reserve(nx*ny);
+    for (size_t j=0; j < ny; ++j) {
+      for (size_t i=0; i < nx; ++i) {
+	m_tiles.push_back(frame_tile_t{i*(layout.module_width + layout.gap_x),
+				       j*(layout.module_height + layout.gap_y),
+				       layout.module_width,
+				       layout.module_height});
+      }
+    }
+    return;
+  }
+
+  for (size_t y=0; y < height; y += fallback_band_height) {
+    m_tiles.push_back(frame_tile_t{0, y, width, std::min(fallback_band_height, height - y)});
+  }
+}
+
+size_t frame_tiling::n_tile_pixels() const {
+  size_t n = 0;
+  for (const auto& t : m_tiles) {
+    n += t.width * t.height;
+  }
+  return n;
+}
+
+frame_stats_t bigpicture::compute_frame_stats(const frame_tiling& tiling, const void* data,
+					      int64_t bit_depth, uint64_t count_cutoff) {
+  frame_stats_t result;
+  dispatch_pixel_type(bit_depth, [&](auto pixel) {
+    using T = decltype(pixel);
+    result = compute_frame_stats(tiling, static_cast<const T*>(data), count_cutoff);
+  });
+  return result;
+}
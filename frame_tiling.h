@@ -0,0 +1,247 @@
+#ifndef BP_FRAME_TILING_H
+#define BP_FRAME_TILING_H
+
+#include <limits>
+#include <stdexcept>
+#include <stdint.h>
+#include <sstream>
+#include <type_traits>
+#include <vector>
+
+#include <simdjson.h>
+
+#include "bigpicture_utils.h"
+#include "dectris_utils.h"
+
+namespace bigpicture {
+  /**
+   * Sentinel values for masked pixels. Dectris detectors mark gap pixels with the
+   * largest value representable at the image bit depth (-1 when read as a signed
+   * integer, as in a minicbf) and defective pixels with the value just below it (-2).
+   *
+   * @tparam T An unsigned integer pixel type, i.e. uint8_t, uint16_t, or uint32_t.
+   */
+  template<typename T> struct pixel_traits {
+    static_assert(std::is_unsigned<T>::value, "pixel types are unsigned integers");
+    static constexpr T gap = std::numeric_limits<T>::max(); //!< -1 when signed
+    static constexpr T bad = std::numeric_limits<T>::max() - 1; //!< -2 when signed
+    static constexpr bool is_masked(T value) { return value >= bad; }
+  };
+
+  /**
+   * Invokes f with a value-initialized pixel of the type matching bit_depth, such that
+   * a generic lambda can recover the pixel type via decltype.
+   *
+   * \throws std::runtime_error if bit_depth is not 8, 16, or 32.
+   */
+  template<typename F> inline
+  void dispatch_pixel_type(int64_t bit_depth, F&& f) {
+    switch (bit_depth) {
+    case 8:
+      f(uint8_t{});
+      break;
+    case 16:
+      f(uint16_t{});
+      break;
+    case 32:
+      f(uint32_t{});
+      break;
+    default:
+      std::stringstream ss;
+      ss << "Unsupported image bit depth: " << bit_depth << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+  }
+
+  /**
+   * A rectangular region of a frame in pixels, e.g. a single detector module.
+   */
+  struct frame_tile_t {
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+  };
+
+  /**
+   * The physical layout of detector modules within a frame. Modules are arranged in a
+   * regular grid and separated by gap rows/columns whose pixels are always masked.
+   *
+   * Defaults describe an EIGER/EIGER2 detector, e.g. a 16M is a 4x8 grid of 1030x514
+   * modules separated by 10-pixel horizontal and 37-pixel vertical gaps. A PILATUS uses
+   * 487x195 modules separated by 7 and 17-pixel gaps.
+   *
+   * An explicit module map may be given instead, for detectors whose modules are not
+   * regularly spaced or when using a region of interest.
+   */
+  struct module_layout_t {
+    module_layout_t() noexcept :
+      module_width(1030),
+      module_height(514),
+      gap_x(10),
+      gap_y(37) {
+    }
+
+    /**
+     * Reads the optional "/detector" section of a bigpicture config file:
+     *
+     *   "detector" : {
+     *     "module_size" : [1030, 514],
+     *     "gap_size"    : [10, 37],
+     *     "modules"     : [[x, y, width, height], ...]
+     *   }
+     *
+     * Missing parameters retain their defaults, and "modules" overrides the rest.
+     *
+     * \throws std::runtime_error if a parameter is present but ill-formed.
+     */
+    explicit module_layout_t(const simdjson::dom::object& config);
+
+    size_t module_width;  //!< pixels
+    size_t module_height; //!< pixels
+    size_t gap_x;         //!< pixels between horizontally adjacent modules
+    size_t gap_y;         //!< pixels between vertically adjacent modules
+    std::vector<frame_tile_t> modules; //!< explicit module map, empty if unused
+  };
+
+  /**
+   * Partitions a frame into independent tiles, one per detector module, such that
+   * per-pixel work can be split across threads with gap pixels skipped entirely.
+   *
+   * If the frame dimensions are not an exact fit for the module layout (e.g. an ROI
+   * mode the layout does not describe), the frame is instead split into full-width
+   * bands of rows, which still parallelizes but does not skip any pixels.
+   */
+  class frame_tiling {
+  public:
+    frame_tiling() noexcept : m_width(0), m_height(0), m_modular(false) {}
+
+    frame_tiling(const detector_config_t& config, const module_layout_t& layout) :
+      frame_tiling() {
+      reset(config, layout);
+    }
+
+    frame_tiling(size_t width, size_t height, const module_layout_t& layout) :
+      frame_tiling() {
+      reset(width, height, layout);
+    }
+
+    void reset(const detector_config_t& config, const module_layout_t& layout) {
+      reset(config.x_pixels_in_detector, config.y_pixels_in_detector, layout);
+    }
+    void reset(size_t width, size_t height, const module_layout_t& layout);
+
+    /// @return true if the tiles are detector modules, false if they are row bands.
+    bool   modular()   const { return m_modular; }
+    size_t width()     const { return m_width; }
+    size_t height()    const { return m_height; }
+    size_t n_tiles()   const { return m_tiles.size(); }
+    size_t n_pixels()  const { return m_width * m_height; }
+
+    /// @return The number of pixels covered by tiles, i.e. n_pixels() minus gaps.
+    size_t n_tile_pixels() const;
+
+    const std::vector<frame_tile_t>& tiles() const { return m_tiles; }
+    const frame_tile_t& tile(size_t i) const { return m_tiles[i]; }
+
+    /**
+     * Calls f(tile, tile_index) for every tile, with tiles processed in parallel.
+     * @note f must be safe to call concurrently for distinct tiles.
+     */
+    template<typename F> void for_each_tile(F&& f) const {
+      const int64_t n = static_cast<int64_t>(m_tiles.size());
+#pragma omp parallel for schedule(dynamic, 1)
+      for (int64_t i=0; i < n; ++i) {
+	f(m_tiles[i], static_cast<size_t>(i));
+      }
+    }
+
+    /**
+     * Calls f(row, x_begin, x_end, tile_index) for every row of every tile, such that
+     * [row*width() + x_begin, row*width() + x_end) is a contiguous run of pixels.
+     * Tiles are processed in parallel.
+     */
+    template<typename F> void for_each_tile_row(F&& f) const {
+      for_each_tile([&](const frame_tile_t& t, size_t i) {
+	for (size_t y=t.y; y < t.y + t.height; ++y) {
+	  f(y, t.x, t.x + t.width, i);
+	}
+      });
+    }
+
+  private:
+    size_t                    m_width;
+    size_t                    m_height;
+    bool                      m_modular;
+    std::vector<frame_tile_t> m_tiles;
+  };
+
+  /**
+   * Per-frame pixel statistics, excluding gap pixels between modules.
+   */
+  struct frame_stats_t {
+    frame_stats_t() noexcept :
+      sum(0), max(0), n_valid(0), n_masked(0), n_saturated(0) {}
+
+    frame_stats_t& operator+=(const frame_stats_t& rhs) noexcept {
+      sum         += rhs.sum;
+      max          = (rhs.max > max) ? rhs.max : max;
+      n_valid     += rhs.n_valid;
+      n_masked    += rhs.n_masked;
+      n_saturated += rhs.n_saturated;
+      return *this;
+    }
+
+    uint64_t sum;         //!< Total counts over unmasked pixels
+    uint64_t max;         //!< Largest unmasked pixel value
+    uint64_t n_valid;     //!< Unmasked pixels
+    uint64_t n_masked;    //!< Masked pixels within modules
+    uint64_t n_saturated; //!< Unmasked pixels at or above the count cutoff
+  };
+
+  /**
+   * Computes frame statistics in parallel, one tile per thread.
+   *
+   * @param data An uncompressed frame with the dimensions of tiling.
+   * @param count_cutoff Pixels with values at or above this value are "saturated",
+   *                     e.g. countrate_correction_count_cutoff from the detector config.
+   */
+  template<typename T>
+  frame_stats_t compute_frame_stats(const frame_tiling& tiling, const T* data,
+				    uint64_t count_cutoff) {
+    std::vector<frame_stats_t> partial(tiling.n_tiles());
+    const size_t width = tiling.width();
+    tiling.for_each_tile([&](const frame_tile_t& t, size_t i) {
+      uint64_t sum = 0, max = 0, n_masked = 0, n_saturated = 0;
+      for (size_t y=t.y; y < t.y + t.height; ++y) {
+	const T* row = data + y*width;
+	for (size_t x=t.x; x < t.x + t.width; ++x) {
+	  const T v = row[x];
+	  const bool masked = pixel_traits<T>::is_masked(v);
+	  const uint64_t value = masked ? 0 : v;
+	  sum += value;
+	  max = (value > max) ? value : max;
+	  n_masked += masked;
+	  n_saturated += (value >= count_cutoff);
+	}
+      }
+      partial[i].sum = sum;
+      partial[i].max = max;
+      partial[i].n_masked = n_masked;
+      partial[i].n_valid = t.width*t.height - n_masked;
+      partial[i].n_saturated = n_saturated;
+    });
+
+    frame_stats_t result;
+    for (const auto& p : partial) {
+      result += p;
+    }
+    return result;
+  }
+
+  /// Type-erased overload of compute_frame_stats() for use with the image bit depth.
+  frame_stats_t compute_frame_stats(const frame_tiling& tiling, const void* data,
+				    int64_t bit_depth, uint64_t count_cutoff);
+}
+
+#endif // header guard
@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "http_server.h"
+
+using namespace bigpicture;
+
+static constexpr size_t max_request_size = 8192;
+
+const char* bigpicture::http_reason(int status) {
+  switch (status) {
+  case 200: return "OK";
+  case 400: return "Bad Request";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 503: return "Service Unavailable";
+  default:  return (status >= 500) ? "Internal Server Error" : "Error";
+  }
+}
+
+static std::string percent_decode(std::string_view s) {
+  std::string out;
+  out.reserve(s.size());
+  for (size_t i=0; i < s.size(); ++i) {
+    if (s[i] == '%' && i + 2 < s.size() && isxdigit(static_cast<unsigned char>(s[i+1])) &&
+	isxdigit(static_cast<unsigned char>(s[i+2]))) {
+      out.push_back(static_cast<char>(std::stoi(std::string(s.substr(i+1, 2)), nullptr, 16)));
+      i += 2;
+    } else if (s[i] == '+') {
+      out.push_back(' ');
+    } else {
+      out.push_back(s[i]);
+    }
+  }
+  return out;
+}
+
+http_request_t bigpicture::parse_request_line(std::string_view line) {
+  size_t sp1 = line.find(' ');
+  size_t sp2 = (sp1 == std::string_view::npos) ? sp1 : line.find(' ', sp1 + 1);
+  if (sp2 == std::string_view::npos || line.substr(sp2 + 1, 5) != "HTTP/") {
+    throw std::runtime_error("Malformed HTTP request line.");
+  }
+
+  http_request_t request;
+  request.method = std::string(line.substr(0, sp1));
+  std::string_view target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+  size_t q = target.find('?');
+  request.path = percent_decode(target.substr(0, q));
+  if (q == std::string_view::npos) {
+    return request;
+  }
+
+  std::string_view query = target.substr(q + 1);
+  while (!query.empty()) {
+    size_t amp = query.find('&');
+    std::string_view pair = query.substr(0, amp);
+    size_t eq = pair.find('=');
+    std::string key = percent_decode(pair.substr(0, eq));
+    std::string value = (eq == std::string_view::npos) ? "" : percent_decode(pair.substr(eq + 1));
+    request.query[key] = value;
+    query = (amp == std::string_view::npos) ? std::string_view() : query.substr(amp + 1);
+  }
+  return request;
+}
+
+http_server::http_server(const std::string& socket_path, size_t n_threads,
+			 http_handler handler) :
+  m_socket_path(socket_path),
+  m_handler(std::move(handler)),
+  m_listen_fd(-1),
+  m_stop(false) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    std::stringstream ss;
+    ss << "The socket path \"" << socket_path << "\" is longer than "
+       << sizeof(addr.sun_path) - 1 << " characters." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+  strlcpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path));
+
+  // Listen non-blocking, since every thread polls the socket and only one of them
+  // wins each connection.
+  m_listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  unlink(socket_path.c_str()); // left behind if the previous process crashed
+  if (m_listen_fd < 0 ||
+      bind(m_listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      listen(m_listen_fd, 128) != 0) {
+    int err = errno;
+    if (m_listen_fd >= 0) close(m_listen_fd);
+    std::stringstream ss;
+    ss << "libc error: " << socket_path << " - " << strerror(err) << "\n";
+    throw std::system_error(err, std::system_category(), ss.str());
+  }
+
+  for (size_t i=0; i < std::max<size_t>(n_threads, 1); ++i) {
+    m_threads.emplace_back(&http_server::serve, this);
+  }
+}
+
+http_server::~http_server() noexcept {
+  stop();
+}
+
+void http_server::stop() noexcept {
+  m_stop = true;
+  for (auto& thread : m_threads) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+  if (m_listen_fd >= 0) {
+    close(m_listen_fd);
+    unlink(m_socket_path.c_str());
+    m_listen_fd = -1;
+  }
+}
+
+void http_server::serve() {
+  const int poll_ms = 250;
+  while (!m_stop) {
+    pollfd pfd = { m_listen_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, poll_ms) <= 0) {
+      continue;
+    }
+    int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      continue; // Another thread accepted the connection.
+    }
+    // Don't let a stalled client hold a thread indefinitely.
+    timeval timeout = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    handle(fd);
+    close(fd);
+  }
+}
+
+static bool send_all(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+void http_server::handle(int fd) {
+  char buf[max_request_size];
+  size_t len = 0;
+  std::string_view received;
+  while (len < sizeof(buf)) {
+    ssize_t n = recv(fd, buf + len, sizeof(buf) - len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    len += n;
+    received = std::string_view(buf, len);
+    if (received.find("\r\n\r\n") != std::string_view::npos) {
+      break;
+    }
+  }
+
+  http_request_t request;
+  http_response_t response;
+  try {
+    request = parse_request_line(received.substr(0, received.find("\r\n")));
+    if (request.method != "GET" && request.method != "HEAD") {
+      response.status = 405;
+      response.text = "Only GET and HEAD are supported.\n";
+    } else {
+      m_handler(request, response);
+    }
+  } catch (const std::exception& e) {
+    response = http_response_t();
+    response.status = request.method.empty() ? 400 : 500;
+    response.text = std::string(e.what()) + "\n";
+    if (response.status == 500) {
+      std::clog << "ERROR: " << request.path << ": " << e.what() << std::endl;
+    }
+  }
+
+  const std::string& body = response.body ? *response.body : response.text;
+  std::stringstream header;
+  header << "HTTP/1.1 " << response.status << " " << http_reason(response.status) << "\r\n"
+	 << "Content-Type: "
+	 << (response.content_type.empty() ? "text/plain" : response.content_type) << "\r\n"
+	 << "Content-Length: " << body.size() << "\r\n";
+  if (!response.cache_control.empty()) {
+    header << "Cache-Control: " << response.cache_control << "\r\n";
+  }
+  header << "Connection: close\r\n\r\n";
+  std::string head = header.str();
+  if (send_all(fd, head.data(), head.size()) && request.method != "HEAD") {
+    send_all(fd, body.data(), body.size());
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef BP_HTTP_SERVER_H
+#define BP_HTTP_SERVER_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace bigpicture {
+  /**
+   * A parsed HTTP request line. Headers other than the request line are ignored.
+   */
+  struct http_request_t {
+    std::string method; //!< e.g. "GET"
+    std::string path;   //!< percent-decoded, without the query string
+    std::unordered_map<std::string, std::string> query;
+
+    /// @return The value of a query parameter, or fallback if it is absent.
+    std::string_view param(const std::string& name, std::string_view fallback="") const {
+      auto it = query.find(name);
+      return (it == query.end()) ? fallback : std::string_view(it->second);
+    }
+  };
+
+  struct http_response_t {
+    http_response_t() noexcept : status(200) {}
+
+    int         status;
+    std::string content_type;
+    std::string cache_control;
+    std::string text; //!< the body, unless body is set
+    std::shared_ptr<const std::string> body; //!< a shared body, e.g. a cached image
+  };
+
+  using http_handler = std::function<void(const http_request_t&, http_response_t&)>;
+
+  /**
+   * A minimal HTTP/1.1 server on a Unix domain socket, to be exposed to browsers
+   * through a reverse proxy such as nginx.
+   *
+   * Each of n_threads threads accepts and serves one connection at a time, and every
+   * connection is closed after its response. This suits requests for images, which
+   * are few, large, and cacheable.
+   *
+   * Exceptions thrown by the handler are logged and answered with status 500.
+   */
+  class http_server {
+  public:
+    /// \throws std::system_error if the socket cannot be bound.
+    http_server(const std::string& socket_path, size_t n_threads, http_handler handler);
+    ~http_server() noexcept;
+
+    /// Stops accepting connections and joins all threads.
+    void stop() noexcept;
+
+    const std::string& socket_path() const { return m_socket_path; }
+
+  private:
+    http_server(const http_server&) = delete;
+
+    void serve();
+    void handle(int fd);
+
+    std::string              m_socket_path;
+    http_handler             m_handler;
+    int                      m_listen_fd;
+    std::atomic<bool>        m_stop;
+    std::vector<std::thread> m_threads;
+  };
+
+  /// @return The reason phrase of an HTTP status code, e.g. "Not Found".
+  const char* http_reason(int status);
+
+  /// @return A request parsed from its request line, e.g. "GET /a?b=c HTTP/1.1".
+  /// \throws std::runtime_error if the request line is malformed.
+  http_request_t parse_request_line(std::string_view line);
+}
+
+#endif // header guard
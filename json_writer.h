@@ -0,0 +1,143 @@
+#ifndef BP_JSON_WRITER_H
+#define BP_JSON_WRITER_H
+
+#include <charconv>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string_view>
+
+namespace bigpicture {
+  /**
+   * A minimal serializer which writes compact JSON into a caller-provided buffer.
+   *
+   * Used on hot paths (one record per frame) where std::stringstream is too slow.
+   * It never allocates; if the buffer is too small, the output is truncated and
+   * overflow() returns true.
+   *
+   * Non-finite floating point values are written as null, since JSON has no
+   * representation for them.
+   */
+  class json_writer {
+  public:
+    json_writer(char* buf, size_t capacity) noexcept :
+      m_buf(buf), m_cap(capacity), m_len(0), m_overflow(false), m_depth(0), m_first(1) {}
+
+    size_t      size()     const { return m_len; }
+    bool        overflow() const { return m_overflow; }
+    const char* data()     const { return m_buf; }
+    std::string_view view() const { return std::string_view(m_buf, m_len); }
+
+    void clear() noexcept {
+      m_len = 0;
+      m_overflow = false;
+      m_depth = 0;
+      m_first = 1;
+    }
+
+    json_writer& begin_object() { separate(); put('{'); push(); return *this; }
+    json_writer& end_object()   { pop(); put('}'); return *this; }
+    json_writer& begin_array()  { separate(); put('['); push(); return *this; }
+    json_writer& end_array()    { pop(); put(']'); return *this; }
+
+    /// Writes an object key; the next value written is its value.
+    json_writer& key(std::string_view name) {
+      separate();
+      put_string(name);
+      put(':');
+      m_first |= bit(); // the value must not be preceded by a comma
+      return *this;
+    }
+
+    json_writer& value(std::string_view v) { separate(); put_string(v); return *this; }
+    json_writer& value(const char* v)      { return value(std::string_view(v)); }
+    json_writer& value(bool v)             { separate(); put(v ? "true" : "false"); return *this; }
+    json_writer& value(int64_t v)          { separate(); put_integer(v); return *this; }
+    json_writer& value(uint64_t v)         { separate(); put_integer(v); return *this; }
+    json_writer& value(int v)              { return value(static_cast<int64_t>(v)); }
+    json_writer& value(double v) {
+      separate();
+      if (!isfinite(v)) {
+	put("null");
+	return *this;
+      }
+      char tmp[32];
+      int n = snprintf(tmp, sizeof(tmp), "%.9g", v);
+      put(std::string_view(tmp, n));
+      return *this;
+    }
+    json_writer& null() { separate(); put("null"); return *this; }
+
+    /// Shorthand for key(name).value(v)
+    template<typename T> json_writer& field(std::string_view name, const T& v) {
+      return key(name).value(v);
+    }
+
+  private:
+    uint64_t bit() const { return uint64_t(1) << (m_depth & 63); }
+    void push() { ++m_depth; m_first |= bit(); }
+    void pop()  { m_first &= ~bit(); --m_depth; }
+
+    void separate() {
+      if (m_first & bit()) {
+	m_first &= ~bit();
+      } else {
+	put(',');
+      }
+    }
+
+    void put(char c) {
+      if (m_len < m_cap) {
+	m_buf[m_len++] = c;
+      } else {
+	m_overflow = true;
+      }
+    }
+
+    void put(std::string_view s) {
+      size_t n = (s.size() <= m_cap - m_len) ? s.size() : (m_overflow = true, m_cap - m_len);
+      memcpy(m_buf + m_len, s.data(), n);
+      m_len += n;
+    }
+
+    template<typename T> void put_integer(T v) {
+      auto result = std::to_chars(m_buf + m_len, m_buf + m_cap, v);
+      if (result.ec != std::errc()) {
+	m_overflow = true;
+	return;
+      }
+      m_len = result.ptr - m_buf;
+    }
+
+    void put_string(std::string_view s) {
+      put('"');
+      for (char c : s) {
+	switch (c) {
+	case '"':  put("\\\""); break;
+	case '\\': put("\\\\"); break;
+	case '\n': put("\\n");  break;
+	case '\t': put("\\t");  break;
+	default:
+	  if (static_cast<unsigned char>(c) < 0x20) {
+	    char tmp[8];
+	    snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+	    put(std::string_view(tmp, 6));
+	  } else {
+	    put(c);
+	  }
+	}
+      }
+      put('"');
+    }
+
+    char*    m_buf;
+    size_t   m_cap;
+    size_t   m_len;
+    bool     m_overflow;
+    unsigned m_depth;
+    uint64_t m_first; //!< bit n is set if nothing has been written at depth n yet
+  };
+}
+
+#endif // header guard
@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+
+#include <simdjson.h>
+
+#include "bigpicture_utils.h"
+#include "frame_ring.h"
+#include "frame_tiling.h"
+#include "live_view.h"
+#include "preview.h"
+
+using namespace bigpicture;
+
+static constexpr const char* name_default       = "/bigpicture-live";
+static constexpr int64_t     n_frames_default   = 10;
+static constexpr int64_t     bin_factor_default = 4;
+static constexpr double      rate_hz_default    = 4.0;
+
+// Readers copy the newest image, so a few slots suffice.
+static constexpr size_t      n_slots            = 3;
+
+static std::chrono::steady_clock::duration interval_for(double rate_hz) {
+  if (rate_hz <= 0) {
+    return std::chrono::steady_clock::duration::zero();
+  }
+  return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    std::chrono::duration<double>(1.0 / rate_hz));
+}
+
+live_view::live_view(const std::string& name, size_t n_frames, size_t bin_factor,
+		     double rate_hz) :
+  m_name(name),
+  m_n_frames(n_frames),
+  m_bin_factor(bin_factor),
+  m_interval(interval_for(rate_hz)),
+  m_src_width(0),
+  m_src_height(0),
+  m_bit_depth(0),
+  m_width(0),
+  m_height(0),
+  m_next(0),
+  m_dirty(false) {
+  check_parameters();
+}
+
+live_view::live_view(const simdjson::dom::object& config) :
+  m_name(name_default),
+  m_n_frames(n_frames_default),
+  m_bin_factor(bin_factor_default),
+  m_interval(interval_for(rate_hz_default)),
+  m_src_width(0),
+  m_src_height(0),
+  m_bit_depth(0),
+  m_width(0),
+  m_height(0),
+  m_next(0),
+  m_dirty(false) {
+  int64_t tmp_int;
+  double tmp_double;
+
+  maybe_extract_json_pointer(m_name, config, "/archiver/live_view/name");
+  if (maybe_extract_json_pointer(tmp_int, config, "/archiver/live_view/frames")) {
+    m_n_frames = std::max<int64_t>(tmp_int, 0);
+  }
+  if (maybe_extract_json_pointer(tmp_int, config, "/archiver/live_view/bin_factor")) {
+    m_bin_factor = std::max<int64_t>(tmp_int, 0);
+  }
+  if (maybe_extract_json_pointer(tmp_double, config, "/archiver/live_view/rate_hz")) {
+    m_interval = interval_for(tmp_double);
+  }
+  check_parameters();
+}
+
+void live_view::check_parameters() const {
+  if (m_n_frames < 1 || m_n_frames > UINT16_MAX) {
+    std::stringstream ss;
+    ss << "The live view must sum between 1 and " << UINT16_MAX << " frames." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+  if (m_bin_factor < 1 || m_bin_factor > max_bin_factor) {
+    std::stringstream ss;
+    ss << "The live view bin factor must be between 1 and " << max_bin_factor << "."
+       << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+}
+
+void live_view::reset(int64_t series_id, size_t width, size_t height, int64_t bit_depth) {
+  m_src_width = width;
+  m_src_height = height;
+  m_bit_depth = bit_depth;
+  m_width = binned_size(width, m_bin_factor);
+  m_height = binned_size(height, m_bin_factor);
+
+  const size_t n_bins = m_width * m_height;
+  m_history.assign(m_n_frames * n_bins, 0);
+  m_next = 0;
+  m_binned.resize(n_bins);
+  m_sum.assign(n_bins, 0);
+  m_n_masked.assign(n_bins, 0);
+  m_image.resize(n_bins);
+  m_dirty = false;
+
+  m_meta = frame_meta_t();
+  m_meta.series_id = series_id;
+  m_meta.width = m_width;
+  m_meta.height = m_height;
+  m_meta.bit_depth = 32;
+
+  const size_t slot_size = n_bins * sizeof(uint32_t);
+  if (!m_ring || m_ring->slot_size() < slot_size) {
+    m_ring.reset(); // unlink the old segment first
+    m_ring.reset(new frame_ring_writer(m_name, n_slots, slot_size));
+  }
+}
+
+uint64_t live_view::memory_usage(size_t width, size_t height) const {
+  const uint64_t n_bins = binned_size(width, m_bin_factor) * binned_size(height, m_bin_factor);
+  // m_history holds m_n_frames binned frames, and m_binned and m_image one each.
+  return n_bins*((m_n_frames + 2)*sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint16_t));
+}
+
+void live_view::add(int64_t frame_id, const void* frame) {
+  bin_frame(frame, m_src_width, m_src_height, m_bit_depth, m_bin_factor,
+	    bin_mode_t::sum, m_binned.data());
+
+  // Replace the oldest frame in the window with the newest. Every masked bin was
+  // written as the gap sentinel by bin_frame(), and contributes nothing to the sum.
+  const int64_t n_bins = m_binned.size();
+  const uint32_t* binned = m_binned.data();
+  uint32_t* oldest = m_history.data() + m_next*n_bins;
+  uint64_t* sum = m_sum.data();
+  uint16_t* n_masked = m_n_masked.data();
+#pragma omp parallel for simd schedule(static)
+  for (int64_t i=0; i < n_bins; ++i) {
+    const bool masked_in = (binned[i] >= pixel_traits<uint32_t>::bad);
+    const bool masked_out = (oldest[i] >= pixel_traits<uint32_t>::bad);
+    sum[i] = sum[i] + (masked_in ? 0 : binned[i]) - (masked_out ? 0 : oldest[i]);
+    n_masked[i] = n_masked[i] + masked_in - masked_out;
+    oldest[i] = binned[i];
+  }
+  m_next = (m_next + 1) % m_n_frames;
+  m_meta.frame_id = frame_id;
+  m_dirty = true;
+
+  if (std::chrono::steady_clock::now() - m_last_publish >= m_interval) {
+    publish();
+  }
+}
+
+void live_view::publish() {
+  if (!m_ring || !m_dirty) {
+    return;
+  }
+  const int64_t n_bins = m_image.size();
+  const uint64_t* sum = m_sum.data();
+  const uint16_t* n_masked = m_n_masked.data();
+  uint32_t* image = m_image.data();
+  constexpr uint64_t max_count = pixel_traits<uint32_t>::bad - 1;
+#pragma omp parallel for simd schedule(static)
+  for (int64_t i=0; i < n_bins; ++i) {
+    image[i] = n_masked[i] ? pixel_traits<uint32_t>::gap : std::min(sum[i], max_count);
+  }
+  m_ring->publish(m_meta, image, n_bins * sizeof(uint32_t));
+  m_last_publish = std::chrono::steady_clock::now();
+  m_dirty = false;
+}
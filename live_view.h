@@ -0,0 +1,108 @@
+#ifndef BP_LIVE_VIEW_H
+#define BP_LIVE_VIEW_H
+
+#include <chrono>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <simdjson.h>
+
+#include "frame_ring.h"
+
+namespace bigpicture {
+  /**
+   * Maintains the sum of the latest N frames of a series, binned down for display, and
+   * publishes it to a shared-memory frame_ring at a throttled rate, e.g. so that
+   * bpcompressd can serve a live view for crystal centering while a series is running.
+   *
+   * The sum slides with each frame: the binned frame is added and the binned frame
+   * which leaves the window is subtracted, so the cost per frame does not depend on N.
+   * A bin is masked in the published image while any frame in the window masks it.
+   *
+   * Publishing uses the frame ring's sequence locks, so the archiver never waits for
+   * a reader. Each published image is a decoded 32-bit frame whose frame_id is the
+   * newest frame in the window, and masked bins are pixel_traits<uint32_t>::gap.
+   */
+  class live_view {
+  public:
+    /**
+     * @param name A POSIX shared-memory object name, e.g. "/bigpicture-live".
+     * @param n_frames Frames in the sliding window.
+     * @param bin_factor Binning of each frame, between 1 and max_bin_factor.
+     * @param rate_hz The most images published per second, or 0 to publish every frame.
+     * \throws std::runtime_error if n_frames or bin_factor is out of range.
+     */
+    live_view(const std::string& name, size_t n_frames, size_t bin_factor, double rate_hz);
+
+    /**
+     * Reads the "/archiver/live_view" section of a bigpicture config file:
+     *
+     *   "live_view" : {
+     *     "name"       : "/bigpicture-live",
+     *     "frames"     : 10,
+     *     "bin_factor" : 4,
+     *     "rate_hz"    : 4.0
+     *   }
+     */
+    explicit live_view(const simdjson::dom::object& config);
+
+    /**
+     * Empties the window and sizes it for a new series. The shared-memory ring is
+     * (re)created only if its slots are too small for the binned frames.
+     */
+    void reset(int64_t series_id, size_t width, size_t height, int64_t bit_depth);
+
+    /**
+     * Slides the window onto an uncompressed frame, and publishes the sum if at least
+     * 1/rate_hz seconds have passed since it was last published.
+     */
+    void add(int64_t frame_id, const void* frame);
+
+    /// Publishes the current sum regardless of the rate limit, e.g. at the end of a series.
+    void publish();
+
+    const std::string& name()       const { return m_name; }
+    size_t             n_frames()   const { return m_n_frames; }
+    size_t             bin_factor() const { return m_bin_factor; }
+    size_t             width()      const { return m_width; }  //!< binned
+    size_t             height()     const { return m_height; } //!< binned
+    uint64_t           n_published() const { return m_ring ? m_ring->n_published() : 0; }
+
+    /// @return The bytes held by the window, not counting the shared-memory ring.
+    uint64_t memory_usage() const {
+      return (m_history.size() + m_binned.size() + m_image.size())*sizeof(uint32_t) +
+	m_sum.size()*sizeof(uint64_t) + m_n_masked.size()*sizeof(uint16_t);
+    }
+
+    /// @return The bytes the window would hold after reset() for frames of width x height.
+    uint64_t memory_usage(size_t width, size_t height) const;
+
+  private:
+    live_view(const live_view&) = delete;
+    void check_parameters() const;
+
+    std::string           m_name;
+    size_t                m_n_frames;
+    size_t                m_bin_factor;
+    std::chrono::steady_clock::duration m_interval;
+    std::unique_ptr<frame_ring_writer> m_ring;
+    frame_meta_t          m_meta;       //!< of the published image
+    size_t                m_src_width;
+    size_t                m_src_height;
+    int64_t               m_bit_depth;
+    size_t                m_width;
+    size_t                m_height;
+    std::vector<uint32_t> m_history;    //!< the binned frames in the window
+    size_t                m_next;       //!< index in m_history of the oldest frame
+    std::vector<uint32_t> m_binned;     //!< the newest binned frame
+    std::vector<uint64_t> m_sum;
+    std::vector<uint16_t> m_n_masked;   //!< frames in the window masking each bin
+    std::vector<uint32_t> m_image;      //!< the published image
+    bool                  m_dirty;      //!< frames were added since the last publish
+    std::chrono::steady_clock::time_point m_last_publish;
+  };
+}
+
+#endif // header guard
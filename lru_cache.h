@@ -0,0 +1,246 @@
+#ifndef BP_LRU_CACHE_H
+#define BP_LRU_CACHE_H
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <utility>
+
+#include "memory_budget.h"
+
+namespace bigpicture {
+  /**
+   * A thread-safe, size-bounded cache which evicts the least recently used entries.
+   *
+   * Values are held by shared_ptr, so an entry evicted while a caller is still using
+   * it stays alive until the caller is done with it. Each entry has a cost, typically
+   * its size in bytes, and the total cost of the cache never exceeds its capacity.
+   *
+   * A cache may also draw its entries' costs from a memory budget shared with the rest
+   * of the process, in which case it caches less while the budget is exhausted and
+   * evicts entries when the budget reclaims memory for frames in flight.
+   *
+   * @tparam K A hashable key type.
+   * @tparam V The value type.
+   */
+  template<typename K, typename V, typename Hash = std::hash<K>> class lru_cache {
+  public:
+    /// @param budget Optional, must outlive the cache.
+    explicit lru_cache(uint64_t capacity, memory_budget* budget=nullptr) :
+      m_budget(budget), m_capacity(capacity), m_cost(0), m_n_hits(0), m_n_misses(0),
+      m_n_coalesced(0), m_reclaimer(0) {
+      if (m_budget) {
+	m_reclaimer = m_budget->add_reclaimer([this](uint64_t n) { return evict(n); });
+      }
+    }
+
+    ~lru_cache() noexcept {
+      if (m_budget) {
+	m_budget->remove_reclaimer(m_reclaimer);
+	m_budget->release(m_cost);
+      }
+    }
+
+    /// @return The cached value, or nullptr if it is not cached.
+    std::shared_ptr<const V> get(const K& key) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_index.find(key);
+      if (it == m_index.end()) {
+	++m_n_misses;
+	return nullptr;
+      }
+      ++m_n_hits;
+      m_entries.splice(m_entries.begin(), m_entries, it->second);
+      return it->second->value;
+    }
+
+    /**
+     * Caches a value, replacing any value cached with the same key. A value costing
+     * more than the capacity of the cache, or than the budget can spare after evicting
+     * every other entry, is not cached.
+     */
+    void put(const K& key, std::shared_ptr<const V> value, uint64_t cost) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_index.find(key);
+      if (it != m_index.end()) {
+	release(it->second->cost);
+	m_entries.erase(it->second);
+	m_index.erase(it);
+      }
+      if (cost > m_capacity) {
+	return;
+      }
+      while (m_cost + cost > m_capacity) {
+	pop_lru();
+      }
+      while (m_budget && !m_budget->try_reserve(cost)) {
+	if (m_entries.empty()) {
+	  return;
+	}
+	pop_lru();
+      }
+      m_entries.push_front(entry_t{ key, std::move(value), cost });
+      m_index.emplace(key, m_entries.begin());
+      m_cost += cost;
+    }
+
+    /**
+     * Updates the cost of a cached entry whose value grew or shrank in place, e.g. a
+     * value which caches results of its own. Other entries are evicted to make room for
+     * growth, and an entry which no longer fits is evicted itself.
+     */
+    void update_cost(const K& key, uint64_t cost) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_index.find(key);
+      if (it == m_index.end()) {
+	return;
+      }
+      entry_t& entry = *it->second;
+      if (cost <= entry.cost) {
+	release(entry.cost - cost);
+	entry.cost = cost;
+	return;
+      }
+      const uint64_t growth = cost - entry.cost;
+      m_entries.splice(m_entries.begin(), m_entries, it->second);
+      while (m_cost + growth > m_capacity ||
+	     (m_budget && !m_budget->try_reserve(growth))) {
+	const bool last = (m_entries.size() == 1);
+	pop_lru();
+	if (last) {
+	  return;
+	}
+      }
+      entry.cost = cost;
+      m_cost += growth;
+    }
+
+    /**
+     * Returns the cached value, or computes and caches it. Concurrent calls for the
+     * same key are coalesced: only the first computes the value, and the others wait
+     * for it, or for its exception to be rethrown.
+     *
+     * @param compute A callable with the signature
+     *                std::shared_ptr<const V>(uint64_t& cost).
+     */
+    template<typename F>
+    std::shared_ptr<const V> get_or_compute(const K& key, F&& compute) {
+      std::promise<std::shared_ptr<const V>> promise;
+      std::shared_future<std::shared_ptr<const V>> pending;
+      {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_index.find(key);
+	if (it != m_index.end()) {
+	  ++m_n_hits;
+	  m_entries.splice(m_entries.begin(), m_entries, it->second);
+	  return it->second->value;
+	}
+	++m_n_misses;
+	auto p = m_pending.find(key);
+	if (p != m_pending.end()) {
+	  pending = p->second;
+	} else {
+	  m_pending.emplace(key, promise.get_future().share());
+	}
+      }
+      if (pending.valid()) {
+	++m_n_coalesced;
+	return pending.get();
+      }
+
+      try {
+	uint64_t cost = 0;
+	std::shared_ptr<const V> value = compute(cost);
+	put(key, value, cost);
+	promise.set_value(value);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_pending.erase(key);
+	return value;
+      } catch (...) {
+	promise.set_exception(std::current_exception());
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_pending.erase(key);
+	throw;
+      }
+    }
+
+    void clear() {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_entries.clear();
+      m_index.clear();
+      release(m_cost);
+    }
+
+    /**
+     * Evicts least recently used entries until their costs add up to at least n, or
+     * the cache is empty.
+     * @return The total cost of the entries evicted.
+     */
+    uint64_t evict(uint64_t n) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      uint64_t evicted = 0;
+      while (evicted < n && !m_entries.empty()) {
+	evicted += m_entries.back().cost;
+	pop_lru();
+      }
+      return evicted;
+    }
+
+    size_t size() const {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_entries.size();
+    }
+
+    uint64_t cost()     const { std::lock_guard<std::mutex> lock(m_mutex); return m_cost; }
+    uint64_t capacity() const { return m_capacity; }
+    uint64_t n_hits()   const { std::lock_guard<std::mutex> lock(m_mutex); return m_n_hits; }
+    uint64_t n_misses() const { std::lock_guard<std::mutex> lock(m_mutex); return m_n_misses; }
+
+    /// @return The number of misses which waited for another caller's computation.
+    uint64_t n_coalesced() const { return m_n_coalesced; }
+
+  private:
+    lru_cache(const lru_cache&) = delete;
+
+    struct entry_t {
+      K                        key;
+      std::shared_ptr<const V> value;
+      uint64_t                 cost;
+    };
+    using list_t = std::list<entry_t>;
+
+    // Both are called with the mutex held.
+    void release(uint64_t cost) noexcept {
+      m_cost -= cost;
+      if (m_budget) {
+	m_budget->release(cost);
+      }
+    }
+
+    void pop_lru() noexcept {
+      const entry_t& lru = m_entries.back();
+      release(lru.cost);
+      m_index.erase(lru.key);
+      m_entries.pop_back();
+    }
+
+    memory_budget*                                            m_budget;
+    mutable std::mutex                                        m_mutex;
+    list_t                                                    m_entries; //!< most recent first
+    std::unordered_map<K, typename list_t::iterator, Hash>    m_index;
+    std::unordered_map<K, std::shared_future<std::shared_ptr<const V>>, Hash> m_pending;
+    uint64_t                                                  m_capacity;
+    uint64_t                                                  m_cost;
+    uint64_t                                                  m_n_hits;
+    uint64_t                                                  m_n_misses;
+    std::atomic<uint64_t>                                     m_n_coalesced;
+    uint64_t                                                  m_reclaimer; //!< id in m_budget
+  };
+}
+
+#endif // header guard
@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+
+#include <simdjson.h>
+
+#include "bigpicture_utils.h"
+#include "memory_budget.h"
+#include "metrics.h"
+
+using namespace bigpicture;
+
+memory_budget::memory_budget(uint64_t limit) :
+  m_high_water(0),
+  m_in_use(0),
+  m_limit(limit),
+  m_n_waits(0),
+  m_next_reclaimer(0) {
+}
+
+memory_budget::memory_budget(const simdjson::dom::object& config, const std::string& section) :
+  memory_budget() {
+  const std::string json_pointer = "/" + section + "/memory_budget_mb";
+  int64_t tmp_int;
+  if (maybe_extract_json_pointer(tmp_int, config, json_pointer.c_str()) && tmp_int > 0) {
+    m_limit = uint64_t(tmp_int) << 20;
+  }
+}
+
+bool memory_budget::try_reserve(uint64_t n) noexcept {
+  uint64_t in_use = m_in_use.load(std::memory_order_relaxed);
+  do {
+    if (m_limit && (in_use + n > m_limit || in_use + n < in_use)) {
+      return false;
+    }
+  } while (!m_in_use.compare_exchange_weak(in_use, in_use + n, std::memory_order_relaxed));
+  update_high_water(in_use + n);
+  return true;
+}
+
+void memory_budget::reserve(uint64_t n) {
+  const uint64_t in_use = m_in_use.fetch_add(n, std::memory_order_relaxed) + n;
+  if (m_limit && in_use > m_limit) {
+    // Caches give way to frames in flight. Reclaimers release what they free, so the
+    // reservation above is counted only once.
+    uint64_t excess = in_use - m_limit;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& reclaimer : m_reclaimers) {
+      uint64_t released = reclaimer.second(excess);
+      excess -= std::min(released, excess);
+      if (!excess) {
+	break;
+      }
+    }
+  }
+  update_high_water(in_use);
+}
+
+void memory_budget::release(uint64_t n) noexcept {
+  const uint64_t in_use = m_in_use.fetch_sub(n, std::memory_order_relaxed) - n;
+  m_metric_in_use.set(m_in_use.load(std::memory_order_relaxed));
+  if (m_limit && in_use + n > m_limit) {
+    // A waiter which misses this wakes up at its timeout instead.
+    m_available.notify_all();
+  }
+}
+
+uint64_t memory_budget::add_reclaimer(reclaimer_t f) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_reclaimers.emplace_back(m_next_reclaimer, std::move(f));
+  return m_next_reclaimer++;
+}
+
+void memory_budget::remove_reclaimer(uint64_t id) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto it = m_reclaimers.begin(); it != m_reclaimers.end(); ++it) {
+    if (it->first == id) {
+      m_reclaimers.erase(it);
+      return;
+    }
+  }
+}
+
+bool memory_budget::wait_until_available(std::chrono::milliseconds timeout) {
+  if (!overdrawn()) {
+    return true;
+  }
+  m_n_waits.fetch_add(1, std::memory_order_relaxed);
+  m_metric_waits.add();
+  std::unique_lock<std::mutex> lock(m_mutex);
+  return m_available.wait_for(lock, timeout, [this]() { return !overdrawn(); });
+}
+
+void memory_budget::publish(metrics_writer& writer) {
+  writer.counter("memory_limit").set(m_limit);
+  m_metric_in_use = writer.counter("memory_in_use");
+  m_metric_high_water = writer.counter("memory_high_water");
+  m_metric_waits = writer.counter("memory_waits");
+  m_metric_in_use.set(in_use());
+  m_metric_high_water.set(high_water());
+  m_metric_waits.set(n_waits());
+}
+
+uint64_t memory_budget::available() const noexcept {
+  if (!m_limit) {
+    return UINT64_MAX;
+  }
+  const uint64_t in_use = m_in_use.load(std::memory_order_relaxed);
+  return in_use < m_limit ? m_limit - in_use : 0;
+}
+
+void memory_budget::update_high_water(uint64_t in_use) noexcept {
+  m_metric_in_use.set(m_in_use.load(std::memory_order_relaxed));
+  uint64_t high_water = m_high_water.load(std::memory_order_relaxed);
+  while (in_use > high_water &&
+	 !m_high_water.compare_exchange_weak(high_water, in_use, std::memory_order_relaxed)) {
+  }
+  if (in_use > high_water) {
+    m_metric_high_water.set(in_use);
+  }
+}
@@ -0,0 +1,163 @@
+#ifndef BP_MEMORY_BUDGET_H
+#define BP_MEMORY_BUDGET_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <simdjson.h>
+
+#include "metrics.h"
+
+namespace bigpicture {
+  /**
+   * A process-wide budget of memory, which frame buffers, queues and caches draw from,
+   * so that a stall downstream, e.g. of an NFS server, makes a daemon stop receiving
+   * rather than grow until it is killed.
+   *
+   * Memory is drawn in one of two ways. Caches call try_reserve(), and cache less when
+   * it fails. Frames in flight call reserve(), which always succeeds, since the frame
+   * is already on its way; if the budget is overdrawn, the reclaimers, i.e. the caches,
+   * are asked to give memory back first. A receive loop which finds the budget still
+   * overdrawn waits for frames in flight to be released before receiving more, and so
+   * lets the sender's ZMQ high-water mark push back.
+   *
+   * Usage is tracked even without a limit, so that the high-water mark shows how much
+   * memory a daemon needs.
+   */
+  class memory_budget {
+  public:
+    using reclaimer_t = std::function<uint64_t(uint64_t)>;
+
+    /// @param limit Bytes, or 0 for no limit.
+    explicit memory_budget(uint64_t limit=0);
+
+    /**
+     * Reads the optional "/<section>/memory_budget_mb" parameter of a bigpicture config
+     * file, e.g. "/archiver/memory_budget_mb". The default is 0, i.e. no limit.
+     */
+    memory_budget(const simdjson::dom::object& config, const std::string& section);
+
+    /// @return false, reserving nothing, if n more bytes would exceed the limit.
+    bool try_reserve(uint64_t n) noexcept;
+
+    /// Reserves n bytes, asking the reclaimers for whatever would exceed the limit.
+    void reserve(uint64_t n);
+
+    void release(uint64_t n) noexcept;
+
+    /**
+     * Registers a function which frees up to the given number of bytes of memory drawn
+     * from this budget, releasing them, and returns how many it released.
+     * @note A reclaimer must not reserve memory, since it is called by reserve().
+     * @return An id for remove_reclaimer().
+     */
+    uint64_t add_reclaimer(reclaimer_t f);
+    void     remove_reclaimer(uint64_t id);
+
+    /**
+     * Waits until the budget is no longer overdrawn.
+     * @return false if it still is after the timeout.
+     */
+    bool wait_until_available(std::chrono::milliseconds timeout);
+
+    /**
+     * Publishes "memory_limit", "memory_in_use", "memory_high_water" and "memory_waits",
+     * the number of times wait_until_available() had to wait.
+     * @note Call this before any other thread draws from the budget.
+     */
+    void publish(metrics_writer& writer);
+
+    /// @return true if more memory is in use than the limit allows.
+    bool overdrawn() const noexcept {
+      return m_limit && m_in_use.load(std::memory_order_relaxed) > m_limit;
+    }
+
+    /// @return The bytes which may still be reserved, UINT64_MAX without a limit.
+    uint64_t available() const noexcept;
+
+    uint64_t limit()      const noexcept { return m_limit; }
+    uint64_t in_use()     const noexcept { return m_in_use.load(std::memory_order_relaxed); }
+    uint64_t high_water() const noexcept { return m_high_water.load(std::memory_order_relaxed); }
+    uint64_t n_waits()    const noexcept { return m_n_waits.load(std::memory_order_relaxed); }
+
+  private:
+    memory_budget(const memory_budget&) = delete;
+    void update_high_water(uint64_t in_use) noexcept;
+
+    std::condition_variable   m_available;
+    std::atomic<uint64_t>     m_high_water;
+    std::atomic<uint64_t>     m_in_use;
+    uint64_t                  m_limit;
+    metrics_counter           m_metric_high_water;
+    metrics_counter           m_metric_in_use;
+    metrics_counter           m_metric_waits;
+    std::mutex                m_mutex;           //!< guards the reclaimers, and waits
+    std::atomic<uint64_t>     m_n_waits;
+    uint64_t                  m_next_reclaimer;
+    std::vector<std::pair<uint64_t, reclaimer_t>> m_reclaimers;
+  };
+
+  /**
+   * Memory drawn from a budget for as long as the reservation lives, e.g. for the
+   * frame a worker is processing. Without a budget, a reservation does nothing.
+   */
+  class memory_reservation {
+  public:
+    memory_reservation() noexcept : m_budget(nullptr), m_size(0) {}
+    explicit memory_reservation(memory_budget* budget) noexcept : m_budget(budget), m_size(0) {}
+    memory_reservation(memory_reservation&& src) noexcept :
+      m_budget(src.m_budget), m_size(std::exchange(src.m_size, 0)) {}
+    ~memory_reservation() noexcept { resize(0); }
+
+    memory_reservation& operator=(memory_reservation&& src) noexcept {
+      if (this != &src) {
+	resize(0);
+	m_budget = src.m_budget;
+	m_size = std::exchange(src.m_size, 0);
+      }
+      return *this;
+    }
+
+    /// Grows or shrinks the reservation, see memory_budget::reserve().
+    void resize(uint64_t size) {
+      if (m_budget && size > m_size) {
+	m_budget->reserve(size - m_size);
+      } else if (m_budget && size < m_size) {
+	m_budget->release(m_size - size);
+      }
+      m_size = size;
+    }
+
+    /**
+     * Grows or shrinks the reservation, see memory_budget::try_reserve().
+     * @return false, leaving the reservation as it is, if the budget is exhausted.
+     */
+    bool try_resize(uint64_t size) noexcept {
+      if (m_budget && size > m_size && !m_budget->try_reserve(size - m_size)) {
+	return false;
+      }
+      if (m_budget && size < m_size) {
+	m_budget->release(m_size - size);
+      }
+      m_size = size;
+      return true;
+    }
+
+    uint64_t size() const noexcept { return m_size; }
+
+  private:
+    memory_reservation(const memory_reservation&) = delete;
+
+    memory_budget* m_budget;
+    uint64_t       m_size;
+  };
+}
+
+#endif // header guard
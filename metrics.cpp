@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <math.h>
+#include <mutex>
+#include <new>
+#include <sched.h>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+#include <simdjson.h>
+
+#include "bigpicture_utils.h"
+#include "metrics.h"
+
+using namespace bigpicture;
+
+/*
+  Shared-memory layout:
+
+    [header][counter 0]...[counter 31][histogram 0]...[histogram 7]
+
+  The segment has a fixed size, so a reader maps all of it up front. Entries are
+  appended, and never removed, while the daemon runs.
+*/
+static constexpr uint32_t metrics_magic   = 0x42504d54; // "BPMT"
+static constexpr uint32_t metrics_version = 1;
+static constexpr size_t   cache_line      = 64;
+
+static constexpr const char* prefix_default = "/bigpicture-metrics-";
+
+/*
+  Layout sequence lock: while an entry is being registered the lock is odd. A reader
+  accepts a copy of the name table if and only if the lock reads the same even value
+  before and after copying it.
+*/
+struct alignas(cache_line) metrics_header_t {
+  uint32_t              magic;
+  uint32_t              version;
+  int64_t               pid;
+  int64_t               started_ms;
+  std::atomic<uint64_t> lock;
+  uint32_t              n_counters;
+  uint32_t              n_histograms;
+};
+
+struct counter_slot_t {
+  char                 name[metrics_name_size];
+  std::atomic<int64_t> value;
+};
+
+struct histogram_slot_t {
+  char                  name[metrics_name_size];
+  std::atomic<uint64_t> values[2 + metrics_n_buckets]; //!< count, sum, then the buckets
+};
+
+struct bigpicture::metrics_segment_t {
+  metrics_header_t header;
+  counter_slot_t   counters[metrics_max_counters];
+  histogram_slot_t histograms[metrics_max_histograms];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+	      "metrics require lock-free 64-bit atomics");
+
+std::atomic<int64_t>  metrics_counter::m_sink(0);
+std::atomic<uint64_t> metrics_histogram::m_sink[2 + metrics_n_buckets];
+
+static void throw_errno(const std::string& what, const std::string& name) {
+  int err = errno;
+  std::stringstream ss;
+  ss << "libc error: " << what << " " << name << " - " << strerror(err) << "\n";
+  throw std::system_error(err, std::system_category(), ss.str());
+}
+
+static void init_header(metrics_header_t& header) {
+  header.magic = metrics_magic;
+  header.version = metrics_version;
+  header.pid = getpid();
+  header.started_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+  header.lock.store(0, std::memory_order_release);
+}
+
+uint64_t metrics_histogram_t::quantile(double q) const noexcept {
+  if (count == 0) {
+    return 0;
+  }
+  const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(ceil(q * count)));
+  uint64_t seen = 0;
+  for (size_t b=0; b < metrics_n_buckets; ++b) {
+    seen += buckets[b];
+    if (seen >= rank) {
+      return (b == 0) ? 0 : (uint64_t(1) << b) - 1;
+    }
+  }
+  return (uint64_t(1) << (metrics_n_buckets - 1)) - 1;
+}
+
+int64_t metrics_snapshot_t::value(std::string_view name, int64_t missing) const noexcept {
+  for (const auto& counter : counters) {
+    if (counter.first == name) {
+      return counter.second;
+    }
+  }
+  return missing;
+}
+
+const metrics_histogram_t* metrics_snapshot_t::histogram(std::string_view name) const noexcept {
+  for (const auto& h : histograms) {
+    if (h.name == name) {
+      return &h;
+    }
+  }
+  return nullptr;
+}
+
+std::string bigpicture::metrics_name(const simdjson::dom::object& config,
+				     const std::string& daemon) {
+  std::string prefix(prefix_default);
+  maybe_extract_json_pointer(prefix, config, "/metrics/prefix");
+  return prefix + daemon;
+}
+
+metrics_writer::metrics_writer() : m_segment(new metrics_segment_t()) {
+  init_header(m_segment->header);
+}
+
+metrics_writer::metrics_writer(const std::string& name) : m_segment(nullptr) {
+  open(name);
+}
+
+metrics_writer::metrics_writer(const simdjson::dom::object& config, const std::string& daemon) :
+  m_segment(nullptr) {
+  simdjson::dom::object metrics_config;
+  if (config.at_pointer("/metrics").get(metrics_config)) {
+    m_segment = new metrics_segment_t();
+    init_header(m_segment->header);
+    return;
+  }
+  open(metrics_name(config, daemon));
+}
+
+void metrics_writer::open(const std::string& name) {
+  // Replace any segment left behind by a previous instance of the daemon.
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT|O_EXCL|O_RDWR, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (fd < 0) {
+    throw_errno("shm_open()", name);
+  }
+  if (ftruncate(fd, sizeof(metrics_segment_t)) != 0) {
+    close(fd);
+    shm_unlink(name.c_str());
+    throw_errno("ftruncate()", name);
+  }
+  void* map = mmap(nullptr, sizeof(metrics_segment_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    throw_errno("mmap()", name);
+  }
+
+  // The segment is zero-filled, so every counter and histogram starts at 0.
+  m_segment = new (map) metrics_segment_t;
+  init_header(m_segment->header);
+  m_name = name;
+  std::clog << "INFO: publishing metrics to shared memory " << m_name << std::endl;
+}
+
+metrics_writer::~metrics_writer() noexcept {
+  if (m_name.empty()) {
+    delete m_segment;
+  } else {
+    munmap(m_segment, sizeof(metrics_segment_t));
+    shm_unlink(m_name.c_str());
+  }
+}
+
+/*
+  Finds or appends an entry under the layout lock. Entries are found by name, so that
+  independent components of a daemon may share a counter.
+*/
+template<typename Slot>
+static Slot& register_slot(metrics_header_t& header, Slot* slots, uint32_t& n_slots,
+			   size_t max_slots, std::string_view name) {
+  if (name.empty() || name.size() >= metrics_name_size) {
+    std::stringstream ss;
+    ss << "The metric name \"" << name << "\" must be from 1 to " << metrics_name_size - 1
+       << " characters long.";
+    throw std::runtime_error(ss.str());
+  }
+  for (uint32_t i=0; i < n_slots; ++i) {
+    if (name == slots[i].name) {
+      return slots[i];
+    }
+  }
+  if (n_slots >= max_slots) {
+    std::stringstream ss;
+    ss << "Too many metrics to register \"" << name << "\".";
+    throw std::runtime_error(ss.str());
+  }
+
+  const uint64_t seq = header.lock.load(std::memory_order_relaxed);
+  header.lock.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  Slot& slot = slots[n_slots];
+  memcpy(slot.name, name.data(), name.size());
+  slot.name[name.size()] = '\0';
+  ++n_slots;
+  header.lock.store(seq + 2, std::memory_order_release);
+  return slot;
+}
+
+metrics_counter metrics_writer::counter(std::string_view name) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  metrics_header_t& header = m_segment->header;
+  counter_slot_t& slot = register_slot(header, m_segment->counters, header.n_counters,
+				       metrics_max_counters, name);
+  return metrics_counter(&slot.value);
+}
+
+metrics_histogram metrics_writer::histogram(std::string_view name) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  metrics_header_t& header = m_segment->header;
+  histogram_slot_t& slot = register_slot(header, m_segment->histograms, header.n_histograms,
+					 metrics_max_histograms, name);
+  return metrics_histogram(slot.values);
+}
+
+/*
+  Copies a segment, retrying while an entry is being registered. Values are read while
+  they are being updated, so counters are individually, not mutually, consistent.
+*/
+static bool copy_segment(const metrics_segment_t& segment, metrics_snapshot_t& snapshot) {
+  const metrics_header_t& header = segment.header;
+  for (int attempt=0; attempt < 100; ++attempt) {
+    const uint64_t seq = header.lock.load(std::memory_order_acquire);
+    if (seq % 2) {
+      sched_yield();
+      continue;
+    }
+    snapshot.pid = header.pid;
+    snapshot.started_ms = header.started_ms;
+    const size_t n_counters = std::min<size_t>(header.n_counters, metrics_max_counters);
+    const size_t n_histograms = std::min<size_t>(header.n_histograms, metrics_max_histograms);
+    snapshot.counters.resize(n_counters);
+    for (size_t i=0; i < n_counters; ++i) {
+      const counter_slot_t& slot = segment.counters[i];
+      snapshot.counters[i].first.assign(slot.name, strnlen(slot.name, metrics_name_size));
+      snapshot.counters[i].second = slot.value.load(std::memory_order_relaxed);
+    }
+    snapshot.histograms.resize(n_histograms);
+    for (size_t i=0; i < n_histograms; ++i) {
+      const histogram_slot_t& slot = segment.histograms[i];
+      metrics_histogram_t& h = snapshot.histograms[i];
+      h.name.assign(slot.name, strnlen(slot.name, metrics_name_size));
+      h.count = slot.values[0].load(std::memory_order_relaxed);
+      h.sum = slot.values[1].load(std::memory_order_relaxed);
+      for (size_t b=0; b < metrics_n_buckets; ++b) {
+	h.buckets[b] = slot.values[2 + b].load(std::memory_order_relaxed);
+      }
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header.lock.load(std::memory_order_relaxed) == seq) {
+      return true;
+    }
+  }
+  return false;
+}
+
+metrics_snapshot_t metrics_writer::snapshot() const {
+  metrics_snapshot_t snapshot;
+  copy_segment(*m_segment, snapshot);
+  return snapshot;
+}
+
+bool bigpicture::read_metrics(const std::string& name, metrics_snapshot_t& snapshot) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  // A segment which was just created may not have its size or header yet.
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  bool valid = static_cast<size_t>(st.st_size) == sizeof(metrics_segment_t);
+  void* map = valid ?
+    mmap(nullptr, sizeof(metrics_segment_t), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  bool ok = false;
+  if (map != MAP_FAILED) {
+    const metrics_segment_t& segment = *static_cast<const metrics_segment_t*>(map);
+    const uint32_t magic = segment.header.magic;
+    valid = (magic == 0) || (magic == metrics_magic && segment.header.version == metrics_version);
+    ok = (magic != 0) && valid && copy_segment(segment, snapshot);
+    munmap(map, sizeof(metrics_segment_t));
+  }
+  if (!valid) {
+    std::stringstream ss;
+    ss << "Shared-memory segment " << name << " is not a version " << metrics_version
+       << " metrics segment. Please make sure all bigpicture daemons are the same version.";
+    throw std::runtime_error(ss.str());
+  }
+  return ok;
+}
@@ -0,0 +1,178 @@
+#ifndef BP_METRICS_H
+#define BP_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <simdjson.h>
+
+namespace bigpicture {
+  static constexpr size_t metrics_max_counters   = 32;
+  static constexpr size_t metrics_max_histograms = 8;
+  static constexpr size_t metrics_name_size      = 32; //!< including the terminating NUL
+  static constexpr size_t metrics_n_buckets      = 32;
+
+  /**
+   * A named 64-bit value in a metrics segment: either a count which only grows, or a
+   * gauge, e.g. the newest frame processed. Any thread may update it without locking.
+   */
+  class metrics_counter {
+  public:
+    metrics_counter() noexcept : m_value(&m_sink) {}
+    explicit metrics_counter(std::atomic<int64_t>* value) noexcept : m_value(value) {}
+
+    void    add(int64_t n=1) noexcept { m_value->fetch_add(n, std::memory_order_relaxed); }
+    void    set(int64_t v) noexcept   { m_value->store(v, std::memory_order_relaxed); }
+    int64_t value() const noexcept    { return m_value->load(std::memory_order_relaxed); }
+
+  private:
+    static std::atomic<int64_t> m_sink; //!< absorbs updates to an unregistered counter
+    std::atomic<int64_t>*       m_value;
+  };
+
+  /**
+   * A named histogram in a metrics segment, e.g. of the time taken per frame. Bucket 0
+   * counts zeros, and bucket b counts values from 2^(b-1) to 2^b - 1; the last bucket
+   * also counts everything larger.
+   */
+  class metrics_histogram {
+  public:
+    metrics_histogram() noexcept : m_values(m_sink) {}
+    explicit metrics_histogram(std::atomic<uint64_t>* values) noexcept : m_values(values) {}
+
+    void record(uint64_t v) noexcept {
+      size_t bucket = v ? 64 - __builtin_clzll(v) : 0;
+      if (bucket >= metrics_n_buckets) {
+	bucket = metrics_n_buckets - 1;
+      }
+      m_values[0].fetch_add(1, std::memory_order_relaxed);
+      m_values[1].fetch_add(v, std::memory_order_relaxed);
+      m_values[2 + bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+  private:
+    static std::atomic<uint64_t> m_sink[2 + metrics_n_buckets];
+    std::atomic<uint64_t>*       m_values; //!< count, sum, then the buckets
+  };
+
+  /**
+   * A copy of a histogram, as read from a metrics segment.
+   */
+  struct metrics_histogram_t {
+    metrics_histogram_t() noexcept : count(0), sum(0), buckets{} {}
+
+    /**
+     * @return An upper bound on the q'th quantile (0 <= q <= 1), accurate to a factor
+     *         of 2, or 0 if nothing was recorded.
+     */
+    uint64_t quantile(double q) const noexcept;
+
+    std::string                                name;
+    uint64_t                                   count;
+    uint64_t                                   sum;
+    std::array<uint64_t, metrics_n_buckets>    buckets;
+  };
+
+  /**
+   * A copy of every counter and histogram of a metrics segment.
+   */
+  struct metrics_snapshot_t {
+    metrics_snapshot_t() noexcept : pid(-1), started_ms(0) {}
+
+    /// @return The value of a counter, or missing if it was never registered.
+    int64_t value(std::string_view name, int64_t missing=0) const noexcept;
+
+    /// @return A histogram, or nullptr if it was never registered.
+    const metrics_histogram_t* histogram(std::string_view name) const noexcept;
+
+    int64_t                                       pid;        //!< of the publishing process
+    int64_t                                       started_ms; //!< since the Unix epoch
+    std::vector<std::pair<std::string, int64_t>>  counters;
+    std::vector<metrics_histogram_t>              histograms;
+  };
+
+  struct metrics_segment_t;
+
+  /**
+   * Publishes a daemon's counters and histograms in a POSIX shared-memory segment, so
+   * that the supervisor can aggregate the metrics of the whole pipeline without asking
+   * any daemon for them.
+   *
+   * Counters and histograms live in the segment itself and are updated with relaxed
+   * atomics, so updating one costs the same as updating a private counter. The table
+   * of names is guarded by a sequence lock, so a reader never sees a half-registered
+   * entry, and the layout is versioned like the frame ring's.
+   */
+  class metrics_writer {
+  public:
+    /// Keeps metrics in private memory, e.g. when "/metrics" is not configured.
+    metrics_writer();
+
+    /**
+     * Creates (or replaces) the shared-memory segment.
+     *
+     * @param name A POSIX shared-memory object name, e.g. "/bigpicture-metrics-bpindexd".
+     * \throws std::system_error if the segment cannot be created or mapped.
+     */
+    explicit metrics_writer(const std::string& name);
+
+    /**
+     * Reads the optional "/metrics" section of a bigpicture config file:
+     *
+     *   "metrics" : {
+     *     "prefix" : "/bigpicture-metrics-" // followed by the daemon's name
+     *   }
+     *
+     * If the section is absent, metrics are kept in private memory.
+     */
+    metrics_writer(const simdjson::dom::object& config, const std::string& daemon);
+
+    /// Unmaps and unlinks the shared-memory segment.
+    ~metrics_writer() noexcept;
+
+    /**
+     * Registers a counter, or finds the one already registered under the same name.
+     * \throws std::runtime_error if the name is too long or the segment is full.
+     */
+    metrics_counter counter(std::string_view name);
+
+    /**
+     * Registers a histogram, or finds the one already registered under the same name.
+     * \throws std::runtime_error if the name is too long or the segment is full.
+     */
+    metrics_histogram histogram(std::string_view name);
+
+    /// @return A copy of the current metrics.
+    metrics_snapshot_t snapshot() const;
+
+    /// @return The name of the segment, empty if private.
+    const std::string& name() const { return m_name; }
+
+  private:
+    metrics_writer(const metrics_writer&) = delete;
+    void open(const std::string& name);
+
+    std::string        m_name;
+    metrics_segment_t* m_segment;
+    std::mutex         m_mutex; //!< serializes registration
+  };
+
+  /**
+   * Reads the metrics published by a metrics_writer in another process.
+   *
+   * @return false if the segment does not exist, e.g. because the daemon is not
+   *         running, or if a consistent copy could not be read.
+   * \throws std::runtime_error if the segment is not a metrics segment of this version.
+   */
+  bool read_metrics(const std::string& name, metrics_snapshot_t& snapshot);
+
+  /// @return "prefix" from the "/metrics" section followed by the daemon's name.
+  std::string metrics_name(const simdjson::dom::object& config, const std::string& daemon);
+}
+
+#endif // header guard
@@ -0,0 +1,416 @@
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+
+#include <jxl/encode.h>
+#include <jxl/thread_parallel_runner.h>
+#include <turbojpeg.h>
+
+#include "frame_tiling.h"
+#include "preview.h"
+
+using namespace bigpicture;
+
+static constexpr size_t histogram_bins = 65536;
+static constexpr size_t block_pixels   = 64*1024; // pixels per parallel work item
+
+template<typename T>
+tone_map_t bigpicture::compute_tone_map(const T* data, size_t n_pixels,
+					double low_pct, double high_pct,
+					size_t max_samples) {
+  std::vector<uint32_t> histogram(histogram_bins, 0);
+  const size_t stride = std::max<size_t>(1, n_pixels / std::max<size_t>(1, max_samples));
+  uint64_t n_samples = 0;
+  for (size_t i=0; i < n_pixels; i += stride) {
+    const T v = data[i];
+    if (pixel_traits<T>::is_masked(v)) {
+      continue;
+    }
+    ++histogram[std::min<size_t>(v, histogram_bins-1)];
+    ++n_samples;
+  }
+
+  tone_map_t tone;
+  if (n_samples == 0) {
+    return tone;
+  }
+
+  const uint64_t low_rank  = static_cast<uint64_t>(std::clamp(low_pct, 0.0, 100.0) *
+						   (n_samples-1) / 100.0);
+  const uint64_t high_rank = static_cast<uint64_t>(std::clamp(high_pct, 0.0, 100.0) *
+						   (n_samples-1) / 100.0);
+  uint64_t cumulative = 0;
+  bool found_low = false;
+  for (size_t bin=0; bin < histogram_bins; ++bin) {
+    cumulative += histogram[bin];
+    if (!found_low && cumulative > low_rank) {
+      tone.low = bin;
+      found_low = true;
+    }
+    if (cumulative > high_rank) {
+      tone.high = bin;
+      break;
+    }
+  }
+  if (tone.high <= tone.low) {
+    tone.high = tone.low + 1;
+  }
+  return tone;
+}
+
+/*
+  Maps a count onto a gray level. Branch-free so that loops calling it vectorize.
+*/
+static inline uint8_t to_gray(float value, float low, float scale, uint8_t flip) {
+  float f = (value - low) * scale;
+  f = std::min(std::max(f, 0.0f), 255.0f);
+  return static_cast<uint8_t>(f + 0.5f) ^ flip;
+}
+
+template<typename T>
+void bigpicture::tone_map_frame(const T* src, size_t n_pixels, const tone_map_t& tone,
+				uint8_t* dst) {
+  const float low   = static_cast<float>(tone.low);
+  const float scale = 255.0f / static_cast<float>(tone.high - tone.low);
+  const uint8_t flip = tone.invert ? 0xFF : 0x00;
+  const int64_t n_blocks = (n_pixels + block_pixels - 1) / block_pixels;
+
+#pragma omp parallel for schedule(static)
+  for (int64_t b=0; b < n_blocks; ++b) {
+    const size_t begin = b*block_pixels;
+    const size_t end = std::min(begin + block_pixels, n_pixels);
+#pragma omp simd
+    for (size_t i=begin; i < end; ++i) {
+      const T v = src[i];
+      uint8_t gray = to_gray(static_cast<float>(v), low, scale, flip);
+      dst[i] = pixel_traits<T>::is_masked(v) ? 0 : gray;
+    }
+  }
+}
+
+/*
+  The shared binning kernel. Each thread owns a band of output rows. For every output
+  row, the factor input rows are first reduced vertically into per-column accumulators
+  in contiguous, branch-free loops which the compiler vectorizes, and then each run of
+  factor columns is reduced horizontally and handed to store(index, total, n_valid).
+
+  Sums of 8 and 16-bit pixels fit in 32 bits for factors up to max_bin_factor, so only
+  32-bit pixels pay for 64-bit accumulators.
+*/
+template<typename T, bool Max, typename Store>
+static void bin_kernel(const T* src, size_t width, size_t height, size_t factor,
+		       Store&& store) {
+  using acc_t = typename std::conditional<(sizeof(T) < 4), uint32_t, uint64_t>::type;
+  if (factor == 0 || factor > max_bin_factor) {
+    std::stringstream ss;
+    ss << "Unsupported bin factor " << factor << ", must be between 1 and "
+       << max_bin_factor << "." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+  const size_t out_width = binned_size(width, factor);
+  const int64_t out_height = binned_size(height, factor);
+
+#pragma omp parallel
+  {
+    std::vector<acc_t>   acc(width);
+    std::vector<uint8_t> count(width);
+
+#pragma omp for schedule(static)
+    for (int64_t oy=0; oy < out_height; ++oy) {
+      std::fill(acc.begin(), acc.end(), 0);
+      std::fill(count.begin(), count.end(), 0);
+      const size_t y_end = std::min((oy+1)*factor, height);
+      for (size_t y=oy*factor; y < y_end; ++y) {
+	const T* row = src + y*width;
+	acc_t*   a = acc.data();
+	uint8_t* n = count.data();
+#pragma omp simd
+	for (size_t x=0; x < width; ++x) {
+	  const T v = row[x];
+	  const bool masked = pixel_traits<T>::is_masked(v);
+	  const acc_t value = masked ? 0 : v;
+	  if constexpr (Max) {
+	    a[x] = (value > a[x]) ? value : a[x];
+	  } else {
+	    a[x] += value;
+	  }
+	  n[x] += !masked;
+	}
+      }
+
+      for (size_t ox=0; ox < out_width; ++ox) {
+	const size_t x_end = std::min((ox+1)*factor, width);
+	acc_t    total = 0;
+	uint32_t n_valid = 0;
+	for (size_t x=ox*factor; x < x_end; ++x) {
+	  if constexpr (Max) {
+	    total = (acc[x] > total) ? acc[x] : total;
+	  } else {
+	    total += acc[x];
+	  }
+	  n_valid += count[x];
+	}
+	store(oy*out_width + ox, static_cast<uint64_t>(total), n_valid);
+      }
+    }
+  }
+}
+
+template<typename T>
+void bigpicture::bin_frame(const T* src, size_t width, size_t height, size_t factor,
+			   bin_mode_t mode, uint32_t* dst) {
+  constexpr uint64_t largest = pixel_traits<uint32_t>::bad - 1;
+  const uint64_t full_bin = factor*factor;
+  if (mode == bin_mode_t::max) {
+    bin_kernel<T, true>(src, width, height, factor,
+			[&](size_t i, uint64_t total, uint32_t n_valid) {
+      dst[i] = (n_valid == 0) ? pixel_traits<uint32_t>::gap : std::min(total, largest);
+    });
+  } else {
+    bin_kernel<T, false>(src, width, height, factor,
+			 [&](size_t i, uint64_t total, uint32_t n_valid) {
+      uint64_t scaled = (n_valid == 0) ? 0 : (total*full_bin + n_valid/2) / n_valid;
+      dst[i] = (n_valid == 0) ? pixel_traits<uint32_t>::gap : std::min(scaled, largest);
+    });
+  }
+}
+
+template<typename T>
+void bigpicture::bin_and_tone_map(const T* src, size_t width, size_t height, size_t factor,
+				  bin_mode_t mode, const tone_map_t& tone, uint8_t* dst) {
+  const float low   = static_cast<float>(tone.low);
+  const float scale = 255.0f / static_cast<float>(tone.high - tone.low);
+  const uint8_t flip = tone.invert ? 0xFF : 0x00;
+  if (mode == bin_mode_t::max) {
+    bin_kernel<T, true>(src, width, height, factor,
+			[&](size_t i, uint64_t total, uint32_t n_valid) {
+      uint8_t gray = to_gray(static_cast<float>(total), low, scale, flip);
+      dst[i] = (n_valid == 0) ? 0 : gray;
+    });
+  } else {
+    bin_kernel<T, false>(src, width, height, factor,
+			 [&](size_t i, uint64_t total, uint32_t n_valid) {
+      float mean = static_cast<float>(total) / static_cast<float>(n_valid ? n_valid : 1);
+      uint8_t gray = to_gray(mean, low, scale, flip);
+      dst[i] = (n_valid == 0) ? 0 : gray;
+    });
+  }
+}
+
+template<typename T>
+void bigpicture::counts_to_gray16(const T* src, size_t n_pixels, uint16_t* dst) {
+  const int64_t n_blocks = (n_pixels + block_pixels - 1) / block_pixels;
+#pragma omp parallel for schedule(static)
+  for (int64_t b=0; b < n_blocks; ++b) {
+    const size_t begin = b*block_pixels;
+    const size_t end = std::min(begin + block_pixels, n_pixels);
+#pragma omp simd
+    for (size_t i=begin; i < end; ++i) {
+      const T v = src[i];
+      const uint16_t count = (uint32_t(v) > UINT16_MAX) ? UINT16_MAX : static_cast<uint16_t>(v);
+      dst[i] = pixel_traits<T>::is_masked(v) ? 0 : count;
+    }
+  }
+}
+
+tone_map_t bigpicture::compute_tone_map(const void* data, size_t n_pixels, int64_t bit_depth,
+					double low_pct, double high_pct) {
+  tone_map_t tone;
+  dispatch_pixel_type(bit_depth, [&](auto pixel) {
+    using T = decltype(pixel);
+    tone = compute_tone_map(static_cast<const T*>(data), n_pixels, low_pct, high_pct);
+  });
+  return tone;
+}
+
+void bigpicture::tone_map_frame(const void* src, size_t n_pixels, int64_t bit_depth,
+				const tone_map_t& tone, uint8_t* dst) {
+  dispatch_pixel_type(bit_depth, [&](auto pixel) {
+    using T = decltype(pixel);
+    tone_map_frame(static_cast<const T*>(src), n_pixels, tone, dst);
+  });
+}
+
+void bigpicture::bin_frame(const void* src, size_t width, size_t height, int64_t bit_depth,
+			   size_t factor, bin_mode_t mode, uint32_t* dst) {
+  dispatch_pixel_type(bit_depth, [&](auto pixel) {
+    using T = decltype(pixel);
+    bin_frame(static_cast<const T*>(src), width, height, factor, mode, dst);
+  });
+}
+
+void bigpicture::bin_and_tone_map(const void* src, size_t width, size_t height,
+				  int64_t bit_depth, size_t factor, bin_mode_t mode,
+				  const tone_map_t& tone, uint8_t* dst) {
+  dispatch_pixel_type(bit_depth, [&](auto pixel) {
+    using T = decltype(pixel);
+    bin_and_tone_map(static_cast<const T*>(src), width, height, factor, mode, tone, dst);
+  });
+}
+
+void bigpicture::counts_to_gray16(const void* src, size_t n_pixels, int64_t bit_depth,
+				  uint16_t* dst) {
+  dispatch_pixel_type(bit_depth, [&](auto pixel) {
+    using T = decltype(pixel);
+    counts_to_gray16(static_cast<const T*>(src), n_pixels, dst);
+  });
+}
+
+// Explicit instantiations for every supported bit depth.
+#define BP_INSTANTIATE_PREVIEW(T)					\
+  template tone_map_t bigpicture::compute_tone_map<T>(const T*, size_t, double, double, size_t); \
+  template void bigpicture::tone_map_frame<T>(const T*, size_t, const tone_map_t&, uint8_t*); \
+  template void bigpicture::bin_frame<T>(const T*, size_t, size_t, size_t, bin_mode_t, uint32_t*); \
+  template void bigpicture::bin_and_tone_map<T>(const T*, size_t, size_t, size_t, bin_mode_t, \
+						const tone_map_t&, uint8_t*); \
+  template void bigpicture::counts_to_gray16<T>(const T*, size_t, uint16_t*);
+BP_INSTANTIATE_PREVIEW(uint8_t)
+BP_INSTANTIATE_PREVIEW(uint16_t)
+BP_INSTANTIATE_PREVIEW(uint32_t)
+#undef BP_INSTANTIATE_PREVIEW
+
+jpeg_encoder::jpeg_encoder(int quality) :
+  m_handle(tjInitCompress()),
+  m_buf(nullptr),
+  m_buf_size(0),
+  m_quality(std::clamp(quality, 1, 100)) {
+  if (m_handle == nullptr) {
+    std::stringstream ss;
+    ss << "tjInitCompress() failed: " << tjGetErrorStr2(nullptr) << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+}
+
+jpeg_encoder::~jpeg_encoder() noexcept {
+  if (m_buf) tjFree(m_buf);
+  if (m_handle) tjDestroy(m_handle);
+}
+
+size_t jpeg_encoder::encode(const uint8_t* gray, size_t width, size_t height) {
+  // Size the output buffer for the worst case once, so that libjpeg-turbo never
+  // reallocates it.
+  unsigned long bound = tjBufSize(width, height, TJSAMP_GRAY);
+  if (bound > m_buf_size) {
+    if (m_buf) tjFree(m_buf);
+    m_buf = tjAlloc(bound);
+    if (m_buf == nullptr) {
+      m_buf_size = 0;
+      throw std::bad_alloc();
+    }
+    m_buf_size = bound;
+  }
+
+  unsigned long jpeg_size = m_buf_size;
+  int err = tjCompress2(m_handle, gray, width, /*pitch*/0, height, TJPF_GRAY,
+			&m_buf, &jpeg_size, TJSAMP_GRAY, m_quality,
+			TJFLAG_NOREALLOC|TJFLAG_FASTDCT);
+  if (err != 0) {
+    std::stringstream ss;
+    ss << "tjCompress2() failed: " << tjGetErrorStr2(m_handle) << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+  return jpeg_size;
+}
+
+jxl_encoder::jxl_encoder(const jxl_options_t& options) :
+  m_encoder(JxlEncoderCreate(nullptr)),
+  m_runner(JxlThreadParallelRunnerCreate(nullptr, std::max<int64_t>(options.threads, 1))),
+  m_options(options) {
+  std::stringstream ss;
+  if (m_encoder == nullptr || m_runner == nullptr) {
+    ss << "Failed to initialize the libjxl encoder." << std::endl;
+  } else if (m_options.bit_depth != 8 && m_options.bit_depth != 16) {
+    ss << "Unsupported JPEG XL bit depth " << m_options.bit_depth
+       << ", must be 8 or 16." << std::endl;
+  }
+  if (!ss.str().empty()) {
+    if (m_runner) JxlThreadParallelRunnerDestroy(m_runner);
+    if (m_encoder) JxlEncoderDestroy(m_encoder);
+    throw std::runtime_error(ss.str());
+  }
+  m_options.effort = std::clamp<int64_t>(m_options.effort, 1, 9);
+}
+
+jxl_encoder::~jxl_encoder() noexcept {
+  JxlThreadParallelRunnerDestroy(m_runner);
+  JxlEncoderDestroy(m_encoder);
+}
+
+size_t jxl_encoder::encode(const void* gray, size_t width, size_t height) {
+  auto check = [this](JxlEncoderStatus status, const char* what) {
+    if (status != JXL_ENC_SUCCESS) {
+      std::stringstream ss;
+      ss << what << "() failed with libjxl error " << JxlEncoderGetError(m_encoder)
+	 << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+  };
+
+  // Resetting keeps the encoder's allocations, but forgets its settings.
+  JxlEncoderReset(m_encoder);
+  check(JxlEncoderSetParallelRunner(m_encoder, JxlThreadParallelRunner, m_runner),
+	"JxlEncoderSetParallelRunner");
+
+  JxlBasicInfo info;
+  JxlEncoderInitBasicInfo(&info);
+  info.xsize = width;
+  info.ysize = height;
+  info.bits_per_sample = m_options.bit_depth;
+  info.num_color_channels = 1;
+  info.uses_original_profile = m_options.lossless ? JXL_TRUE : JXL_FALSE;
+  check(JxlEncoderSetBasicInfo(m_encoder, &info), "JxlEncoderSetBasicInfo");
+
+  // Photon counts are linear in intensity; tone-mapped gray levels are for display.
+  JxlColorEncoding color;
+  if (m_options.bit_depth == 16) {
+    JxlColorEncodingSetToLinearSRGB(&color, /*is_gray*/JXL_TRUE);
+  } else {
+    JxlColorEncodingSetToSRGB(&color, /*is_gray*/JXL_TRUE);
+  }
+  check(JxlEncoderSetColorEncoding(m_encoder, &color), "JxlEncoderSetColorEncoding");
+
+  JxlEncoderFrameSettings* settings = JxlEncoderFrameSettingsCreate(m_encoder, nullptr);
+  check(JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_EFFORT,
+					 m_options.effort), "JxlEncoderFrameSettingsSetOption");
+  if (m_options.lossless) {
+    check(JxlEncoderSetFrameLossless(settings, JXL_TRUE), "JxlEncoderSetFrameLossless");
+  } else {
+    check(JxlEncoderSetFrameDistance(settings, m_options.distance),
+	  "JxlEncoderSetFrameDistance");
+  }
+  if (m_options.progressive) {
+    check(JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_RESPONSIVE, 1),
+	  "JxlEncoderFrameSettingsSetOption");
+    check(JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_PROGRESSIVE_DC, 1),
+	  "JxlEncoderFrameSettingsSetOption");
+    check(JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_QPROGRESSIVE_AC, 1),
+	  "JxlEncoderFrameSettingsSetOption");
+  }
+
+  JxlPixelFormat format = { 1, (m_options.bit_depth == 16) ? JXL_TYPE_UINT16 : JXL_TYPE_UINT8,
+			    JXL_NATIVE_ENDIAN, 0 };
+  const size_t n_bytes = width * height * (m_options.bit_depth/8);
+  check(JxlEncoderAddImageFrame(settings, &format, gray, n_bytes), "JxlEncoderAddImageFrame");
+  JxlEncoderCloseInput(m_encoder);
+
+  // Start from the size of the previous preview, which is usually close.
+  if (m_buf.size() < n_bytes/4 + 4096) {
+    m_buf.resize(n_bytes/4 + 4096);
+  }
+  size_t len = 0;
+  JxlEncoderStatus status = JXL_ENC_NEED_MORE_OUTPUT;
+  while (status == JXL_ENC_NEED_MORE_OUTPUT) {
+    uint8_t* next = m_buf.data() + len;
+    size_t avail = m_buf.size() - len;
+    status = JxlEncoderProcessOutput(m_encoder, &next, &avail);
+    len = next - m_buf.data();
+    if (status == JXL_ENC_NEED_MORE_OUTPUT) {
+      m_buf.resize(m_buf.size() * 2);
+    }
+  }
+  check(status, "JxlEncoderProcessOutput");
+  return len;
+}
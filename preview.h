@@ -0,0 +1,253 @@
+#ifndef BP_PREVIEW_H
+#define BP_PREVIEW_H
+
+#include <iostream>
+#include <stdint.h>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <jxl/encode.h>
+#include <turbojpeg.h>
+
+#include "frame_tiling.h"
+
+namespace bigpicture {
+  /**
+   * The legal values of the "/compressor/format" config parameter.
+   */
+  enum class preview_format_t : int {
+    unknown=-1,
+    jpeg=0,
+    jxl=1,
+  };
+
+  const std::unordered_map<preview_format_t, std::string_view>
+  preview_format_names {
+    { preview_format_t::unknown, "unknown" },
+    { preview_format_t::jpeg,    "jpeg" },
+    { preview_format_t::jxl,     "jxl" }
+  };
+  inline std::string_view preview_format_name(preview_format_t value) {
+    return preview_format_names.at(value);
+  }
+
+  const std::unordered_map<std::string_view, preview_format_t>
+  preview_format_values {
+    { "unknown", preview_format_t::unknown },
+    { "jpeg",    preview_format_t::jpeg },
+    { "jxl",     preview_format_t::jxl }
+  };
+  inline preview_format_t preview_format_value(const std::string_view& name) {
+    return preview_format_values.at(name);
+  }
+
+  inline std::ostream& operator<<(std::ostream& lhs, preview_format_t value) {
+    return lhs << preview_format_name(value);
+  }
+
+  /**
+   * A linear mapping of photon counts onto 8-bit gray levels. Counts at or below low
+   * map to 0 and counts at or above high map to 255. Masked pixels map to 0.
+   */
+  struct tone_map_t {
+    tone_map_t() noexcept : low(0), high(1), invert(false) {}
+
+    uint64_t low;
+    uint64_t high;
+    bool     invert; //!< If true, map low to 255 and high to 0 (dark spots on white).
+  };
+
+  /**
+   * Computes a robust percentile stretch over the unmasked pixels of a frame.
+   *
+   * Percentiles are estimated from a histogram of at most max_samples evenly-strided
+   * pixels, which is accurate to within a count for detector-sized frames. Counts above
+   * 65535 share the top histogram bin, which only affects frames whose upper
+   * percentile is itself above 65535.
+   *
+   * @param low_pct,high_pct Percentiles in [0, 100] mapped to the ends of the range.
+   */
+  template<typename T>
+  tone_map_t compute_tone_map(const T* data, size_t n_pixels,
+			      double low_pct, double high_pct,
+			      size_t max_samples=(1 << 20));
+
+  /// Type-erased overload of compute_tone_map() for use with the image bit depth.
+  tone_map_t compute_tone_map(const void* data, size_t n_pixels, int64_t bit_depth,
+			      double low_pct, double high_pct);
+
+  /**
+   * Maps every pixel of a frame onto 8 bits, in parallel over rows.
+   */
+  template<typename T>
+  void tone_map_frame(const T* src, size_t n_pixels, const tone_map_t& tone, uint8_t* dst);
+
+  /// Type-erased overload of tone_map_frame() for use with the image bit depth.
+  void tone_map_frame(const void* src, size_t n_pixels, int64_t bit_depth,
+		      const tone_map_t& tone, uint8_t* dst);
+
+  /**
+   * How the pixels of each bin are combined when downsampling a frame.
+   */
+  enum class bin_mode_t : int {
+    unknown=-1,
+    sum=0, //!< Preserves total intensity; best for diffuse features and background.
+    max=1, //!< Preserves peak intensity; keeps single-pixel reflections visible.
+  };
+
+  const std::unordered_map<std::string_view, bin_mode_t>
+  bin_mode_values {
+    { "unknown", bin_mode_t::unknown },
+    { "sum",     bin_mode_t::sum },
+    { "max",     bin_mode_t::max }
+  };
+  inline bin_mode_t bin_mode_value(const std::string_view& name) {
+    return bin_mode_values.at(name);
+  }
+
+  /// The largest supported bin factor, which keeps 16-bit sums within 32 bits.
+  constexpr size_t max_bin_factor = 16;
+
+  /// @return The binned extent of a dimension, rounding partial bins up.
+  constexpr size_t binned_size(size_t extent, size_t factor) {
+    return (extent + factor - 1) / factor;
+  }
+
+  /// @return The smallest bin factor which fits extent within max_extent pixels.
+  constexpr size_t bin_factor_for(size_t extent, size_t max_extent) {
+    return (max_extent == 0 || extent <= max_extent) ? 1 : binned_size(extent, max_extent);
+  }
+
+  /**
+   * Downsamples a frame by combining each factor x factor block of pixels, ignoring
+   * masked pixels. Bins along the right and bottom edges may be partial.
+   *
+   * In sum mode, bins with some masked pixels are scaled up to the sum of a full bin,
+   * so that module edges do not appear dim. Bins where every pixel is masked are
+   * written as pixel_traits<uint32_t>::gap.
+   *
+   * @param dst binned_size(width, factor) * binned_size(height, factor) pixels.
+   * \throws std::runtime_error if factor is 0 or greater than max_bin_factor.
+   */
+  template<typename T>
+  void bin_frame(const T* src, size_t width, size_t height, size_t factor,
+		 bin_mode_t mode, uint32_t* dst);
+
+  /// Type-erased overload of bin_frame() for use with the image bit depth.
+  void bin_frame(const void* src, size_t width, size_t height, int64_t bit_depth,
+		 size_t factor, bin_mode_t mode, uint32_t* dst);
+
+  /**
+   * Downsamples and tone maps a frame in a single pass, without materializing the
+   * binned frame, for preview generation.
+   *
+   * The tone map applies to per-pixel counts: in sum mode each bin is mapped by its
+   * mean over unmasked pixels and in max mode by its maximum, so one tone map (e.g.
+   * from compute_tone_map() on the full frame) serves every bin factor. Bins where
+   * every pixel is masked map to 0.
+   *
+   * @param dst binned_size(width, factor) * binned_size(height, factor) pixels.
+   * \throws std::runtime_error if factor is 0 or greater than max_bin_factor.
+   */
+  template<typename T>
+  void bin_and_tone_map(const T* src, size_t width, size_t height, size_t factor,
+			bin_mode_t mode, const tone_map_t& tone, uint8_t* dst);
+
+  /// Type-erased overload of bin_and_tone_map() for use with the image bit depth.
+  void bin_and_tone_map(const void* src, size_t width, size_t height, int64_t bit_depth,
+			size_t factor, bin_mode_t mode, const tone_map_t& tone, uint8_t* dst);
+
+  /**
+   * Converts photon counts to 16-bit gray levels without tone mapping, for formats which
+   * preserve the dynamic range of the detector. Counts above 65535 saturate, and masked
+   * pixels map to 0.
+   */
+  template<typename T>
+  void counts_to_gray16(const T* src, size_t n_pixels, uint16_t* dst);
+
+  /// Type-erased overload of counts_to_gray16() for use with the image bit depth.
+  void counts_to_gray16(const void* src, size_t n_pixels, int64_t bit_depth, uint16_t* dst);
+
+  /**
+   * Deserialized "/compressor/jxl" config parameters.
+   */
+  struct jxl_options_t {
+    jxl_options_t() noexcept :
+      bit_depth(16), distance(1.0), effort(3), threads(1), lossless(false),
+      progressive(true) {}
+
+    int64_t bit_depth;   //!< 8 for tone-mapped gray levels, 16 for photon counts
+    double  distance;    //!< Butteraugli distance, 0.5-3 is visually lossless to acceptable
+    int64_t effort;      //!< 1 (fastest) to 9 (smallest)
+    int64_t threads;     //!< threads of libjxl's parallel runner, per encoder
+    bool    lossless;    //!< overrides distance
+    bool    progressive; //!< lets browsers render a coarse preview while downloading
+  };
+
+  /**
+   * Encodes 8 or 16-bit grayscale images as JPEG XL, using libjxl's thread pool. Like
+   * jpeg_encoder, the encoder and its output buffer are reused across calls.
+   *
+   * @note Not thread-safe; use one encoder per thread.
+   */
+  class jxl_encoder {
+  public:
+    /// \throws std::runtime_error if libjxl cannot be initialized.
+    explicit jxl_encoder(const jxl_options_t& options);
+    ~jxl_encoder() noexcept;
+
+    /**
+     * @param gray width*height pixels of options().bit_depth bits each.
+     * @return The size of the encoded image, which remains in data() until the next
+     *         call to encode().
+     * \throws std::runtime_error if encoding fails.
+     */
+    size_t encode(const void* gray, size_t width, size_t height);
+
+    const unsigned char* data() const { return m_buf.data(); }
+    const jxl_options_t& options() const { return m_options; }
+
+  private:
+    jxl_encoder(const jxl_encoder&) = delete;
+
+    JxlEncoder*                m_encoder;
+    void*                      m_runner;
+    std::vector<unsigned char> m_buf;
+    jxl_options_t              m_options;
+  };
+
+  /**
+   * Encodes 8-bit grayscale images as baseline JPEG. The libjpeg-turbo handle and the
+   * output buffer are reused across calls, so an encoder should be owned by a single
+   * thread and kept for its lifetime.
+   *
+   * @note Not thread-safe; use one encoder per thread.
+   */
+  class jpeg_encoder {
+  public:
+    /// \throws std::runtime_error if libjpeg-turbo cannot be initialized.
+    explicit jpeg_encoder(int quality=90);
+    ~jpeg_encoder() noexcept;
+
+    /**
+     * @return The size of the encoded image, which remains in data() until the next
+     *         call to encode().
+     * \throws std::runtime_error if encoding fails.
+     */
+    size_t encode(const uint8_t* gray, size_t width, size_t height);
+
+    const unsigned char* data() const { return m_buf; }
+    int quality() const { return m_quality; }
+
+  private:
+    jpeg_encoder(const jpeg_encoder&) = delete;
+
+    tjhandle       m_handle;
+    unsigned char* m_buf;
+    unsigned long  m_buf_size;
+    int            m_quality;
+  };
+}
+
+#endif // header guard
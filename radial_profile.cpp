@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "frame_quality.h"
+#include "frame_tiling.h"
+#include "radial_profile.h"
+#include "resolution_map.h"
+
+using namespace bigpicture;
+
+template<typename T>
+void radial_profile::compute(const frame_tiling& tiling, const resolution_map& map,
+			     const T* frame) {
+  const size_t n_bins = map.n_bins();
+  const size_t n_threads = omp_get_max_threads();
+  m_partial_sum.assign(n_threads * n_bins, 0);
+  m_partial_n.assign(n_threads * n_bins, 0);
+  const uint16_t* bins = map.bins();
+  const size_t width = tiling.width();
+
+  tiling.for_each_tile_row([&](size_t y, size_t x0, size_t x1, size_t) {
+    const size_t thread = omp_get_thread_num();
+    uint64_t* sum = m_partial_sum.data() + thread*n_bins;
+    uint64_t* n = m_partial_n.data() + thread*n_bins;
+    const T* row = frame + y*width;
+    const uint16_t* row_bins = bins + y*width;
+    for (size_t x=x0; x < x1; ++x) {
+      const T v = row[x];
+      const bool masked = pixel_traits<T>::is_masked(v);
+      sum[row_bins[x]] += masked ? 0 : v;
+      n[row_bins[x]] += !masked;
+    }
+  });
+
+  m_sum.assign(n_bins, 0);
+  m_n.assign(n_bins, 0);
+  const int64_t n_bins_signed = n_bins;
+#pragma omp parallel for schedule(static)
+  for (int64_t b=0; b < n_bins_signed; ++b) {
+    uint64_t sum = 0, n = 0;
+    for (size_t thread=0; thread < n_threads; ++thread) {
+      sum += m_partial_sum[thread*n_bins + b];
+      n += m_partial_n[thread*n_bins + b];
+    }
+    m_sum[b] = sum;
+    m_n[b] = n;
+  }
+}
+
+void radial_profile::compute(const frame_tiling& tiling, const resolution_map& map,
+			     const void* frame, int64_t bit_depth) {
+  dispatch_pixel_type(bit_depth, [&](auto pixel) {
+    using T = decltype(pixel);
+    compute(tiling, map, static_cast<const T*>(frame));
+  });
+}
+
+double radial_profile::mean(size_t begin, size_t end) const {
+  uint64_t sum = 0, n = 0;
+  for (size_t b=begin; b < std::min(end, n_bins()); ++b) {
+    sum += m_sum[b];
+    n += m_n[b];
+  }
+  return n ? double(sum) / n : NAN;
+}
+
+size_t bigpicture::count_ice_rings(const radial_profile& profile, const resolution_map& map,
+				   double sigma) {
+  size_t n_rings = 0;
+  for (double d : ice_ring_resolutions) {
+    const double s = 1.0 / d;
+    if (s + 3*ice_ring_width >= 1.0 / map.d_min()) {
+      continue; // the ring or its shoulders are off the detector
+    }
+    // Bins [lo, hi) hold the ring, and bins of the same total width either side of it
+    // are its shoulders.
+    const size_t lo = map.bin_of(1.0 / (s - ice_ring_width));
+    const size_t hi = map.bin_of(1.0 / (s + ice_ring_width)) + 1;
+    const size_t shoulder = std::max<size_t>((hi - lo) / 2, 1);
+    if (lo < shoulder) {
+      continue;
+    }
+    uint64_t ring_n = 0;
+    for (size_t b=lo; b < hi; ++b) {
+      ring_n += profile.n_pixels(b);
+    }
+    const double ring = profile.mean(lo, hi);
+    const double below = profile.mean(lo - shoulder, lo);
+    const double above = profile.mean(hi, hi + shoulder);
+    const double background = 0.5 * (below + above);
+    if (ring_n > 0 && isfinite(background) &&
+	ring - background > sigma * sqrt(std::max(background, 1.0) / ring_n)) {
+      ++n_rings;
+    }
+  }
+  return n_rings;
+}
+
+template void radial_profile::compute<uint8_t>(const frame_tiling&, const resolution_map&, const uint8_t*);
+template void radial_profile::compute<uint16_t>(const frame_tiling&, const resolution_map&, const uint16_t*);
+template void radial_profile::compute<uint32_t>(const frame_tiling&, const resolution_map&, const uint32_t*);
@@ -0,0 +1,58 @@
+#ifndef BP_RADIAL_PROFILE_H
+#define BP_RADIAL_PROFILE_H
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#include "frame_tiling.h"
+#include "resolution_map.h"
+
+namespace bigpicture {
+  /**
+   * The azimuthally integrated intensity of a frame, i.e. the total counts and the
+   * number of unmasked pixels in each radial bin of a resolution_map.
+   *
+   * Each thread scatter-adds its share of the tiles into a private histogram, which
+   * avoids atomics and false sharing, and the histograms are merged at the end. Gaps
+   * between modules are skipped and masked pixels are not counted.
+   */
+  class radial_profile {
+  public:
+    radial_profile() noexcept {}
+
+    /// Replaces the profile with that of a frame with the dimensions of tiling and map.
+    template<typename T>
+    void compute(const frame_tiling& tiling, const resolution_map& map, const T* frame);
+
+    /// Type-erased overload of compute() for use with the image bit depth.
+    void compute(const frame_tiling& tiling, const resolution_map& map, const void* frame,
+		 int64_t bit_depth);
+
+    size_t   n_bins()             const { return m_sum.size(); }
+    uint64_t sum(size_t bin)      const { return m_sum[bin]; }
+    uint64_t n_pixels(size_t bin) const { return m_n[bin]; }
+
+    /// @return The mean counts per unmasked pixel in a bin, or NAN if it has none.
+    double mean(size_t bin) const { return m_n[bin] ? double(m_sum[bin]) / m_n[bin] : NAN; }
+
+    /// @return The mean counts per unmasked pixel over bins [begin, end), or NAN.
+    double mean(size_t begin, size_t end) const;
+
+  private:
+    std::vector<uint64_t> m_sum;
+    std::vector<uint64_t> m_n;
+    std::vector<uint64_t> m_partial_sum; //!< one histogram per thread
+    std::vector<uint64_t> m_partial_n;
+  };
+
+  /**
+   * @return The number of ice rings which stand out of a profile: the mean counts on
+   *         the ring exceed the mean of the shoulders either side of it by more than
+   *         sigma Poisson standard errors.
+   */
+  size_t count_ice_rings(const radial_profile& profile, const resolution_map& map,
+			 double sigma=5.0);
+}
+
+#endif // header guard
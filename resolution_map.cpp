@@ -0,0 +1,75 @@
+#include <algorithm>
+#include <functional>
+#include <math.h>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "frame_events.h"
+#include "resolution_map.h"
+
+using namespace bigpicture;
+
+/*
+  1/d = 2 sin(theta) / wavelength, where 2 theta is the scattering angle of a pixel
+  at distance r from the beam center.
+*/
+static inline double inverse_d_at(const frame_geometry_t& g, double dx, double dy) {
+  const double r = sqrt(dx*dx + dy*dy);
+  return 2.0 * sin(0.5 * atan2(r, g.detector_distance)) / g.wavelength;
+}
+
+resolution_map::resolution_map(const frame_geometry_t& geometry, size_t n_bins) :
+  m_geometry(geometry),
+  m_n_bins(n_bins),
+  m_bin_width(0) {
+  const frame_geometry_t& g = geometry;
+  if (!(g.width > 0 && g.height > 0 && isfinite(g.beam_center_x) &&
+	isfinite(g.beam_center_y) && g.detector_distance > 0 && g.wavelength > 0 &&
+	g.x_pixel_size > 0 && g.y_pixel_size > 0)) {
+    throw std::runtime_error("The detector geometry is incomplete, so pixel resolutions are unknown.");
+  }
+  if (n_bins < 1 || n_bins > max_bins) {
+    std::stringstream ss;
+    ss << "A resolution map must have between 1 and " << max_bins << " bins." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+  // The farthest pixel is in a corner, measured to the far edges of the corner pixels.
+  const double dx = std::max(fabs(g.beam_center_x), fabs(g.width - g.beam_center_x));
+  const double dy = std::max(fabs(g.beam_center_y), fabs(g.height - g.beam_center_y));
+  const double s_max = inverse_d_at(g, dx * g.x_pixel_size, dy * g.y_pixel_size);
+  m_bin_width = s_max / n_bins;
+
+  const int64_t width = g.width, height = g.height;
+  const double scale = 1.0 / m_bin_width;
+  const uint16_t last = n_bins - 1;
+  m_bins.resize(width * height);
+  uint16_t* bins = m_bins.data();
+#pragma omp parallel for schedule(static)
+  for (int64_t y=0; y < height; ++y) {
+    const double py = (y + 0.5 - g.beam_center_y) * g.y_pixel_size;
+    uint16_t* row = bins + y*width;
+#pragma omp simd
+    for (int64_t x=0; x < width; ++x) {
+      const double px = (x + 0.5 - g.beam_center_x) * g.x_pixel_size;
+      const double bin = inverse_d_at(g, px, py) * scale;
+      row[x] = (bin < last) ? uint16_t(bin) : last;
+    }
+  }
+}
+
+size_t resolution_map::bin_of(double d) const {
+  const double bin = 1.0 / (d * m_bin_width);
+  return (bin < m_n_bins - 1) ? size_t(bin) : m_n_bins - 1;
+}
+
+size_t resolution_map_key_hash::operator()(const resolution_map_key_t& key) const {
+  std::hash<double> h;
+  size_t seed = std::hash<int64_t>()(key.width * 1000003 + key.height) ^ key.n_bins;
+  for (double v : {key.beam_center_x, key.beam_center_y, key.detector_distance,
+		   key.wavelength, key.x_pixel_size, key.y_pixel_size}) {
+    seed ^= h(v) + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2);
+  }
+  return seed;
+}
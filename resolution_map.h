@@ -0,0 +1,124 @@
+#ifndef BP_RESOLUTION_MAP_H
+#define BP_RESOLUTION_MAP_H
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "frame_events.h"
+#include "lru_cache.h"
+
+namespace bigpicture {
+  /**
+   * The resolution of every pixel of a detector, quantized into radial bins of equal
+   * width in 1/d (reciprocal Angstroms) from the beam center to the farthest corner.
+   *
+   * Resolution depends only on the geometry of a series, so a map is computed once,
+   * in parallel, and shared by every frame with the same geometry. Bins are stored as
+   * 16 bits per pixel, a quarter of the memory of a float per pixel.
+   */
+  class resolution_map {
+  public:
+    static constexpr size_t max_bins = UINT16_MAX; //!< bin indices are 0 to max_bins-1
+
+    /**
+     * @param n_bins Radial bins, between 1 and max_bins.
+     * \throws std::runtime_error if the geometry is incomplete, e.g. the beam center
+     *         is unknown, or n_bins is out of range.
+     */
+    resolution_map(const frame_geometry_t& geometry, size_t n_bins);
+
+    const frame_geometry_t& geometry() const { return m_geometry; }
+    size_t width()  const { return m_geometry.width; }
+    size_t height() const { return m_geometry.height; }
+    size_t n_bins() const { return m_n_bins; }
+
+    /// @return The radial bin of every pixel, row-major.
+    const uint16_t* bins() const { return m_bins.data(); }
+    uint16_t bin(size_t x, size_t y) const { return m_bins[y*width() + x]; }
+
+    /// @return The bin containing a resolution in Angstroms, clamped to the last bin.
+    size_t bin_of(double d) const;
+
+    /// @return 1/d at the center of a bin, in 1/Angstrom.
+    double inverse_d(size_t bin) const { return (bin + 0.5) * m_bin_width; }
+
+    /// @return The resolution in Angstroms at the center of a bin.
+    double resolution(size_t bin) const { return 1.0 / inverse_d(bin); }
+    double resolution(size_t x, size_t y) const { return resolution(bin(x, y)); }
+
+    /// @return The highest resolution on the detector, at its farthest corner.
+    double d_min() const { return 1.0 / (m_n_bins * m_bin_width); }
+
+    size_t memory_usage() const { return m_bins.size() * sizeof(uint16_t); }
+
+  private:
+    frame_geometry_t      m_geometry;
+    size_t                m_n_bins;
+    double                m_bin_width; //!< 1/Angstrom
+    std::vector<uint16_t> m_bins;
+  };
+
+  /**
+   * The parameters of a frame_geometry_t which determine a resolution_map.
+   */
+  struct resolution_map_key_t {
+    resolution_map_key_t(const frame_geometry_t& g, size_t n_bins) noexcept :
+      width(g.width), height(g.height), n_bins(n_bins),
+      beam_center_x(g.beam_center_x), beam_center_y(g.beam_center_y),
+      detector_distance(g.detector_distance), wavelength(g.wavelength),
+      x_pixel_size(g.x_pixel_size), y_pixel_size(g.y_pixel_size) {}
+
+    bool operator==(const resolution_map_key_t& rhs) const {
+      return width == rhs.width && height == rhs.height && n_bins == rhs.n_bins &&
+	beam_center_x == rhs.beam_center_x && beam_center_y == rhs.beam_center_y &&
+	detector_distance == rhs.detector_distance && wavelength == rhs.wavelength &&
+	x_pixel_size == rhs.x_pixel_size && y_pixel_size == rhs.y_pixel_size;
+    }
+
+    int64_t width;
+    int64_t height;
+    size_t  n_bins;
+    double  beam_center_x;
+    double  beam_center_y;
+    double  detector_distance;
+    double  wavelength;
+    double  x_pixel_size;
+    double  y_pixel_size;
+  };
+
+  struct resolution_map_key_hash {
+    size_t operator()(const resolution_map_key_t& key) const;
+  };
+
+  /**
+   * Resolution maps of recently seen geometries, shared by all threads. Concurrent
+   * requests for the same geometry compute its map once.
+   */
+  class resolution_map_cache {
+  public:
+    /**
+     * @param capacity_mb Memory for maps; a map of an EIGER2 16M takes 35 MiB.
+     * @param budget Optional, see lru_cache.
+     */
+    explicit resolution_map_cache(size_t capacity_mb=256, memory_budget* budget=nullptr) :
+      m_maps(uint64_t(capacity_mb) << 20, budget) {}
+
+    /// \throws std::runtime_error if the geometry is incomplete, see resolution_map.
+    std::shared_ptr<const resolution_map> get(const frame_geometry_t& geometry, size_t n_bins) {
+      return m_maps.get_or_compute(resolution_map_key_t(geometry, n_bins), [&](uint64_t& cost) {
+	auto map = std::make_shared<const resolution_map>(geometry, n_bins);
+	cost = map->memory_usage();
+	return map;
+      });
+    }
+
+    uint64_t n_hits()   const { return m_maps.n_hits(); }
+    uint64_t n_misses() const { return m_maps.n_misses(); }
+
+  private:
+    lru_cache<resolution_map_key_t, resolution_map, resolution_map_key_hash> m_maps;
+  };
+}
+
+#endif // header guard
@@ -0,0 +1,273 @@
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <system_error>
+#include <unistd.h>
+
+#include <simdjson.h>
+
+#include "bigpicture_utils.h"
+#include "series_journal.h"
+
+using namespace bigpicture;
+
+/*
+  File layout:
+
+    [header][global header JSON][record]...[record]
+
+  Every record is one word of the committed-frame bitmap, and the series is complete
+  if and only if the end record follows the last one.
+*/
+static constexpr uint32_t journal_magic   = 0x42504a4c; // "BPJL"
+static constexpr uint32_t journal_version = 1;
+static constexpr int64_t  end_record      = -1;
+static constexpr uint64_t max_header_len  = 16 << 20;
+static constexpr int64_t  max_words       = 1 << 24; // a billion frames
+
+static constexpr const char* path_default    = "bparchived.journal";
+static constexpr int64_t     sync_ms_default = 1000;
+
+struct journal_header_t {
+  uint32_t magic;
+  uint32_t version;
+  int64_t  series_id;
+  int64_t  n_frames;
+  uint64_t header_len;
+};
+
+struct journal_record_t {
+  int64_t  base; //!< the first frame of the word, or end_record
+  uint64_t bits;
+};
+
+static void throw_errno(const std::string& what, const std::string& path) {
+  int err = errno;
+  std::stringstream ss;
+  ss << "libc error: " << what << " " << path << " - " << strerror(err) << "\n";
+  throw std::system_error(err, std::system_category(), ss.str());
+}
+
+std::string bigpicture::format_frame_ranges(const frame_ranges_t& ranges) {
+  if (ranges.empty()) {
+    return "none";
+  }
+  std::stringstream ss;
+  for (size_t i=0; i < ranges.size(); ++i) {
+    ss << (i ? "," : "") << ranges[i].first;
+    if (ranges[i].second != ranges[i].first) {
+      ss << "-" << ranges[i].second;
+    }
+  }
+  return ss.str();
+}
+
+/*
+  @return The ranges of frames from first to last whose bit is equal to value.
+*/
+static frame_ranges_t bitmap_ranges(const std::vector<uint64_t>& bitmap, int64_t first,
+				    int64_t last, bool value) {
+  frame_ranges_t ranges;
+  for (int64_t i=first; i <= last; ++i) {
+    const size_t word = i / 64;
+    const bool bit = word < bitmap.size() && (bitmap[word] >> (i % 64)) & 1;
+    if (bit != value) {
+      continue;
+    }
+    if (!ranges.empty() && ranges.back().second + 1 == i) {
+      ++ranges.back().second;
+    } else {
+      ranges.emplace_back(i, i);
+    }
+  }
+  return ranges;
+}
+
+frame_ranges_t series_journal_t::committed() const {
+  return bitmap_ranges(bitmap, 0, int64_t(bitmap.size()) * 64 - 1, true);
+}
+
+frame_ranges_t series_journal_t::missing() const {
+  // Frame ids count from 1.
+  return bitmap_ranges(bitmap, 1, n_frames, false);
+}
+
+int64_t series_journal_t::n_committed() const {
+  int64_t n = 0;
+  for (uint64_t word : bitmap) {
+    n += __builtin_popcountll(word);
+  }
+  return n;
+}
+
+series_journal_writer::series_journal_writer(const std::string& path,
+					     std::chrono::milliseconds sync_interval) :
+  m_path(path),
+  m_sync_interval(sync_interval),
+  m_fd(-1),
+  m_word_base(-1),
+  m_word(0) {
+}
+
+series_journal_writer::series_journal_writer(const simdjson::dom::object& config) :
+  series_journal_writer(path_default, std::chrono::milliseconds(sync_ms_default)) {
+  maybe_extract_json_pointer(m_path, config, "/archiver/journal/path");
+  int64_t tmp_int;
+  if (maybe_extract_json_pointer(tmp_int, config, "/archiver/journal/sync_ms")) {
+    m_sync_interval = std::chrono::milliseconds(tmp_int);
+  }
+}
+
+series_journal_writer::~series_journal_writer() noexcept {
+  try {
+    sync();
+  } catch (const std::exception&) {
+    // Nothing more can be done for the journal of an interrupted series.
+  }
+  close();
+}
+
+void series_journal_writer::begin(int64_t series_id, int64_t n_frames, std::string_view header) {
+  close();
+  m_word_base = -1;
+  m_word = 0;
+  m_pending.clear();
+  m_fd = open(m_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (m_fd < 0) {
+    throw_errno("open()", m_path);
+  }
+
+  journal_header_t h;
+  memset(&h, 0, sizeof(h));
+  h.magic = journal_magic;
+  h.version = journal_version;
+  h.series_id = series_id;
+  h.n_frames = n_frames;
+  h.header_len = header.size();
+  m_pending.resize(sizeof(h) + header.size());
+  memcpy(m_pending.data(), &h, sizeof(h));
+  memcpy(m_pending.data() + sizeof(h), header.data(), header.size());
+  sync();
+}
+
+void series_journal_writer::commit(int64_t frame_id) {
+  if (m_fd < 0 || frame_id < 0) {
+    return;
+  }
+  const int64_t base = frame_id - frame_id % 64;
+  if (base != m_word_base) {
+    if (m_word) {
+      append_word();
+    }
+    m_word_base = base;
+    m_word = 0;
+  }
+  m_word |= uint64_t(1) << (frame_id % 64);
+  if (std::chrono::steady_clock::now() - m_last_sync >= m_sync_interval) {
+    sync();
+  }
+}
+
+void series_journal_writer::end() {
+  if (m_fd < 0) {
+    return;
+  }
+  if (m_word) {
+    append_word();
+    m_word = 0;
+  }
+  journal_record_t record{end_record, 0};
+  const char* p = reinterpret_cast<const char*>(&record);
+  m_pending.insert(m_pending.end(), p, p + sizeof(record));
+  sync();
+  close();
+}
+
+void series_journal_writer::sync() {
+  if (m_fd < 0) {
+    return;
+  }
+  // The pending word is appended again as more of its frames are committed.
+  if (m_word) {
+    append_word();
+  }
+  size_t n_written = 0;
+  while (n_written < m_pending.size()) {
+    ssize_t n = write(m_fd, m_pending.data() + n_written, m_pending.size() - n_written);
+    if (n < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      throw_errno("write()", m_path);
+    }
+    n_written += n;
+  }
+  m_pending.clear();
+  if (fdatasync(m_fd) != 0) {
+    throw_errno("fdatasync()", m_path);
+  }
+  m_last_sync = std::chrono::steady_clock::now();
+}
+
+void series_journal_writer::append_word() {
+  journal_record_t record{m_word_base, m_word};
+  const char* p = reinterpret_cast<const char*>(&record);
+  m_pending.insert(m_pending.end(), p, p + sizeof(record));
+}
+
+void series_journal_writer::close() noexcept {
+  if (m_fd >= 0) {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+}
+
+bool bigpicture::read_series_journal(const std::string& path, series_journal_t& journal) {
+  FILE* file_handle = fopen(path.c_str(), "rb");
+  if (file_handle == nullptr) {
+    return false;
+  }
+  journal = series_journal_t();
+  journal_header_t h;
+  if (fread(&h, sizeof(h), 1, file_handle) != 1) {
+    fclose(file_handle); // created, but the series never began
+    return false;
+  }
+  if (h.magic != journal_magic || h.version != journal_version || h.header_len > max_header_len) {
+    fclose(file_handle);
+    std::stringstream ss;
+    ss << path << " is not a version " << journal_version << " series journal.";
+    throw std::runtime_error(ss.str());
+  }
+  journal.series_id = h.series_id;
+  journal.n_frames = h.n_frames;
+  journal.header.resize(h.header_len);
+  if (h.header_len && fread(journal.header.data(), h.header_len, 1, file_handle) != 1) {
+    fclose(file_handle);
+    return false;
+  }
+
+  // A record torn by a crash is shorter than a record, and is ignored.
+  journal_record_t record;
+  while (fread(&record, sizeof(record), 1, file_handle) == 1) {
+    if (record.base == end_record) {
+      journal.complete = true;
+      continue;
+    }
+    if (record.base < 0 || record.base % 64 || record.base / 64 >= max_words) {
+      continue;
+    }
+    const size_t word = record.base / 64;
+    if (journal.bitmap.size() <= word) {
+      journal.bitmap.resize(word + 1, 0);
+    }
+    journal.bitmap[word] |= record.bits;
+  }
+  fclose(file_handle);
+  return true;
+}
@@ -0,0 +1,131 @@
+#ifndef BP_SERIES_JOURNAL_H
+#define BP_SERIES_JOURNAL_H
+
+#include <chrono>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <simdjson.h>
+
+namespace bigpicture {
+  /// Inclusive ranges of frame ids, e.g. {{1, 99}, {101, 150}}.
+  using frame_ranges_t = std::vector<std::pair<int64_t, int64_t>>;
+
+  /// @return The ranges as "1-99,101-150", or "none" if there are none.
+  std::string format_frame_ranges(const frame_ranges_t& ranges);
+
+  /**
+   * A series journal, as read back after a restart.
+   */
+  struct series_journal_t {
+    series_journal_t() noexcept : series_id(-1), n_frames(-1), complete(false) {}
+
+    /// @return The committed frames, as ranges.
+    frame_ranges_t committed() const;
+
+    /**
+     * @return The frames from 1 to n_frames which were never committed, as ranges,
+     *         or none if n_frames is unknown.
+     */
+    frame_ranges_t missing() const;
+
+    /// @return The number of committed frames.
+    int64_t n_committed() const;
+
+    int64_t               series_id;
+    int64_t               n_frames; //!< nimages*ntrigger, -1 if unknown
+    std::string           header;   //!< a snapshot of the global header, as JSON
+    std::vector<uint64_t> bitmap;   //!< bit i%64 of word i/64 is set if frame i was committed
+    bool                  complete; //!< true if the series ended
+  };
+
+  /**
+   * Records which frames of the current series have been written out, in a compact
+   * append-only file, so that after a crash the archiver can report exactly which
+   * frames of the interrupted series are missing without scanning any directory.
+   *
+   * The file holds one series at a time and is truncated when the next one begins.
+   * Each record is a 64-frame word of the committed-frame bitmap; a word is appended
+   * again whenever it changes, and a reader ORs them together. Records are buffered
+   * and written with one fdatasync() every sync interval, so the journal costs one
+   * system call per interval rather than one per frame, and at most the frames of the
+   * last interval are unaccounted for after a power loss. A torn record at the end
+   * of the file is ignored.
+   *
+   * @note The journal records frames once they are handed to the kernel. A frame is
+   *       therefore only lost with the journal claiming otherwise if the host, rather
+   *       than the archiver, goes down.
+   */
+  class series_journal_writer {
+  public:
+    /// @param path The journal file, created or truncated by begin().
+    series_journal_writer(const std::string& path, std::chrono::milliseconds sync_interval);
+
+    /**
+     * Reads the "/archiver/journal" section of a bigpicture config file:
+     *
+     *   "journal" : {
+     *     "path"    : "bparchived.journal", // relative to the output directory
+     *     "sync_ms" : 1000                  // between batches of records
+     *   }
+     */
+    explicit series_journal_writer(const simdjson::dom::object& config);
+
+    /// Syncs and closes the journal, leaving an unfinished series marked incomplete.
+    ~series_journal_writer() noexcept;
+
+    /**
+     * Starts the journal of a new series, replacing the previous one.
+     * @param header A snapshot of the series' global header.
+     * \throws std::system_error
+     */
+    void begin(int64_t series_id, int64_t n_frames, std::string_view header);
+
+    /**
+     * Records a committed frame, writing the pending records once the sync interval
+     * has elapsed.
+     * \throws std::system_error
+     */
+    void commit(int64_t frame_id);
+
+    /**
+     * Marks the series complete and syncs the journal.
+     * \throws std::system_error
+     */
+    void end();
+
+    /**
+     * Writes and syncs the pending records.
+     * \throws std::system_error
+     */
+    void sync();
+
+    const std::string& path() const { return m_path; }
+
+  private:
+    series_journal_writer(const series_journal_writer&) = delete;
+    void append_word();
+    void close() noexcept;
+
+    std::string                           m_path;
+    std::chrono::milliseconds             m_sync_interval;
+    int                                   m_fd;
+    int64_t                               m_word_base; //!< first frame of the pending word
+    uint64_t                              m_word;      //!< pending bits, not yet buffered
+    std::vector<char>                     m_pending;   //!< records not yet written
+    std::chrono::steady_clock::time_point m_last_sync;
+  };
+
+  /**
+   * Reads a journal written by series_journal_writer.
+   *
+   * @return false if the file does not exist or holds no series.
+   * \throws std::runtime_error if the file is not a series journal of this version.
+   */
+  bool read_series_journal(const std::string& path, series_journal_t& journal);
+}
+
+#endif // header guard
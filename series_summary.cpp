@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <stdint.h>
+
+#include "bigpicture_utils.h"
+#include "frame_tiling.h"
+#include "series_summary.h"
+
+using namespace bigpicture;
+
+static constexpr uint8_t mask_gap = 1;
+static constexpr uint8_t mask_bad = 2;
+
+series_summary::series_summary(const simdjson::dom::object& config) : series_summary() {
+  maybe_extract_json_pointer(m_with_sum, config, "/archiver/summary/sum");
+  maybe_extract_json_pointer(m_with_max, config, "/archiver/summary/max");
+}
+
+void series_summary::reset(const frame_tiling& tiling) {
+  m_tiling = tiling;
+  m_n_frames = 0;
+  const size_t n_pixels = tiling.n_pixels();
+  m_sum.assign(m_with_sum ? n_pixels : 0, 0);
+  m_max.assign(m_with_max ? n_pixels : 0, 0);
+
+  // Everything outside the modules is a gap.
+  m_mask.assign(n_pixels, mask_gap);
+  const size_t width = tiling.width();
+  tiling.for_each_tile_row([&](size_t y, size_t x0, size_t x1, size_t) {
+    std::fill(m_mask.begin() + y*width + x0, m_mask.begin() + y*width + x1, 0);
+  });
+}
+
+template<typename T>
+void series_summary::add(const T* frame) {
+  const size_t width = m_tiling.width();
+  uint64_t* sum = m_sum.data();
+  uint32_t* max = m_max.data();
+  uint8_t* mask = m_mask.data();
+  const bool with_sum = m_with_sum, with_max = m_with_max;
+
+  // Rows of a module are contiguous, so each run is a branch-free loop which the
+  // compiler vectorizes.
+  m_tiling.for_each_tile_row([&](size_t y, size_t x0, size_t x1, size_t) {
+    const size_t begin = y*width + x0, end = y*width + x1;
+#pragma omp simd
+    for (size_t i=begin; i < end; ++i) {
+      const T v = frame[i];
+      mask[i] |= (v == pixel_traits<T>::gap) | ((v == pixel_traits<T>::bad) << 1);
+    }
+    if (with_sum) {
+#pragma omp simd
+      for (size_t i=begin; i < end; ++i) {
+	const T v = frame[i];
+	sum[i] += pixel_traits<T>::is_masked(v) ? 0 : v;
+      }
+    }
+    if (with_max) {
+#pragma omp simd
+      for (size_t i=begin; i < end; ++i) {
+	const T v = frame[i];
+	const uint32_t value = pixel_traits<T>::is_masked(v) ? 0 : v;
+	max[i] = (value > max[i]) ? value : max[i];
+      }
+    }
+  });
+  ++m_n_frames;
+}
+
+void series_summary::add(const void* frame, int64_t bit_depth) {
+  dispatch_pixel_type(bit_depth, [&](auto pixel) {
+    using T = decltype(pixel);
+    add(static_cast<const T*>(frame));
+  });
+}
+
+template<typename T>
+void series_summary::to_image(const std::vector<T>& src, int32_t* dst) const {
+  const int64_t n = src.size();
+  const uint8_t* mask = m_mask.data();
+#pragma omp parallel for simd schedule(static)
+  for (int64_t i=0; i < n; ++i) {
+    const int32_t value = static_cast<int32_t>(std::min<uint64_t>(src[i], INT32_MAX));
+    dst[i] = (mask[i] & mask_gap) ? -1 : (mask[i] & mask_bad) ? -2 : value;
+  }
+}
+
+void series_summary::sum_image(int32_t* dst) const {
+  to_image(m_sum, dst);
+}
+
+void series_summary::max_image(int32_t* dst) const {
+  to_image(m_max, dst);
+}
+
+template void series_summary::add<uint8_t>(const uint8_t*);
+template void series_summary::add<uint16_t>(const uint16_t*);
+template void series_summary::add<uint32_t>(const uint32_t*);
@@ -0,0 +1,83 @@
+#ifndef BP_SERIES_SUMMARY_H
+#define BP_SERIES_SUMMARY_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <simdjson.h>
+
+#include "frame_tiling.h"
+
+namespace bigpicture {
+  /**
+   * Accumulates the sum and the maximum projection of every frame in a series as the
+   * frames arrive, so that both images are available as soon as the series ends
+   * rather than by re-reading every archived frame.
+   *
+   * Sums are accumulated in 64 bits, so they cannot overflow for any realistic series.
+   * A pixel masked in any frame is masked in both images, as a gap if it was ever a
+   * gap and otherwise as a bad pixel.
+   */
+  class series_summary {
+  public:
+    /// Accumulates both images.
+    series_summary() noexcept : m_n_frames(0), m_with_sum(true), m_with_max(true) {}
+
+    /// Accumulates the images enabled by "/archiver/summary/{sum,max}" (default true).
+    explicit series_summary(const simdjson::dom::object& config);
+
+    /**
+     * Clears the accumulators and sizes them for frames partitioned by tiling. Pixels
+     * outside every tile, i.e. the gaps between modules, are masked as gaps.
+     */
+    void reset(const frame_tiling& tiling);
+
+    /**
+     * Adds a frame to the summary, in parallel over the rows of each tile.
+     * @param frame An uncompressed frame with the dimensions passed to reset().
+     */
+    template<typename T> void add(const T* frame);
+
+    /// Type-erased overload of add() for use with the image bit depth.
+    void add(const void* frame, int64_t bit_depth);
+
+    bool     with_sum() const { return m_with_sum; }
+    bool     with_max() const { return m_with_max; }
+    uint64_t n_frames() const { return m_n_frames; }
+    size_t   width()    const { return m_tiling.width(); }
+    size_t   height()   const { return m_tiling.height(); }
+
+    /// @return The bytes held by the accumulators.
+    uint64_t memory_usage() const {
+      return m_sum.size()*sizeof(uint64_t) + m_max.size()*sizeof(uint32_t) + m_mask.size();
+    }
+
+    /// @return The bytes the accumulators would hold after reset(tiling).
+    uint64_t memory_usage(const frame_tiling& tiling) const {
+      return tiling.n_pixels()*((m_with_sum ? sizeof(uint64_t) : 0) +
+				(m_with_max ? sizeof(uint32_t) : 0) + sizeof(uint8_t));
+    }
+
+    /**
+     * Converts the sum or the maximum projection to the signed 32-bit pixels of a
+     * miniCBF file: counts saturate at INT32_MAX, gaps are -1, and bad pixels are -2.
+     *
+     * @param dst width()*height() pixels.
+     */
+    void sum_image(int32_t* dst) const;
+    void max_image(int32_t* dst) const;
+
+  private:
+    template<typename T> void to_image(const std::vector<T>& src, int32_t* dst) const;
+
+    frame_tiling          m_tiling;
+    std::vector<uint64_t> m_sum;
+    std::vector<uint32_t> m_max;
+    std::vector<uint8_t>  m_mask; //!< bit 0 if ever a gap, bit 1 if ever bad
+    uint64_t              m_n_frames;
+    bool                  m_with_sum;
+    bool                  m_with_max;
+  };
+}
+
+#endif // header guard
@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <math.h>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+
+#include <simdjson.h>
+
+#include "bigpicture_utils.h"
+#include "dectris_utils.h"
+#include "frame_tiling.h"
+#include "spot_finder.h"
+
+using namespace bigpicture;
+
+spot_finder_options_t::spot_finder_options_t(const simdjson::dom::object& config) :
+  spot_finder_options_t() {
+  std::string_view tmp_sv;
+  if (maybe_extract_json_pointer(tmp_sv, config, "/indexer/spot_finder/background")) {
+    if (tmp_sv.compare("local") == 0) {
+      background = spot_background_t::local;
+    } else if (tmp_sv.compare("incremental") == 0) {
+      background = spot_background_t::incremental;
+    } else {
+      std::stringstream ss;
+      ss << "The config parameter \"/indexer/spot_finder/background\" has an unsupported "
+	 << "value, \"" << tmp_sv << "\". Supported values are \"local\" and \"incremental\"."
+	 << std::endl;
+      throw std::runtime_error(ss.str());
+    }
+  }
+  maybe_extract_json_pointer(background_alpha, config, "/indexer/spot_finder/background_alpha");
+  int64_t tmp_int;
+  if (maybe_extract_json_pointer(tmp_int, config, "/indexer/spot_finder/background_readmit")) {
+    background_readmit = std::clamp<int64_t>(tmp_int, 1, 255);
+  }
+  if (maybe_extract_json_pointer(tmp_int, config, "/indexer/spot_finder/background_warmup")) {
+    background_warmup = std::max<int64_t>(tmp_int, 1);
+  }
+  if (maybe_extract_json_pointer(tmp_int, config, "/indexer/spot_finder/kernel_size")) {
+    kernel_size = std::max<int64_t>(tmp_int, 1);
+  }
+  maybe_extract_json_pointer(sigma_background, config, "/indexer/spot_finder/sigma_background");
+  maybe_extract_json_pointer(sigma_strong, config, "/indexer/spot_finder/sigma_strong");
+  maybe_extract_json_pointer(gain, config, "/indexer/spot_finder/gain");
+  if (maybe_extract_json_pointer(tmp_int, config, "/indexer/spot_finder/global_threshold")) {
+    global_threshold = std::max<int64_t>(tmp_int, 0);
+  }
+  if (maybe_extract_json_pointer(tmp_int, config, "/indexer/spot_finder/min_local")) {
+    min_local = std::max<int64_t>(tmp_int, 2);
+  }
+  if (maybe_extract_json_pointer(tmp_int, config, "/indexer/spot_finder/spot_size/0")) {
+    min_spot_size = std::max<int64_t>(tmp_int, 1);
+  }
+  if (maybe_extract_json_pointer(tmp_int, config, "/indexer/spot_finder/spot_size/1")) {
+    max_spot_size = std::max<int64_t>(tmp_int, 1);
+  }
+  if (gain <= 0) {
+    throw std::runtime_error("The config parameter \"/indexer/spot_finder/gain\" must be positive.");
+  }
+  if (!(background_alpha > 0 && background_alpha <= 1)) {
+    throw std::runtime_error("The config parameter \"/indexer/spot_finder/background_alpha\" "
+			     "must be greater than 0 and at most 1.");
+  }
+}
+
+void spot_finder::set_pixel_mask(const mask_t<uint32_t>& mask) {
+  const size_t n = mask.width * mask.height;
+  m_pixel_mask.resize(n);
+  m_mask_width = mask.width;
+  m_mask_height = mask.height;
+  const uint32_t* src = mask.data.get();
+#pragma omp simd
+  for (size_t i=0; i < n; ++i) {
+    m_pixel_mask[i] = (src[i] != 0);
+  }
+}
+
+/*
+  Summed-area tables of a tile: entry (y, x) holds the number of unmasked pixels, and
+  the sums of their counts and squared counts, over rows [0, y) and columns [0, x).
+*/
+struct summed_area_t {
+  void resize(size_t width, size_t height) {
+    stride = width + 1;
+    n.assign(stride * (height + 1), 0);
+    sum.assign(stride * (height + 1), 0);
+    sum_sq.assign(stride * (height + 1), 0);
+  }
+
+  size_t                stride;
+  std::vector<uint32_t> n;
+  std::vector<uint64_t> sum;
+  std::vector<double>   sum_sq; //!< can exceed 64 bits for 32-bit pixels
+};
+
+template<typename T>
+void spot_finder::threshold(const frame_tile_t& tile, const T* frame, size_t width) {
+  thread_local summed_area_t sat;
+  thread_local std::vector<uint32_t> row_n;
+  thread_local std::vector<uint64_t> row_sum;
+  thread_local std::vector<double> row_sum_sq;
+  const size_t tw = tile.width, th = tile.height;
+  sat.resize(tw, th);
+  row_n.resize(tw);
+  row_sum.resize(tw);
+  row_sum_sq.resize(tw);
+  const uint8_t* pixel_mask = m_pixel_mask.empty() ? nullptr : m_pixel_mask.data();
+  const size_t stride = sat.stride;
+
+  // Each row of the tables is the previous row plus a prefix sum along this row. The
+  // prefix sum is serial, the rest is vectorized.
+  for (size_t y=0; y < th; ++y) {
+    const size_t offset = (tile.y + y)*width + tile.x;
+    const T* row = frame + offset;
+    const uint8_t* row_mask = pixel_mask ? pixel_mask + offset : nullptr;
+#pragma omp simd
+    for (size_t x=0; x < tw; ++x) {
+      const bool valid = !pixel_traits<T>::is_masked(row[x]) && !(row_mask && row_mask[x]);
+      const uint64_t v = valid ? row[x] : 0;
+      row_n[x] = valid;
+      row_sum[x] = v;
+      row_sum_sq[x] = double(v) * double(v);
+    }
+    for (size_t x=1; x < tw; ++x) {
+      row_n[x] += row_n[x-1];
+      row_sum[x] += row_sum[x-1];
+      row_sum_sq[x] += row_sum_sq[x-1];
+    }
+    const uint32_t* above_n = sat.n.data() + y*stride + 1;
+    const uint64_t* above_sum = sat.sum.data() + y*stride + 1;
+    const double* above_sum_sq = sat.sum_sq.data() + y*stride + 1;
+    uint32_t* out_n = sat.n.data() + (y+1)*stride + 1;
+    uint64_t* out_sum = sat.sum.data() + (y+1)*stride + 1;
+    double* out_sum_sq = sat.sum_sq.data() + (y+1)*stride + 1;
+#pragma omp simd
+    for (size_t x=0; x < tw; ++x) {
+      out_n[x] = above_n[x] + row_n[x];
+      out_sum[x] = above_sum[x] + row_sum[x];
+      out_sum_sq[x] = above_sum_sq[x] + row_sum_sq[x];
+    }
+  }
+
+  const int64_t k = m_options.kernel_size;
+  const double gain = m_options.gain;
+  const double sigma_b = m_options.sigma_background;
+  const double sigma_s = m_options.sigma_strong;
+  const uint64_t global_threshold = m_options.global_threshold;
+  const uint32_t min_local = m_options.min_local;
+  const uint32_t* n = sat.n.data();
+  const uint64_t* sum = sat.sum.data();
+  const double* sum_sq = sat.sum_sq.data();
+  size_t n_strong = 0;
+  for (int64_t y=0; y < int64_t(th); ++y) {
+    const size_t offset = (tile.y + y)*width + tile.x;
+    const T* row = frame + offset;
+    const uint8_t* row_mask = pixel_mask ? pixel_mask + offset : nullptr;
+    uint8_t* strong = m_strong.data() + offset;
+    const size_t top = std::max<int64_t>(y - k, 0) * stride;
+    const size_t bottom = std::min<int64_t>(y + k + 1, th) * stride;
+#pragma omp simd reduction(+:n_strong)
+    for (int64_t x=0; x < int64_t(tw); ++x) {
+      const size_t left = std::max<int64_t>(x - k, 0);
+      const size_t right = std::min<int64_t>(x + k + 1, tw);
+      const uint32_t box_n = n[bottom + right] - n[top + right] - n[bottom + left] + n[top + left];
+      const double box_sum = double(sum[bottom + right] - sum[top + right] -
+				    sum[bottom + left] + sum[top + left]);
+      const double box_sum_sq = sum_sq[bottom + right] - sum_sq[top + right] -
+	sum_sq[bottom + left] + sum_sq[top + left];
+
+      const double m = (box_n > 1) ? double(box_n) : 2.0; // avoids dividing by zero
+      const double mean = box_sum / m;
+      const double variance = (m*box_sum_sq - box_sum*box_sum) / (m*(m - 1));
+      const double v = row[x];
+      const bool valid = !pixel_traits<T>::is_masked(row[x]) && !(row_mask && row_mask[x]);
+      const bool dispersed = variance > gain * mean * (1.0 + sigma_b * sqrt(2.0 / (m - 1)));
+      const bool above_mean = v > mean + sigma_s * sqrt(gain * mean);
+      const bool result = valid && box_n >= min_local && mean > 0 && dispersed &&
+	above_mean && uint64_t(row[x]) > global_threshold;
+      strong[x] = result;
+      n_strong += result;
+    }
+  }
+#pragma omp atomic
+  m_n_strong += n_strong;
+}
+
+template<typename T>
+void spot_finder::label(const T* frame, size_t width, size_t height,
+			std::vector<spot_t>& spots) {
+  // Extract runs of strong pixels, one row per iteration.
+  m_row_runs.resize(height);
+  const int64_t n_rows = height;
+#pragma omp parallel for schedule(static)
+  for (int64_t y=0; y < n_rows; ++y) {
+    std::vector<run_t>& runs = m_row_runs[y];
+    runs.clear();
+    const uint8_t* strong = m_strong.data() + y*width;
+    for (size_t x=0; x < width; ++x) {
+      if (strong[x]) {
+	const size_t x0 = x;
+	while (x < width && strong[x]) {
+	  ++x;
+	}
+	runs.push_back(run_t{uint32_t(y), uint32_t(x0), uint32_t(x)});
+      }
+    }
+  }
+
+  // Join runs which overlap a run in the row above into one union-find tree per spot.
+  auto find_root = [this](uint32_t i) {
+    while (m_parents[i] != i) {
+      m_parents[i] = m_parents[m_parents[i]]; // path halving
+      i = m_parents[i];
+    }
+    return i;
+  };
+  std::vector<run_t> runs;
+  std::vector<size_t> row_begin(height + 1, 0);
+  for (size_t y=0; y < height; ++y) {
+    row_begin[y] = runs.size();
+    runs.insert(runs.end(), m_row_runs[y].begin(), m_row_runs[y].end());
+  }
+  row_begin[height] = runs.size();
+  m_parents.resize(runs.size());
+  for (uint32_t i=0; i < m_parents.size(); ++i) {
+    m_parents[i] = i;
+  }
+  for (size_t y=1; y < height; ++y) {
+    size_t a = row_begin[y-1], b = row_begin[y];
+    while (a < row_begin[y] && b < row_begin[y+1]) {
+      if (runs[a].x0 < runs[b].x1 && runs[b].x0 < runs[a].x1) {
+	uint32_t ra = find_root(a), rb = find_root(b);
+	m_parents[std::max(ra, rb)] = std::min(ra, rb);
+      }
+      // Advance whichever run ends first; it cannot overlap anything further right.
+      if (runs[a].x1 < runs[b].x1) {
+	++a;
+      } else {
+	++b;
+      }
+    }
+  }
+
+  // Accumulate the moments of each spot at its root, which is its first run.
+  struct moments_t {
+    uint64_t n;
+    uint64_t sum;
+    double   sum_x;
+    double   sum_y;
+    uint32_t peak;
+  };
+  std::vector<moments_t> moments(runs.size(), moments_t{0, 0, 0, 0, 0});
+  for (uint32_t i=0; i < runs.size(); ++i) {
+    moments_t& m = moments[find_root(i)];
+    const run_t& r = runs[i];
+    const T* row = frame + size_t(r.y)*width;
+    for (uint32_t x=r.x0; x < r.x1; ++x) {
+      const uint64_t v = row[x];
+      m.sum += v;
+      m.sum_x += double(v) * (x + 0.5);
+      m.sum_y += double(v) * (r.y + 0.5);
+      m.peak = std::max<uint32_t>(m.peak, v);
+    }
+    m.n += r.x1 - r.x0;
+  }
+
+  spots.clear();
+  for (uint32_t i=0; i < runs.size(); ++i) {
+    const moments_t& m = moments[i];
+    if (m_parents[i] != i || m.n < m_options.min_spot_size ||
+	m.n > m_options.max_spot_size || m.sum == 0) {
+      continue;
+    }
+    spots.push_back(spot_t{m.sum_x / m.sum, m.sum_y / m.sum, m.sum, m.peak, uint32_t(m.n)});
+  }
+}
+
+template<typename T>
+void spot_finder::find(const frame_tiling& tiling, const T* frame, std::vector<spot_t>& spots) {
+  const size_t width = tiling.width(), height = tiling.height();
+  if (!m_pixel_mask.empty() && (m_mask_width != width || m_mask_height != height)) {
+    std::stringstream ss;
+    ss << "The pixel mask is " << m_mask_width << "x" << m_mask_height
+       << " pixels, but the frame is " << width << "x" << height << " pixels." << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+  // Pixels outside every tile are never written, and so are never strong.
+  if (m_strong.size() != tiling.n_pixels()) {
+    m_strong.assign(tiling.n_pixels(), 0);
+  }
+  const uint8_t* pixel_mask = m_pixel_mask.empty() ? nullptr : m_pixel_mask.data();
+  const bool incremental = m_use_background &&
+    m_options.background == spot_background_t::incremental;
+  // Another worker may start the next series at any time, so threshold() itself
+  // checks whether the model applies to this frame.
+  if (!incremental ||
+      !m_background->threshold(tiling, frame, pixel_mask, m_options.sigma_strong,
+			       m_options.gain, m_options.global_threshold, m_strong.data(),
+			       m_n_strong)) {
+    m_n_strong = 0;
+    tiling.for_each_tile([&](const frame_tile_t& tile, size_t) {
+      threshold(tile, frame, width);
+    });
+    if (incremental) {
+      m_background->update(tiling, frame, pixel_mask, m_strong.data());
+    }
+  }
+  label(frame, width, height, spots);
+}
+
+void spot_finder::find(const frame_tiling& tiling, const void* frame, int64_t bit_depth,
+		       std::vector<spot_t>& spots) {
+  dispatch_pixel_type(bit_depth, [&](auto pixel) {
+    using T = decltype(pixel);
+    find(tiling, static_cast<const T*>(frame), spots);
+  });
+}
+
+template void spot_finder::find<uint8_t>(const frame_tiling&, const uint8_t*, std::vector<spot_t>&);
+template void spot_finder::find<uint16_t>(const frame_tiling&, const uint16_t*, std::vector<spot_t>&);
+template void spot_finder::find<uint32_t>(const frame_tiling&, const uint32_t*, std::vector<spot_t>&);
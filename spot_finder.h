@@ -0,0 +1,185 @@
+#ifndef BP_SPOT_FINDER_H
+#define BP_SPOT_FINDER_H
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include <simdjson.h>
+
+#include "background_model.h"
+#include "dectris_utils.h"
+#include "frame_tiling.h"
+
+namespace bigpicture {
+  /**
+   * A connected group of strong pixels, i.e. a candidate Bragg reflection.
+   */
+  struct spot_t {
+    double   x;         //!< count-weighted centroid, pixels from the frame edge
+    double   y;         //!< count-weighted centroid, pixels from the frame edge
+    uint64_t intensity; //!< total counts
+    uint32_t peak;      //!< largest pixel value
+    uint32_t n_pixels;
+  };
+
+  /**
+   * How the spot finder estimates the background of each pixel.
+   */
+  enum class spot_background_t : int {
+    local=0,       //!< From the box around the pixel, in every frame
+    incremental=1, //!< From a background_model of the preceding frames of the series
+  };
+
+  /**
+   * Parameters of the dispersion spot finder, as in DIALS' "dispersion" threshold.
+   */
+  struct spot_finder_options_t {
+    spot_finder_options_t() noexcept :
+      background(spot_background_t::local),
+      background_alpha(0.05),
+      background_readmit(10),
+      background_warmup(5),
+      kernel_size(3),
+      sigma_background(6.0),
+      sigma_strong(3.0),
+      gain(1.0),
+      global_threshold(0),
+      min_local(2),
+      min_spot_size(2),
+      max_spot_size(1000) {}
+
+    /**
+     * Reads the optional "/indexer/spot_finder" section of a bigpicture config file:
+     *
+     *   "spot_finder" : {
+     *     "background"         : "local", // or "incremental"
+     *     "background_alpha"   : 0.05,
+     *     "background_readmit" : 10,
+     *     "background_warmup"  : 5,
+     *     "kernel_size"        : 3,    // half-width of the local box, i.e. 7x7
+     *     "sigma_background"   : 6.0,
+     *     "sigma_strong"       : 3.0,
+     *     "gain"               : 1.0,
+     *     "global_threshold"   : 0,
+     *     "min_local"          : 2,
+     *     "spot_size"          : [2, 1000]
+     *   }
+     *
+     * Missing parameters retain their defaults.
+     */
+    explicit spot_finder_options_t(const simdjson::dom::object& config);
+
+    spot_background_t background;
+    double            background_alpha;  //!< weight of each frame in the background model
+    size_t            background_readmit; //!< strong frames in a row before a pixel is background
+    size_t            background_warmup; //!< frames searched with the local background first
+    size_t            kernel_size;       //!< half-width of the local box in pixels
+    double            sigma_background;  //!< dispersion above which a box is not background
+    double            sigma_strong;      //!< counts above the local mean, in standard deviations
+    double            gain;              //!< detector gain in counts per photon
+    uint64_t          global_threshold;  //!< strong pixels must exceed this many counts
+    size_t            min_local;         //!< unmasked pixels required in the local box
+    size_t            min_spot_size;     //!< pixels
+    size_t            max_spot_size;     //!< pixels
+  };
+
+  /**
+   * Finds strong spots in a frame.
+   *
+   * A pixel is strong if the counts in the box of (2*kernel_size+1)^2 pixels around it
+   * are over-dispersed for Poisson noise (variance/mean is more than sigma_background
+   * standard errors above 1), and the pixel is more than sigma_strong standard
+   * deviations above the mean of the box. Box sums come from summed-area tables, so
+   * the cost per pixel does not depend on kernel_size. Strong pixels are then joined
+   * into 4-connected spots.
+   *
+   * Gaps and bad pixels (see pixel_traits), and pixels set in the optional pixel mask,
+   * are excluded from every box and never strong. Boxes do not extend past the edges
+   * of a tile, i.e. a detector module, and tiles are processed in parallel.
+   *
+   * With an incremental background, the box is only used for the first frames of a
+   * series. Once its background_model is warm, a pixel is strong if it is more than
+   * sigma_strong standard deviations above its own background, in a single pass over
+   * the frame which also updates the model. Spot finders searching the same series in
+   * parallel may share one model.
+   */
+  class spot_finder {
+  public:
+    /**
+     * @param background The incremental background model, e.g. one shared with other
+     *                   spot finders, or nullptr for one of its own.
+     */
+    explicit spot_finder(const spot_finder_options_t& options=spot_finder_options_t(),
+			 std::shared_ptr<background_model> background=nullptr) :
+      m_options(options),
+      m_background(background ? std::move(background) :
+		   std::make_shared<background_model>(options.background_alpha,
+						      options.background_warmup,
+						      options.background_readmit)),
+      m_mask_width(0), m_mask_height(0), m_n_strong(0), m_use_background(true) {}
+
+    /**
+     * Excludes every pixel with a nonzero value in mask, e.g. the pixel mask from the
+     * detector's global header (see dectris_global_data::pixelmask()), in addition to
+     * the gap and bad pixel sentinels. An empty mask clears it.
+     */
+    void set_pixel_mask(const mask_t<uint32_t>& mask);
+
+    /**
+     * Replaces spots with the spots found in a frame.
+     * @param frame An uncompressed frame with the dimensions of tiling.
+     * \throws std::runtime_error if a pixel mask is set with other dimensions.
+     */
+    template<typename T>
+    void find(const frame_tiling& tiling, const T* frame, std::vector<spot_t>& spots);
+
+    /// Type-erased overload of find() for use with the image bit depth.
+    void find(const frame_tiling& tiling, const void* frame, int64_t bit_depth,
+	      std::vector<spot_t>& spots);
+
+    /**
+     * Starts searching the frames of a series, see background_model::begin_series().
+     * A frame of the previous series, which another spot finder sharing the model has
+     * already moved on from, is searched with the local background instead.
+     */
+    void begin_series(int64_t series_id) {
+      m_use_background = m_background->begin_series(series_id);
+    }
+
+    /// Forgets the incremental background, e.g. at the start of a series.
+    void reset_background() { m_background->reset(); m_use_background = true; }
+
+    const spot_finder_options_t& options() const { return m_options; }
+    const background_model&      background() const { return *m_background; }
+
+    /// @return The number of strong pixels in the last frame.
+    size_t n_strong() const { return m_n_strong; }
+
+  private:
+    /// A horizontal run of strong pixels [x0, x1) in row y.
+    struct run_t {
+      uint32_t y;
+      uint32_t x0;
+      uint32_t x1;
+    };
+
+    template<typename T> void threshold(const frame_tile_t& tile, const T* frame,
+					size_t width);
+    template<typename T> void label(const T* frame, size_t width, size_t height,
+				    std::vector<spot_t>& spots);
+
+    spot_finder_options_t m_options;
+    std::shared_ptr<background_model> m_background;
+    std::vector<uint8_t>  m_pixel_mask; //!< 1 if masked, empty if no mask is set
+    size_t                m_mask_width;
+    size_t                m_mask_height;
+    std::vector<uint8_t>  m_strong;     //!< 1 if strong, one per pixel
+    std::vector<std::vector<run_t>> m_row_runs;
+    std::vector<uint32_t> m_parents;    //!< union-find forest over runs
+    size_t                m_n_strong;
+    bool                  m_use_background; //!< false for a frame of the previous series
+  };
+}
+
+#endif // header guard
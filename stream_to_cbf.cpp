@@ -1,4 +1,7 @@
+#include <chrono>
 #include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
 #include <inttypes.h>
 #include <memory>
 #include <sstream>
@@ -7,6 +10,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <vector>
 
 #include <cbflib/cbf.h>
 
@@ -16,20 +21,154 @@
 #include "bigpicture_utils.h"
 #include "dectris_stream.h"
 #include "dectris_utils.h"
+#include "frame_tiling.h"
 #include "stream_to_cbf.h"
 
 using namespace bigpicture;
 
 bool stream_to_cbf::parse(const void* data, size_t len) {
+  try {
+    return parse_message(data, len);
+  } catch (const std::system_error&) {
+    throw; // storage failures are not protocol errors
+  } catch (const std::bad_alloc&) {
+    throw;
+  } catch (const std::exception& e) {
+    return begin_resync(e, data, len);
+  }
+}
+
+/*
+  Called with the message part which could not be parsed. Frames are self-contained, so
+  once the global header of a series is known, the series resumes at the next frame.
+  Returns true if the message part ends the series, like resync().
+*/
+bool stream_to_cbf::begin_resync(const std::exception& e, const void* data, size_t len) {
+  const parse_state_t failed_state = m_parse_state;
+  std::clog << "ERROR: series " << m_global.series_id() << ", frame " << m_frame_id
+	    << ": " << e.what() << std::endl;
+  if (failed_state == parse_state_t::global_header) {
+    // Discarded up to the next global header as if the archiver had just started.
+    m_global.reset();
+    ++m_n_discarded;
+    m_parts_discarded.add();
+    std::clog << "WARNING: discarding message parts until the next global header" << std::endl;
+    return false;
+  }
+  std::clog << "WARNING: discarding message parts until the next frame, series end or "
+	    << "global header" << std::endl;
+  m_parse_state = parse_state_t::resync;
+  m_appendix.clear();
+  m_frame_id = -1;
+  m_frame_stats = frame_stats_t();
+  cbf_free_handle(m_cbf);
+  m_cbf = nullptr; // necessary if line below fails
+  cbf_make_handle(&m_cbf);
+
+  // A part 1 which arrived where another part was expected, e.g. because a part was
+  // lost, starts the next frame. One which failed to parse as a part 1 is discarded.
+  if (failed_state != parse_state_t::new_frame) {
+    return resync(data, len);
+  }
+  ++m_n_discarded;
+  m_parts_discarded.add();
+  return false;
+}
+
+/*
+  Returns the result of parsing the message part if it resumes the stream, or true if
+  it starts the next series, since the series before has ended. Otherwise discards it
+  and returns false.
+*/
+bool stream_to_cbf::resync(const void* data, size_t len) {
+  std::string_view htype = sniff_htype(data, len);
+  bool series_ended = false;
+  if (htype == "dheader-1.0") {
+    // The rest of the series is lost, but consumers still learn that it ended.
+    std::clog << "WARNING: series " << m_global.series_id() << " ended without a series "
+	      << "end, " << m_n_committed << " frames committed: " << committed_frames()
+	      << std::endl;
+    if (m_journal) {
+      with_journal([&]() { m_journal->sync(); });
+    }
+    if (m_live) {
+      m_live->publish();
+    }
+    if (m_events) {
+      publish_event(frame_event_type_t::series_end);
+    }
+    reset();
+    series_ended = true;
+  } else if (htype == "dimage-1.0" || htype == "dseries_end-1.0") {
+    m_parse_state = parse_state_t::new_frame;
+  } else {
+    ++m_n_discarded;
+    m_parts_discarded.add();
+    return false;
+  }
+  std::clog << "WARNING: resynchronized on \"" << htype << "\" after discarding "
+	    << m_n_discarded << " message parts" << std::endl;
+  m_n_discarded = 0;
+  // The streamer learns that the series ended, e.g. to apply a pending reload before
+  // the rest of the next global header arrives.
+  return parse(data, len) || series_ended;
+}
+
+bool stream_to_cbf::parse_message(const void* data, size_t len) {
   bool received_series_end = false;
   
   switch (m_parse_state) {
   case parse_state_t::global_header:
+    // A restarted archiver may connect in the middle of a series, so everything up to
+    // the next global header is discarded.
+    if (m_global.series_id() < 0 && sniff_htype(data, len) != "dheader-1.0") {
+      ++m_n_discarded;
+      m_parts_discarded.add();
+      break;
+    }
     if (m_global.parse(data, len)) {
+      const size_t frame_size = (m_global.config().bit_depth_image/8) *
+	m_global.config().x_pixels_in_detector * m_global.config().y_pixels_in_detector;
+      m_tiling.reset(m_global.config(), m_layout);
+      // A series which does not fit in the memory budget is discarded, as if its
+      // global header had been malformed, rather than risking the archiver. The
+      // accumulators are sized only once the budget allows it.
+      const uint64_t series_memory = frame_size +
+	(m_summary ? m_summary->memory_usage(m_tiling) : 0) +
+	(m_live ? m_live->memory_usage(m_global.config().x_pixels_in_detector,
+				       m_global.config().y_pixels_in_detector) : 0);
+      if (!m_series_memory.try_resize(series_memory)) {
+	m_series_memory.resize(0);
+	m_buffer.reset();
+	std::stringstream ss;
+	ss << "series " << m_global.series_id() << " needs " << ((series_memory + (1 << 20) - 1) >> 20)
+	   << " MiB of frame buffers, more than is left of the memory budget";
+	throw std::runtime_error(ss.str());
+      }
+      if (m_summary) {
+	m_summary->reset(m_tiling);
+      }
+      if (m_live) {
+	m_live->reset(m_global.series_id(), m_global.config().x_pixels_in_detector,
+		      m_global.config().y_pixels_in_detector,
+		      m_global.config().bit_depth_image);
+      }
       m_parse_state = parse_state_t::new_frame;
-      m_buffer.reset((m_global.config().bit_depth_image/8) *
-		     m_global.config().x_pixels_in_detector *
-		     m_global.config().y_pixels_in_detector);
+      m_buffer.reset(frame_size);
+      m_metric_series.set(m_global.series_id());
+      if (m_n_discarded) {
+	std::clog << "WARNING: discarded " << m_n_discarded << " message parts before the "
+		  << "global header of series " << m_global.series_id() << std::endl;
+	m_n_discarded = 0;
+      }
+      if (m_journal) {
+	const detector_config_t& detector = m_global.config();
+	const int64_t n_frames = (detector.nimages > 0 && detector.ntrigger > 0) ?
+	  detector.nimages * detector.ntrigger : -1;
+	with_journal([&]() {
+	  m_journal->begin(m_global.series_id(), n_frames, detector.to_json());
+	});
+      }
     }
     break;
     
@@ -37,9 +176,14 @@ bool stream_to_cbf::parse(const void* data, size_t len) {
     if (parse_part1_or_series_end(data, len)) {
       // Parsed series end
       received_series_end = true;
+      if (m_events) {
+	publish_event(frame_event_type_t::series_end);
+      }
       reset(); // sets state to global_header
     } else {
       // Parsed part 1
+      m_frame_start = std::chrono::steady_clock::now();
+      m_frames_received.add();
       build_cbf_header();
       m_parse_state = parse_state_t::midframe_part2;
     }      
@@ -71,6 +215,9 @@ bool stream_to_cbf::parse(const void* data, size_t len) {
     flush(); // TODO: remove me, call flush() in dectris_streamer
     m_parse_state = parse_state_t::new_frame;
     break;
+
+  case parse_state_t::resync:
+    return resync(data, len);
     
   default:
     assert(false && "stream_to_cbf is in an unknown state");
@@ -106,6 +253,17 @@ bool stream_to_cbf::parse_part1_or_series_end(const void* data, size_t len) {
       throw std::runtime_error(ss.str());
     }
     std::clog << "INFO: series end record - " << padded << std::endl;
+    std::clog << "INFO: series " << series_id << ", " << m_n_committed
+	      << " frames committed: " << committed_frames() << std::endl;
+    if (m_journal) {
+      with_journal([&]() { m_journal->end(); });
+    }
+    if (m_summary) {
+      write_summary();
+    }
+    if (m_live) {
+      m_live->publish();
+    }
     return true;
     
   } else if (htype.compare("dimage-1.0") != 0) { // not part 1
@@ -152,8 +310,24 @@ inline void stream_to_cbf::parse_part2(const void* data, size_t len) {
 }
 
 inline void stream_to_cbf::parse_part3(const void* data, size_t len) {
-  m_buffer.decode(m_global.config().compression, data, len,
-		  m_global.config().bit_depth_image/8);
+  const detector_config_t& config = m_global.config();
+  m_buffer.decode(config.compression, data, len, config.bit_depth_image/8);
+  if (m_ring) {
+    publish_frame(data, len);
+  }
+
+  // Statistics are gathered per detector module in parallel while the frame is
+  // still hot in cache.
+  uint64_t cutoff = (config.countrate_correction_count_cutoff > 0) ?
+    config.countrate_correction_count_cutoff : UINT64_MAX;
+  m_frame_stats = compute_frame_stats(m_tiling, m_buffer.get(),
+				      config.bit_depth_image, cutoff);
+  if (m_summary) {
+    m_summary->add(m_buffer.get(), config.bit_depth_image);
+  }
+  if (m_live) {
+    m_live->add(m_frame_id, m_buffer.get());
+  }
 }
 
 inline void stream_to_cbf::parse_part4(const void* data, size_t len) {
@@ -171,6 +345,34 @@ inline void stream_to_cbf::parse_part4(const void* data, size_t len) {
 #endif
 }
 
+void stream_to_cbf::publish_frame(const void* data, size_t len) {
+  const detector_config_t& config = m_global.config();
+  frame_meta_t meta;
+  meta.series_id = m_global.series_id();
+  meta.frame_id  = m_frame_id;
+  meta.width     = config.x_pixels_in_detector;
+  meta.height    = config.y_pixels_in_detector;
+  meta.bit_depth = config.bit_depth_image;
+
+  bool published;
+  if (m_ring->payload() == frame_ring_payload_t::decoded) {
+    meta.compression = compressor_t::none;
+    published = m_ring->publish(meta, m_buffer.get(), m_buffer.size());
+  } else {
+    meta.compression = config.compression;
+    published = m_ring->publish(meta, data, len);
+  }
+
+  // Consumers of the ring are best-effort, so an oversized frame is not fatal, but
+  // warn once so the slot size can be corrected.
+  if (!published && m_ring->n_oversize() == 1) {
+    std::clog << "WARNING: frame " << m_frame_id << " of series " << meta.series_id
+	      << " is too large for the shared-memory frame ring (slot size "
+	      << m_ring->slot_size() << " bytes); increase \"/archiver/frame_ring/slot_mb\"."
+	      << std::endl;
+  }
+}
+
 inline void stream_to_cbf::parse_appendix(const void* data, size_t len) {
   /*
     This general-purpose class doesn't do anything with the image appendix,
@@ -180,7 +382,12 @@ inline void stream_to_cbf::parse_appendix(const void* data, size_t len) {
   m_appendix = std::string(static_cast<const char*>(data), len);
 }
 
-void stream_to_cbf::build_cbf_header() {
+/*
+  Formats the SLS miniCBF header, which describes the detector and the exposure.
+*/
+static void format_minicbf_header(char* buf, size_t len, const detector_config_t& config,
+				  double exposure_time, double exposure_period,
+				  double start_angle, double angle_increment) {
   // FIXME: Is it really necessary to convert the pixel size to an integer number?
   // eiger2cbf does it, but surely there's some documentation that can decisively
   // say one way or another whether this is needed or unnecessary loss of precision.
@@ -197,21 +404,28 @@ void stream_to_cbf::build_cbf_header() {
     "# Beam_xy (%d, %d) pixels\n"
     "# Start_angle %lf deg.\n"
     "# Angle_increment %lf deg.\n";
-  static char header_content[4096];
-  
-  const detector_config_t& config = m_global.config();
-  snprintf(static_cast<char*>(header_content), sizeof(header_content), header_format,
+  snprintf(buf, len, header_format,
 	   config.description.c_str(), config.detector_number.c_str(),
 	   (int64_t)(config.x_pixel_size * 1E6), (int64_t)(config.y_pixel_size * 1E6),
 	   config.sensor_thickness,
-	   config.count_time,
-	   config.frame_time,
+	   exposure_time,
+	   exposure_period,
 	   config.countrate_correction_count_cutoff,
 	   config.wavelength,
 	   config.detector_distance,
 	   (int)config.beam_center_x, (int)config.beam_center_y,
-	   config.omega_start + ((double)(m_frame_id-1))*config.omega_increment,
-	   config.omega_increment);
+	   start_angle,
+	   angle_increment);
+}
+
+void stream_to_cbf::build_cbf_header() {
+  static char header_content[4096];
+
+  const detector_config_t& config = m_global.config();
+  format_minicbf_header(header_content, sizeof(header_content), config,
+			config.count_time, config.frame_time,
+			config.omega_start + ((double)(m_frame_id-1))*config.omega_increment,
+			config.omega_increment);
 
   cbf_new_datablock(m_cbf, "image_1");
   cbf_new_category(m_cbf, "array_data");
@@ -243,34 +457,266 @@ inline void stream_to_cbf::build_cbf_data() {
 				0); //padding
 }
 
-void stream_to_cbf::flush() {
-  // Build a filepath and open the output file.
+std::string stream_to_cbf::output_path() const {
   // TODO: The current implementation litters output files in the cwd of the process.
   //       We need to determine a sufficiently general-purpose directory structure
   //       which is relatively neat and orderly.
   std::stringstream ss_filename;
   ss_filename << m_global.series_id() << "-" << m_frame_id << ".cbf";
+  return ss_filename.str();
+}
+
+void stream_to_cbf::reconfigure(const simdjson::dom::object& config) {
+  using json_obj = simdjson::dom::object;
+  json_obj tmp_obj;
+
+  // Build everything which might throw before replacing anything.
+  bool using_image_appendix = false;
+  maybe_extract_json_pointer(using_image_appendix, config,
+			     "/archiver/source/using_image_appendix");
+  module_layout_t layout(config);
+  std::unique_ptr<series_summary> summary;
+  if (!config.at_pointer("/archiver/summary").get(tmp_obj)) {
+    summary.reset(new series_summary(config));
+  }
+
+  bool with_ring = !config.at_pointer("/archiver/frame_ring").get(tmp_obj);
+  keep_running_value(with_ring, bool(m_ring), "/archiver/frame_ring");
+  bool with_events = !config.at_pointer("/events").get(tmp_obj);
+  keep_running_value(with_events, bool(m_events), "/events");
+
+  // The live view is recreated under the same shared-memory name, so the old one must
+  // be released first. If the new one fails, the archiver runs on without it.
+  m_live.reset();
+  if (!config.at_pointer("/archiver/live_view").get(tmp_obj)) {
+    try {
+      m_live.reset(new live_view(config));
+    } catch (const std::exception& e) {
+      std::clog << "ERROR: the live view is disabled until the config is fixed: "
+		<< e.what() << std::endl;
+    }
+  }
+  m_layout = std::move(layout);
+  m_summary = std::move(summary);
+  m_using_image_appendix = using_image_appendix;
+  std::clog << "INFO: applied the reloaded config file" << std::endl;
+}
+
+std::string stream_to_cbf::committed_frames() const {
+  return format_frame_ranges(m_committed);
+}
+
+/*
+  Journal failures are logged rather than thrown, since a frame which could not be
+  journaled was still archived.
+*/
+template<typename F>
+void stream_to_cbf::with_journal(F f) {
+  try {
+    f();
+  } catch (const std::exception& e) {
+    std::clog << "ERROR: the series journal is disabled until restart: " << e.what() << std::endl;
+    m_journal.reset();
+  }
+}
+
+void stream_to_cbf::recover_journal() {
+  series_journal_t journal;
+  try {
+    if (!read_series_journal(m_journal->path(), journal)) {
+      return;
+    }
+  } catch (const std::exception& e) {
+    std::clog << "WARNING: " << e.what() << std::endl;
+    return;
+  }
+  if (journal.complete) {
+    std::clog << "INFO: series " << journal.series_id << " was archived completely" << std::endl;
+    return;
+  }
+  std::clog << "WARNING: series " << journal.series_id << " was interrupted, "
+	    << journal.n_committed() << " frames committed: "
+	    << format_frame_ranges(journal.committed()) << std::endl;
+  if (journal.n_frames >= 0) {
+    std::clog << "WARNING: series " << journal.series_id << " is missing frames "
+	      << format_frame_ranges(journal.missing()) << " of " << journal.n_frames
+	      << ", see " << m_journal->path() << " for its global header" << std::endl;
+  }
+}
+
+void stream_to_cbf::drain() {
+  if (m_journal) {
+    with_journal([&]() { m_journal->sync(); });
+  }
+  if (m_parse_state != parse_state_t::global_header) {
+    // Consumers close out the series as if it had ended, with the frames it has.
+    std::clog << "WARNING: series " << m_global.series_id() << " interrupted, "
+	      << m_n_committed << " frames committed: " << committed_frames() << std::endl;
+    if (m_live) {
+      m_live->publish();
+    }
+    if (m_events) {
+      publish_event(frame_event_type_t::series_end);
+    }
+    frame_ranges_t committed = std::move(m_committed);
+    reset();
+    m_committed = std::move(committed); // still reported by committed_frames()
+  }
+
+  // Frames are written to the working directory, see output_path().
+  int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || syncfs(fd) != 0) {
+    std::clog << "ERROR: failed to sync archived frames to storage: "
+	      << strerror(errno) << std::endl;
+  } else {
+    std::clog << "INFO: archived frames synced to storage" << std::endl;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+void stream_to_cbf::register_metrics() {
+  m_frames_received = m_metrics->counter("frames_received");
+  m_frames_archived = m_metrics->counter("frames_archived");
+  m_metric_series   = m_metrics->counter("series_id");
+  m_metric_frame    = m_metrics->counter("frame_id");
+  m_parts_discarded = m_metrics->counter("parts_discarded");
+  m_frame_us        = m_metrics->histogram("frame_us");
+}
+
+void stream_to_cbf::publish_event(frame_event_type_t type) {
+  frame_event_t event;
+  event.type        = type;
+  event.series_id   = m_global.series_id();
+  event.n_committed = m_n_committed;
+  event.geometry    = frame_geometry_t(m_global.config());
+  if (type == frame_event_type_t::frame) {
+    event.frame_id = m_frame_id;
+    event.path     = std::filesystem::absolute(output_path()).string();
+    event.stats    = m_frame_stats;
+  }
+  m_events->publish(event);
+}
+
+/*
+  Failed writes are storage failures rather than protocol errors, so they are thrown as
+  std::system_error like failures to open the file, and are not resynchronized past.
+*/
+static void throw_cbf_write_error(int cbf_err, int err, const std::string& filename) {
+  std::stringstream ss;
+  ss << "libcbf error code " << cbf_err << ": " << filename
+     << " - " << cbf_strerror(cbf_err) << "\n";
+  throw std::system_error(err ? err : EIO, std::system_category(), ss.str());
+}
+
+/*
+  Writes a signed 32-bit image to a standalone miniCBF file.
+*/
+static void write_minicbf(const std::string& filename, const char* header_content,
+			  int32_t* data, size_t width, size_t height) {
+  cbf_handle cbf = nullptr;
+  cbf_make_handle(&cbf);
+  cbf_new_datablock(cbf, "image_1");
+  cbf_new_category(cbf, "array_data");
+  cbf_new_column(cbf, "header_convention");
+  cbf_set_value(cbf, "SLS_1.0");
+  cbf_new_column(cbf, "header_contents");
+  cbf_set_value(cbf, header_content);
+  cbf_new_category(cbf, "array_data");
+  cbf_new_column(cbf, "data");
+  cbf_set_integerarray_wdims_fs(cbf, CBF_BYTE_OFFSET, 1, data, sizeof(int32_t), 1,
+				width * height, "little_endian", width, height, 0, 0);
+
+  FILE* file_handle = fopen(filename.c_str(), "wb");
+  if (file_handle == nullptr) {
+    int err = errno;
+    cbf_free_handle(cbf);
+    std::stringstream ss;
+    ss << "libc error: " << filename << " - " << strerror(err) << "\n";
+    throw std::system_error(err, std::system_category(), ss.str());
+  }
+  // NOTE: cbf_write_file() closes file_handle.
+  errno = 0;
+  int cbf_err = cbf_write_file(cbf, file_handle, /*readable*/1, /*format*/CBF,
+			       MSG_DIGEST|MIME_HEADERS|PAD_4K, /*encoding*/ENC_BASE64);
+  int err = errno;
+  cbf_free_handle(cbf);
+  if (cbf_err != 0) {
+    throw_cbf_write_error(cbf_err, err, filename);
+  }
+}
+
+void stream_to_cbf::write_summary() {
+  const detector_config_t& config = m_global.config();
+  const uint64_t n_frames = m_summary->n_frames();
+  if (n_frames == 0) {
+    return;
+  }
+
+  // The summary spans the whole sweep, as if it were a single long exposure.
+  static char header_content[4096];
+  format_minicbf_header(header_content, sizeof(header_content), config,
+			config.count_time * n_frames, config.frame_time * n_frames,
+			config.omega_start, config.omega_increment * n_frames);
+
+  std::vector<int32_t> image(m_summary->width() * m_summary->height());
+  auto write = [&](const char* kind) {
+    std::stringstream ss_filename;
+    ss_filename << m_global.series_id() << "-" << kind << ".cbf";
+    write_minicbf(ss_filename.str(), header_content, image.data(),
+		  m_summary->width(), m_summary->height());
+    std::clog << "INFO: wrote the " << kind << " of " << n_frames << " frames of series "
+	      << m_global.series_id() << " to " << ss_filename.str() << std::endl;
+  };
+  if (m_summary->with_sum()) {
+    m_summary->sum_image(image.data());
+    write("sum");
+  }
+  if (m_summary->with_max()) {
+    m_summary->max_image(image.data());
+    write("max");
+  }
+}
+
+void stream_to_cbf::flush() {
+  // Build a filepath and open the output file.
+  std::string filename = output_path();
   
   // We open a file handle but pass ownership to libcbf.
-  FILE* file_handle = fopen(ss_filename.str().c_str(), "wb");
+  FILE* file_handle = fopen(filename.c_str(), "wb");
   if (file_handle == nullptr) {
     std::stringstream ss;
-    ss << "libc error: " << ss_filename.str() << " - " << strerror(errno) << "\n";
+    ss << "libc error: " << filename << " - " << strerror(errno) << "\n";
     throw std::system_error(errno, std::system_category(), ss.str());
   }
 
   // Write the file; set readable to 1 so we can close the file handle ourselves.
   // NOTE: We do not fclose because cbf_write_file() does it for us.
+  errno = 0;
   int cbf_err = cbf_write_file(m_cbf, file_handle, /*readable*/1, /*format*/CBF,
 			       MSG_DIGEST|MIME_HEADERS|PAD_4K, /*encoding*/ENC_BASE64);
   //fclose(file_handle);
   if (cbf_err != 0) {
-    std::stringstream ss;
-    ss << "libcbf error code " << cbf_err << ": " << ss_filename.str()
-       << " - " << cbf_strerror(cbf_err) << "\n";
-    throw std::runtime_error(ss.str());
+    throw_cbf_write_error(cbf_err, errno, filename);
   }
+  ++m_n_committed;
+  if (!m_committed.empty() && m_committed.back().second + 1 == m_frame_id) {
+    ++m_committed.back().second;
+  } else {
+    m_committed.emplace_back(m_frame_id, m_frame_id);
+  }
+  if (m_journal) {
+    with_journal([&]() { m_journal->commit(m_frame_id); });
+  }
+  m_frames_archived.add();
+  m_metric_frame.set(m_frame_id);
+  m_frame_us.record(std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - m_frame_start).count());
 #ifndef NDEBUG
-  std::clog << "DEBUG: " << ss_filename.str() << " committed to storage\n";
+  std::clog << "DEBUG: " << filename << " committed to storage\n";
 #endif
+  if (m_events) {
+    publish_event(frame_event_type_t::frame);
+  }
 }
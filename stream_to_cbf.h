@@ -1,13 +1,25 @@
 #ifndef BP_STREAM_TO_CBF_H
 #define BP_STREAM_TO_CBF_H
 
+#include <chrono>
+#include <memory>
 #include <string>
 #include <string.h>
+#include <utility>
+#include <vector>
 #include <cbflib/cbf.h>
 #include <simdjson.h>
 
 #include "dectris_stream.h"
 #include "dectris_utils.h"
+#include "frame_events.h"
+#include "frame_ring.h"
+#include "frame_tiling.h"
+#include "live_view.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "series_journal.h"
+#include "series_summary.h"
 
 namespace bigpicture {
 
@@ -18,8 +30,6 @@ namespace bigpicture {
    * @todo stream_to_cbf does not post-process image frames, e.g. by applying a pixel mask.
    *       The pixel mask and any other correction to images must be applied by the DCU.
    *
-   * @todo implement move constructor
-   *
    */
   class stream_to_cbf : public stream_parser<stream_to_cbf> {
   public:
@@ -35,9 +45,13 @@ namespace bigpicture {
       m_cbf(nullptr),
       m_frame_id(-1),
       m_global(using_header_appendix),
+      m_metrics(new metrics_writer()),
+      m_n_committed(0),
+      m_n_discarded(0),
       m_parse_state(parse_state_t::global_header),
       m_using_image_appendix(using_image_appendix) {
       
+      register_metrics();
       cbf_make_handle(&m_cbf);
     }
     
@@ -45,11 +59,37 @@ namespace bigpicture {
       m_cbf(nullptr),
       m_frame_id(-1),
       m_global(config),
+      m_layout(config),
+      m_metrics(new metrics_writer(config, "bparchived")),
+      m_n_committed(0),
+      m_n_discarded(0),
       m_parse_state(parse_state_t::global_header),
       m_using_image_appendix(false) {
       
       maybe_extract_json_pointer(m_using_image_appendix, config,
 				 "/archiver/source/using_image_appendix");
+      json_obj ring_config;
+      if (!config.at_pointer("/archiver/frame_ring").get(ring_config)) {
+	m_ring.reset(new frame_ring_writer(config));
+      }
+      json_obj events_config;
+      if (!config.at_pointer("/events").get(events_config)) {
+	m_events.reset(new frame_event_publisher(config));
+      }
+      json_obj live_config;
+      if (!config.at_pointer("/archiver/live_view").get(live_config)) {
+	m_live.reset(new live_view(config));
+      }
+      json_obj summary_config;
+      if (!config.at_pointer("/archiver/summary").get(summary_config)) {
+	m_summary.reset(new series_summary(config));
+      }
+      json_obj journal_config;
+      if (!config.at_pointer("/archiver/journal").get(journal_config)) {
+	m_journal.reset(new series_journal_writer(config));
+	recover_journal();
+      }
+      register_metrics();
       cbf_make_handle(&m_cbf);
     }
 
@@ -60,10 +100,32 @@ namespace bigpicture {
       m_appendix(std::move(src.m_appendix)),
       m_buffer(std::move(src.m_buffer)),
       m_cbf(src.m_cbf),
+      m_committed(std::move(src.m_committed)),
+      m_events(std::move(src.m_events)),
       m_frame_id(src.m_frame_id),
+      m_frame_start(src.m_frame_start),
+      m_frame_stats(src.m_frame_stats),
+      m_frame_us(src.m_frame_us),
+      m_frames_archived(src.m_frames_archived),
+      m_frames_received(src.m_frames_received),
       m_global(std::move(src.m_global)),
+      m_journal(std::move(src.m_journal)),
+      m_layout(std::move(src.m_layout)),
+      m_live(std::move(src.m_live)),
+      m_metric_frame(src.m_metric_frame),
+      m_metric_series(src.m_metric_series),
+      m_metrics(std::move(src.m_metrics)),
+      m_n_committed(src.m_n_committed),
+      m_n_discarded(src.m_n_discarded),
       m_parser(std::move(src.m_parser)),
-      m_parse_state(src.m_parse_state) {
+      m_parse_state(src.m_parse_state),
+      m_parts_discarded(src.m_parts_discarded),
+      m_ring(std::move(src.m_ring)),
+      m_series_memory(std::move(src.m_series_memory)),
+      m_summary(std::move(src.m_summary)),
+      m_tiling(std::move(src.m_tiling)),
+      m_using_image_appendix(src.m_using_image_appendix) {
+      src.m_cbf = nullptr; // the handle is freed once, by this object
     }
 
     ~stream_to_cbf() noexcept {
@@ -80,6 +142,10 @@ namespace bigpicture {
      * @return true if there are still more messages to parse, false if we have 
      *              reached the end of an entire image series.
      * @precondition If a pixel mask is used, the pixel mask is applied to all images.
+     * @note A message which cannot be parsed, e.g. one with an unexpected htype, costs
+     *       only the frame or global header it belongs to: message parts are discarded
+     *       until the next frame, series end or global header.
+     * \throws std::system_error if a frame cannot be written to storage.
      */
     bool parse(const void* data, size_t len);
 
@@ -89,16 +155,79 @@ namespace bigpicture {
      */
     void flush();
 
+    /**
+     * Abandons the current series, if any, reporting exactly which of its frames were
+     * written out, and syncs the output directory to stable storage.
+     */
+    void drain();
+
+    /**
+     * @return The frames of the current series written out so far, or after drain(),
+     *         those of the series it abandoned, as ranges of frame ids, e.g.
+     *         "1-99,101-150", or "none".
+     */
+    std::string committed_frames() const;
+
+    /**
+     * @return A copy of the archiver's metrics, e.g. "frames_archived" and
+     *         "parts_discarded".
+     */
+    metrics_snapshot_t metrics() const { return m_metrics->snapshot(); }
+
+    /**
+     * @return Statistics of the most recently decoded frame.
+     */
+    const frame_stats_t& frame_stats() const { return m_frame_stats; }
+
+    /**
+     * @return The partitioning of frames in the current series into detector modules.
+     */
+    const frame_tiling& tiling() const { return m_tiling; }
+
+    /**
+     * @return The file to which the current frame is written by flush().
+     */
+    std::string output_path() const;
+
+    /**
+     * @return The sum and maximum projection of the current series so far, or nullptr
+     *         if "/archiver/summary" is not configured.
+     */
+    const series_summary* summary() const { return m_summary.get(); }
+
+    /**
+     * Applies a reloaded config file between series: the live view, the series summary,
+     * the module layout and "/archiver/source/using_image_appendix". The frame ring and
+     * event publisher keep running as they are, since consumers are attached to them.
+     *
+     * \throws std::runtime_error if the new config is invalid, in which case nothing
+     *         has been changed.
+     */
+    void reconfigure(const simdjson::dom::object& config);
+
+    /**
+     * Draws the frame buffer and the accumulators of every series from a memory budget,
+     * discarding a series which does not fit, and publishes the budget's metrics.
+     */
+    void use_memory_budget(memory_budget& budget) {
+      budget.publish(*m_metrics);
+      m_series_memory = memory_reservation(&budget);
+    }
+
     /**
      * @note This method is idempotent.
      */
     void reset() {
       m_appendix.clear();
       m_buffer.reset();
+      m_committed.clear();
       m_frame_id = -1;
+      m_frame_stats = frame_stats_t();
       m_global.reset();
+      m_n_committed = 0;
       // nothing to do for m_parser
       m_parse_state = parse_state_t::global_header;
+      m_series_memory.resize(0);
 
       cbf_free_handle(m_cbf);
       m_cbf = nullptr; // necessary if line below fails
@@ -110,6 +239,9 @@ namespace bigpicture {
 
     void build_cbf_header();
     void build_cbf_data();
+    bool parse_message(const void* data, size_t len);
+    bool resync(const void* data, size_t len);
+    bool begin_resync(const std::exception& e, const void* data, size_t len);
     
     /*
       Returns true if message parsed is "End of Series", false if message is 
@@ -120,6 +252,12 @@ namespace bigpicture {
     void parse_part3(const void* data, size_t len);
     void parse_part4(const void* data, size_t len);
     void parse_appendix(const void* data, size_t len);
+    void publish_frame(const void* data, size_t len);
+    void publish_event(frame_event_type_t type);
+    void recover_journal();
+    void register_metrics();
+    template<typename F> void with_journal(F f);
+    void write_summary();
 
     enum class parse_state_t : int {
       error=0,
@@ -129,6 +267,7 @@ namespace bigpicture {
       midframe_part3,
       midframe_part4,
       midframe_appendix,
+      resync,            //!< Discarding message parts after a protocol error
     };
 
     // TODO: Separate the logic for parsing and building a CBF, but
@@ -136,10 +275,30 @@ namespace bigpicture {
     std::string             m_appendix;
     unique_buffer           m_buffer;
     cbf_handle              m_cbf;
+    frame_ranges_t          m_committed;  //!< Frames of the current series written out
+    std::unique_ptr<frame_event_publisher> m_events; //!< Optional, notifies local consumers
     int64_t                 m_frame_id;
+    std::chrono::steady_clock::time_point m_frame_start; //!< When part 1 of the frame arrived
+    frame_stats_t           m_frame_stats;
+    metrics_histogram       m_frame_us;        //!< From part 1 until the frame is committed
+    metrics_counter         m_frames_archived;
+    metrics_counter         m_frames_received;
     dectris_global_data     m_global;
+    std::unique_ptr<series_journal_writer> m_journal; //!< Optional, survives a crash
+    module_layout_t         m_layout;
+    std::unique_ptr<live_view> m_live; //!< Optional, the sum of the latest frames for display
+    metrics_counter         m_metric_frame;    //!< The newest frame committed
+    metrics_counter         m_metric_series;   //!< The current series
+    std::unique_ptr<metrics_writer> m_metrics; //!< Shared memory if "/metrics" is configured
+    int64_t                 m_n_committed; //!< Frames of the current series written out
+    int64_t                 m_n_discarded; //!< Parts discarded awaiting a global header or resync
     json_parser             m_parser;
     parse_state_t           m_parse_state;
+    metrics_counter         m_parts_discarded;
+    std::unique_ptr<frame_ring_writer> m_ring; //!< Optional, shares frames with local consumers
+    memory_reservation      m_series_memory; //!< The frame buffer and accumulators
+    std::unique_ptr<series_summary> m_summary; //!< Optional, sum and max of each series
+    frame_tiling            m_tiling;
     bool                    m_using_image_appendix;
   };
 }
@@ -0,0 +1,212 @@
+#include <iostream>
+#include <math.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "background_model.h"
+#include "frame_tiling.h"
+#include "memory_budget.h"
+
+#define BOOST_TEST_MODULE BackgroundModelTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+static module_layout_t make_layout() {
+  module_layout_t layout;
+  layout.module_width = 20;
+  layout.module_height = 10;
+  layout.gap_x = 2;
+  layout.gap_y = 2;
+  return layout;
+}
+
+static std::vector<uint16_t> make_frame(const frame_tiling& tiling, uint16_t value) {
+  std::vector<uint16_t> frame(tiling.n_pixels(), pixel_traits<uint16_t>::gap);
+  const size_t width = tiling.width();
+  tiling.for_each_tile_row([&](size_t y, size_t x0, size_t x1, size_t) {
+    std::fill(frame.begin() + y*width + x0, frame.begin() + y*width + x1, value);
+  });
+  return frame;
+}
+
+BOOST_AUTO_TEST_SUITE(TestBackgroundModel);
+
+BOOST_AUTO_TEST_CASE(update) {
+  std::clog << "******** TEST CASE: update ********\n";
+  frame_tiling tiling(42, 10, make_layout()); // 2x1 modules
+  background_model model(0.5, 2);
+  BOOST_TEST(!model.warm(tiling));
+
+  std::vector<uint16_t> frame = make_frame(tiling, 10);
+  frame[5*42 + 5] = pixel_traits<uint16_t>::bad;
+  std::vector<uint8_t> mask(tiling.n_pixels(), 0);
+  mask[5*42 + 6] = 1;
+  model.update(tiling, frame.data(), mask.data(), nullptr);
+  BOOST_TEST(model.mean(0, 0) == 10.0f);
+  BOOST_TEST(model.variance(0, 0) == 10.0f); // Poisson until observed otherwise
+  BOOST_TEST(isnan(model.mean(5, 5)));
+  BOOST_TEST(isnan(model.mean(6, 5)));
+  BOOST_TEST(isnan(model.mean(20, 0))); // the gap
+  BOOST_TEST(!model.warm(tiling));
+
+  frame = make_frame(tiling, 20);
+  std::vector<uint8_t> exclude(tiling.n_pixels(), 0);
+  exclude[0] = 1;
+  model.update(tiling, frame.data(), nullptr, exclude.data());
+  BOOST_TEST(model.warm(tiling));
+  BOOST_TEST(model.mean(0, 0) == 10.0f);
+  BOOST_TEST(model.mean(1, 0) == 15.0f);
+  BOOST_TEST(model.variance(1, 0) == 0.5f * (10.0f + 10.0f*5.0f));
+  BOOST_TEST(model.mean(5, 5) == 20.0f); // the first time it was unmasked
+
+  frame_tiling other(42, 22, make_layout());
+  BOOST_TEST(!model.warm(other));
+  model.reset();
+  BOOST_TEST(!model.warm(tiling));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(threshold) {
+  std::clog << "****** TEST CASE: threshold ******\n";
+  frame_tiling tiling(42, 10, make_layout());
+  background_model model(0.1, 1);
+  std::vector<uint16_t> frame = make_frame(tiling, 100);
+  model.update(tiling, frame.data(), nullptr, nullptr);
+  BOOST_TEST_REQUIRE(model.warm(tiling));
+
+  // The floor of the standard deviation is sqrt(100) = 10 counts.
+  frame[3*42 + 3] = 129;
+  frame[3*42 + 4] = 131;
+  frame[3*42 + 30] = 500;
+  std::vector<uint8_t> mask(tiling.n_pixels(), 0);
+  mask[3*42 + 30] = 1;
+  std::vector<uint8_t> strong(tiling.n_pixels(), 0);
+  size_t n = 0;
+  BOOST_TEST(model.threshold(tiling, frame.data(), mask.data(), 3.0, 1.0, 0, strong.data(), n));
+  BOOST_TEST(n == 1u);
+  BOOST_TEST(strong[3*42 + 3] == 0);
+  BOOST_TEST(strong[3*42 + 4] == 1);
+  BOOST_TEST(strong[3*42 + 30] == 0);
+  BOOST_TEST(model.mean(4, 3) == 100.0f); // strong pixels are left out
+  BOOST_TEST(model.mean(3, 3) == 102.9f, boost::test_tools::tolerance(1e-4f));
+  BOOST_TEST(model.mean(30, 3) == 100.0f);
+
+  // A global threshold above the pixel suppresses it.
+  model.threshold(tiling, frame.data(), mask.data(), 3.0, 1.0, 200, strong.data(), n);
+  BOOST_TEST(n == 0u);
+
+  // A frame of other dimensions is not thresholded.
+  frame_tiling other(42, 22, make_layout());
+  std::vector<uint16_t> other_frame = make_frame(other, 100);
+  std::vector<uint8_t> other_strong(other.n_pixels(), 7);
+  BOOST_TEST(!model.threshold(other, other_frame.data(), nullptr, 3.0, 1.0, 0,
+			      other_strong.data(), n));
+  BOOST_TEST(other_strong[0] == 7);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(readmit) {
+  std::clog << "******* TEST CASE: readmit *******\n";
+  frame_tiling tiling(42, 10, make_layout());
+  background_model model(0.5, 1, 3);
+  std::vector<uint16_t> frame = make_frame(tiling, 100);
+  model.update(tiling, frame.data(), nullptr, nullptr);
+
+  // A pixel which stays strong is left out twice, and then taken for background.
+  frame[3*42 + 3] = 300;
+  std::vector<uint8_t> strong(tiling.n_pixels(), 0);
+  size_t n = 0;
+  for (int i=0; i < 2; ++i) {
+    model.threshold(tiling, frame.data(), nullptr, 3.0, 1.0, 0, strong.data(), n);
+    BOOST_TEST(n == 1u);
+    BOOST_TEST(model.mean(3, 3) == 100.0f);
+  }
+  model.threshold(tiling, frame.data(), nullptr, 3.0, 1.0, 0, strong.data(), n);
+  BOOST_TEST(n == 1u);
+  BOOST_TEST(model.mean(3, 3) == 200.0f);
+
+  // A single frame as background starts the count again.
+  frame[3*42 + 3] = 200;
+  model.threshold(tiling, frame.data(), nullptr, 3.0, 1.0, 0, strong.data(), n);
+  BOOST_TEST(strong[3*42 + 3] == 0);
+  frame[3*42 + 3] = 1000;
+  model.threshold(tiling, frame.data(), nullptr, 3.0, 1.0, 0, strong.data(), n);
+  BOOST_TEST(strong[3*42 + 3] == 1);
+  BOOST_TEST(model.mean(3, 3) == 200.0f);
+  BOOST_TEST(model.memory_usage() == 9u*tiling.n_pixels());
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(shared) {
+  std::clog << "******* TEST CASE: shared ********\n";
+  frame_tiling tiling(42, 10, make_layout());
+  memory_budget budget;
+  background_model model(0.5, 4);
+  model.use_memory_budget(budget);
+  BOOST_TEST(model.begin_series(1));
+  BOOST_TEST(budget.in_use() == 0u);
+
+  // Threads add frames concurrently, tile by tile.
+  std::vector<uint16_t> frame = make_frame(tiling, 10);
+  std::vector<std::thread> threads;
+  for (int i=0; i < 4; ++i) {
+    threads.emplace_back([&]() { model.update(tiling, frame.data(), nullptr, nullptr); });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  BOOST_TEST(model.n_frames() == 4u);
+  BOOST_TEST(model.warm(tiling));
+  BOOST_TEST(model.mean(0, 0) == 10.0f);
+  BOOST_TEST(budget.in_use() == model.memory_usage());
+  BOOST_TEST(model.memory_usage() == 9u*tiling.n_pixels());
+
+  // The next series starts afresh, and frames of the one before are turned away.
+  BOOST_TEST(model.begin_series(2));
+  BOOST_TEST(!model.warm(tiling));
+  BOOST_TEST(!model.begin_series(1));
+  BOOST_TEST(model.begin_series(2));
+  frame = make_frame(tiling, 20);
+  model.update(tiling, frame.data(), nullptr, nullptr);
+  BOOST_TEST(model.n_frames() == 1u);
+  BOOST_TEST(model.mean(0, 0) == 20.0f);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(next_series) {
+  std::clog << "***** TEST CASE: next_series ******\n";
+  // While one thread thresholds frames of a series, another starts the next series,
+  // whose frames have other dimensions, e.g. a region of interest.
+  frame_tiling tiling(42, 22, make_layout()), roi(42, 10, make_layout());
+  background_model model(0.5, 1);
+  BOOST_TEST(model.begin_series(1));
+  std::vector<uint16_t> frame = make_frame(tiling, 100), roi_frame = make_frame(roi, 50);
+  model.update(tiling, frame.data(), nullptr, nullptr);
+
+  size_t n_applied = 0, n_turned_away = 0;
+  std::thread worker([&]() {
+    std::vector<uint8_t> strong(tiling.n_pixels(), 0);
+    for (int i=0; i < 2000; ++i) {
+      size_t n = 0;
+      if (model.threshold(tiling, frame.data(), nullptr, 3.0, 1.0, 0, strong.data(), n)) {
+	++n_applied;
+      } else {
+	++n_turned_away;
+      }
+    }
+  });
+  for (int64_t series_id=2; series_id < 200; ++series_id) {
+    BOOST_TEST(model.begin_series(series_id));
+    model.update(series_id % 2 ? tiling : roi, series_id % 2 ? frame.data() : roi_frame.data(),
+		 nullptr, nullptr);
+  }
+  worker.join();
+  BOOST_TEST(n_applied + n_turned_away == 2000u);
+  BOOST_TEST(model.warm(tiling));
+  BOOST_TEST(!model.warm(roi));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,92 @@
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+#include "bigpicture_utils.h"
+#include "cbf_reader.h"
+#include "frame_tiling.h"
+
+#define BOOST_TEST_MODULE CbfReaderTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+// Byte-offset encoding of {0, 5, 300, 70000, -1, 3}, using 1, 2, and 4-byte deltas.
+static const std::vector<uint8_t> byte_offset_data = {
+  0x00, 0x05, 0x80, 0x27, 0x01, 0x80, 0x00, 0x80, 0x44, 0x10, 0x01, 0x00,
+  0x80, 0x00, 0x80, 0x8f, 0xee, 0xfe, 0xff, 0x04
+};
+static const char* byte_offset_base64 = "AAWAJwGAAIBEEAEA\r\ngACAj+7+/wQ=";
+
+BOOST_AUTO_TEST_SUITE(TestCbfReader);
+
+BOOST_AUTO_TEST_CASE(byte_offset) {
+  std::clog << "****** TEST CASE: byte_offset ******\n";
+  std::vector<uint32_t> pixels(6);
+  byte_offset_decode(byte_offset_data.data(), byte_offset_data.size(), pixels.data(),
+		     pixels.size(), 32);
+  BOOST_TEST(pixels[0] == 0u);
+  BOOST_TEST(pixels[1] == 5u);
+  BOOST_TEST(pixels[2] == 300u);
+  BOOST_TEST(pixels[3] == 70000u);
+  BOOST_TEST(pixels[4] == pixel_traits<uint32_t>::gap);
+  BOOST_TEST(pixels[5] == 3u);
+
+  std::vector<uint8_t> decoded(byte_offset_data.size());
+  size_t len = base64_decode(byte_offset_base64, strlen(byte_offset_base64),
+			     decoded.data(), decoded.size());
+  BOOST_TEST(len == byte_offset_data.size());
+  BOOST_TEST(decoded == byte_offset_data);
+
+  BOOST_CHECK_THROW(byte_offset_decode(byte_offset_data.data(), 5, pixels.data(),
+				       pixels.size(), 32), std::runtime_error);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(minicbf_file) {
+  std::clog << "***** TEST CASE: minicbf_file *****\n";
+  // A 3x2 image laid out as libcbf writes it with MIME_HEADERS and ENC_BASE64.
+  const std::string path = "test_cbf_reader.cbf";
+  {
+    std::ofstream file(path, std::ios::binary);
+    file << "###CBF: VERSION 1.5\r\n\r\ndata_image_1\r\n\r\n_array_data.data\r\n;\r\n"
+	 << "--CIF-BINARY-FORMAT-SECTION--\r\n"
+	 << "Content-Type: application/octet-stream;\r\n"
+	 << "     conversions=\"x-CBF_BYTE_OFFSET\"\r\n"
+	 << "Content-Transfer-Encoding: BASE64\r\n"
+	 << "X-Binary-Size: 20\r\n"
+	 << "X-Binary-ID: 1\r\n"
+	 << "X-Binary-Element-Type: \"signed 32-bit integer\"\r\n"
+	 << "X-Binary-Element-Byte-Order: LITTLE_ENDIAN\r\n"
+	 << "X-Binary-Number-of-Elements: 6\r\n"
+	 << "X-Binary-Size-Fastest-Dimension: 3\r\n"
+	 << "X-Binary-Size-Second-Dimension: 2\r\n"
+	 << "X-Binary-Size-Padding: 0\r\n"
+	 << "\r\n"
+	 << byte_offset_base64 << "\r\n"
+	 << "--CIF-BINARY-FORMAT-SECTION----\r\n;\r\n";
+  }
+
+  cbf_reader cbf(path);
+  BOOST_TEST(cbf.width() == 3u);
+  BOOST_TEST(cbf.height() == 2u);
+  BOOST_TEST(cbf.bit_depth() == 32);
+  unique_buffer pixels;
+  cbf.decode(pixels);
+  BOOST_TEST(pixels.size() == 24u);
+  const uint32_t* p = reinterpret_cast<const uint32_t*>(pixels.get());
+  BOOST_TEST(p[3] == 70000u);
+  BOOST_TEST(p[4] == pixel_traits<uint32_t>::gap);
+  unlink(path.c_str());
+
+  BOOST_CHECK_THROW(cbf_reader("test_cbf_reader.missing"), std::system_error);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -8,12 +8,14 @@
 #include <thread>
 #include <unistd.h>
 
+#include <simdjson.h>
 #include <zmq.h>
 #include <lz4.h>
 
 #include "bigpicture_utils.h"
 #include "dectris_utils.h"
 #include "dectris_stream.h"
+#include "series_journal.h"
 #include "stream_to_cbf.h"
 
 #define BOOST_TEST_MODULE DectrisStreamTest
@@ -207,6 +209,147 @@ static void use_tmpdir() {
   std::clog << "INFO: Using tmpdir - " << tmpdir << "\n";
 }
 
+static void send_global_header(zmq::socket_t& sock, const test_params_t& params,
+			       int series_id) {
+  zmq::message_t msg;
+  generate_global_part1_message(msg, params, series_id);
+  sock.send(msg, zmq::send_flags::none);
+  std::string part2 = params.cfg.to_json();
+  msg.rebuild(part2.data(), part2.size());
+  sock.send(msg, zmq::send_flags::none);
+}
+
+// Sends parts first_part to last_part of a frame, e.g. to cut a frame short.
+static void send_frame(zmq::socket_t& sock, const test_params_t& params, int series_id,
+		       int frame_id, const unique_buffer& image, int64_t image_size,
+		       int first_part=1, int last_part=4) {
+  zmq::message_t msg;
+  for (int part=first_part; part <= last_part; ++part) {
+    switch (part) {
+    case 1:
+      generate_frame_part1_message(msg, series_id, frame_id);
+      break;
+    case 2:
+      generate_frame_part2_message(msg, params, image_size);
+      break;
+    case 3:
+      msg.rebuild(image.get(), image_size);
+      break;
+    default:
+      generate_frame_part4_message(msg, params, frame_id);
+      break;
+    }
+    sock.send(msg, zmq::send_flags::none);
+  }
+}
+
+static bool wait_for_file(const std::string& path) {
+  for (int i=0; i < 1000; ++i) {
+    if (access(path.c_str(), F_OK) == 0) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+static bool archived(const std::string& path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+// A small detector, so that a series streams in milliseconds.
+static test_params_t small_params() {
+  test_params_t params;
+  params.cfg.compression = compressor_t::lz4;
+  params.cfg.x_pixels_in_detector = 64;
+  params.cfg.y_pixels_in_detector = 32;
+  return params;
+}
+
+/*
+  Moves to a new tmpdir, where frames and the journal are written, and returns the
+  config of a streamer which polls for a second at a time and drains for a second, so
+  that a test case can shut it down without a signal.
+*/
+static simdjson::dom::object stream_config(simdjson::dom::parser& json,
+					   const test_params_t& params,
+					   const std::string& addr) {
+  params.log();
+  use_tmpdir();
+  std::stringstream ss;
+  ss << "{\"archiver\":{"
+     << "\"source\":{\"zmq_push_socket\":\"" << addr << "\","
+     << "\"drain_timeout_s\":1,\"poll_interval\":1},"
+     << "\"journal\":{\"path\":\"bparchived.journal\",\"sync_ms\":60000}}}";
+  simdjson::dom::object config;
+  if (json.parse(simdjson::padded_string(ss.str())).get(config)) {
+    throw std::runtime_error("Failed to parse the test config");
+  }
+  return config;
+}
+
+/*
+  Streams message parts from a test case to an archiver of a small detector, like
+  run_client_server_pair(), but lets the test case send anything, e.g. parts out of
+  protocol.
+*/
+struct stream_harness_t {
+  stream_harness_t(const test_params_t& test_params) :
+    addr("tcp://127.0.0.1:9999"),
+    params(test_params),
+    config(stream_config(json, params, addr)),
+    server_sock(server_ctx, zmq::socket_type::push),
+    parser(config),
+    streamer(parser, config) {
+    server_sock.bind(addr);
+    unique_buffer uncompressed_image(params.cfg.bit_depth_image/8 *
+				     params.cfg.x_pixels_in_detector *
+				     params.cfg.y_pixels_in_detector);
+    memset(uncompressed_image.get(), 1, uncompressed_image.size());
+    image_size = generate_compressed_image(params.cfg.compression, uncompressed_image, image);
+    client_thread = std::thread(std::ref(streamer));
+  }
+
+  void send(const std::string& part) {
+    zmq::message_t msg(part.data(), part.size());
+    server_sock.send(msg, zmq::send_flags::none);
+  }
+
+  void send_global_header(int series_id) {
+    ::send_global_header(server_sock, params, series_id);
+  }
+
+  void send_frame(int series_id, int frame_id, int first_part=1, int last_part=4) {
+    ::send_frame(server_sock, params, series_id, frame_id, image, image_size,
+		 first_part, last_part);
+  }
+
+  void send_series_end(int series_id) {
+    zmq::message_t msg;
+    generate_series_end_message(msg, series_id);
+    server_sock.send(msg, zmq::send_flags::none);
+  }
+
+  // Waits for the last frame sent to be archived, then lets the series end.
+  void finish(const std::string& last_file) {
+    BOOST_TEST(wait_for_file(last_file));
+    streamer.shutdown();
+    client_thread.join();
+  }
+
+  std::string           addr;
+  const test_params_t&  params;
+  simdjson::dom::parser json;
+  simdjson::dom::object config;
+  zmq::context_t        server_ctx;
+  zmq::socket_t         server_sock;
+  stream_to_cbf         parser;
+  dectris_streamer<stream_to_cbf> streamer;
+  std::thread           client_thread;
+  unique_buffer         image;
+  int64_t               image_size;
+};
+
 static void run_client_server_pair(const test_params_t& params) {
   const std::string addr("tcp://127.0.0.1:9999");
   params.log();
@@ -435,6 +578,165 @@ BOOST_AUTO_TEST_CASE(multi_image) {
   std::clog << "********* END TEST CASE *********\n\n";
 }
 
+BOOST_AUTO_TEST_CASE(drain_on_shutdown) {
+  std::clog << "**** TEST CASE: drain_on_shutdown ****\n";
+  test_params_t params = small_params();
+  params.cfg.nimages = 5;
+  stream_harness_t stream(params);
+
+  // The DCU sends 3 of 5 frames and part of the 4th, then goes quiet.
+  stream.send_global_header(1);
+  for (int j=1; j <= 3; ++j) {
+    stream.send_frame(1, j);
+  }
+  stream.send_frame(1, 4, 1, 2);
+  BOOST_REQUIRE(wait_for_file("1-3.cbf"));
+
+  // The series in progress is abandoned once the drain timeout has passed.
+  const auto start = std::chrono::steady_clock::now();
+  stream.streamer.shutdown();
+  stream.client_thread.join();
+  const auto drained = std::chrono::steady_clock::now() - start;
+  BOOST_TEST(std::chrono::duration_cast<std::chrono::milliseconds>(drained).count() >= 900);
+  BOOST_TEST(stream.parser.committed_frames() == "1-3");
+  BOOST_TEST(!archived("1-4.cbf"));
+
+  // The journal, synced by the drain rather than its interval, agrees.
+  series_journal_t journal;
+  BOOST_REQUIRE(read_series_journal("bparchived.journal", journal));
+  BOOST_TEST(journal.series_id == 1);
+  BOOST_TEST(journal.n_frames == 5);
+  BOOST_TEST(!journal.complete);
+  BOOST_TEST(format_frame_ranges(journal.committed()) == "1-3");
+  BOOST_TEST(format_frame_ranges(journal.missing()) == "4-5");
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(resync_mid_frame) {
+  std::clog << "**** TEST CASE: resync_mid_frame ****\n";
+  test_params_t params = small_params();
+  params.cfg.nimages = 3;
+  stream_harness_t stream(params);
+  stream.send_global_header(1);
+  stream.send_frame(1, 1);
+  // Frame 2 has an unexpected part where part 2 belongs, so the rest of it is lost.
+  stream.send_frame(1, 2, 1, 1);
+  stream.send("{\"htype\":\"dunexpected-1.0\"}");
+  stream.send_frame(1, 2, 3, 4);
+  stream.send_frame(1, 3);
+  stream.send_series_end(1);
+  stream.finish("1-3.cbf");
+
+  BOOST_TEST(archived("1-1.cbf"));
+  BOOST_TEST(!archived("1-2.cbf"));
+  metrics_snapshot_t metrics = stream.parser.metrics();
+  BOOST_TEST(metrics.value("frames_archived") == 2);
+  BOOST_TEST(metrics.value("parts_discarded") == 3);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(resync_lost_part1) {
+  std::clog << "*** TEST CASE: resync_lost_part1 ***\n";
+  test_params_t params = small_params();
+  params.cfg.nimages = 3;
+  stream_harness_t stream(params);
+  stream.send_global_header(1);
+  stream.send_frame(1, 1);
+  // Part 1 of frame 2 is lost, so its other 3 parts are discarded.
+  stream.send_frame(1, 2, 2, 4);
+  stream.send_frame(1, 3);
+  stream.send_series_end(1);
+  stream.finish("1-3.cbf");
+
+  BOOST_TEST(archived("1-1.cbf"));
+  BOOST_TEST(!archived("1-2.cbf"));
+  metrics_snapshot_t metrics = stream.parser.metrics();
+  BOOST_TEST(metrics.value("frames_archived") == 2);
+  BOOST_TEST(metrics.value("parts_discarded") == 3);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(resync_mid_header) {
+  std::clog << "*** TEST CASE: resync_mid_header ***\n";
+  test_params_t params = small_params();
+  params.cfg.nimages = 2;
+  stream_harness_t stream(params);
+  // The global header of series 1 has an unexpected part 2, so the whole series is
+  // discarded up to the global header of series 2.
+  zmq::message_t msg;
+  generate_global_part1_message(msg, params, 1);
+  stream.server_sock.send(msg, zmq::send_flags::none);
+  stream.send("{\"htype\":\"dunexpected-1.0\"}");
+  stream.send_frame(1, 1);
+  stream.send_frame(1, 2);
+  stream.send_series_end(1);
+  stream.send_global_header(2);
+  stream.send_frame(2, 1);
+  stream.send_frame(2, 2);
+  stream.send_series_end(2);
+  stream.finish("2-2.cbf");
+
+  BOOST_TEST(!archived("1-1.cbf"));
+  BOOST_TEST(archived("2-1.cbf"));
+  metrics_snapshot_t metrics = stream.parser.metrics();
+  BOOST_TEST(metrics.value("frames_archived") == 2);
+  // The unexpected part, and the 2 frames and the end of series 1.
+  BOOST_TEST(metrics.value("parts_discarded") == 10);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(resync_lost_series_end) {
+  std::clog << "** TEST CASE: resync_lost_series_end **\n";
+  test_params_t params = small_params();
+  params.cfg.nimages = 2;
+  stream_harness_t stream(params);
+  bool reloaded_between_series = false;
+  stream.streamer.on_reload([&]() { reloaded_between_series = !archived("2-1.cbf"); });
+  stream.send_global_header(1);
+  stream.send_frame(1, 1);
+  BOOST_REQUIRE(wait_for_file("1-1.cbf"));
+
+  // Frame 2 and the end of series 1 are lost. A reload requested meanwhile is applied
+  // as soon as the global header of series 2 shows that series 1 is over.
+  stream.streamer.reload();
+  stream.send_frame(1, 2, 1, 2);
+  stream.send_global_header(2);
+  stream.send_frame(2, 1);
+  stream.send_frame(2, 2);
+  stream.send_series_end(2);
+  stream.finish("2-2.cbf");
+
+  BOOST_TEST(reloaded_between_series);
+  BOOST_TEST(!archived("1-2.cbf"));
+  metrics_snapshot_t metrics = stream.parser.metrics();
+  BOOST_TEST(metrics.value("frames_archived") == 3);
+  BOOST_TEST(metrics.value("parts_discarded") == 0);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(receive_queue_budget) {
+  std::clog << "** TEST CASE: receive_queue_budget **\n";
+  simdjson::dom::parser json;
+  simdjson::dom::object config;
+  BOOST_REQUIRE(!json.parse(simdjson::padded_string(std::string(
+    "{\"archiver\":{\"source\":{\"read_buffer_mb\":1,\"rcvhwm\":4}}}"))).get(config));
+  stream_to_cbf parser;
+  dectris_streamer<stream_to_cbf> streamer(parser, config);
+
+  // The receive buffer and a full queue of messages as large.
+  memory_budget too_small(5*1024*1024 - 1);
+  BOOST_CHECK_THROW(streamer.use_memory_budget(too_small), std::runtime_error);
+  BOOST_TEST(too_small.in_use() == 0u);
+  memory_budget enough(5*1024*1024);
+  streamer.use_memory_budget(enough);
+  BOOST_TEST(enough.in_use() == 5u*1024*1024);
+
+  BOOST_REQUIRE(!json.parse(simdjson::padded_string(std::string(
+    "{\"archiver\":{\"source\":{\"rcvhwm\":0}}}"))).get(config));
+  BOOST_CHECK_THROW(dectris_streamer<stream_to_cbf>(parser, config), std::runtime_error);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
 /*
 // TODO: Move this into a separate file, log performance metrics, 
 // and run performance tests as a separate Makefile target.
@@ -0,0 +1,117 @@
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "external_indexer.h"
+#include "frame_events.h"
+
+#define BOOST_TEST_MODULE ExternalIndexerTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+static external_indexer_options_t make_options(const char* script) {
+  external_indexer_options_t options;
+  options.argv = { "/bin/sh", "-c", script };
+  options.processes = 1;
+  options.batch_size = 4;
+  options.timeout_s = 5.0;
+  return options;
+}
+
+static frame_event_t make_event(int64_t series_id, int64_t frame_id) {
+  frame_event_t event;
+  event.type = frame_event_type_t::frame;
+  event.series_id = series_id;
+  event.frame_id = frame_id;
+  event.path = "/tmp/" + std::to_string(series_id) + "_" + std::to_string(frame_id) + ".cbf";
+  return event;
+}
+
+BOOST_AUTO_TEST_SUITE(TestExternalIndexer);
+
+BOOST_AUTO_TEST_CASE(process) {
+  std::clog << "******** TEST CASE: process ********\n";
+  indexer_process child({ "/bin/sh", "-c", "while read -r line; do echo \"ok $line\"; done" });
+  BOOST_TEST(!child.running());
+  child.start();
+  BOOST_TEST(child.running());
+  std::string response;
+  auto result = child.call("{\"a\":1}", response, std::chrono::milliseconds(5000));
+  BOOST_TEST((result == indexer_process::result_t::ok));
+  BOOST_TEST(response == "ok {\"a\":1}");
+  result = child.call("second", response, std::chrono::milliseconds(5000));
+  BOOST_TEST(response == "ok second");
+  int status = child.stop(std::chrono::milliseconds(2000));
+  BOOST_TEST(!child.running());
+  BOOST_TEST((WIFEXITED(status) && WEXITSTATUS(status) == 0));
+
+  indexer_process slow({ "/bin/sh", "-c", "read -r line; sleep 10" });
+  slow.start();
+  auto start = std::chrono::steady_clock::now();
+  result = slow.call("x", response, std::chrono::milliseconds(200));
+  BOOST_TEST((result == indexer_process::result_t::timeout));
+  BOOST_TEST(!slow.running());
+  BOOST_TEST((std::chrono::steady_clock::now() - start < std::chrono::seconds(5)));
+
+  indexer_process missing({ "/nonexistent/indexer" });
+  BOOST_CHECK_THROW(missing.start(), std::system_error);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(pool) {
+  std::clog << "******** TEST CASE: pool ********\n";
+  std::mutex mutex;
+  std::vector<std::string> responses;
+  size_t n_frames = 0;
+  external_indexer_pool pool(make_options("while read -r line; do echo \"$line\"; done"), 64,
+			     [&](const std::vector<frame_event_t>& batch, std::string_view response) {
+    std::lock_guard<std::mutex> lock(mutex);
+    BOOST_TEST(batch.size() <= 4u);
+    for (const frame_event_t& event : batch) {
+      BOOST_TEST(event.series_id == batch.front().series_id);
+    }
+    n_frames += batch.size();
+    responses.emplace_back(response);
+  });
+  for (int64_t i=0; i < 10; ++i) {
+    pool.submit(make_event(i < 5 ? 1 : 2, i));
+  }
+  pool.close();
+
+  BOOST_TEST(n_frames == 10u);
+  BOOST_TEST(pool.counters().frames == 10u);
+  BOOST_TEST(pool.counters().failed == 0u);
+  BOOST_TEST(pool.counters().restarts == 0u);
+  BOOST_TEST(responses.size() == pool.counters().batches);
+  BOOST_TEST(responses.front().find("{\"series\":1,\"ring\":\"/bigpicture-frames\",") == 0u);
+  BOOST_TEST(responses.front().find("\"path\":\"/tmp/1_0.cbf\"") != std::string::npos);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(restart) {
+  std::clog << "******** TEST CASE: restart ********\n";
+  // Answers one request, then crashes on the next.
+  size_t n_responses = 0;
+  external_indexer_pool pool(make_options("read -r line; echo done; read -r line; exit 3"), 64,
+			     [&](const std::vector<frame_event_t>&, std::string_view response) {
+    BOOST_TEST(response == "done");
+    ++n_responses;
+  });
+  for (int64_t series_id=1; series_id <= 3; ++series_id) {
+    pool.submit(make_event(series_id, 0));
+  }
+  pool.close();
+
+  // Series 1 succeeds and series 2 crashes the process. Series 3 is either handed to
+  // the restarted process, or given up on if the pool closed during the backoff.
+  BOOST_TEST(pool.counters().frames + pool.counters().failed == 3u);
+  BOOST_TEST(pool.counters().failed >= 1u);
+  BOOST_TEST(n_responses == pool.counters().frames);
+  BOOST_TEST(pool.counters().timeouts == 0u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
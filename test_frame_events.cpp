@@ -0,0 +1,71 @@
+#include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <simdjson.h>
+
+#include "frame_events.h"
+
+#define BOOST_TEST_MODULE FrameEventsTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+static frame_event_t make_event() {
+  frame_event_t event;
+  event.type        = frame_event_type_t::frame;
+  event.series_id   = 3;
+  event.frame_id    = 42;
+  event.n_committed = 42;
+  event.path        = "/data/3-42.cbf";
+  event.stats.sum   = 1000;
+  event.stats.max   = 17;
+  return event;
+}
+
+BOOST_AUTO_TEST_SUITE(TestFrameEvents);
+
+BOOST_AUTO_TEST_CASE(round_trip) {
+  std::clog << "****** TEST CASE: round_trip ******\n";
+  const frame_event_t event = make_event();
+  char buf[4096];
+  size_t len = event.serialize(buf, sizeof(buf));
+  BOOST_REQUIRE(len < sizeof(buf));
+  BOOST_TEST(strlen(buf) == len);
+  BOOST_TEST(std::string(buf, 17) == "{\"event\":\"frame\",");
+
+  simdjson::dom::parser parser;
+  simdjson::dom::object record;
+  BOOST_REQUIRE(!parser.parse(buf, len).get(record));
+  frame_event_t parsed;
+  parsed.parse(record);
+  BOOST_TEST(int(parsed.type) == int(event.type));
+  BOOST_TEST(parsed.series_id == event.series_id);
+  BOOST_TEST(parsed.frame_id == event.frame_id);
+  BOOST_TEST(parsed.path == event.path);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(exact_fit) {
+  std::clog << "****** TEST CASE: exact_fit ******\n";
+  const frame_event_t event = make_event();
+  char big[4096];
+  const size_t n = event.serialize(big, sizeof(big));
+
+  // The event and its terminator fit exactly.
+  std::vector<char> buf(n + 2, 'x');
+  BOOST_TEST(event.serialize(buf.data(), n + 1) == n);
+  BOOST_TEST(buf[n] == '\0');
+  BOOST_TEST(buf[n + 1] == 'x');
+
+  // Without room for the terminator, nothing is written past the buffer.
+  std::fill(buf.begin(), buf.end(), 'x');
+  BOOST_TEST(event.serialize(buf.data(), n) >= n);
+  BOOST_TEST(buf[n] == 'x');
+  BOOST_TEST(event.serialize(buf.data(), 0) == 0u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
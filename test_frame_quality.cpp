@@ -0,0 +1,101 @@
+#include <iostream>
+#include <math.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "frame_events.h"
+#include "frame_quality.h"
+#include "spot_finder.h"
+
+#define BOOST_TEST_MODULE FrameQualityTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+static frame_event_t make_event() {
+  frame_event_t event;
+  event.type = frame_event_type_t::frame;
+  event.series_id = 4;
+  event.frame_id = 9;
+  event.geometry.beam_center_x = 1000;
+  event.geometry.beam_center_y = 1000;
+  event.geometry.detector_distance = 0.1;
+  event.geometry.wavelength = 1.0;
+  event.geometry.x_pixel_size = 75e-6;
+  event.geometry.y_pixel_size = 75e-6;
+  event.stats.sum = 100000;
+  event.stats.n_valid = 10000;
+  event.stats.n_saturated = 3;
+  return event;
+}
+
+// The distance from the beam center in pixels at resolution d.
+static double radius_at(const frame_geometry_t& g, double d) {
+  return g.detector_distance * tan(2.0 * asin(g.wavelength / (2.0 * d))) / g.x_pixel_size;
+}
+
+static spot_t make_spot(const frame_geometry_t& g, double d) {
+  return spot_t{g.beam_center_x + radius_at(g, d), g.beam_center_y, 100, 20, 5};
+}
+
+BOOST_AUTO_TEST_SUITE(TestFrameQuality);
+
+BOOST_AUTO_TEST_CASE(resolution) {
+  std::clog << "***** TEST CASE: resolution *****\n";
+  frame_event_t event = make_event();
+  const frame_geometry_t& g = event.geometry;
+  BOOST_TEST(isinf(resolution_at(g, 1000, 1000)));
+  BOOST_TEST(resolution_at(g, 1000 + radius_at(g, 2.0), 1000) == 2.0,
+	     boost::test_tools::tolerance(1e-9));
+  BOOST_TEST(resolution_at(g, 1000, 1000 - radius_at(g, 2.0)) == 2.0,
+	     boost::test_tools::tolerance(1e-9));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(metrics) {
+  std::clog << "****** TEST CASE: metrics ******\n";
+  frame_event_t event = make_event();
+  std::vector<spot_t> spots;
+  for (int i=0; i < 20; ++i) {
+    spots.push_back(make_spot(event.geometry, 10.0 - 0.4*i)); // 10 to 2.4 Angstroms
+  }
+  frame_quality_t quality = assess_frame_quality(event, spots);
+  BOOST_TEST(quality.n_spots == 20u);
+  BOOST_TEST(quality.spot_intensity == 2000u);
+  BOOST_TEST(quality.d_min == 10.0 - 0.4*18, boost::test_tools::tolerance(1e-9));
+  BOOST_TEST(!quality.ice_rings);
+  BOOST_TEST(quality.n_saturated == 3u);
+  BOOST_TEST(quality.background == (100000.0 - 2000) / (10000 - 100),
+	     boost::test_tools::tolerance(1e-12));
+
+  // Too few spots for a resolution limit.
+  spots.resize(5);
+  BOOST_TEST(isnan(assess_frame_quality(event, spots).d_min));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(ice_rings) {
+  std::clog << "***** TEST CASE: ice_rings *****\n";
+  frame_event_t event = make_event();
+  std::vector<spot_t> spots;
+  for (int i=0; i < 30; ++i) {
+    spots.push_back(make_spot(event.geometry, 5.0 + 0.1*i));
+  }
+  for (int i=0; i < 12; ++i) {
+    spots.push_back(make_spot(event.geometry, (i % 2) ? 3.669 : 2.249));
+  }
+  frame_quality_t quality = assess_frame_quality(event, spots);
+  BOOST_TEST(quality.n_ice_spots == 12u);
+  BOOST_TEST(quality.ice_rings);
+
+  char buf[256];
+  size_t len = quality.serialize(buf, sizeof(buf));
+  BOOST_TEST_REQUIRE(len < sizeof(buf));
+  std::string line(buf, len);
+  BOOST_TEST(line.find("{\"series\":4,\"frame\":9,\"spots\":42,") == 0u);
+  BOOST_TEST(line.find("\"ice_rings\":true") != std::string::npos);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,100 @@
+#include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "frame_ring.h"
+
+#define BOOST_TEST_MODULE FrameRingTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+static std::string ring_name() {
+  return "/bigpicture-test-" + std::to_string(getpid());
+}
+
+static frame_meta_t make_meta(int64_t frame_id) {
+  frame_meta_t meta;
+  meta.series_id = 7;
+  meta.frame_id  = frame_id;
+  meta.width     = 4;
+  meta.height    = 2;
+  meta.bit_depth = 32;
+  return meta;
+}
+
+BOOST_AUTO_TEST_SUITE(TestFrameRing);
+
+BOOST_AUTO_TEST_CASE(publish_and_read) {
+  std::clog << "*** TEST CASE: publish_and_read ***\n";
+  frame_ring_writer writer(ring_name(), 4, 64);
+  frame_ring_reader reader(ring_name());
+
+  frame_view_t view;
+  BOOST_TEST(!reader.next(view));
+
+  uint32_t pixels[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+  BOOST_TEST(writer.publish(make_meta(1), pixels, sizeof(pixels)));
+  BOOST_TEST(reader.next(view));
+  BOOST_TEST(view.meta.frame_id == 1);
+  BOOST_TEST(view.size == sizeof(pixels));
+  BOOST_TEST(memcmp(view.data, pixels, sizeof(pixels)) == 0);
+  BOOST_TEST(reader.validate(view));
+  BOOST_TEST(!reader.next(view));
+
+  // Payloads larger than a slot are rejected rather than truncated.
+  char big[128] = {0};
+  BOOST_TEST(!writer.publish(make_meta(2), big, sizeof(big)));
+  BOOST_TEST(writer.n_oversize() == 1u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(slow_reader_skips_ahead) {
+  std::clog << "*** TEST CASE: slow_reader_skips_ahead ***\n";
+  frame_ring_writer writer(ring_name(), 4, 64);
+  frame_ring_reader reader(ring_name());
+
+  uint32_t pixel = 0;
+  BOOST_TEST(writer.publish(make_meta(1), &pixel, sizeof(pixel)));
+  frame_view_t stale;
+  BOOST_TEST(reader.next(stale));
+
+  for (int64_t i=2; i <= 10; ++i) {
+    pixel = i;
+    BOOST_TEST(writer.publish(make_meta(i), &pixel, sizeof(pixel)));
+  }
+
+  // The first frame has been overwritten, and the reader jumps to the newest.
+  BOOST_TEST(!reader.validate(stale));
+  frame_view_t view;
+  BOOST_TEST(reader.next(view));
+  BOOST_TEST(view.meta.frame_id == 10);
+  BOOST_TEST(reader.n_skipped() == 8u);
+
+  BOOST_TEST(reader.find(7, 8, view));
+  BOOST_TEST(!reader.find(7, 3, view));
+  BOOST_TEST(reader.latest(view));
+  BOOST_TEST(view.meta.frame_id == 10);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(copy_frame) {
+  std::clog << "****** TEST CASE: copy_frame ******\n";
+  frame_ring_writer writer(ring_name(), 4, 64);
+  frame_source source(ring_name());
+
+  uint32_t pixels[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+  BOOST_TEST(writer.publish(make_meta(1), pixels, sizeof(pixels)));
+  unique_buffer scratch;
+  frame_meta_t meta;
+  BOOST_TEST(source.copy_frame(7, 1, scratch, meta));
+  BOOST_TEST(meta.frame_id == 1);
+  BOOST_TEST(scratch.size() == sizeof(pixels));
+  BOOST_TEST(memcmp(scratch.get(), pixels, sizeof(pixels)) == 0);
+  BOOST_TEST(!source.copy_frame(7, 2, scratch, meta));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
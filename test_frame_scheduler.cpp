@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <math.h>
+#include <stdint.h>
+
+#include "frame_events.h"
+#include "frame_scheduler.h"
+
+#define BOOST_TEST_MODULE FrameSchedulerTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+using namespace std::chrono;
+
+static frame_geometry_t make_geometry(int64_t n_frames, double omega_increment) {
+  frame_geometry_t g;
+  g.n_frames = n_frames;
+  g.omega_start = 0;
+  g.omega_increment = omega_increment;
+  return g;
+}
+
+BOOST_AUTO_TEST_SUITE(TestFrameScheduler);
+
+BOOST_AUTO_TEST_CASE(wedges) {
+  std::clog << "******** TEST CASE: wedges ********\n";
+  frame_scheduler scheduler(frame_scheduler_options_t(), 1);
+  scheduler.begin_series(make_geometry(1800, 0.1)); // 180 degrees
+  BOOST_TEST(scheduler.wedge_size() == 50);
+  BOOST_TEST(!scheduler.in_wedge(0));
+  BOOST_TEST(scheduler.in_wedge(1));
+  BOOST_TEST(scheduler.in_wedge(50));
+  BOOST_TEST(!scheduler.in_wedge(51));
+  BOOST_TEST(!scheduler.in_wedge(875));
+  BOOST_TEST(scheduler.in_wedge(876));
+  BOOST_TEST(scheduler.in_wedge(925));
+  BOOST_TEST(!scheduler.in_wedge(926));
+  BOOST_TEST(!scheduler.in_wedge(1750));
+  BOOST_TEST(scheduler.in_wedge(1751));
+  BOOST_TEST(scheduler.in_wedge(1800));
+  BOOST_TEST(!scheduler.in_wedge(1801));
+
+  // Every wedge holds exactly wedge_size() of the frames 1..n, the middle one centred.
+  for (int64_t n_frames : {1800, 1801, 7}) {
+    scheduler.begin_series(make_geometry(n_frames, 0.1));
+    const int64_t w = std::min<int64_t>(scheduler.wedge_size(), n_frames);
+    int64_t first = 0, middle = 0, last = 0, before = 0, after = 0;
+    for (int64_t i=1; i <= n_frames; ++i) {
+      if (!scheduler.in_wedge(i)) {
+	continue;
+      }
+      if (i <= w) {
+	++first;
+      } else if (i > n_frames - w) {
+	++last;
+      } else {
+	++middle;
+	(i <= n_frames/2 ? before : after) += 1;
+      }
+    }
+    if (n_frames > 3*w) {
+      BOOST_TEST(first == w);
+      BOOST_TEST(middle == w);
+      BOOST_TEST(last == w);
+      BOOST_TEST(std::abs(before - after) <= 1);
+    } else {
+      BOOST_TEST(first + middle + last == n_frames); // the wedges overlap
+    }
+  }
+
+  // Without a rotation increment or a frame count, only the first wedge is known.
+  scheduler.begin_series(make_geometry(-1, NAN));
+  BOOST_TEST(scheduler.wedge_size() == 10);
+  BOOST_TEST(scheduler.in_wedge(10));
+  BOOST_TEST(!scheduler.in_wedge(11));
+  BOOST_TEST(!scheduler.in_wedge(1000));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(stride) {
+  std::clog << "******** TEST CASE: stride ********\n";
+  frame_scheduler_options_t options;
+  options.utilization = 1.0;
+  options.max_stride = 8;
+  options.interval_s = 0;
+  frame_scheduler scheduler(options, 2);
+  scheduler.begin_series(make_geometry(10000, 0.1));
+
+  // Until analysis times are known, every frame is analyzed.
+  auto now = steady_clock::now();
+  for (int64_t i=0; i < 100; ++i) {
+    now += milliseconds(10); // 100 Hz
+    BOOST_TEST(scheduler.decide(i, now).analyze);
+  }
+  BOOST_TEST(scheduler.incoming_rate() == 100.0, boost::test_tools::tolerance(1e-6));
+
+  // 2 workers at 40ms per frame keep up with 50 Hz, so every 2nd frame is analyzed.
+  scheduler.completed(milliseconds(40));
+  BOOST_TEST(scheduler.capacity() == 50.0, boost::test_tools::tolerance(1e-6));
+  size_t n_analyzed = 0;
+  for (int64_t i=100; i < 200; ++i) {
+    now += milliseconds(10);
+    frame_decision_t d = scheduler.decide(i, now);
+    BOOST_TEST((d.mode == sampling_mode_t::stride));
+    BOOST_TEST(d.stride == 2);
+    BOOST_TEST(d.analyze == (i % 2 == 0));
+    n_analyzed += d.analyze;
+  }
+  BOOST_TEST(n_analyzed == 50u);
+
+  // Far behind, only the wedges are analyzed.
+  scheduler.completed(seconds(1000));
+  for (int64_t i=200; i < 9600; ++i) {
+    now += milliseconds(10);
+    frame_decision_t d = scheduler.decide(i, now);
+    if (i > 300) {
+      BOOST_TEST((d.mode == sampling_mode_t::wedges));
+      BOOST_TEST(d.analyze == scheduler.in_wedge(i));
+    }
+  }
+  frame_decision_t d = scheduler.decide(5000, now + milliseconds(10)); // the middle wedge
+  BOOST_TEST(d.analyze);
+  BOOST_TEST(d.wedge);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
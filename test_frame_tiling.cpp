@@ -0,0 +1,67 @@
+#include <iostream>
+#include <stdint.h>
+#include <vector>
+
+#include "dectris_utils.h"
+#include "frame_tiling.h"
+
+#define BOOST_TEST_MODULE FrameTilingTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+BOOST_AUTO_TEST_SUITE(TestFrameTiling);
+
+BOOST_AUTO_TEST_CASE(eiger_16m) {
+  std::clog << "****** TEST CASE: eiger_16m ******\n";
+  frame_tiling tiling(4150, 4371, module_layout_t());
+  BOOST_TEST(tiling.modular());
+  BOOST_TEST(tiling.n_tiles() == 32);
+  BOOST_TEST(tiling.n_tile_pixels() == 32u*1030*514);
+
+  const frame_tile_t& last = tiling.tile(tiling.n_tiles()-1);
+  BOOST_TEST(last.x + last.width == 4150u);
+  BOOST_TEST(last.y + last.height == 4371u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(roi_fallback) {
+  std::clog << "***** TEST CASE: roi_fallback *****\n";
+  frame_tiling tiling(1000, 130, module_layout_t());
+  BOOST_TEST(!tiling.modular());
+  BOOST_TEST(tiling.n_tile_pixels() == tiling.n_pixels());
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(stats_skip_gaps) {
+  std::clog << "**** TEST CASE: stats_skip_gaps ****\n";
+  module_layout_t layout;
+  layout.module_width = 4;
+  layout.module_height = 3;
+  layout.gap_x = 1;
+  layout.gap_y = 2;
+  frame_tiling tiling(9, 8, layout); // 2x2 modules
+  BOOST_TEST(tiling.modular());
+  BOOST_TEST(tiling.n_tiles() == 4u);
+
+  // Gap pixels hold garbage which must never be counted.
+  std::vector<uint16_t> frame(tiling.n_pixels(), 1000);
+  tiling.for_each_tile_row([&](size_t y, size_t x0, size_t x1, size_t) {
+    for (size_t x=x0; x < x1; ++x) {
+      frame[y*tiling.width() + x] = 2;
+    }
+  });
+  frame[0] = pixel_traits<uint16_t>::gap;
+  frame[1] = pixel_traits<uint16_t>::bad;
+  frame[2] = 50;
+
+  frame_stats_t stats = compute_frame_stats(tiling, frame.data(), 16, 50);
+  BOOST_TEST(stats.n_masked == 2u);
+  BOOST_TEST(stats.n_valid == 4u*12 - 2);
+  BOOST_TEST(stats.sum == (4u*12 - 3)*2 + 50);
+  BOOST_TEST(stats.max == 50u);
+  BOOST_TEST(stats.n_saturated == 1u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,98 @@
+#include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "frame_ring.h"
+#include "frame_tiling.h"
+#include "live_view.h"
+
+#define BOOST_TEST_MODULE LiveViewTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+static std::string live_name() {
+  return "/bigpicture-live-test-" + std::to_string(getpid());
+}
+
+static std::vector<uint32_t> read_latest(frame_ring_reader& reader, frame_meta_t& meta) {
+  frame_view_t view;
+  BOOST_REQUIRE(reader.latest(view));
+  meta = view.meta;
+  std::vector<uint32_t> image(view.size / sizeof(uint32_t));
+  memcpy(image.data(), view.data, view.size);
+  BOOST_TEST(reader.validate(view));
+  return image;
+}
+
+BOOST_AUTO_TEST_SUITE(TestLiveView);
+
+BOOST_AUTO_TEST_CASE(sliding_sum) {
+  std::clog << "***** TEST CASE: sliding_sum *****\n";
+  live_view live(live_name(), 2, 2, 0); // unthrottled
+  const uint64_t expected_memory = live.memory_usage(4, 2);
+  live.reset(3, 4, 2, 16);
+  BOOST_TEST(live.memory_usage() == expected_memory);
+  BOOST_TEST(live.width() == 2u);
+  BOOST_TEST(live.height() == 1u);
+  frame_ring_reader reader(live_name());
+
+  std::vector<uint16_t> frame(8);
+  for (uint16_t i=1; i <= 3; ++i) {
+    std::fill(frame.begin(), frame.end(), i);
+    if (i == 2) {
+      frame[0] = pixel_traits<uint16_t>::gap; // the left bin is only partially masked
+      frame[2] = frame[4] = frame[5] = pixel_traits<uint16_t>::bad;
+    }
+    live.add(i, frame.data());
+  }
+  BOOST_TEST(live.n_published() == 3u);
+
+  // The window holds frames 2 and 3, each summed over 2x2 bins.
+  frame_meta_t meta;
+  std::vector<uint32_t> image = read_latest(reader, meta);
+  BOOST_TEST(meta.series_id == 3);
+  BOOST_TEST(meta.frame_id == 3);
+  BOOST_TEST(meta.bit_depth == 32);
+  BOOST_TEST(image.size() == 2u);
+  BOOST_TEST(image[0] == 4u*2 + 4*3); // partial bins are rescaled to full bins
+  BOOST_TEST(image[1] == 4u*2 + 4*3);
+
+  // Frame 2 leaves the window.
+  live.add(4, frame.data());
+  image = read_latest(reader, meta);
+  BOOST_TEST(image[0] == 4u*3 + 4*3);
+
+  // A bin masked by every pixel of a frame is masked while that frame is in the window.
+  frame[2] = frame[3] = frame[6] = frame[7] = pixel_traits<uint16_t>::gap;
+  live.add(5, frame.data());
+  image = read_latest(reader, meta);
+  BOOST_TEST(image[1] == pixel_traits<uint32_t>::gap);
+  std::fill(frame.begin(), frame.end(), 1);
+  live.add(6, frame.data());
+  live.add(7, frame.data());
+  image = read_latest(reader, meta);
+  BOOST_TEST(image[1] == 4u*2);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(throttled) {
+  std::clog << "****** TEST CASE: throttled ******\n";
+  live_view live(live_name(), 4, 1, 0.001);
+  live.reset(1, 4, 2, 32);
+  std::vector<uint32_t> frame(8, 1);
+  for (int64_t i=1; i <= 5; ++i) {
+    live.add(i, frame.data());
+  }
+  BOOST_TEST(live.n_published() == 1u);
+
+  live.publish();
+  BOOST_TEST(live.n_published() == 2u);
+  live.publish(); // nothing new to publish
+  BOOST_TEST(live.n_published() == 2u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,115 @@
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+#include "lru_cache.h"
+#include "memory_budget.h"
+#include "metrics.h"
+
+#define BOOST_TEST_MODULE MemoryBudgetTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+BOOST_AUTO_TEST_SUITE(TestMemoryBudget);
+
+BOOST_AUTO_TEST_CASE(reservations) {
+  std::clog << "****** TEST CASE: reservations ******\n";
+  memory_budget budget(100);
+  metrics_writer writer;
+  budget.publish(writer);
+  BOOST_TEST(budget.try_reserve(60));
+  BOOST_TEST(!budget.try_reserve(41));
+  BOOST_TEST(budget.available() == 40u);
+  {
+    memory_reservation frame(&budget);
+    BOOST_TEST(frame.try_resize(40));
+    BOOST_TEST(!frame.try_resize(41));
+    BOOST_TEST(frame.size() == 40u);
+
+    // Frames in flight may overdraw the budget, which a receive loop waits out.
+    frame.resize(50);
+    BOOST_TEST(budget.overdrawn());
+    BOOST_TEST(budget.available() == 0u);
+    BOOST_TEST(!budget.wait_until_available(std::chrono::milliseconds(1)));
+  }
+  BOOST_TEST(!budget.overdrawn());
+  BOOST_TEST(budget.in_use() == 60u);
+  BOOST_TEST(budget.high_water() == 110u);
+  budget.release(60);
+
+  metrics_snapshot_t snapshot = writer.snapshot();
+  BOOST_TEST(snapshot.value("memory_limit") == 100);
+  BOOST_TEST(snapshot.value("memory_in_use") == 0);
+  BOOST_TEST(snapshot.value("memory_high_water") == 110);
+  BOOST_TEST(snapshot.value("memory_waits") == 1);
+
+  // Without a limit, usage is only tracked.
+  memory_budget unlimited;
+  memory_reservation frame(&unlimited);
+  BOOST_TEST(frame.try_resize(UINT64_MAX / 2));
+  BOOST_TEST(!unlimited.overdrawn());
+  BOOST_TEST(unlimited.wait_until_available(std::chrono::milliseconds(0)));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(release_wakes_waiter) {
+  std::clog << "*** TEST CASE: release_wakes_waiter ***\n";
+  memory_budget budget(10);
+  budget.reserve(20);
+  std::thread worker([&budget]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    budget.release(20);
+  });
+  BOOST_TEST(budget.wait_until_available(std::chrono::seconds(10)));
+  worker.join();
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(caches) {
+  std::clog << "******** TEST CASE: caches ********\n";
+  memory_budget budget(100);
+  lru_cache<int, std::string> a(1000, &budget), b(1000, &budget);
+  auto value = std::make_shared<const std::string>("x");
+  a.put(1, value, 40);
+  a.put(2, value, 40);
+  b.put(1, value, 20);
+  BOOST_TEST(budget.in_use() == 100u);
+
+  // A cache makes room within the budget by evicting its own entries.
+  a.put(3, value, 40);
+  BOOST_TEST(!a.get(1));
+  BOOST_TEST(a.get(2));
+  BOOST_TEST(b.get(1));
+  BOOST_TEST(budget.in_use() == 100u);
+
+  // An entry the budget cannot spare, even after evicting everything, is not cached.
+  b.put(2, value, 90);
+  BOOST_TEST(!b.get(2));
+  BOOST_TEST(b.size() == 0u);
+  BOOST_TEST(budget.in_use() == 80u);
+
+  // Frames in flight reclaim memory from the caches, least recently used first.
+  {
+    memory_reservation frame(&budget);
+    frame.resize(60);
+    BOOST_TEST(!budget.overdrawn());
+    BOOST_TEST(a.size() == 1u);
+    BOOST_TEST(a.get(2));
+    BOOST_TEST(budget.in_use() == 100u);
+  }
+  a.clear();
+  BOOST_TEST(budget.in_use() == 0u);
+  {
+    lru_cache<int, std::string> c(1000, &budget);
+    c.put(1, value, 50);
+    BOOST_TEST(budget.in_use() == 50u);
+  }
+  BOOST_TEST(budget.in_use() == 0u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
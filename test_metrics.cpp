@@ -0,0 +1,78 @@
+#include <iostream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define BOOST_TEST_MODULE MetricsTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+BOOST_AUTO_TEST_SUITE(TestMetrics);
+
+BOOST_AUTO_TEST_CASE(counters) {
+  std::clog << "******** TEST CASE: counters ********\n";
+  const std::string name = "/bigpicture-test-metrics-" + std::to_string(getpid());
+  metrics_snapshot_t snapshot;
+  {
+    metrics_writer writer(name);
+    metrics_counter frames = writer.counter("frames");
+    metrics_counter series = writer.counter("series_id");
+    frames.add();
+    frames.add(2);
+    series.set(42);
+    writer.counter("frames").add(); // shared by name
+
+    BOOST_REQUIRE(read_metrics(name, snapshot));
+    BOOST_TEST(snapshot.pid == int64_t(getpid()));
+    BOOST_TEST(snapshot.counters.size() == 2u);
+    BOOST_TEST(snapshot.value("frames") == 4);
+    BOOST_TEST(snapshot.value("series_id") == 42);
+    BOOST_TEST(snapshot.value("missing", -1) == -1);
+    BOOST_TEST(writer.snapshot().value("frames") == 4);
+
+    BOOST_CHECK_THROW(writer.counter(""), std::runtime_error);
+    BOOST_CHECK_THROW(writer.counter(std::string(metrics_name_size, 'x')), std::runtime_error);
+  }
+  // The segment is unlinked along with the writer.
+  BOOST_TEST(!read_metrics(name, snapshot));
+
+  // Without a segment, counters are private, and unregistered ones count nothing.
+  metrics_writer local;
+  local.counter("frames").add(5);
+  BOOST_TEST(local.name().empty());
+  BOOST_TEST(local.snapshot().value("frames") == 5);
+  metrics_counter unregistered;
+  unregistered.add();
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(histograms) {
+  std::clog << "******* TEST CASE: histograms *******\n";
+  metrics_writer writer;
+  metrics_histogram latency = writer.histogram("frame_us");
+  for (uint64_t v=1; v <= 100; ++v) {
+    latency.record(v);
+  }
+  latency.record(0);
+  latency.record(UINT64_MAX / 2); // lands in the last bucket
+
+  metrics_snapshot_t snapshot = writer.snapshot();
+  const metrics_histogram_t* h = snapshot.histogram("frame_us");
+  BOOST_REQUIRE(h);
+  BOOST_TEST(h->count == 102u);
+  BOOST_TEST(h->buckets[0] == 1u);
+  BOOST_TEST(h->buckets[1] == 1u);   // 1
+  BOOST_TEST(h->buckets[7] == 37u);  // 64 to 100
+  BOOST_TEST(h->buckets[metrics_n_buckets - 1] == 1u);
+  BOOST_TEST(h->quantile(0) == 0u);
+  BOOST_TEST(h->quantile(0.5) == 63u);
+  BOOST_TEST(h->quantile(0.99) == 127u);
+  BOOST_TEST(!snapshot.histogram("missing"));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,119 @@
+#include <iostream>
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+
+#include "frame_tiling.h"
+#include "preview.h"
+
+#define BOOST_TEST_MODULE PreviewTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+BOOST_AUTO_TEST_SUITE(TestPreview);
+
+BOOST_AUTO_TEST_CASE(percentile_stretch) {
+  std::clog << "*** TEST CASE: percentile_stretch ***\n";
+  // Values 0..999 with a few hot pixels and masked pixels, which must not move
+  // the stretch.
+  std::vector<uint32_t> frame(1000);
+  for (size_t i=0; i < frame.size(); ++i) {
+    frame[i] = i;
+  }
+  frame[10] = 1000000;
+  frame[20] = pixel_traits<uint32_t>::gap;
+  frame[30] = pixel_traits<uint32_t>::bad;
+
+  tone_map_t tone = compute_tone_map(frame.data(), frame.size(), 10.0, 99.0);
+  BOOST_TEST(tone.low >= 95u);
+  BOOST_TEST(tone.low <= 105u);
+  BOOST_TEST(tone.high >= 980u);
+  BOOST_TEST(tone.high <= 995u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(tone_mapping) {
+  std::clog << "***** TEST CASE: tone_mapping *****\n";
+  std::vector<uint16_t> frame = {0, 100, 150, 200, 300, pixel_traits<uint16_t>::gap};
+  tone_map_t tone;
+  tone.low = 100;
+  tone.high = 200;
+
+  std::vector<uint8_t> gray(frame.size());
+  tone_map_frame(frame.data(), frame.size(), tone, gray.data());
+  BOOST_TEST(gray[0] == 0);
+  BOOST_TEST(gray[1] == 0);
+  BOOST_TEST(gray[2] == 128);
+  BOOST_TEST(gray[3] == 255);
+  BOOST_TEST(gray[4] == 255);
+  BOOST_TEST(gray[5] == 0);
+
+  // Inverted, masked pixels stay black.
+  tone.invert = true;
+  tone_map_frame(frame.data(), frame.size(), tone, gray.data());
+  BOOST_TEST(gray[0] == 255);
+  BOOST_TEST(gray[3] == 0);
+  BOOST_TEST(gray[5] == 0);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(counts_16_bit) {
+  std::clog << "***** TEST CASE: counts_16_bit *****\n";
+  std::vector<uint32_t> frame = {0, 7, 65535, 70000, pixel_traits<uint32_t>::gap,
+				 pixel_traits<uint32_t>::bad};
+  std::vector<uint16_t> gray(frame.size());
+  counts_to_gray16(frame.data(), frame.size(), gray.data());
+  BOOST_TEST(gray[0] == 0);
+  BOOST_TEST(gray[1] == 7);
+  BOOST_TEST(gray[2] == 65535);
+  BOOST_TEST(gray[3] == 65535);
+  BOOST_TEST(gray[4] == 0);
+  BOOST_TEST(gray[5] == 0);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(binning) {
+  std::clog << "******** TEST CASE: binning ********\n";
+  // A 5x3 frame binned 2x2 yields 3x2 bins, with partial bins on the right and bottom.
+  constexpr uint16_t gap = pixel_traits<uint16_t>::gap;
+  std::vector<uint16_t> frame = {
+    1,   2,   3,   4,   5,
+    3,   4,   gap, 60,  7,
+    gap, gap, 10,  11,  gap,
+  };
+  BOOST_TEST(binned_size(5, 2) == 3u);
+  BOOST_TEST(bin_factor_for(4150, 1024) == 5u);
+  BOOST_TEST(bin_factor_for(512, 1024) == 1u);
+
+  std::vector<uint32_t> binned(3*2);
+  bin_frame(frame.data(), 5, 3, 2, bin_mode_t::sum, binned.data());
+  BOOST_TEST(binned[0] == 10u);
+  BOOST_TEST(binned[1] == 89u); // 3 valid pixels summing to 67, scaled to 4 pixels
+  BOOST_TEST(binned[2] == 24u); // 2 valid pixels summing to 12
+  BOOST_TEST(binned[3] == pixel_traits<uint32_t>::gap);
+  BOOST_TEST(binned[4] == 42u);
+  BOOST_TEST(binned[5] == pixel_traits<uint32_t>::gap);
+
+  bin_frame(frame.data(), 5, 3, 2, bin_mode_t::max, binned.data());
+  BOOST_TEST(binned[1] == 60u);
+  BOOST_TEST(binned[2] == 7u);
+  BOOST_TEST(binned[5] == pixel_traits<uint32_t>::gap);
+
+  // Fused with tone mapping, sum mode maps the mean of the unmasked pixels.
+  tone_map_t tone;
+  tone.low = 0;
+  tone.high = 20;
+  std::vector<uint8_t> gray(3*2);
+  bin_and_tone_map(frame.data(), 5, 3, 2, bin_mode_t::sum, tone, gray.data());
+  BOOST_TEST(gray[0] == 32);  // mean 2.5
+  BOOST_TEST(gray[1] == 255); // mean 22.3
+  BOOST_TEST(gray[4] == 134); // mean 10.5
+  BOOST_TEST(gray[5] == 0);
+
+  BOOST_CHECK_THROW(bin_frame(frame.data(), 5, 3, 0, bin_mode_t::sum, binned.data()),
+		    std::runtime_error);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,84 @@
+#include <iostream>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#include "frame_events.h"
+#include "frame_quality.h"
+#include "frame_tiling.h"
+#include "radial_profile.h"
+#include "resolution_map.h"
+
+#define BOOST_TEST_MODULE RadialProfileTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+static frame_geometry_t make_geometry() {
+  frame_geometry_t g;
+  g.width = 400;
+  g.height = 400;
+  g.beam_center_x = 200;
+  g.beam_center_y = 200;
+  g.detector_distance = 0.05;
+  g.wavelength = 1.0;
+  g.x_pixel_size = 75e-6;
+  g.y_pixel_size = 75e-6;
+  return g;
+}
+
+BOOST_AUTO_TEST_SUITE(TestRadialProfile);
+
+BOOST_AUTO_TEST_CASE(sums) {
+  std::clog << "******** TEST CASE: sums ********\n";
+  frame_geometry_t g = make_geometry();
+  resolution_map map(g, 100);
+  frame_tiling tiling(400, 400, module_layout_t()); // bands of rows
+  std::vector<uint16_t> frame(400*400);
+  std::vector<uint64_t> sum(100, 0), n(100, 0);
+  for (size_t i=0; i < frame.size(); ++i) {
+    frame[i] = i % 7;
+    if (i % 13 == 0) {
+      frame[i] = pixel_traits<uint16_t>::bad;
+      continue;
+    }
+    sum[map.bins()[i]] += frame[i];
+    ++n[map.bins()[i]];
+  }
+
+  radial_profile profile;
+  profile.compute(tiling, map, frame.data(), 16);
+  BOOST_TEST_REQUIRE(profile.n_bins() == 100u);
+  for (size_t b=0; b < 100; ++b) {
+    BOOST_TEST(profile.sum(b) == sum[b]);
+    BOOST_TEST(profile.n_pixels(b) == n[b]);
+  }
+  BOOST_TEST(profile.mean(10) == double(sum[10]) / n[10]);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(ice_ring) {
+  std::clog << "****** TEST CASE: ice_ring ******\n";
+  frame_geometry_t g = make_geometry();
+  resolution_map map(g, 1000);
+  frame_tiling tiling(400, 400, module_layout_t());
+  std::vector<uint32_t> frame(400*400, 10);
+
+  radial_profile profile;
+  profile.compute(tiling, map, frame.data(), 32);
+  BOOST_TEST(count_ice_rings(profile, map) == 0u);
+
+  for (size_t y=0; y < 400; ++y) {
+    for (size_t x=0; x < 400; ++x) {
+      const double s = 1.0 / resolution_at(g, x + 0.5, y + 0.5);
+      if (fabs(s - 1.0/3.669) < 0.6*ice_ring_width) {
+	frame[y*400 + x] = 30;
+      }
+    }
+  }
+  profile.compute(tiling, map, frame.data(), 32);
+  BOOST_TEST(count_ice_rings(profile, map) == 1u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
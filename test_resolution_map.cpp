@@ -0,0 +1,71 @@
+#include <iostream>
+#include <math.h>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "frame_events.h"
+#include "frame_quality.h"
+#include "resolution_map.h"
+
+#define BOOST_TEST_MODULE ResolutionMapTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+static frame_geometry_t make_geometry() {
+  frame_geometry_t g;
+  g.width = 300;
+  g.height = 200;
+  g.beam_center_x = 100;
+  g.beam_center_y = 80;
+  g.detector_distance = 0.05;
+  g.wavelength = 1.0;
+  g.x_pixel_size = 75e-6;
+  g.y_pixel_size = 75e-6;
+  return g;
+}
+
+BOOST_AUTO_TEST_SUITE(TestResolutionMap);
+
+BOOST_AUTO_TEST_CASE(bins) {
+  std::clog << "******** TEST CASE: bins ********\n";
+  frame_geometry_t g = make_geometry();
+  resolution_map map(g, 500);
+  BOOST_TEST(map.bin(100, 80) <= 1u); // bins are narrower than a pixel
+  BOOST_TEST(map.bin(299, 199) >= 498u); // the farthest corner
+  BOOST_TEST(map.d_min() == resolution_at(g, 300, 200), boost::test_tools::tolerance(1e-9));
+
+  // Bins increase away from the beam center, and agree with the exact resolution.
+  for (size_t x=101; x < 300; ++x) {
+    BOOST_TEST(map.bin(x, 80) >= map.bin(x-1, 80));
+    const double d = resolution_at(g, x + 0.5, 80.5);
+    BOOST_TEST(map.bin(x, 80) == map.bin_of(d));
+    BOOST_TEST(fabs(1.0/map.resolution(x, 80) - 1.0/d) <= 0.5 * 1.0/(500 * map.d_min()) + 1e-12);
+  }
+  BOOST_TEST(map.bin_of(INFINITY) == 0u);
+  BOOST_TEST(map.bin_of(0.1) == 499u);
+
+  g.beam_center_x = NAN;
+  BOOST_CHECK_THROW(resolution_map(g, 500), std::runtime_error);
+  BOOST_CHECK_THROW(resolution_map(make_geometry(), 0), std::runtime_error);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(cache) {
+  std::clog << "******** TEST CASE: cache ********\n";
+  resolution_map_cache cache;
+  frame_geometry_t g = make_geometry();
+  auto a = cache.get(g, 500);
+  g.omega_start = 90; // does not affect resolution
+  auto b = cache.get(g, 500);
+  BOOST_TEST(a.get() == b.get());
+  g.detector_distance = 0.1;
+  auto c = cache.get(g, 500);
+  BOOST_TEST(a.get() != c.get());
+  BOOST_TEST(cache.get(make_geometry(), 250)->n_bins() == 250u);
+  BOOST_TEST(cache.n_hits() == 1u);
+  BOOST_TEST(cache.n_misses() == 3u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
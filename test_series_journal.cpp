@@ -0,0 +1,89 @@
+#include <chrono>
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <unistd.h>
+
+#include "series_journal.h"
+
+#define BOOST_TEST_MODULE SeriesJournalTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+static std::string journal_path() {
+  return "/tmp/bigpicture-test-" + std::to_string(getpid()) + ".journal";
+}
+
+BOOST_AUTO_TEST_SUITE(TestSeriesJournal);
+
+BOOST_AUTO_TEST_CASE(complete_series) {
+  std::clog << "***** TEST CASE: complete_series *****\n";
+  const std::string path = journal_path();
+  series_journal_t journal;
+  {
+    series_journal_writer writer(path, std::chrono::milliseconds(0));
+    writer.begin(7, 100, "{\"nimages\":100}");
+    for (int64_t frame=1; frame <= 100; ++frame) {
+      writer.commit(frame);
+    }
+    writer.end();
+  }
+  BOOST_REQUIRE(read_series_journal(path, journal));
+  BOOST_TEST(journal.series_id == 7);
+  BOOST_TEST(journal.n_frames == 100);
+  BOOST_TEST(journal.header == "{\"nimages\":100}");
+  BOOST_TEST(journal.complete);
+  BOOST_TEST(journal.n_committed() == 100);
+  BOOST_TEST(format_frame_ranges(journal.committed()) == "1-100");
+  BOOST_TEST(format_frame_ranges(journal.missing()) == "none");
+
+  // The next series replaces the previous one.
+  {
+    series_journal_writer writer(path, std::chrono::milliseconds(0));
+    writer.begin(8, 10, "{}");
+  }
+  BOOST_REQUIRE(read_series_journal(path, journal));
+  BOOST_TEST(journal.series_id == 8);
+  BOOST_TEST(!journal.complete);
+  BOOST_TEST(journal.n_committed() == 0);
+  BOOST_TEST(format_frame_ranges(journal.missing()) == "1-10");
+  unlink(path.c_str());
+  BOOST_TEST(!read_series_journal(path, journal));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(interrupted_series) {
+  std::clog << "**** TEST CASE: interrupted_series ****\n";
+  const std::string path = journal_path();
+  {
+    // Records are only written once per interval, and by the destructor.
+    series_journal_writer writer(path, std::chrono::hours(1));
+    writer.begin(3, 200, "{}");
+    for (int64_t frame=1; frame <= 150; ++frame) {
+      if (frame != 5 && (frame < 70 || frame > 80)) {
+	writer.commit(frame);
+      }
+    }
+    series_journal_t journal;
+    BOOST_REQUIRE(read_series_journal(path, journal));
+    BOOST_TEST(journal.n_committed() == 0);
+  }
+  // A torn record at the end is ignored.
+  FILE* file_handle = fopen(path.c_str(), "ab");
+  BOOST_REQUIRE(file_handle);
+  fwrite("torn", 1, 4, file_handle);
+  fclose(file_handle);
+
+  series_journal_t journal;
+  BOOST_REQUIRE(read_series_journal(path, journal));
+  BOOST_TEST(!journal.complete);
+  BOOST_TEST(journal.n_committed() == 138);
+  BOOST_TEST(format_frame_ranges(journal.committed()) == "1-4,6-69,81-150");
+  BOOST_TEST(format_frame_ranges(journal.missing()) == "5,70-80,151-200");
+  unlink(path.c_str());
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,70 @@
+#include <iostream>
+#include <stdint.h>
+#include <vector>
+
+#include "dectris_utils.h"
+#include "frame_tiling.h"
+#include "series_summary.h"
+
+#define BOOST_TEST_MODULE SeriesSummaryTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+BOOST_AUTO_TEST_SUITE(TestSeriesSummary);
+
+BOOST_AUTO_TEST_CASE(sum_and_max) {
+  std::clog << "***** TEST CASE: sum_and_max *****\n";
+  module_layout_t layout;
+  layout.module_width = 4;
+  layout.module_height = 3;
+  layout.gap_x = 1;
+  layout.gap_y = 2;
+  frame_tiling tiling(9, 8, layout); // 2x2 modules
+  BOOST_TEST(tiling.modular());
+
+  series_summary summary;
+  const uint64_t expected_memory = summary.memory_usage(tiling);
+  summary.reset(tiling);
+  BOOST_TEST(summary.memory_usage() == expected_memory);
+  const size_t n = tiling.n_pixels();
+  std::vector<uint16_t> frame(n, 0);
+  for (uint16_t i=1; i <= 3; ++i) {
+    std::fill(frame.begin(), frame.end(), i);
+    if (i == 2) {
+      frame[1] = pixel_traits<uint16_t>::bad;
+    }
+    summary.add(frame.data(), 16);
+  }
+  BOOST_TEST(summary.n_frames() == 3u);
+
+  std::vector<int32_t> sum(n), max(n);
+  summary.sum_image(sum.data());
+  summary.max_image(max.data());
+  BOOST_TEST(sum[0] == 6);
+  BOOST_TEST(max[0] == 3);
+  BOOST_TEST(sum[1] == -2); // bad in one frame, bad in the summary
+  BOOST_TEST(max[1] == -2);
+  BOOST_TEST(sum[4] == -1); // vertical gap between modules
+  BOOST_TEST(max[3*9] == -1); // horizontal gap between modules
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(saturation) {
+  std::clog << "***** TEST CASE: saturation *****\n";
+  frame_tiling tiling(4, 2, module_layout_t()); // a single ROI tile
+  series_summary summary;
+  summary.reset(tiling);
+  std::vector<uint32_t> frame(tiling.n_pixels(), UINT32_MAX - 2);
+  summary.add(frame.data(), 32);
+  summary.add(frame.data(), 32);
+
+  std::vector<int32_t> sum(tiling.n_pixels()), max(tiling.n_pixels());
+  summary.sum_image(sum.data());
+  summary.max_image(max.data());
+  BOOST_TEST(sum[0] == INT32_MAX);
+  BOOST_TEST(max[0] == INT32_MAX);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
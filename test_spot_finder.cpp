@@ -0,0 +1,135 @@
+#include <iostream>
+#include <stdint.h>
+#include <vector>
+
+#include "dectris_utils.h"
+#include "frame_tiling.h"
+#include "spot_finder.h"
+
+#define BOOST_TEST_MODULE SpotFinderTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+/*
+  A 2x1 module frame with a background of 9 and 11 counts in a checkerboard, a 3x3
+  spot centered on (cx, cy) in the left module, and a hot pixel in the right module.
+*/
+static std::vector<uint16_t> make_frame(const frame_tiling& tiling, size_t cx, size_t cy) {
+  std::vector<uint16_t> frame(tiling.n_pixels(), pixel_traits<uint16_t>::gap);
+  const size_t width = tiling.width();
+  tiling.for_each_tile_row([&](size_t y, size_t x0, size_t x1, size_t) {
+    for (size_t x=x0; x < x1; ++x) {
+      frame[y*width + x] = ((x + y) % 2) ? 9 : 11;
+    }
+  });
+  for (size_t y=cy-1; y <= cy+1; ++y) {
+    for (size_t x=cx-1; x <= cx+1; ++x) {
+      frame[y*width + x] = 200;
+    }
+  }
+  frame[cy*width + cx] = 400;
+  frame[10*width + 50] = 5000; // a single pixel is too small to be a spot
+  frame[12*width + 12] = pixel_traits<uint16_t>::bad;
+  return frame;
+}
+
+static module_layout_t make_layout() {
+  module_layout_t layout;
+  layout.module_width = 40;
+  layout.module_height = 30;
+  layout.gap_x = 4;
+  layout.gap_y = 2;
+  return layout;
+}
+
+BOOST_AUTO_TEST_SUITE(TestSpotFinder);
+
+BOOST_AUTO_TEST_CASE(one_spot) {
+  std::clog << "****** TEST CASE: one_spot ******\n";
+  frame_tiling tiling(84, 30, make_layout()); // 2x1 modules
+  BOOST_TEST(tiling.n_tiles() == 2u);
+  std::vector<uint16_t> frame = make_frame(tiling, 20, 15);
+
+  spot_finder finder;
+  std::vector<spot_t> spots;
+  finder.find(tiling, frame.data(), 16, spots);
+  BOOST_TEST_REQUIRE(spots.size() == 1u);
+  BOOST_TEST(spots[0].n_pixels == 9u);
+  BOOST_TEST(spots[0].intensity == 8u*200 + 400);
+  BOOST_TEST(spots[0].peak == 400u);
+  BOOST_TEST(spots[0].x == 20.5, boost::test_tools::tolerance(1e-9));
+  BOOST_TEST(spots[0].y == 15.5, boost::test_tools::tolerance(1e-9));
+  BOOST_TEST(finder.n_strong() == 10u); // including the hot pixel
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(module_edge) {
+  std::clog << "***** TEST CASE: module_edge *****\n";
+  frame_tiling tiling(84, 30, make_layout());
+  // A spot against the gap, with a box truncated by the module edge.
+  std::vector<uint16_t> frame = make_frame(tiling, 38, 1);
+
+  spot_finder finder;
+  std::vector<spot_t> spots;
+  finder.find(tiling, frame.data(), 16, spots);
+  BOOST_TEST_REQUIRE(spots.size() == 1u);
+  BOOST_TEST(spots[0].n_pixels == 9u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(pixel_mask) {
+  std::clog << "***** TEST CASE: pixel_mask *****\n";
+  frame_tiling tiling(84, 30, make_layout());
+  std::vector<uint16_t> frame = make_frame(tiling, 20, 15);
+
+  mask_t<uint32_t> mask;
+  mask.reset(84, 30);
+  std::fill(mask.data.get(), mask.data.get() + 84*30, 0);
+  mask.data[15*84 + 20] = 1; // the peak, which splits the spot in two
+
+  spot_finder finder;
+  finder.set_pixel_mask(mask);
+  std::vector<spot_t> spots;
+  finder.find(tiling, frame.data(), 16, spots);
+  BOOST_TEST_REQUIRE(spots.size() == 1u); // 8 pixels in a ring are still 4-connected
+  BOOST_TEST(spots[0].n_pixels == 8u);
+  BOOST_TEST(spots[0].intensity == 8u*200);
+
+  mask_t<uint32_t> wrong_size;
+  wrong_size.reset(10, 10);
+  std::fill(wrong_size.data.get(), wrong_size.data.get() + 10*10, 0);
+  finder.set_pixel_mask(wrong_size);
+  BOOST_CHECK_THROW(finder.find(tiling, frame.data(), 16, spots), std::runtime_error);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(incremental_background) {
+  std::clog << "** TEST CASE: incremental_background **\n";
+  frame_tiling tiling(84, 30, make_layout());
+  std::vector<uint16_t> a = make_frame(tiling, 20, 15);
+  std::vector<uint16_t> b = make_frame(tiling, 60, 20);
+
+  spot_finder_options_t options;
+  options.background = spot_background_t::incremental;
+  options.background_warmup = 2;
+  spot_finder finder(options);
+  std::vector<spot_t> spots;
+  // Each spot is background in the other frame, so every pixel has an estimate.
+  finder.find(tiling, a.data(), 16, spots);
+  finder.find(tiling, b.data(), 16, spots);
+  BOOST_TEST(finder.background().warm(tiling));
+  BOOST_TEST(finder.background().mean(20, 15) == 9.0f); // the spot was left out
+
+  finder.find(tiling, a.data(), 16, spots);
+  BOOST_TEST_REQUIRE(spots.size() == 1u);
+  BOOST_TEST(spots[0].n_pixels == 9u);
+  BOOST_TEST(spots[0].intensity == 8u*200 + 400);
+  BOOST_TEST(finder.n_strong() == 9u); // the hot pixel has never been background
+
+  finder.reset_background();
+  BOOST_TEST(!finder.background().warm(tiling));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,152 @@
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "frame_tiling.h"
+#include "lru_cache.h"
+#include "tile_pyramid.h"
+
+#define BOOST_TEST_MODULE TilePyramidTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+BOOST_AUTO_TEST_SUITE(TestTilePyramid);
+
+BOOST_AUTO_TEST_CASE(levels) {
+  std::clog << "******** TEST CASE: levels ********\n";
+  // A 600x300 frame has levels down to 1x1: 600, 300, 150, 75, 38, 19, 10, 5, 3, 2, 1.
+  const size_t width = 600, height = 300;
+  std::vector<uint16_t> frame(width*height, 10);
+  frame[0] = pixel_traits<uint16_t>::gap;
+  frame[1] = 1000;
+  tone_map_t tone;
+  tone.low = 0;
+  tone.high = 20;
+
+  tile_pyramid pyramid(frame.data(), width, height, 16, bin_mode_t::max, tone, 256);
+  BOOST_TEST(pyramid.max_level() == 10u);
+  BOOST_TEST(pyramid.width(10) == 600u);
+  BOOST_TEST(pyramid.height(10) == 300u);
+  BOOST_TEST(pyramid.width(9) == 300u);
+  BOOST_TEST(pyramid.width(6) == 38u);
+  BOOST_TEST(pyramid.height(6) == 19u);
+  BOOST_TEST(pyramid.width(0) == 1u);
+  BOOST_TEST(pyramid.height(0) == 1u);
+  BOOST_TEST(pyramid.n_columns(10) == 3u);
+  BOOST_TEST(pyramid.n_rows(10) == 2u);
+
+  // Edge tiles are partial, and the hot pixel survives max binning to level 0.
+  std::vector<uint8_t> gray;
+  size_t tile_width = 0, tile_height = 0;
+  pyramid.render_tile(10, 2, 1, gray, tile_width, tile_height);
+  BOOST_TEST(tile_width == 88u);
+  BOOST_TEST(tile_height == 44u);
+  BOOST_TEST(gray[0] == 128);
+
+  pyramid.render_tile(10, 0, 0, gray, tile_width, tile_height);
+  BOOST_TEST(gray[0] == 0);   // masked
+  BOOST_TEST(gray[1] == 255); // hot pixel
+  pyramid.render_tile(0, 0, 0, gray, tile_width, tile_height);
+  BOOST_TEST(tile_width == 1u);
+  BOOST_TEST(gray[0] == 255);
+
+  BOOST_CHECK_THROW(pyramid.render_tile(10, 3, 0, gray, tile_width, tile_height),
+		    std::out_of_range);
+  BOOST_TEST(pyramid.dzi().find("Width=\"600\" Height=\"300\"") != std::string::npos);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(sum_levels) {
+  std::clog << "****** TEST CASE: sum_levels ******\n";
+  // In sum mode, the tone map scales with the bin area so every level looks alike.
+  std::vector<uint32_t> frame(64*64, 10);
+  tone_map_t tone;
+  tone.low = 0;
+  tone.high = 20;
+  tile_pyramid pyramid(frame.data(), 64, 64, 32, bin_mode_t::sum, tone, 16);
+  std::vector<uint8_t> gray;
+  size_t tile_width = 0, tile_height = 0;
+  for (size_t level=0; level <= pyramid.max_level(); ++level) {
+    pyramid.render_tile(level, 0, 0, gray, tile_width, tile_height);
+    BOOST_TEST(gray[0] == 128);
+  }
+
+  // Bins of large counts neither saturate nor turn into masked pixels.
+  std::vector<uint32_t> bright(64*64, 3000000000u);
+  bright[0] = pixel_traits<uint32_t>::bad;
+  tone.high = 3000000000u;
+  tile_pyramid saturated(bright.data(), 64, 64, 32, bin_mode_t::sum, tone, 16);
+  for (size_t level=0; level < saturated.max_level(); ++level) {
+    saturated.render_tile(level, 0, 0, gray, tile_width, tile_height);
+    BOOST_TEST(gray[0] == 255);
+  }
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(lru_eviction) {
+  std::clog << "***** TEST CASE: lru_eviction *****\n";
+  lru_cache<int, std::string> cache(10);
+  cache.put(1, std::make_shared<const std::string>("a"), 4);
+  cache.put(2, std::make_shared<const std::string>("b"), 4);
+  BOOST_TEST(cache.get(1) != nullptr); // 1 is now the most recently used
+  cache.put(3, std::make_shared<const std::string>("c"), 4);
+  BOOST_TEST(cache.get(2) == nullptr);
+  BOOST_TEST(*cache.get(1) == "a");
+  BOOST_TEST(*cache.get(3) == "c");
+  BOOST_TEST(cache.cost() == 8u);
+
+  cache.put(4, std::make_shared<const std::string>("too big"), 11);
+  BOOST_TEST(cache.get(4) == nullptr);
+  BOOST_TEST(cache.size() == 2u);
+
+  // Computed values are cached, and failures are not.
+  int n_computed = 0;
+  auto compute = [&](uint64_t& cost) {
+    ++n_computed;
+    cost = 1;
+    return std::make_shared<const std::string>("d");
+  };
+  BOOST_TEST(*cache.get_or_compute(5, compute) == "d");
+  BOOST_TEST(*cache.get_or_compute(5, compute) == "d");
+  BOOST_TEST(n_computed == 1);
+  auto fail = [](uint64_t&) -> std::shared_ptr<const std::string> {
+    throw std::runtime_error("failed");
+  };
+  BOOST_CHECK_THROW(cache.get_or_compute(6, fail), std::runtime_error);
+  BOOST_TEST(*cache.get_or_compute(6, compute) == "d");
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(update_cost) {
+  std::clog << "***** TEST CASE: update_cost *****\n";
+  lru_cache<int, std::string> cache(10);
+  auto value = std::make_shared<const std::string>("a");
+  cache.put(1, value, 3);
+  cache.put(2, value, 3);
+  cache.put(3, value, 3);
+
+  // A value which grows in place evicts the least recently used entries.
+  cache.update_cost(2, 6);
+  BOOST_TEST(cache.get(1) == nullptr);
+  BOOST_TEST(cache.get(2) != nullptr);
+  BOOST_TEST(cache.get(3) != nullptr);
+  BOOST_TEST(cache.cost() == 9u);
+
+  cache.update_cost(2, 1);
+  BOOST_TEST(cache.cost() == 4u);
+  cache.update_cost(4, 1);
+  BOOST_TEST(cache.size() == 2u);
+
+  // An entry which outgrows the cache is evicted.
+  cache.update_cost(3, 11);
+  BOOST_TEST(cache.get(3) == nullptr);
+  BOOST_TEST(cache.size() == 0u);
+  BOOST_TEST(cache.cost() == 0u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,90 @@
+#include <iostream>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "work_queue.h"
+
+#define BOOST_TEST_MODULE WorkQueueTest
+#include <boost/test/unit_test.hpp>
+
+using namespace bigpicture;
+
+BOOST_AUTO_TEST_SUITE(TestWorkQueue);
+
+BOOST_AUTO_TEST_CASE(drop_oldest) {
+  std::clog << "***** TEST CASE: drop_oldest ******\n";
+  work_queue<int> queue(3);
+  for (int i=1; i <= 5; ++i) {
+    BOOST_TEST(queue.push(int(i)));
+  }
+  BOOST_TEST(queue.size() == 3u);
+  BOOST_TEST(queue.n_dropped() == 2u);
+  std::vector<int> jobs;
+  BOOST_TEST(queue.pop_batch(jobs, 10));
+  BOOST_TEST(jobs == std::vector<int>({ 3, 4, 5 }));
+
+  queue.close();
+  int job = 0;
+  BOOST_TEST(!queue.pop(job));
+  BOOST_TEST(!queue.push(6));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(pinned) {
+  std::clog << "******* TEST CASE: pinned ********\n";
+  // The first frames of a series, a wedge, arrive while a slow worker is busy.
+  work_queue<int> queue(3);
+  for (int i=1; i <= 3; ++i) {
+    BOOST_TEST(queue.push(int(i), true));
+  }
+
+  // A job which is not pinned cannot displace them, and is discarded itself.
+  BOOST_TEST(queue.push(4));
+  BOOST_TEST(queue.size() == 3u);
+  BOOST_TEST(queue.n_dropped() == 1u);
+  int job = 0;
+  BOOST_TEST(queue.pop(job));
+  BOOST_TEST(job == 1);
+
+  // The oldest job which is not pinned makes way for the next pinned one.
+  BOOST_TEST(queue.push(5));
+  BOOST_TEST(queue.push(6, true));
+  BOOST_TEST(queue.n_dropped() == 2u);
+
+  // With only pinned jobs queued, a pinned job goes beyond the capacity.
+  BOOST_TEST(queue.push(7, true));
+  BOOST_TEST(queue.size() == 4u);
+  BOOST_TEST(queue.n_dropped() == 2u);
+  std::vector<int> jobs;
+  BOOST_TEST(queue.pop_batch(jobs, 10));
+  BOOST_TEST(jobs == std::vector<int>({ 2, 3, 6, 7 }));
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_CASE(consumers) {
+  std::clog << "****** TEST CASE: consumers ******\n";
+  work_queue<int> queue(1000);
+  std::vector<uint64_t> sums(4, 0);
+  std::vector<std::thread> threads;
+  for (size_t i=0; i < sums.size(); ++i) {
+    threads.emplace_back([&queue, &sums, i]() {
+      int job = 0;
+      while (queue.pop(job)) {
+	sums[i] += job;
+      }
+    });
+  }
+  for (int i=1; i <= 1000; ++i) {
+    queue.push(int(i), i % 2);
+  }
+  queue.close();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  BOOST_TEST(sums[0] + sums[1] + sums[2] + sums[3] == 500500u);
+  BOOST_TEST(queue.n_dropped() == 0u);
+  std::clog << "********* END TEST CASE *********\n\n";
+}
+
+BOOST_AUTO_TEST_SUITE_END();
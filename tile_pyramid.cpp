@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+
+#include "frame_tiling.h"
+#include "tile_pyramid.h"
+
+using namespace bigpicture;
+
+/*
+  Bins a level 2x2 into the mean of each bin's unmasked pixels, or gap if all are masked.
+  Unlike sums, means never exceed the largest count of the frame, so deep levels of large
+  frames cannot saturate into the mask sentinels.
+*/
+template<typename T>
+static void mean_2x2(const T* src, size_t width, size_t height, uint32_t* dst) {
+  const size_t out_width = binned_size(width, 2);
+  const size_t out_height = binned_size(height, 2);
+  for (size_t oy=0; oy < out_height; ++oy) {
+    for (size_t ox=0; ox < out_width; ++ox) {
+      uint64_t total = 0;
+      uint32_t n_valid = 0;
+      for (size_t y=2*oy; y < std::min(2*oy + 2, height); ++y) {
+	for (size_t x=2*ox; x < std::min(2*ox + 2, width); ++x) {
+	  const T v = src[y*width + x];
+	  if (!pixel_traits<T>::is_masked(v)) {
+	    total += v;
+	    ++n_valid;
+	  }
+	}
+      }
+      dst[oy*out_width + ox] = n_valid ? uint32_t((total + n_valid/2) / n_valid)
+	: pixel_traits<uint32_t>::gap;
+    }
+  }
+}
+
+tile_pyramid::tile_pyramid(const void* pixels, size_t width, size_t height, int64_t bit_depth,
+			   bin_mode_t mode, const tone_map_t& tone, size_t tile_size) :
+  m_full(static_cast<const char*>(pixels),
+	 static_cast<const char*>(pixels) + width*height*(bit_depth/8)),
+  m_bit_depth(bit_depth),
+  m_tile_size(tile_size ? tile_size : 256),
+  m_tile_bytes(0) {
+  if (width == 0 || height == 0) {
+    throw std::runtime_error("Cannot build a tile pyramid of an empty frame.");
+  }
+  size_t max_level = 0;
+  while ((size_t(1) << max_level) < std::max(width, height)) {
+    ++max_level;
+  }
+
+  m_levels.resize(max_level + 1);
+  for (size_t level=0; level <= max_level; ++level) {
+    const size_t factor = size_t(1) << (max_level - level);
+    level_t& l = m_levels[level];
+    l.width = binned_size(width, factor);
+    l.height = binned_size(height, factor);
+    l.tone = tone;
+  }
+
+  // Each level is binned 2x2 from the level above it.
+  for (size_t level=max_level; level-- > 0; ) {
+    level_t& l = m_levels[level];
+    const level_t& above = m_levels[level + 1];
+    l.pixels.resize(l.width * l.height);
+    if (mode == bin_mode_t::max && level + 1 == max_level) {
+      bin_frame(m_full.data(), width, height, bit_depth, 2, mode, l.pixels.data());
+    } else if (mode == bin_mode_t::max) {
+      bin_frame(above.pixels.data(), above.width, above.height, 2, mode, l.pixels.data());
+    } else if (level + 1 == max_level) {
+      dispatch_pixel_type(bit_depth, [&](auto pixel) {
+	using T = decltype(pixel);
+	mean_2x2(reinterpret_cast<const T*>(m_full.data()), width, height, l.pixels.data());
+      });
+    } else {
+      mean_2x2(above.pixels.data(), above.width, above.height, l.pixels.data());
+    }
+  }
+}
+
+void tile_pyramid::render_tile(size_t level, size_t column, size_t row,
+			       std::vector<uint8_t>& gray,
+			       size_t& tile_width, size_t& tile_height) const {
+  if (level > max_level() || column >= n_columns(level) || row >= n_rows(level)) {
+    std::stringstream ss;
+    ss << "Tile " << level << "/" << column << "_" << row << " is outside the pyramid."
+       << std::endl;
+    throw std::out_of_range(ss.str());
+  }
+  const level_t& l = m_levels[level];
+  const size_t x0 = column * m_tile_size;
+  const size_t y0 = row * m_tile_size;
+  tile_width = std::min(m_tile_size, l.width - x0);
+  tile_height = std::min(m_tile_size, l.height - y0);
+  gray.resize(tile_width * tile_height);
+
+  for (size_t y=0; y < tile_height; ++y) {
+    const size_t offset = (y0 + y)*l.width + x0;
+    uint8_t* dst = gray.data() + y*tile_width;
+    if (level == max_level()) {
+      const char* src = m_full.data() + offset*(m_bit_depth/8);
+      tone_map_frame(src, tile_width, m_bit_depth, l.tone, dst);
+    } else {
+      tone_map_frame(l.pixels.data() + offset, tile_width, l.tone, dst);
+    }
+  }
+}
+
+std::shared_ptr<const std::string> tile_pyramid::tile(size_t level, size_t column, size_t row,
+						      jpeg_encoder& encoder) const {
+  // Levels have fewer than 2^28 tiles per side, since frames are far smaller than 2^36.
+  const uint64_t key = (uint64_t(level) << 56) | (uint64_t(column) << 28) | row;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_tiles.find(key);
+    if (it != m_tiles.end()) {
+      return it->second;
+    }
+  }
+
+  // Render without holding the lock; if two threads race for a tile, both render it
+  // and the first one cached wins.
+  std::vector<uint8_t> gray;
+  size_t tile_width = 0, tile_height = 0;
+  render_tile(level, column, row, gray, tile_width, tile_height);
+  size_t len = encoder.encode(gray.data(), tile_width, tile_height);
+  auto encoded = std::make_shared<const std::string>(
+    reinterpret_cast<const char*>(encoder.data()), len);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto result = m_tiles.emplace(key, encoded);
+  if (result.second) {
+    m_tile_bytes += len;
+  }
+  return result.first->second;
+}
+
+std::string tile_pyramid::dzi() const {
+  std::stringstream ss;
+  ss << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+     << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"jpg\" "
+     << "Overlap=\"0\" TileSize=\"" << m_tile_size << "\">\n"
+     << "  <Size Width=\"" << width(max_level()) << "\" Height=\"" << height(max_level())
+     << "\"/>\n"
+     << "</Image>\n";
+  return ss.str();
+}
+
+uint64_t tile_pyramid::memory_usage() const {
+  uint64_t total = m_full.size();
+  for (const level_t& l : m_levels) {
+    total += l.pixels.size() * sizeof(uint32_t);
+  }
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return total + m_tile_bytes;
+}
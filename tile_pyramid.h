@@ -0,0 +1,88 @@
+#ifndef BP_TILE_PYRAMID_H
+#define BP_TILE_PYRAMID_H
+
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "preview.h"
+
+namespace bigpicture {
+  /**
+   * A Deep Zoom (DZI) image pyramid of a frame, from which browser viewers such as
+   * OpenSeadragon fetch only the tiles covering the region being viewed.
+   *
+   * Level max_level() is the frame at full resolution, and each lower level halves
+   * both dimensions, down to a single pixel at level 0. The binned levels are built
+   * bottom-up on construction, each from the level above it, so the frame is read
+   * once. Tiles are rendered and encoded lazily on first access and then cached.
+   *
+   * All levels share the tone map of the full-resolution frame. In sum mode, binned
+   * levels hold the mean of each bin's unmasked pixels, as in bin_and_tone_map(), so
+   * that they cannot saturate however large the bin.
+   *
+   * @note tile() is thread-safe.
+   */
+  class tile_pyramid {
+  public:
+    /**
+     * Copies a frame and builds its binned levels.
+     *
+     * @param tile_size The edge of a square tile in pixels; tiles along the right and
+     *                  bottom edges of a level may be smaller.
+     */
+    tile_pyramid(const void* pixels, size_t width, size_t height, int64_t bit_depth,
+		 bin_mode_t mode, const tone_map_t& tone, size_t tile_size=256);
+
+    size_t max_level() const { return m_levels.size() - 1; }
+    size_t tile_size() const { return m_tile_size; }
+    size_t width(size_t level)     const { return m_levels.at(level).width; }
+    size_t height(size_t level)    const { return m_levels.at(level).height; }
+    size_t n_columns(size_t level) const { return binned_size(width(level), m_tile_size); }
+    size_t n_rows(size_t level)    const { return binned_size(height(level), m_tile_size); }
+
+    /**
+     * Tone maps one tile into gray, resizing it to the tile.
+     * \throws std::out_of_range if the tile does not exist.
+     */
+    void render_tile(size_t level, size_t column, size_t row, std::vector<uint8_t>& gray,
+		     size_t& tile_width, size_t& tile_height) const;
+
+    /**
+     * @return The tile encoded as JPEG, from the cache if it has been requested before.
+     * \throws std::out_of_range if the tile does not exist.
+     */
+    std::shared_ptr<const std::string> tile(size_t level, size_t column, size_t row,
+					    jpeg_encoder& encoder) const;
+
+    /// @return The DZI descriptor (XML) of this pyramid.
+    std::string dzi() const;
+
+    /// @return The approximate heap usage in bytes, including cached tiles.
+    uint64_t memory_usage() const;
+
+  private:
+    tile_pyramid(const tile_pyramid&) = delete;
+
+    struct level_t {
+      size_t                width;
+      size_t                height;
+      tone_map_t            tone;
+      std::vector<uint32_t> pixels; //!< empty at max_level(), see m_full
+    };
+
+    std::vector<level_t> m_levels;
+    std::vector<char>    m_full; //!< the frame at its original bit depth
+    int64_t              m_bit_depth;
+    size_t               m_tile_size;
+
+    mutable std::mutex   m_mutex;
+    mutable uint64_t     m_tile_bytes;
+    mutable std::unordered_map<uint64_t, std::shared_ptr<const std::string>> m_tiles;
+  };
+}
+
+#endif // header guard
@@ -0,0 +1,123 @@
+#ifndef BP_WORK_QUEUE_H
+#define BP_WORK_QUEUE_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+namespace bigpicture {
+  /**
+   * A bounded multi-producer, multi-consumer queue of jobs for a pool of worker threads.
+   *
+   * When the queue is full, push() discards the oldest job instead of blocking, since
+   * every consumer of frames in bigpicture prefers fresh frames over a growing backlog.
+   * Jobs pushed as pinned, e.g. the frames of a sampling wedge, are never discarded.
+   *
+   * @tparam T A movable job type.
+   */
+  template<typename T> class work_queue {
+  public:
+    explicit work_queue(size_t capacity) :
+      m_capacity(capacity ? capacity : 1), m_closed(false), m_n_dropped(0) {}
+
+    /**
+     * Enqueues a job, discarding the oldest job which is not pinned if the queue is
+     * full. If every queued job is pinned, a pinned job is queued beyond the capacity,
+     * and any other job is discarded itself.
+     * @return false if the queue has been closed.
+     */
+    bool push(T&& job, bool pinned=false) {
+      {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_closed) {
+	  return false;
+	}
+	if (m_jobs.size() >= m_capacity) {
+	  auto it = std::find_if(m_jobs.begin(), m_jobs.end(),
+				 [](const entry_t& entry) { return !entry.pinned; });
+	  if (it != m_jobs.end()) {
+	    m_jobs.erase(it);
+	    ++m_n_dropped;
+	  } else if (!pinned) {
+	    ++m_n_dropped;
+	    return true;
+	  }
+	}
+	m_jobs.push_back(entry_t{ std::move(job), pinned });
+      }
+      m_cv.notify_one();
+      return true;
+    }
+
+    /**
+     * Blocks until a job is available.
+     * @return false if the queue has been closed and drained.
+     */
+    bool pop(T& job) {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [this]() { return m_closed || !m_jobs.empty(); });
+      if (m_jobs.empty()) {
+	return false;
+      }
+      job = std::move(m_jobs.front().job);
+      m_jobs.pop_front();
+      return true;
+    }
+
+    /**
+     * Blocks until a job is available, then takes up to max_jobs of the queued jobs,
+     * oldest first, so a consumer with a high per-call overhead can amortize it.
+     * @return false if the queue has been closed and drained.
+     */
+    bool pop_batch(std::vector<T>& jobs, size_t max_jobs) {
+      jobs.clear();
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [this]() { return m_closed || !m_jobs.empty(); });
+      while (!m_jobs.empty() && jobs.size() < max_jobs) {
+	jobs.push_back(std::move(m_jobs.front().job));
+	m_jobs.pop_front();
+      }
+      return !jobs.empty();
+    }
+
+    /// Wakes all consumers; jobs already queued are still handed out by pop().
+    void close() {
+      {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_closed = true;
+      }
+      m_cv.notify_all();
+    }
+
+    size_t size() const {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_jobs.size();
+    }
+
+    /// @return The number of jobs discarded because the queue was full.
+    uint64_t n_dropped() const {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_n_dropped;
+    }
+
+  private:
+    work_queue(const work_queue&) = delete;
+
+    struct entry_t {
+      T    job;
+      bool pinned;
+    };
+
+    mutable std::mutex      m_mutex;
+    std::condition_variable m_cv;
+    std::deque<entry_t>     m_jobs;
+    size_t                  m_capacity;
+    bool                    m_closed;
+    uint64_t                m_n_dropped;
+  };
+}
+
+#endif // header guard